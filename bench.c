@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bench.c
+ *
+ * benchmark driver: generate a synthetic song of the given shape
+ * (tracks, notes per track, controller events per note), then time
+ * the main operations on it. Results are printed one per line, as
+ * tab separated fields, so they can be compared between versions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utils.h"
+#include "str.h"
+#include "cons.h"
+#include "ev.h"
+#include "mux.h"
+#include "track.h"
+#include "frame.h"
+#include "song.h"
+#include "user.h"
+#include "filt.h"
+#include "mididev.h"
+#include "defs.h"
+#include "sysex.h"
+#include "textio.h"
+#include "data.h"
+#include "saveload.h"
+#include "smf.h"
+
+#define BENCH_STEP	12		/* tics between notes */
+#define BENCH_LEN	6		/* note length in tics */
+#define BENCH_MSH	"bench.tmp.msh"
+#define BENCH_SMF	"bench.tmp.mid"
+
+unsigned bench_ntrks = 16, bench_nnotes = 2000, bench_nctls = 4;
+
+/*
+ * return the current time in microseconds
+ */
+long long
+bench_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return 1000000LL * ts.tv_sec + ts.tv_nsec / 1000;
+}
+
+/*
+ * print the result of a benchmark: time spent and
+ * number of items (events, tics) processed
+ */
+void
+bench_report(char *name, long long start, unsigned long nops)
+{
+	printf("%s\t%u\t%u\t%u\t%lld\t%lu\n", name,
+	    bench_ntrks, bench_nnotes, bench_nctls,
+	    bench_usec() - start, nops);
+	fflush(stdout);
+}
+
+/*
+ * fill the given track with notes on the given channel, each note
+ * followed by a ramp of modulation wheel controllers returning to
+ * zero, so controller frames are terminated
+ */
+void
+bench_gentrk(struct track *t, unsigned ch)
+{
+	struct seqptr *sp;
+	struct ev ev;
+	unsigned i, j, tic, delta;
+
+	sp = seqptr_new(t);
+	ev.dev = 0;
+	ev.ch = ch;
+	delta = 0;
+	for (i = 0; i < bench_nnotes; i++) {
+		for (tic = 0; tic < BENCH_STEP; tic++) {
+			if (tic == 0) {
+				ev.cmd = EV_NON;
+				ev.note_num = 36 + (i * 7 + ch) % 48;
+				ev.note_vel = 40 + (i * 13) % 80;
+				seqptr_ticput(sp, delta);
+				seqptr_evput(sp, &ev);
+				delta = 0;
+			}
+			for (j = 1; j <= bench_nctls; j++) {
+				if (j * BENCH_STEP / (bench_nctls + 1) != tic)
+					continue;
+				ev.cmd = EV_XCTL;
+				ev.ctl_num = 1;
+				ev.ctl_val = (j < bench_nctls) ?
+				    j * EV_MAXFINE / bench_nctls : 0;
+				seqptr_ticput(sp, delta);
+				seqptr_evput(sp, &ev);
+				delta = 0;
+			}
+			if (tic == BENCH_LEN) {
+				ev.cmd = EV_NOFF;
+				ev.note_num = 36 + (i * 7 + ch) % 48;
+				ev.note_vel = EV_NOFF_DEFAULTVEL;
+				seqptr_ticput(sp, delta);
+				seqptr_evput(sp, &ev);
+				delta = 0;
+			}
+			delta++;
+		}
+	}
+	seqptr_ticput(sp, delta);
+	seqptr_del(sp);
+}
+
+/*
+ * create a song of the configured shape
+ */
+struct song *
+bench_gensong(void)
+{
+	struct song *s;
+	struct songtrk *t;
+	char name[32];
+	unsigned i;
+
+	s = song_new();
+	for (i = 0; i < bench_ntrks; i++) {
+		snprintf(name, sizeof(name), "trk%u", i);
+		t = song_trknew(s, name);
+		bench_gentrk(&t->track, i % (EV_MAXCH + 1));
+	}
+	return s;
+}
+
+/*
+ * return the number of events of the song
+ */
+unsigned long
+bench_numev(struct song *s)
+{
+	struct songtrk *t;
+	unsigned long n = 0;
+
+	SONG_FOREACH_TRK(s, t)
+		n += track_numev(&t->track);
+	return n;
+}
+
+/*
+ * time the frame editors, each one applied to all tracks
+ */
+void
+bench_frame(void)
+{
+	struct songtrk *t;
+	struct evspec es, from, to;
+	unsigned long nev;
+	unsigned len;
+	long long start;
+
+	evspec_reset(&es);
+	evspec_reset(&from);
+	evspec_reset(&to);
+	from.cmd = to.cmd = EVSPEC_NOTE;
+	from.v0_min = from.v1_min = to.v0_min = to.v1_min = 0;
+	from.v0_max = from.v1_max = to.v0_max = to.v1_max = EV_MAXCOARSE;
+	to.ch_min = to.ch_max = 1;
+	from.ch_min = from.ch_max = 0;
+	len = bench_nnotes * BENCH_STEP;
+	nev = bench_numev(usong);
+
+	start = bench_usec();
+	SONG_FOREACH_TRK(usong, t)
+		track_quantize(&t->track, &es, 0, len, 0, 24, 100);
+	bench_report("tquanta", start, nev);
+
+	start = bench_usec();
+	SONG_FOREACH_TRK(usong, t)
+		track_transpose(&t->track, 0, len, &es, 12);
+	bench_report("ttransp", start, nev);
+
+	start = bench_usec();
+	SONG_FOREACH_TRK(usong, t)
+		track_vcurve(&t->track, 0, len, &es, 20);
+	bench_report("tvcurve", start, nev);
+
+	start = bench_usec();
+	SONG_FOREACH_TRK(usong, t)
+		track_evmap(&t->track, 0, len, &es, &from, &to);
+	bench_report("tevmap", start, nev);
+
+	start = bench_usec();
+	SONG_FOREACH_TRK(usong, t)
+		track_thin(&t->track, 0, len, &es, 4, 8);
+	bench_report("tthin", start, nev);
+}
+
+/*
+ * time the filter, with typical map, vcurve and transp rules
+ */
+void
+bench_filt(void)
+{
+	struct filt f;
+	struct evspec from, to;
+	struct songtrk *t;
+	struct seqptr *sp;
+	struct state *st;
+	struct ev out[FILT_MAXNRULES];
+	unsigned long nev;
+	long long start;
+
+	filt_init(&f);
+	evspec_reset(&from);
+	evspec_reset(&to);
+	to.dev_min = to.dev_max = 1;
+	from.dev_min = from.dev_max = 0;
+	filt_mapnew(&f, &from, &to);
+	from.cmd = to.cmd = EVSPEC_NOTE;
+	from.v0_min = from.v1_min = to.v0_min = to.v1_min = 0;
+	from.v0_max = from.v1_max = to.v0_max = to.v1_max = EV_MAXCOARSE;
+	from.ch_min = from.ch_max = to.ch_min = to.ch_max = 0;
+	to.ch_min = to.ch_max = 9;
+	filt_mapnew(&f, &from, &to);
+	to.ch_min = 0;
+	to.ch_max = EV_MAXCH;
+	filt_vcurve(&f, &to, 20);
+	filt_transp(&f, &to, -12);
+
+	nev = 0;
+	start = bench_usec();
+	SONG_FOREACH_TRK(usong, t) {
+		sp = seqptr_new(&t->track);
+		for (;;) {
+			while ((st = seqptr_evget(sp)) != NULL) {
+				filt_do(&f, &st->ev, out);
+				nev++;
+			}
+			if (!seqptr_ticskip(sp, 1))
+				break;
+		}
+		seqptr_del(sp);
+	}
+	bench_report("filt", start, nev);
+	filt_done(&f);
+}
+
+void
+bench_run(void)
+{
+	struct song *s;
+	struct track trk;
+	unsigned long nev;
+	long long start;
+
+	usong = bench_gensong();
+	nev = bench_numev(usong);
+
+	start = bench_usec();
+	song_save(usong, BENCH_MSH);
+	bench_report("save", start, nev);
+
+	start = bench_usec();
+	s = song_new();
+	if (!song_load(s, BENCH_MSH)) {
+		fprintf(stderr, "%s: couldn't load\n", BENCH_MSH);
+		exit(1);
+	}
+	bench_report("load", start, bench_numev(s));
+	song_delete(s);
+
+	start = bench_usec();
+	if (!song_exportsmf(usong, BENCH_SMF)) {
+		fprintf(stderr, "%s: couldn't export\n", BENCH_SMF);
+		exit(1);
+	}
+	bench_report("export", start, nev);
+
+	start = bench_usec();
+	s = song_importsmf(BENCH_SMF);
+	if (s == NULL) {
+		fprintf(stderr, "%s: couldn't import\n", BENCH_SMF);
+		exit(1);
+	}
+	bench_report("import", start, bench_numev(s));
+	song_delete(s);
+
+	bench_filt();
+
+	track_init(&trk);
+	start = bench_usec();
+	song_render(usong, &trk);
+	bench_report("render", start, usong->abspos);
+	track_done(&trk);
+
+	bench_frame();
+
+	song_delete(usong);
+	usong = NULL;
+	unlink(BENCH_MSH);
+	unlink(BENCH_SMF);
+}
+
+unsigned
+bench_getnum(char *arg, unsigned max)
+{
+	long val;
+	char *end;
+
+	val = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || val < 0 || val > max) {
+		fprintf(stderr, "%s: bad number\n", arg);
+		exit(1);
+	}
+	return val;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, header = 1;
+
+	while ((ch = getopt(argc, argv, "c:e:nt:")) != -1) {
+		switch (ch) {
+		case 'c':
+			bench_nctls = bench_getnum(optarg, 64);
+			break;
+		case 'e':
+			bench_nnotes = bench_getnum(optarg, 1000000);
+			break;
+		case 'n':
+			header = 0;
+			break;
+		case 't':
+			bench_ntrks = bench_getnum(optarg, 256);
+			break;
+		default:
+			goto err;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc >= 1 || bench_ntrks == 0 || bench_nnotes == 0) {
+	err:
+		fputs("usage: midish-bench [-n] [-c ctls] [-e notes] "
+		    "[-t tracks]\n", stderr);
+		return 1;
+	}
+
+	user_flag_batch = 1;
+	cons_init(NULL, NULL);
+	textio_init();
+	evctl_init();
+	data_pool_init(DEFAULT_NDATAS);
+	seqev_pool_init(DEFAULT_NSEQEVS);
+	state_pool_init(DEFAULT_NSTATES);
+	chunk_pool_init(DEFAULT_NCHUNKS);
+	sysex_pool_init(DEFAULT_NSYSEXS);
+	seqptr_pool_init(DEFAULT_NSEQPTRS);
+	mididev_listinit();
+
+	if (header)
+		printf("# name\ttracks\tnotes\tctls\tusec\titems\n");
+	bench_run();
+
+	mididev_listdone();
+	seqptr_pool_done();
+	sysex_pool_done();
+	chunk_pool_done();
+	state_pool_done();
+	seqev_pool_done();
+	data_pool_done();
+	evctl_done();
+	textio_done();
+	cons_done();
+	return 0;
+}
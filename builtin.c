@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include "utils.h"
 #include "defs.h"
 #include "node.h"
@@ -33,6 +34,8 @@
 #include "builtin.h"
 #include "version.h"
 #include "undo.h"
+#include "pool.h"
+#include "trace.h"
 
 unsigned
 blt_info(struct exec *o, struct data **r)
@@ -156,6 +159,8 @@ blt_debug(struct exec *o, struct data **r)
 		norm_debug = value;
 	} else if (str_eq(flag, "pool")) {
 		pool_debug = value;
+	} else if (str_eq(flag, "prof")) {
+		exec_prof = value;
 	} else if (str_eq(flag, "song")) {
 		song_debug = value;
 	} else if (str_eq(flag, "timo")) {
@@ -167,6 +172,197 @@ blt_debug(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_tickstat(struct exec *o, struct data **r)
+{
+	unsigned i;
+
+	textout_putstr(tout, "tickstat {\n");
+	textout_shiftright(tout);
+	textout_putstr(tout, "# usecs\tlate\tproc\tclk\n");
+	for (i = 0; i < MUX_NHIST; i++) {
+		if (mux_latehist.cnt[i] == 0 && mux_prochist.cnt[i] == 0 &&
+		    mux_clkhist.cnt[i] == 0)
+			continue;
+		textout_putstr(tout, i < MUX_NHIST - 1 ? "<" : ">=");
+		textout_putlong(tout, 1L << (i < MUX_NHIST - 1 ? i : i - 1));
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, mux_latehist.cnt[i]);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, mux_prochist.cnt[i]);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, mux_clkhist.cnt[i]);
+		textout_putstr(tout, "\n");
+	}
+	textout_putstr(tout, "max\t");
+	textout_putlong(tout, mux_latehist.max);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, mux_prochist.max);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, mux_clkhist.max);
+	textout_putstr(tout, "\n");
+	textout_putstr(tout, "count\t");
+	textout_putlong(tout, mux_latehist.n);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, mux_prochist.n);
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, mux_clkhist.n);
+	textout_putstr(tout, "\n");
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	return 1;
+}
+
+unsigned
+blt_tickstatreset(struct exec *o, struct data **r)
+{
+	muxhist_reset(&mux_latehist);
+	muxhist_reset(&mux_prochist);
+	muxhist_reset(&mux_clkhist);
+	return 1;
+}
+
+/*
+ * compare procs by exclusive time, used by qsort()
+ */
+static int
+blt_proccmp(const void *p1, const void *p2)
+{
+	struct proc *a = *(struct proc **)p1, *b = *(struct proc **)p2;
+
+	if (a->excltime != b->excltime)
+		return a->excltime < b->excltime ? 1 : -1;
+	return a->ncalls < b->ncalls ? 1 : (a->ncalls > b->ncalls ? -1 : 0);
+}
+
+unsigned
+blt_procstat(struct exec *o, struct data **r)
+{
+	struct proc *i, **tab;
+	unsigned n, k;
+
+	n = 0;
+	PROC_FOREACH(i, o->procs) {
+		if (i->ncalls > 0)
+			n++;
+	}
+	tab = xmalloc((n > 0 ? n : 1) * sizeof(struct proc *), "procstat");
+	n = 0;
+	PROC_FOREACH(i, o->procs) {
+		if (i->ncalls > 0)
+			tab[n++] = i;
+	}
+	qsort(tab, n, sizeof(struct proc *), blt_proccmp);
+
+	textout_putstr(tout, "procstat {\n");
+	textout_shiftright(tout);
+	textout_putstr(tout, "# name\tcalls\tincl\texcl\tdatas\n");
+	for (k = 0; k < n; k++) {
+		i = tab[k];
+		textout_putstr(tout, i->name.str);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, i->ncalls);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, i->incltime / 1000);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, i->excltime / 1000);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, i->ndatas);
+		textout_putstr(tout, "\n");
+	}
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	xfree(tab);
+	return 1;
+}
+
+unsigned
+blt_procstatreset(struct exec *o, struct data **r)
+{
+	struct proc *i;
+
+	PROC_FOREACH(i, o->procs)
+		proc_statreset(i);
+	return 1;
+}
+
+unsigned
+blt_poolstat(struct exec *o, struct data **r)
+{
+	struct pool *i;
+
+	textout_putstr(tout, "poolstat {\n");
+	textout_shiftright(tout);
+	textout_putstr(tout, "# name\tused\tpeak\tsize\tkB\n");
+	for (i = pool_list; i != NULL; i = i->nextpool) {
+		textout_putstr(tout, i->name);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, i->used);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, i->maxused);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, i->itemnum);
+		textout_putstr(tout, "\t");
+		textout_putlong(tout, (i->itemnum * i->itemsize + 1023) / 1024);
+		textout_putstr(tout, "\n");
+	}
+	textout_putstr(tout, "undo\t-\t-\t-\t");
+	textout_putlong(tout, (usong->undo_size + 1023) / 1024);
+	textout_putstr(tout, "\n");
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	return 1;
+}
+
+unsigned
+blt_poolstatreset(struct exec *o, struct data **r)
+{
+	pool_statreset();
+	return 1;
+}
+
+unsigned
+blt_poolwarn(struct exec *o, struct data **r)
+{
+	long pct;
+
+	if (!exec_lookuplong(o, "percent", &pct)) {
+		return 0;
+	}
+	if (pct < 0 || pct > 100) {
+		logx(1, "%s: percent must be in the 0..100 range", o->procname);
+		return 0;
+	}
+	pool_setwarn(pct);
+	return 1;
+}
+
+unsigned
+blt_trace(struct exec *o, struct data **r)
+{
+	long onoff;
+
+	if (!exec_lookupbool(o, "bool", &onoff)) {
+		return 0;
+	}
+	if (onoff)
+		trace_start();
+	else
+		trace_stop();
+	return 1;
+}
+
+unsigned
+blt_tracesave(struct exec *o, struct data **r)
+{
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	return trace_save(filename);
+}
+
 unsigned
 blt_exec(struct exec *o, struct data **r)
 {
@@ -493,6 +689,36 @@ blt_noloop(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_recdefer(struct exec *o, struct data **r)
+{
+	long onoff;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookupbool(o, "bool", &onoff)) {
+		return 0;
+	}
+	usong->recdefer = onoff;
+	return 1;
+}
+
+unsigned
+blt_sxwait(struct exec *o, struct data **r)
+{
+	long onoff;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookupbool(o, "bool", &onoff)) {
+		return 0;
+	}
+	usong->sxwait = onoff;
+	return 1;
+}
+
 unsigned
 blt_setq(struct exec *o, struct data **r)
 {
@@ -681,7 +907,7 @@ blt_getmute(struct exec *o, struct data **r)
 unsigned
 blt_ls(struct exec *o, struct data **r)
 {
-	char map[DEFAULT_MAXNCHANS];
+	char map[MAXNCHANS_LIMIT];
 	struct songtrk *t;
 	struct songchan *c;
 	struct songfilt *f;
@@ -763,7 +989,7 @@ blt_ls(struct exec *o, struct data **r)
 		}
 		textout_putstr(tout, "\t{");
 		track_chanmap(&t->track, map);
-		for (i = 0, count = 0; i < DEFAULT_MAXNCHANS; i++) {
+		for (i = 0, count = 0; i < ev_ndevs * 16; i++) {
 			if (map[i]) {
 				if (count) {
 					textout_putstr(tout, " ");
@@ -921,6 +1147,69 @@ blt_load(struct exec *o, struct data **r)
 	return res;
 }
 
+unsigned
+blt_songstage(struct exec *o, struct data **r)
+{
+	struct song *newsong;
+	struct songtrk *t;
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	newsong = song_new();
+	if (!song_load(newsong, filename)) {
+		song_delete(newsong);
+		return 0;
+	}
+
+	/*
+	 * sort tracks now, rather than when the song is started
+	 */
+	SONG_FOREACH_TRK(newsong, t)
+		track_compact(&t->track);
+	track_compact(&newsong->meta);
+	if (usong_stage)
+		song_delete(usong_stage);
+	usong_stage = newsong;
+	return 1;
+}
+
+unsigned
+blt_songswap(struct exec *o, struct data **r)
+{
+	struct song *oldsong;
+
+	if (usong_stage == NULL) {
+		logx(1, "%s: no song staged", o->procname);
+		return 0;
+	}
+	if (usong->mode == SONG_REC) {
+		logx(1, "%s: can't swap songs while recording", o->procname);
+		return 0;
+	}
+
+	/*
+	 * if playing, wait for the end of the current measure
+	 */
+	if (usong->mode >= SONG_PLAY) {
+		usong->cutreq = 1;
+		while (usong->mode >= SONG_PLAY && !usong->cutready &&
+		    mux_mdep_wait(0))
+			; /* nothing */
+		if (!usong->cutready) {
+			usong->cutreq = 0;
+			logx(1, "%s: interrupted", o->procname);
+			return 0;
+		}
+	}
+	oldsong = usong;
+	song_cut(&usong, usong_stage);
+	usong_stage = NULL;
+	song_delete(oldsong);
+	return 1;
+}
+
 unsigned
 blt_reset(struct exec *o, struct data **r)
 {
@@ -988,7 +1277,8 @@ blt_play(struct exec *o, struct data **r)
 	song_play(usong);
 	if (user_flag_batch) {
 		logx(1, "press ^C to stop playback");
-		while (!usong->complete && mux_mdep_wait(0))
+		while ((!usong->complete || usong->sxstate != SONG_SX_DONE) &&
+		    mux_mdep_wait(0))
 			; /* nothing */
 		logx(1, "playback stopped");
 		song_stop(usong);
@@ -1014,6 +1304,122 @@ blt_rec(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_render(struct exec *o, struct data **r)
+{
+	char *name;
+	struct songtrk *t;
+	struct track trk;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookupname(o, "trackname", &name)) {
+		return 0;
+	}
+	if (song_trklookup(usong, name) != NULL) {
+		logx(1, "%s: track already exists", o->procname);
+		return 0;
+	}
+	if (usong->loop || (usong_stage && usong_stage->loop)) {
+		logx(1, "%s: can't render in loop mode", o->procname);
+		return 0;
+	}
+	if (usong->tap_mode || (usong_stage && usong_stage->tap_mode)) {
+		logx(1, "%s: can't render in tap mode", o->procname);
+		return 0;
+	}
+	if (mididev_clksrc || mididev_mtcsrc) {
+		logx(1, "%s: can't render with external clock", o->procname);
+		return 0;
+	}
+	track_init(&trk);
+	if (usong_stage)
+		song_rendercut(&usong, usong_stage, &trk);
+	else
+		song_render(usong, &trk);
+	t = undo_tnew_do(usong, o->procname, name);
+	track_swap(&t->track, &trk);
+	track_done(&trk);
+	return 1;
+}
+
+/*
+ * print a column of a dryrun table
+ */
+static void
+blt_dryruncol(unsigned long val)
+{
+	textout_putstr(tout, "\t");
+	textout_putlong(tout, val);
+}
+
+unsigned
+blt_dryrun(struct exec *o, struct data **r)
+{
+	struct songana a;
+	struct songanadev *d;
+	struct songanahot *h;
+	unsigned i;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (usong->loop) {
+		logx(1, "%s: can't analyze in loop mode", o->procname);
+		return 0;
+	}
+	if (usong->tap_mode) {
+		logx(1, "%s: can't analyze in tap mode", o->procname);
+		return 0;
+	}
+	if (mididev_clksrc || mididev_mtcsrc) {
+		logx(1, "%s: can't analyze with external clock", o->procname);
+		return 0;
+	}
+	song_analyze(usong, &a);
+	textout_putstr(tout, "dryrun {\n");
+	textout_shiftright(tout);
+	textout_putstr(tout, "ticks");
+	blt_dryruncol(a.nticks);
+	textout_putstr(tout, "\n");
+	textout_putstr(tout, "states");
+	blt_dryruncol(a.maxstates);
+	blt_dryruncol(a.maxstatesmeas);
+	textout_putstr(tout, "\n");
+	textout_putstr(tout, "# dev\tevents\tbytes\ttickev\tmeas"
+	    "\ttickbytes\tmeas\tmsbytes\tmeas\ttxusec\tover\tsxbytes\n");
+	for (i = 0; i < ev_ndevs; i++) {
+		d = a.dev + i;
+		if (d->nev == 0 && d->sxbytes == 0)
+			continue;
+		textout_putlong(tout, i);
+		blt_dryruncol(d->nev);
+		blt_dryruncol(d->nbytes);
+		blt_dryruncol(d->maxev);
+		blt_dryruncol(d->maxevmeas);
+		blt_dryruncol(d->maxbytes);
+		blt_dryruncol(d->maxbytesmeas);
+		blt_dryruncol(d->maxwin);
+		blt_dryruncol(d->maxwinmeas);
+		blt_dryruncol(d->maxusec);
+		blt_dryruncol(d->nover);
+		blt_dryruncol(d->sxbytes);
+		textout_putstr(tout, "\n");
+	}
+	for (i = 0, h = a.hot; i < a.nhot; i++, h++) {
+		textout_putstr(tout, "overload");
+		blt_dryruncol(h->dev);
+		blt_dryruncol(h->measure);
+		blt_dryruncol(h->nticks);
+		textout_putstr(tout, "\n");
+	}
+	textout_shiftleft(tout);
+	textout_putstr(tout, "}\n");
+	xfree(a.dev);
+	return 1;
+}
+
 unsigned
 blt_stop(struct exec *o, struct data **r)
 {
@@ -1961,7 +2367,7 @@ blt_tpaste(struct exec *o, struct data **r)
 	track_init(&copy);
 	track_move(&usong->clip, tic, ~0U, &usong->curev, &copy, 1, 0);
 	if (!track_isempty(&copy)) {
-		copy.first->delta += tic2;
+		track_shift(&copy, tic2);
 		undo_track_save(usong, &t->track, o->procname, t->name.str);
 		track_merge(&t->track, &copy);
 		undo_track_diff(usong);
@@ -2017,6 +2423,7 @@ blt_tmerge(struct exec *o, struct data **r)
 		return 0;
 	}
 	undo_track_save(usong, &dst->track, o->procname, dst->name.str);
+	song_trkdirty(usong, &src->track);
 	track_merge(&src->track, &dst->track);
 	undo_track_diff(usong);
 	return 1;
@@ -2157,6 +2564,46 @@ blt_tvcurve(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_tthin(struct exec *o, struct data **r)
+{
+	struct songtrk *t;
+	unsigned tic, len, qstep;
+	long tics, delta;
+
+	song_getcurtrk(usong, &t);
+	if (t == NULL) {
+		logx(1, "%s: no current track", o->procname);
+		return 0;
+	}
+	if (!exec_lookuplong(o, "tics", &tics) ||
+	    !exec_lookuplong(o, "delta", &delta))
+		return 0;
+	if (tics < 0) {
+		logx(1, "%s: tics cant be negative", o->procname);
+		return 0;
+	}
+	if (delta < 0 || delta > EV_MAXCOARSE) {
+		logx(1, "%s: delta must be in the 0..127 range", o->procname);
+		return 0;
+	}
+	if (!song_try_trk(usong, t)) {
+		return 0;
+	}
+	tic = track_findmeasure(&usong->meta, usong->curpos);
+	len = track_findmeasure(&usong->meta, usong->curpos + usong->curlen) - tic;
+	qstep = usong->curquant / 2;
+	if (tic > qstep) {
+		tic -= qstep;
+	} else if (tic + len > qstep) {
+		len -= qstep;
+	}
+	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	track_thin(&t->track, tic, len, &usong->curev, tics, delta);
+	undo_track_diff(usong);
+	return 1;
+}
+
 unsigned
 blt_tevmap(struct exec *o, struct data **r)
 {
@@ -2190,13 +2637,154 @@ blt_tevmap(struct exec *o, struct data **r)
 	return 1;
 }
 
+/*
+ * operations of the tapply list
+ */
+#define TAPPLY_XFORM	0
+#define TAPPLY_QUANTA	1
+#define TAPPLY_QUANTF	2
+
+/*
+ * convert a '{ func args ... }' list to a tapply operation, return
+ * the operation type or -1 on error
+ */
+static int
+tapply_getop(struct exec *o, struct data *d, struct xform *op, long *rate)
+{
+	char *func;
+
+	if (d->type != DATA_LIST || d->val.list == NULL ||
+	    d->val.list->type != DATA_REF) {
+		logx(1, "%s: {func args ...} list expected", o->procname);
+		return -1;
+	}
+	func = d->val.list->val.ref;
+	d = d->val.list->next;
+	if (str_eq(func, "tevmap")) {
+		if (d == NULL || d->next == NULL || d->next->next != NULL) {
+			logx(1, "%s: tevmap: source and dest expected",
+			    o->procname);
+			return -1;
+		}
+		if (!data_getevspec(d, &op->from, 0) ||
+		    !data_getevspec(d->next, &op->to, 0) ||
+		    !evspec_isamap(&op->from, &op->to))
+			return -1;
+		op->type = XFORM_EVMAP;
+		return TAPPLY_XFORM;
+	}
+	if (d == NULL || d->type != DATA_LONG || d->next != NULL) {
+		logx(1, "%s: %s: single number expected", o->procname, func);
+		return -1;
+	}
+	if (str_eq(func, "ttransp")) {
+		if (d->val.num < -64 || d->val.num >= 63) {
+			logx(1, "%s: ttransp: argument not in the -64..63 range",
+			    o->procname);
+			return -1;
+		}
+		op->type = XFORM_TRANSP;
+		op->arg = d->val.num;
+		return TAPPLY_XFORM;
+	}
+	if (str_eq(func, "tvcurve")) {
+		if (d->val.num < -63 || d->val.num > 63) {
+			logx(1, "%s: tvcurve: weight must be in the -63..63 range",
+			    o->procname);
+			return -1;
+		}
+		op->type = XFORM_VCURVE;
+		op->arg = d->val.num;
+		return TAPPLY_XFORM;
+	}
+	if (str_eq(func, "tquanta") || str_eq(func, "tquantf")) {
+		if (d->val.num < 0 || d->val.num > 100) {
+			logx(1, "%s: %s: rate must be between 0 and 100",
+			    o->procname, func);
+			return -1;
+		}
+		*rate = d->val.num;
+		return str_eq(func, "tquanta") ? TAPPLY_QUANTA : TAPPLY_QUANTF;
+	}
+	logx(1, "%s: %s: unsupported function", o->procname, func);
+	return -1;
+}
+
+unsigned
+blt_tapply(struct exec *o, struct data **r)
+{
+	struct songtrk *t;
+	struct data *list, *d;
+	struct xform ops[XFORM_MAX];
+	unsigned nops, tic, len, qstep, offset;
+	long rate;
+	int type;
+
+	song_getcurtrk(usong, &t);
+	if (t == NULL) {
+		logx(1, "%s: no current track", o->procname);
+		return 0;
+	}
+	if (!exec_lookuplist(o, "oplist", &list)) {
+		return 0;
+	}
+	for (d = list; d != NULL; d = d->next) {
+		if (tapply_getop(o, d, &ops[0], &rate) < 0)
+			return 0;
+	}
+	if (!song_try_trk(usong, t)) {
+		return 0;
+	}
+	tic = track_findmeasure(&usong->meta, usong->curpos);
+	len = track_findmeasure(&usong->meta, usong->curpos + usong->curlen) - tic;
+	qstep = usong->curquant / 2;
+	if (tic > qstep) {
+		tic -= qstep;
+		offset = qstep;
+	} else {
+		offset = 0;
+		if (tic + len > qstep)
+			len -= qstep;
+	}
+
+	/*
+	 * apply consecutive per-event transformations in a single
+	 * pass, quantization moves events, so it's a pass on its own
+	 */
+	undo_track_save(usong, &t->track, o->procname, t->name.str);
+	nops = 0;
+	for (d = list; d != NULL; d = d->next) {
+		type = tapply_getop(o, d, &ops[nops], &rate);
+		if (type == TAPPLY_XFORM) {
+			if (++nops < XFORM_MAX)
+				continue;
+		}
+		if (nops > 0) {
+			track_xform(&t->track, tic, len,
+			    &usong->curev, ops, nops);
+			nops = 0;
+		}
+		if (type == TAPPLY_QUANTA) {
+			track_quantize(&t->track, &usong->curev,
+			    tic, len, offset, 2 * qstep, rate);
+		} else if (type == TAPPLY_QUANTF) {
+			track_quantize_frame(&t->track, &usong->curev,
+			    tic, len, offset, 2 * qstep, rate);
+		}
+	}
+	if (nops > 0)
+		track_xform(&t->track, tic, len, &usong->curev, ops, nops);
+	undo_track_diff(usong);
+	return 1;
+}
+
 unsigned
 blt_tclist(struct exec *o, struct data **r)
 {
 	struct songtrk *t;
 	struct songchan *c;
 	struct data *num;
-	char map[DEFAULT_MAXNCHANS];
+	char map[MAXNCHANS_LIMIT];
 	unsigned i;
 
 	song_getcurtrk(usong, &t);
@@ -2206,7 +2794,7 @@ blt_tclist(struct exec *o, struct data **r)
 	}
 	*r = data_newlist(NULL);
 	track_chanmap(&t->track, map);
-	for (i = 0; i < DEFAULT_MAXNCHANS; i++) {
+	for (i = 0; i < ev_ndevs * 16; i++) {
 		if (map[i]) {
 			c = song_chanlookup_bynum(usong, i / 16, i % 16, 0);
 			if (c != 0) {
@@ -2620,8 +3208,8 @@ blt_cset(struct exec *o, struct data **r, int input)
 	to.dev_min = to.dev_max = dev;
 	to.ch_min = to.ch_max = ch;
 
-	undo_setuint(usong, o->procname, c->name.str, &c->dev, dev);
-	undo_setuint(usong, NULL, c->name.str, &c->ch, ch);
+	undo_setchan(usong, o->procname, c->name.str, &c->dev, dev);
+	undo_setchan(usong, NULL, c->name.str, &c->ch, ch);
 
 	SONG_FOREACH_FILT(usong, f) {
 		undo_filt_save(usong, &f->filt, NULL, f->name.str);
@@ -3036,6 +3624,39 @@ blt_fvcurve(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_fthin(struct exec *o, struct data **r)
+{
+	struct songfilt *f;
+	struct evspec es;
+	long ms, delta;
+
+	song_getcurfilt(usong, &f);
+	if (f == NULL) {
+		logx(1, "%s: no current filt", o->procname);
+		return 0;
+	}
+	if (!exec_lookupevspec(o, "evspec", &es, 0) ||
+	    !exec_lookuplong(o, "millisecs", &ms) ||
+	    !exec_lookuplong(o, "delta", &delta)) {
+		return 0;
+	}
+	if (ms < 0 || ms > FILT_THIN_MAXMS) {
+		logx(1, "%s: millisecs must be in the 0..%u range",
+		    o->procname, FILT_THIN_MAXMS);
+		return 0;
+	}
+	if (delta < 0 || delta > EV_MAXCOARSE) {
+		logx(1, "%s: delta must be in the 0..127 range", o->procname);
+		return 0;
+	}
+	if (mux_isopen)
+		norm_shut();
+	undo_filt_save(usong, &f->filt, o->procname, f->name.str);
+	filt_thin(&f->filt, &es, ms * 24000, delta);
+	return 1;
+}
+
 unsigned
 blt_fchgxxx(struct exec *o, struct data **r, int input, int swap)
 {
@@ -3198,15 +3819,13 @@ blt_xinfo(struct exec *o, struct data **r)
 	for (e = c->sx.first; e != NULL; e = e->next) {
 		textout_putlong(tout, e->unit);
 		textout_putstr(tout, " { ");
-		if (e->first) {
-			for (i = 0; i < e->first->used; i++) {
-				if (i > 10) {
-					textout_putstr(tout, "... ");
-					break;
-				}
-				textout_putbyte(tout, e->first->data[i]);
-				textout_putstr(tout, " ");
+		for (i = 0; i < e->used; i++) {
+			if (i > 10) {
+				textout_putstr(tout, "... ");
+				break;
 			}
+			textout_putbyte(tout, e->data[i]);
+			textout_putstr(tout, " ");
 		}
 		textout_putstr(tout, "}\n");
 	}
@@ -3267,7 +3886,7 @@ blt_xsetd(struct exec *o, struct data **r)
 	    !exec_lookuplist(o, "data", &d)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS) {
+	if (unit < 0 || unit >= ev_ndevs) {
 		logx(1, "%s: devnum out of range", o->procname);
 		return 0;
 	}
@@ -3305,7 +3924,7 @@ blt_xadd(struct exec *o, struct data **r)
 	if (!exec_lookuplong(o, "devnum", &unit)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS) {
+	if (unit < 0 || unit >= ev_ndevs) {
 		logx(1, "%s: devnum out of range", o->procname);
 		return 0;
 	}
@@ -3340,7 +3959,7 @@ blt_xadd(struct exec *o, struct data **r)
 		sysex_del(x);
 		return 0;
 	}
-	if (x->first) {
+	if (x->used > 0) {
 		undo_xadd_do(usong, o->procname, c, x);
 	} else {
 		sysex_del(x);
@@ -3364,7 +3983,7 @@ blt_ximport(struct exec *o, struct data **r)
 	if (!exec_lookuplong(o, "devnum", &unit)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS) {
+	if (unit < 0 || unit >= ev_ndevs) {
 		logx(1, "%s: devnum out of range", o->procname);
 		return 0;
 	}
@@ -3503,7 +4122,7 @@ blt_dmtcrx(struct exec *o, struct data **r)
 		return 0;
 	} else if (arg->data->type == DATA_LONG) {
 		unit = arg->data->val.num;
-		if (unit < 0 || unit >= DEFAULT_MAXNDEVS ||
+		if (unit < 0 || unit >= ev_ndevs ||
 		    !mididev_byunit[unit]) {
 			logx(1, "%s: bad device number", o->procname);
 			return 0;
@@ -3520,7 +4139,7 @@ unsigned
 blt_dmmctx(struct exec *o, struct data **r)
 {
 	struct data *units, *n;
-	unsigned i, tx[DEFAULT_MAXNDEVS];
+	unsigned i, tx[MAXNDEVS_LIMIT];
 
 	if (!song_try_mode(usong, 0)) {
 		return 0;
@@ -3528,24 +4147,86 @@ blt_dmmctx(struct exec *o, struct data **r)
 	if (!exec_lookuplist(o, "devlist", &units)) {
 		return 0;
 	}
-	for (i = 0; i < DEFAULT_MAXNDEVS; i++)
+	for (i = 0; i < ev_ndevs; i++)
 		tx[i] = 0;
 	for (n = units; n != NULL; n = n->next) {
 		if (n->type != DATA_LONG ||
-		    n->val.num < 0 || n->val.num >= DEFAULT_MAXNDEVS ||
+		    n->val.num < 0 || n->val.num >= ev_ndevs ||
 		    !mididev_byunit[n->val.num]) {
 			logx(1, "%s: bad device number", o->procname);
 			return 0;
 		}
 		tx[n->val.num] = 1;
 	}
-	for (i = 0; i < DEFAULT_MAXNDEVS; i++) {
+	for (i = 0; i < ev_ndevs; i++) {
 		if (mididev_byunit[i])
 			mididev_byunit[i]->sendmmc = tx[i];
 	}
 	return 1;
 }
 
+unsigned
+blt_dnodup(struct exec *o, struct data **r)
+{
+	struct data *units, *n;
+	unsigned i, nodup[MAXNDEVS_LIMIT];
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplist(o, "devlist", &units)) {
+		return 0;
+	}
+	for (i = 0; i < ev_ndevs; i++)
+		nodup[i] = 0;
+	for (n = units; n != NULL; n = n->next) {
+		if (n->type != DATA_LONG ||
+		    n->val.num < 0 || n->val.num >= ev_ndevs ||
+		    !mididev_byunit[n->val.num]) {
+			logx(1, "%s: bad device number", o->procname);
+			return 0;
+		}
+		nodup[n->val.num] = 1;
+	}
+	for (i = 0; i < ev_ndevs; i++) {
+		if (mididev_byunit[i]) {
+			mididev_byunit[i]->onodup = nodup[i];
+			mididev_shadowreset(mididev_byunit[i]);
+		}
+	}
+	return 1;
+}
+
+unsigned
+blt_dcoalesce(struct exec *o, struct data **r)
+{
+	struct data *units, *n;
+	unsigned i, coalesce[MAXNDEVS_LIMIT];
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplist(o, "devlist", &units)) {
+		return 0;
+	}
+	for (i = 0; i < ev_ndevs; i++)
+		coalesce[i] = 0;
+	for (n = units; n != NULL; n = n->next) {
+		if (n->type != DATA_LONG ||
+		    n->val.num < 0 || n->val.num >= ev_ndevs ||
+		    !mididev_byunit[n->val.num]) {
+			logx(1, "%s: bad device number", o->procname);
+			return 0;
+		}
+		coalesce[n->val.num] = 1;
+	}
+	for (i = 0; i < ev_ndevs; i++) {
+		if (mididev_byunit[i])
+			mididev_byunit[i]->icoalesce = coalesce[i];
+	}
+	return 1;
+}
+
 unsigned
 blt_dclkrx(struct exec *o, struct data **r)
 {
@@ -3565,7 +4246,7 @@ blt_dclkrx(struct exec *o, struct data **r)
 		return 0;
 	} else if (arg->data->type == DATA_LONG) {
 		unit = arg->data->val.num;
-		if (unit < 0 || unit >= DEFAULT_MAXNDEVS ||
+		if (unit < 0 || unit >= ev_ndevs ||
 		    !mididev_byunit[unit]) {
 			logx(1, "%s: bad device number", o->procname);
 			return 0;
@@ -3582,7 +4263,7 @@ unsigned
 blt_dclktx(struct exec *o, struct data **r)
 {
 	struct data *units, *n;
-	unsigned i, tx[DEFAULT_MAXNDEVS];
+	unsigned i, tx[MAXNDEVS_LIMIT];
 
 	if (!song_try_mode(usong, 0)) {
 		return 0;
@@ -3590,18 +4271,18 @@ blt_dclktx(struct exec *o, struct data **r)
 	if (!exec_lookuplist(o, "devlist", &units)) {
 		return 0;
 	}
-	for (i = 0; i < DEFAULT_MAXNDEVS; i++)
+	for (i = 0; i < ev_ndevs; i++)
 		tx[i] = 0;
 	for (n = units; n != NULL; n = n->next) {
 		if (n->type != DATA_LONG ||
-		    n->val.num < 0 || n->val.num >= DEFAULT_MAXNDEVS ||
+		    n->val.num < 0 || n->val.num >= ev_ndevs ||
 		    !mididev_byunit[n->val.num]) {
 			logx(1, "%s: bad device number", o->procname);
 			return 0;
 		}
 		tx[n->val.num] = 1;
 	}
-	for (i = 0; i < DEFAULT_MAXNDEVS; i++) {
+	for (i = 0; i < ev_ndevs; i++) {
 		if (mididev_byunit[i])
 			mididev_byunit[i]->sendclk = tx[i];
 	}
@@ -3620,7 +4301,7 @@ blt_dclkrate(struct exec *o, struct data **r)
 	    !exec_lookuplong(o, "tics_per_unit", &tpu)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
 		logx(1, "%s: bad device number", o->procname);
 		return 0;
 	}
@@ -3632,6 +4313,99 @@ blt_dclkrate(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_dclkpll(struct exec *o, struct data **r)
+{
+	long unit, onoff;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookupbool(o, "bool", &onoff)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
+		logx(1, "%s: bad device number", o->procname);
+		return 0;
+	}
+	mididev_byunit[unit]->clkpll = onoff;
+	return 1;
+}
+
+unsigned
+blt_dlatency(struct exec *o, struct data **r)
+{
+	long unit, msecs;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookuplong(o, "millisecs", &msecs)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
+		logx(1, "%s: bad device number", o->procname);
+		return 0;
+	}
+	if (msecs < 0 || msecs > 500) {
+		logx(1, "%s: latency must be in the 0..500 range", o->procname);
+		return 0;
+	}
+	mididev_byunit[unit]->odelay = msecs * 24000;
+	return 1;
+}
+
+unsigned
+blt_dcomp(struct exec *o, struct data **r)
+{
+	long unit, msecs;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookuplong(o, "millisecs", &msecs)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
+		logx(1, "%s: bad device number", o->procname);
+		return 0;
+	}
+	if (msecs < 0 || msecs > 500) {
+		logx(1, "%s: latency must be in the 0..500 range", o->procname);
+		return 0;
+	}
+	mididev_setlatency(mididev_byunit[unit], msecs * 24000);
+	return 1;
+}
+
+unsigned
+blt_drate(struct exec *o, struct data **r)
+{
+	long unit, rate;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookuplong(o, "bytes_per_sec", &rate)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
+		logx(1, "%s: bad device number", o->procname);
+		return 0;
+	}
+	if (rate != 0 && (rate < 100 || rate > 1000000)) {
+		logx(1, "%s: rate must be 0 or in the 100..1000000 range",
+		    o->procname);
+		return 0;
+	}
+	mididev_setrate(mididev_byunit[unit], rate);
+	return 1;
+}
+
 unsigned
 blt_dinfo(struct exec *o, struct data **r)
 {
@@ -3642,7 +4416,7 @@ blt_dinfo(struct exec *o, struct data **r)
 	if (!exec_lookuplong(o, "devnum", &unit)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
 		logx(1, "%s: bad device number", o->procname);
 		return 0;
 	}
@@ -3666,6 +4440,35 @@ blt_dinfo(struct exec *o, struct data **r)
 	if (dev->sendclk) {
 		textout_putstr(tout, "clktx\t\t\t# sends clock ticks\n");
 	}
+	if (dev->clkpll) {
+		textout_putstr(tout, "clkpll\t\t\t# smooths received clock\n");
+	}
+	if (dev->onodup) {
+		textout_putstr(tout, "nodup\t\t\t# drops redundant messages\n");
+	}
+	if (dev->icoalesce) {
+		textout_putstr(tout, "coalesce\t\t# merges input controller values\n");
+	}
+	if (dev->odelay) {
+		textout_putstr(tout, "latency ");
+		textout_putlong(tout, dev->odelay / 24000);
+		textout_putstr(tout, "\t\t# output scheduled ahead (ms)\n");
+	}
+	if (dev->olatency) {
+		textout_putstr(tout, "comp ");
+		textout_putlong(tout, dev->olatency / 24000);
+		textout_putstr(tout, "\t\t\t# latency compensated (ms)\n");
+	}
+	if (dev->ocomp) {
+		textout_putstr(tout, "# output delayed by ");
+		textout_putlong(tout, dev->ocomp / 24000);
+		textout_putstr(tout, "ms to match other devices\n");
+	}
+	if (dev->orate) {
+		textout_putstr(tout, "rate ");
+		textout_putlong(tout, dev->orate);
+		textout_putstr(tout, "\t\t# max output bytes per second\n");
+	}
 	textout_putstr(tout, "ixctl {");
 	for (i = 0, more = 0; i < 32; i++) {
 		if (dev->ixctlset & (1 << i)) {
@@ -3714,6 +4517,14 @@ blt_dinfo(struct exec *o, struct data **r)
 	textout_putlong(tout, mididev_byunit[unit]->ticrate);
 	textout_putstr(tout, "\n");
 
+	if (dev->ops->stat)
+		dev->ops->stat(dev, tout);
+	if (dev->noverrun) {
+		textout_putstr(tout, "# output overrun: ");
+		textout_putlong(tout, dev->noverrun);
+		textout_putstr(tout, " bytes dropped\n");
+	}
+
 	textout_shiftleft(tout);
 	textout_putstr(tout, "}\n");
 	return 1;
@@ -3733,7 +4544,7 @@ blt_dixctl(struct exec *o, struct data **r)
 	    !exec_lookuplist(o, "ctlset", &list)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
 		logx(1, "%s: bad device number", o->procname);
 		return 0;
 	}
@@ -3758,7 +4569,7 @@ blt_doxctl(struct exec *o, struct data **r)
 	    !exec_lookuplist(o, "ctlset", &list)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
 		logx(1, "%s: bad device number", o->procname);
 		return 0;
 	}
@@ -3783,7 +4594,7 @@ blt_diev(struct exec *o, struct data **r)
 	    !exec_lookuplist(o, "flags", &list)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
 		logx(1, "%s: bad device number", o->procname);
 		return 0;
 	}
@@ -3808,7 +4619,7 @@ blt_doev(struct exec *o, struct data **r)
 	    !exec_lookuplist(o, "flags", &list)) {
 		return 0;
 	}
-	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+	if (unit < 0 || unit >= ev_ndevs || !mididev_byunit[unit]) {
 		logx(1, "%s: bad device number", o->procname);
 		return 0;
 	}
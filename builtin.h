@@ -29,6 +29,15 @@ unsigned blt_version(struct exec *, struct data **);
 unsigned blt_panic(struct exec *, struct data **);
 unsigned blt_debug(struct exec *, struct data **);
 unsigned blt_exec(struct exec *, struct data **);
+unsigned blt_tickstat(struct exec *, struct data **);
+unsigned blt_tickstatreset(struct exec *, struct data **);
+unsigned blt_procstat(struct exec *, struct data **);
+unsigned blt_procstatreset(struct exec *, struct data **);
+unsigned blt_poolstat(struct exec *, struct data **);
+unsigned blt_poolstatreset(struct exec *, struct data **);
+unsigned blt_poolwarn(struct exec *, struct data **);
+unsigned blt_trace(struct exec *, struct data **);
+unsigned blt_tracesave(struct exec *, struct data **);
 unsigned blt_print(struct exec *, struct data **);
 unsigned blt_err(struct exec *, struct data **);
 unsigned blt_h(struct exec *, struct data **);
@@ -44,6 +53,10 @@ unsigned blt_setunit(struct exec *, struct data **);
 unsigned blt_getunit(struct exec *, struct data **);
 unsigned blt_loop(struct exec *, struct data **);
 unsigned blt_noloop(struct exec *, struct data **);
+unsigned blt_recdefer(struct exec *, struct data **);
+unsigned blt_songstage(struct exec *, struct data **);
+unsigned blt_songswap(struct exec *, struct data **);
+unsigned blt_sxwait(struct exec *, struct data **);
 unsigned blt_goto(struct exec *, struct data **);
 unsigned blt_getpos(struct exec *, struct data **);
 unsigned blt_sel(struct exec *, struct data **);
@@ -68,6 +81,8 @@ unsigned blt_import(struct exec *, struct data **);
 unsigned blt_idle(struct exec *, struct data **);
 unsigned blt_play(struct exec *, struct data **);
 unsigned blt_rec(struct exec *, struct data **);
+unsigned blt_render(struct exec *, struct data **);
+unsigned blt_dryrun(struct exec *, struct data **);
 unsigned blt_stop(struct exec *, struct data **);
 unsigned blt_tempo(struct exec *, struct data **);
 unsigned blt_mins(struct exec *, struct data **);
@@ -111,7 +126,9 @@ unsigned blt_tquanta(struct exec *, struct data **);
 unsigned blt_tquantf(struct exec *, struct data **);
 unsigned blt_ttransp(struct exec *, struct data **);
 unsigned blt_tvcurve(struct exec *, struct data **);
+unsigned blt_tthin(struct exec *, struct data **);
 unsigned blt_tevmap(struct exec *, struct data **);
+unsigned blt_tapply(struct exec *, struct data **);
 unsigned blt_tclist(struct exec *, struct data **);
 unsigned blt_tinfo(struct exec *, struct data **);
 unsigned blt_tdump(struct exec *, struct data **);
@@ -151,6 +168,7 @@ unsigned blt_fmap(struct exec *, struct data **);
 unsigned blt_funmap(struct exec *, struct data **);
 unsigned blt_ftransp(struct exec *, struct data **);
 unsigned blt_fvcurve(struct exec *, struct data **);
+unsigned blt_fthin(struct exec *, struct data **);
 unsigned blt_fchgin(struct exec *, struct data **);
 unsigned blt_fchgout(struct exec *, struct data **);
 unsigned blt_fswapin(struct exec *, struct data **);
@@ -176,6 +194,12 @@ unsigned blt_dmmctx(struct exec *, struct data **);
 unsigned blt_dclkrx(struct exec *, struct data **);
 unsigned blt_dclktx(struct exec *, struct data **);
 unsigned blt_dclkrate(struct exec *, struct data **);
+unsigned blt_dclkpll(struct exec *, struct data **);
+unsigned blt_dlatency(struct exec *, struct data **);
+unsigned blt_dcomp(struct exec *, struct data **);
+unsigned blt_drate(struct exec *, struct data **);
+unsigned blt_dnodup(struct exec *, struct data **);
+unsigned blt_dcoalesce(struct exec *, struct data **);
 unsigned blt_dinfo(struct exec *, struct data **);
 unsigned blt_dixctl(struct exec *, struct data **);
 unsigned blt_doxctl(struct exec *, struct data **);
@@ -61,6 +61,5 @@ cons_ready(void)
 {
 	if (user_flag_verb) {
 		fprintf(stdout, "+ready\n");
-		fflush(stdout);
 	}
 }
@@ -24,6 +24,7 @@ void cons_done(void);
 void cons_putpos(unsigned, unsigned, unsigned);
 void cons_puttag(char *);
 void cons_ready(void);
+int cons_interrupted(void);
 
 extern int cons_isatty;
 
@@ -28,42 +28,77 @@
  * controller followed by a prog change will be converted to a
  * "extended" prog change (XPC) that contains also the bank number.
  * In order to generate XPCs whose context is the current bank number,
- * we keep the bank number into a statelist. Similarly the current
+ * we keep the bank number of each channel. Similarly the current
  * NRPN and RPN numbers are kept.
  *
- * To keep the state, we use statelist_xxx() functions. However since
- * we store only controllers, we roll simplified lookup() and update()
- * functions.
+ * Only controller values are stored, so the state is a fixed array
+ * of the 128 controller values of each (dev, ch), allocated on first
+ * use. Lookups and updates are simple array accesses.
  */
 
 #include "utils.h"
-#include "state.h"
 #include "conv.h"
 
-#define CHAN_MATCH(e1, e2) \
-	((e1)->ch == (e2)->ch && (e1)->dev == (e2)->dev)
+/*
+ * value of controllers not set
+ */
+#define CONV_NOVAL	0xff
+
+/*
+ * initialize the conversion state with all controllers not set
+ */
+void
+conv_init(struct conv *o)
+{
+	unsigned i;
 
-#define CTL_MATCH(e1, e2) \
-	((e1)->ctl_num == (e2)->ctl_num && CHAN_MATCH((e1), (e2)))
+	o->chan = xmalloc(MAXNCHANS_LIMIT * sizeof(unsigned char *),
+	    "conv_chan");
+	for (i = 0; i < MAXNCHANS_LIMIT; i++)
+		o->chan[i] = NULL;
+}
 
 /*
- * create a state for the given controller event. If there is already
- * one, then update it.
+ * free the conversion state
  */
 void
-conv_setctl(struct statelist *slist, struct ev *ev)
+conv_done(struct conv *o)
 {
-	struct state *i;
+	unsigned i;
 
-	for (i = slist->first; i != NULL; i = i->next) {
-		if (CTL_MATCH(&i->ev, ev)) {
-			i->ev.ctl_val = ev->ctl_val;
-			return;
-		}
+	for (i = 0; i < MAXNCHANS_LIMIT; i++) {
+		if (o->chan[i])
+			xfree(o->chan[i]);
+	}
+	xfree(o->chan);
+}
+
+/*
+ * return the controller values of the channel of the given event,
+ * or NULL if none was ever set and 'create' is zero
+ */
+static unsigned char *
+conv_getchan(struct conv *o, struct ev *ev, int create)
+{
+	unsigned char **p;
+	unsigned i;
+
+	p = &o->chan[(ev->dev << 4) + (ev->ch & 0xf)];
+	if (*p == NULL && create) {
+		*p = xmalloc(128, "conv_ctls");
+		for (i = 0; i < 128; i++)
+			(*p)[i] = CONV_NOVAL;
 	}
-	i = state_new();
-	statelist_add(slist, i);
-	i->ev = *ev;
+	return *p;
+}
+
+/*
+ * store the value of the given controller event
+ */
+void
+conv_setctl(struct conv *o, struct ev *ev)
+{
+	conv_getchan(o, ev, 1)[ev->ctl_num] = ev->ctl_val;
 }
 
 /*
@@ -72,16 +107,14 @@ conv_setctl(struct statelist *slist, struct ev *ev)
  * recorded, then return EV_UNDEF
  */
 unsigned
-conv_getctl(struct statelist *slist, struct ev *ev, unsigned num)
+conv_getctl(struct conv *o, struct ev *ev, unsigned num)
 {
-	struct state *i;
+	unsigned char *ctls;
 
-	for (i = slist->first; i != NULL; i = i->next) {
-		if (i->ev.ctl_num == num && CHAN_MATCH(&i->ev, ev)) {
-			return i->ev.ctl_val;
-		}
-	}
-	return EV_UNDEF;
+	ctls = conv_getchan(o, ev, 0);
+	if (ctls == NULL || ctls[num] == CONV_NOVAL)
+		return EV_UNDEF;
+	return ctls[num];
 }
 
 /*
@@ -89,17 +122,13 @@ conv_getctl(struct statelist *slist, struct ev *ev, unsigned num)
  * same channel/device as the given event.
  */
 void
-conv_rmctl(struct statelist *slist, struct ev *ev, unsigned num)
+conv_rmctl(struct conv *o, struct ev *ev, unsigned num)
 {
-	struct state *i;
+	unsigned char *ctls;
 
-	for (i = slist->first; i != NULL; i = i->next) {
-		if (i->ev.ctl_num == num && CHAN_MATCH(&i->ev, ev)) {
-			statelist_rm(slist, i);
-			state_del(i);
-			break;
-		}
-	}
+	ctls = conv_getchan(o, ev, 0);
+	if (ctls != NULL)
+		ctls[num] = CONV_NOVAL;
 }
 
 /*
@@ -109,15 +138,15 @@ conv_rmctl(struct statelist *slist, struct ev *ev, unsigned num)
  * returned.
  */
 unsigned
-conv_getctx(struct statelist *slist, struct ev *ev, unsigned hi, unsigned lo)
+conv_getctx(struct conv *o, struct ev *ev, unsigned hi, unsigned lo)
 {
 	unsigned vhi, vlo;
 
-	vlo = conv_getctl(slist, ev, lo);
+	vlo = conv_getctl(o, ev, lo);
 	if (vlo == EV_UNDEF) {
 		return EV_UNDEF;
 	}
-	vhi = conv_getctl(slist, ev, hi);
+	vhi = conv_getctl(o, ev, hi);
 	if (vhi == EV_UNDEF) {
 		return EV_UNDEF;
 	}
@@ -130,7 +159,7 @@ conv_getctx(struct statelist *slist, struct ev *ev, unsigned hi, unsigned lo)
  * filled and 1 is returned.
  */
 unsigned
-conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
+conv_packev(struct conv *o, unsigned xctlset, unsigned flags,
 	    struct ev *ev, struct ev *rev)
 {
 	unsigned num, val;
@@ -141,67 +170,67 @@ conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
 		rev->ch = ev->ch;
 		rev->pc_prog = ev->v0;
 		rev->pc_bank = (flags & CONV_XPC) ?
-		    conv_getctx(l, ev, BANK_HI, BANK_LO) : 0;
+		    conv_getctx(o, ev, BANK_HI, BANK_LO) : 0;
 		return 1;
 	} else if (ev->cmd == EV_CTL) {
 		switch (ev->ctl_num) {
 		case BANK_HI:
 			if (!(flags & CONV_XPC))
 				break;
-			conv_rmctl(l, ev, BANK_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(o, ev, BANK_LO);
+			conv_setctl(o, ev);
 			return 0;
 		case RPN_HI:
 			if (!(flags & CONV_XPC))
 				break;
-			conv_rmctl(l, ev, NRPN_LO);
-			conv_rmctl(l, ev, RPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(o, ev, NRPN_LO);
+			conv_rmctl(o, ev, RPN_LO);
+			conv_setctl(o, ev);
 			return 0;
 		case NRPN_HI:
 			if (!(flags & CONV_NRPN))
 				break;
-			conv_rmctl(l, ev, RPN_LO);
-			conv_rmctl(l, ev, NRPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(o, ev, RPN_LO);
+			conv_rmctl(o, ev, NRPN_LO);
+			conv_setctl(o, ev);
 			return 0;
 		case DATAENT_HI:
 			if (!(flags & (CONV_RPN | CONV_NRPN)))
 				break;
-			conv_rmctl(l, ev, DATAENT_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(o, ev, DATAENT_LO);
+			conv_setctl(o, ev);
 			return 0;
 		case BANK_LO:
 			if (!(flags & CONV_XPC))
 				break;
-			conv_setctl(l, ev);
+			conv_setctl(o, ev);
 			return 0;
 		case NRPN_LO:
 			if (!(flags & CONV_NRPN))
 				break;
-			conv_rmctl(l, ev, RPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(o, ev, RPN_LO);
+			conv_setctl(o, ev);
 			return 0;
 		case RPN_LO:
 			if (!(flags & CONV_RPN))
 				break;
-			conv_rmctl(l, ev, NRPN_LO);
-			conv_setctl(l, ev);
+			conv_rmctl(o, ev, NRPN_LO);
+			conv_setctl(o, ev);
 			return 0;
 		case DATAENT_LO:
 			if (!(flags & (CONV_RPN | CONV_NRPN)))
 				break;
-			num = conv_getctx(l, ev, NRPN_HI, NRPN_LO);
+			num = conv_getctx(o, ev, NRPN_HI, NRPN_LO);
 			if (num != EV_UNDEF) {
 				rev->cmd = EV_NRPN;
 			} else {
-				num = conv_getctx(l, ev,
+				num = conv_getctx(o, ev,
 				    RPN_HI, NRPN_LO);
 				if (num == EV_UNDEF)
 					return 0;
 				rev->cmd = EV_RPN;
 			}
-			val = conv_getctl(l, ev, DATAENT_HI);
+			val = conv_getctl(o, ev, DATAENT_HI);
 			if (val == EV_UNDEF)
 				return 0;
 			rev->dev = ev->dev;
@@ -212,13 +241,13 @@ conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
 		}
 		if (ev->ctl_num < 32) {
 			if (EVCTL_ISFINE(xctlset, ev->ctl_num)) {
-				conv_setctl(l, ev);
+				conv_setctl(o, ev);
 				return 0;
 			}
 		} else if (ev->ctl_num < 64) {
 			num = ev->ctl_num - 32;
 			if (EVCTL_ISFINE(xctlset, num)) {
-				val = conv_getctl(l, ev, num);
+				val = conv_getctl(o, ev, num);
 				if (val == EV_UNDEF)
 					return 0;
 				rev->ctl_num = num;
@@ -245,7 +274,7 @@ conv_packev(struct statelist *l, unsigned xctlset, unsigned flags,
  * the array.
  */
 unsigned
-conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
+conv_unpackev(struct conv *o, unsigned xctlset, unsigned flags,
 	      struct ev *ev, struct ev *rev)
 {
 	unsigned val, hi;
@@ -276,14 +305,14 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 		}
 		if (ev->ctl_num < 32 && EVCTL_ISFINE(xctlset, ev->ctl_num)) {
 			hi = ev->ctl_val >> 7;
-			val = conv_getctl(slist, ev, ev->ctl_num);
+			val = conv_getctl(o, ev, ev->ctl_num);
 			if (val != hi || val == EV_UNDEF) {
 				rev->cmd = EV_CTL;
 				rev->dev = ev->dev;
 				rev->ch = ev->ch;
 				rev->ctl_num = ev->ctl_num;
 				rev->ctl_val = hi;
-				conv_setctl(slist, rev);
+				conv_setctl(o, rev);
 				rev++;
 				nev++;
 			}
@@ -305,14 +334,14 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 		}
 	} else if (ev->cmd == EV_XPC) {
 		if (flags & CONV_XPC) {
-			val = conv_getctx(slist, ev, BANK_HI, BANK_LO);
+			val = conv_getctx(o, ev, BANK_HI, BANK_LO);
 			if (val != ev->pc_bank && ev->pc_bank != EV_UNDEF) {
 				rev->cmd = EV_CTL;
 				rev->dev = ev->dev;
 				rev->ch = ev->ch;
 				rev->ctl_num = BANK_HI;
 				rev->ctl_val = ev->pc_bank >> 7;
-				conv_setctl(slist, rev);
+				conv_setctl(o, rev);
 				rev++;
 				nev++;
 				rev->cmd = EV_CTL;
@@ -320,7 +349,7 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 				rev->ch = ev->ch;
 				rev->ctl_num = BANK_LO;
 				rev->ctl_val = ev->pc_bank & 0x7f;
-				conv_setctl(slist, rev);
+				conv_setctl(o, rev);
 				rev++;
 				nev++;
 			}
@@ -335,16 +364,16 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 	} else if (ev->cmd == EV_NRPN) {
 		if (!(flags & CONV_NRPN))
 			return 0;
-		val = conv_getctx(slist, ev, NRPN_HI, NRPN_LO);
+		val = conv_getctx(o, ev, NRPN_HI, NRPN_LO);
 		if (val != ev->rpn_num) {
-			conv_rmctl(slist, ev, RPN_HI);
-			conv_rmctl(slist, ev, RPN_LO);
+			conv_rmctl(o, ev, RPN_HI);
+			conv_rmctl(o, ev, RPN_LO);
 			rev->cmd = EV_CTL;
 			rev->dev = ev->dev;
 			rev->ch = ev->ch;
 			rev->ctl_num = NRPN_HI;
 			rev->ctl_val = ev->rpn_num >> 7;
-			conv_setctl(slist, rev);
+			conv_setctl(o, rev);
 			rev++;
 			nev++;
 			rev->cmd = EV_CTL;
@@ -352,7 +381,7 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 			rev->ch = ev->ch;
 			rev->ctl_num = NRPN_LO;
 			rev->ctl_val = ev->rpn_num & 0x7f;
-			conv_setctl(slist, rev);
+			conv_setctl(o, rev);
 			rev++;
 			nev++;
 		}
@@ -375,16 +404,16 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 	} else if (ev->cmd == EV_RPN) {
 		if (!(flags & CONV_RPN))
 			return 0;
-		val = conv_getctx(slist, ev, RPN_HI, RPN_LO);
+		val = conv_getctx(o, ev, RPN_HI, RPN_LO);
 		if (val != ev->rpn_num) {
-			conv_rmctl(slist, ev, NRPN_HI);
-			conv_rmctl(slist, ev, NRPN_LO);
+			conv_rmctl(o, ev, NRPN_HI);
+			conv_rmctl(o, ev, NRPN_LO);
 			rev->cmd = EV_CTL;
 			rev->dev = ev->dev;
 			rev->ch = ev->ch;
 			rev->ctl_num = RPN_HI;
 			rev->ctl_val = ev->rpn_num >> 7;
-			conv_setctl(slist, rev);
+			conv_setctl(o, rev);
 			rev++;
 			nev++;
 			rev->cmd = EV_CTL;
@@ -392,7 +421,7 @@ conv_unpackev(struct statelist *slist, unsigned xctlset, unsigned flags,
 			rev->ch = ev->ch;
 			rev->ctl_num = RPN_LO;
 			rev->ctl_val = ev->rpn_num & 0x7f;
-			conv_setctl(slist, rev);
+			conv_setctl(o, rev);
 			rev++;
 			nev++;
 		}
@@ -28,12 +28,20 @@
 #define CONV_NRPN	(1 << EV_NRPN)
 #define CONV_RPN	(1 << EV_RPN)
 
+/*
+ * state of the conversion: controller values of each (dev, ch)
+ */
+struct conv {
+	unsigned char **chan;
+};
+
 struct ev;
-struct statelist;
 
-unsigned conv_packev(struct statelist *, unsigned, unsigned,
+void conv_init(struct conv *);
+void conv_done(struct conv *);
+unsigned conv_packev(struct conv *, unsigned, unsigned,
     struct ev *, struct ev *);
-unsigned conv_unpackev(struct statelist *, unsigned, unsigned,
+unsigned conv_unpackev(struct conv *, unsigned, unsigned,
     struct ev *, struct ev *);
 
 #endif /* MIDISH_CONV_H */
@@ -33,6 +33,30 @@
 #include "str.h"
 #include "cons.h"
 #include "data.h"
+#include "pool.h"
+
+/*
+ * scripts create and delete a data structure for each evaluated
+ * expression, so take them from a pool rather than calling xmalloc()
+ */
+struct pool data_pool;
+
+/*
+ * number of values allocated so far, used by the proc profiler
+ */
+unsigned long data_nnew = 0;
+
+void
+data_pool_init(unsigned size)
+{
+	pool_init(&data_pool, "data", sizeof(struct data), size);
+}
+
+void
+data_pool_done(void)
+{
+	pool_done(&data_pool);
+}
 
 /*
  * allocate a new data structure and initialize it as 'nil'
@@ -41,7 +65,8 @@ struct data *
 data_newnil(void)
 {
 	struct data *o;
-	o = (struct data *)xmalloc(sizeof(struct data), "data");
+	o = (struct data *)pool_new(&data_pool);
+	data_nnew++;
 	o->type = DATA_NIL;
 	o->next = NULL;
 	return o;
@@ -224,7 +249,7 @@ void
 data_delete(struct data *o)
 {
 	data_clear(o);
-	xfree(o);
+	pool_del(&data_pool, o);
 }
 
 size_t
@@ -289,15 +314,14 @@ data_assign(struct data *dst, struct data *src)
 		break;
 	case DATA_LIST:
 		dst->type = DATA_LIST;
-		dst->val.list = NULL;
+		j = &dst->val.list;
 		for (i = src->val.list; i != NULL; i = i->next) {
 			n = data_newnil();
 			data_assign(n, i);
-			for (j = &dst->val.list; *j != NULL; j = &(*j)->next)
-				; /* noting */
-			n->next = NULL;
 			*j = n;
+			j = &n->next;
 		}
+		*j = NULL;
 		break;
 	case DATA_RANGE:
 		dst->type = DATA_RANGE;
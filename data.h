@@ -49,6 +49,10 @@ struct data {
 	struct data *next;
 };
 
+extern unsigned long data_nnew;
+
+void	     data_pool_init(unsigned);
+void	     data_pool_done(void);
 struct data *data_newnil(void);
 struct data *data_newlong(long);
 struct data *data_newstring(char *);
@@ -57,40 +57,29 @@
 #define TPU_MAX			(96 * 40)
 
 /*
- * maximum number of midi devices supported by midish
+ * default number of midi devices supported by midish, it may be
+ * changed at startup up to MAXNDEVS_LIMIT (device numbers are
+ * stored in a byte)
  */
 #define DEFAULT_MAXNDEVS	16
+#define MAXNDEVS_LIMIT		256
 
 /*
  * maximum number of instruments
  */
-#define DEFAULT_MAXNCHANS	(DEFAULT_MAXNDEVS * 16)
+#define MAXNCHANS_LIMIT		(MAXNDEVS_LIMIT * 16)
 
 /*
- * maximum number of events
+ * number of events, tracks, filter states, system exclusive messages
+ * and chunks (each sysex is a set of chunks) allocated at once when
+ * the corresponding pool grows
  */
-#define DEFAULT_MAXNSEQEVS	400000
-
-/*
- * maximum number of tracks
- */
-#define DEFAULT_MAXNSEQPTRS	200
-
-/*
- * maximum number of filter states (roughly maximum number of
- * simultaneous notes
- */
-#define DEFAULT_MAXNSTATES	10000
-
-/*
- * maximum number of system exclusive messages
- */
-#define DEFAULT_MAXNSYSEXS	2000
-
-/*
- * maximum number of chunks (each sysex is a set of chunks)
- */
-#define DEFAULT_MAXNCHUNKS	(DEFAULT_MAXNSYSEXS * 2)
+#define DEFAULT_NSEQEVS		4096
+#define DEFAULT_NSEQPTRS	32
+#define DEFAULT_NSTATES		256
+#define DEFAULT_NSYSEXS		64
+#define DEFAULT_NCHUNKS		(DEFAULT_NSYSEXS * 2)
+#define DEFAULT_NDATAS		256
 
 /*
  * default number of tics per beat
@@ -135,6 +124,12 @@
  */
 #define DEFAULT_SXWAIT		20
 
+/*
+ * number of bytes per second sysex messages are sent at, if the output
+ * rate of the device is not limited (MIDI 1.0 links)
+ */
+#define DEFAULT_SXRATE		3125
+
 /*
  * metronome click length in 24-th of microsecond (30ms)
  */
@@ -159,6 +154,12 @@
  */
 #define UNDO_MAXSIZE		(4 * 1024 * 1024)
 
+/*
+ * max size of track undo data moved to a temporary file once
+ * UNDO_MAXSIZE is exceeded
+ */
+#define UNDO_MAXSPILL		(64 * 1024 * 1024)
+
 /*
  * output source prioriries
  */
@@ -137,6 +137,11 @@ struct evinfo evinfo[EV_NUMCMD] =
 
 struct evctl evctl_tab[EV_MAXCOARSE + 1];
 
+/*
+ * number of devices, ie. EV_MAXDEV + 1
+ */
+unsigned ev_ndevs = DEFAULT_MAXNDEVS;
+
 /*
  * return the 'name' of the given event
  */
@@ -158,7 +163,8 @@ ev_str2cmd(struct ev *ev, char *str)
 	unsigned i;
 
 	for (i = 0; i < EV_NUMCMD; i++) {
-		if (evinfo[i].ev && str_eq(evinfo[i].ev, str)) {
+		if (evinfo[i].ev && evinfo[i].ev[0] == str[0] &&
+		    str_eq(evinfo[i].ev, str)) {
 			ev->cmd = i;
 			return 1;
 		}
@@ -226,6 +232,35 @@ ev_phase(struct ev *ev)
 	return phase;
 }
 
+/*
+ * if the event belongs to a continuous stream (controller, bender
+ * or aftertouch), store its value scaled to 14 bits in "rval"
+ * and return 1, else return 0
+ */
+unsigned
+ev_contval(struct ev *ev, unsigned *rval)
+{
+	switch (ev->cmd) {
+	case EV_XCTL:
+	case EV_NRPN:
+	case EV_RPN:
+		*rval = ev->v1;
+		break;
+	case EV_BEND:
+		*rval = ev->bend_val;
+		break;
+	case EV_CAT:
+		*rval = ev->cat_val << 7;
+		break;
+	case EV_KAT:
+		*rval = ev->note_kat << 7;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
 /*
  * check if the given event matches the given frame (if so, this means
  * that, iether the event is part of the frame, either there is a
@@ -448,7 +483,8 @@ evspec_str2cmd(struct evspec *ev, char *str)
 	unsigned i;
 
 	for (i = 0; i < EV_NUMCMD; i++) {
-		if (evinfo[i].spec != NULL && str_eq(evinfo[i].spec, str)) {
+		if (evinfo[i].spec != NULL && evinfo[i].spec[0] == str[0] &&
+		    str_eq(evinfo[i].spec, str)) {
 			ev->cmd = i;
 			return 1;
 		}
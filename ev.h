@@ -84,7 +84,7 @@ struct ev {
 #define timesig_tics	v1
 	unsigned v0, v1;
 #define EV_UNDEF	0xffff
-#define EV_MAXDEV	(DEFAULT_MAXNDEVS - 1)
+#define EV_MAXDEV	(ev_ndevs - 1)
 #define EV_MAXCH	15
 #define EV_MAXCOARSE	0x7f
 #define EV_MAXFINE	0x3fff
@@ -153,10 +153,12 @@ struct evinfo {
 };
 
 extern struct evinfo evinfo[EV_NUMCMD];
+extern unsigned ev_ndevs;
 
 size_t   ev_fmt(char *buf, size_t bufsz, struct ev *ev);
 unsigned ev_str2cmd(struct ev *, char *);
 unsigned ev_phase(struct ev *);
+unsigned ev_contval(struct ev *, unsigned *);
 unsigned ev_eq(struct ev *, struct ev *);
 unsigned ev_match(struct ev *, struct ev *);
 void	 ev_map(struct ev *, struct evspec *, struct evspec *, struct ev *);
@@ -78,6 +78,11 @@ var_empty(struct name **list)
 	}
 }
 
+/*
+ * if set, count calls, time and allocations of each proc
+ */
+unsigned exec_prof = 0;
+
 /*
  * allocate a new procedure with the given name
  */
@@ -89,6 +94,8 @@ proc_new(char *name)
 	name_init(&o->name, name);
 	o->args = NULL;
 	o->code = NULL;
+	o->hnext = NULL;
+	proc_statreset(o);
 	return o;
 }
 
@@ -104,6 +111,17 @@ proc_delete(struct proc *o)
 	xfree(o);
 }
 
+/*
+ * clear profiling counters of the given procedure
+ */
+void
+proc_statreset(struct proc *o)
+{
+	o->ncalls = 0;
+	o->incltime = o->excltime = 0;
+	o->ndatas = 0;
+}
+
 /*
  * free all procedures and clear the given list
  */
@@ -126,13 +144,20 @@ struct exec *
 exec_new(void)
 {
 	struct exec *o;
+	unsigned i;
+
 	o = (struct exec *)xmalloc(sizeof(struct exec), "exec");
 	o->procs = NULL;
+	for (i = 0; i < EXEC_NPROCHASH; i++)
+		o->prochash[i] = NULL;
 	o->globals = NULL;
 	o->locals = &o->globals;
 	o->procname = "top-level";
+	o->frame = o->nframes = 0;
 	o->depth = 0;
 	o->result = RESULT_OK;
+	o->subtime = 0;
+	o->subdatas = 0;
 	return o;
 }
 
@@ -182,7 +207,41 @@ exec_varlookup(struct exec *o, char *name)
 struct proc *
 exec_proclookup(struct exec *o, char *name)
 {
-	return (struct proc *)name_lookup(&o->procs, name);
+	struct proc *p;
+
+	p = o->prochash[name_hash(name) & (EXEC_NPROCHASH - 1)];
+	for (; p != NULL; p = p->hnext) {
+		if (str_eq(p->name.str, name))
+			break;
+	}
+	return p;
+}
+
+/*
+ * add the given procedure to the hash index
+ */
+static void
+exec_prochashadd(struct exec *o, struct proc *p)
+{
+	struct proc **b;
+
+	b = o->prochash + (name_hash(p->name.str) & (EXEC_NPROCHASH - 1));
+	p->hnext = *b;
+	*b = p;
+}
+
+/*
+ * add a new empty user-defined procedure in the exec environment
+ */
+struct proc *
+exec_newproc(struct exec *o, char *name)
+{
+	struct proc *p;
+
+	p = proc_new(name);
+	name_insert(&o->procs, (struct name *)p);
+	exec_prochashadd(o, p);
+	return p;
 }
 
 /*
@@ -197,6 +256,7 @@ exec_newbuiltin(struct exec *o, char *name,
 	newp->args = args;
 	newp->code = node_new(&node_vmt_builtin, data_newuser((void *)func));
 	name_add(&o->procs, (struct name *)newp);
+	exec_prochashadd(o, newp);
 }
 
 /*
@@ -53,6 +53,11 @@ struct proc {
 	struct name name;
 	struct name *args;
 	struct node *code;
+	struct proc *hnext;	/* next proc in the same hash bucket */
+	unsigned long ncalls;	/* number of calls, see exec_prof */
+	unsigned long long incltime;	/* nsecs in the proc and callees */
+	unsigned long long excltime;	/* nsecs in the proc only */
+	unsigned long ndatas;	/* values allocated by the proc only */
 };
 
 #define PROC_FOREACH(i,list)			\
@@ -68,12 +73,20 @@ struct exec {
 	struct name *globals;	/* list of global variables */
 	struct name **locals;	/* pointer to list of local variables */
 	struct name *procs;	/* list of user and built-in procs */
+#define EXEC_NPROCHASH	256
+	struct proc *prochash[EXEC_NPROCHASH];	/* procs indexed by name */
 	char *procname;		/* current proc name, for err messages */
+	unsigned long frame;	/* id of the current locals list */
+	unsigned long nframes;	/* number of ids used so far */
 #define EXEC_MAXDEPTH	40
 	unsigned depth;		/* max depth of nested proc calls */
 	unsigned result;	/* result of last operation */
+	unsigned long long subtime;	/* nsecs in callees of current proc */
+	unsigned long subdatas;	/* values allocated by them */
 };
 
+extern unsigned exec_prof;
+
 struct var *var_new(struct name **, char *, struct data *);
 void        var_delete(struct name **, struct var *);
 void	    var_log(struct var *);
@@ -82,6 +95,7 @@ void	    var_empty(struct name **);
 struct exec *exec_new(void);
 void	     exec_delete(struct exec *);
 struct proc *exec_proclookup(struct exec *, char *);
+struct proc *exec_newproc(struct exec *, char *);
 struct var  *exec_varlookup(struct exec *, char *);
 
 void exec_newbuiltin(struct exec *, char *, unsigned (*)(struct exec *, struct data **), struct name *);
@@ -97,6 +111,7 @@ unsigned exec_lookupbool(struct exec *, char *, long *);
 struct proc *proc_new(char *);
 void 	     proc_delete(struct proc *);
 void	     proc_empty(struct name **);
+void	     proc_statreset(struct proc *);
 void 	     proc_log(struct proc *);
 
 #endif /* MIDISH_EXEC_H */
@@ -142,6 +142,234 @@ filtnode_mkdst(struct filtnode *s, struct evspec *to)
 	return filtnode_new(to, pd);
 }
 
+/*
+ * return true if the given source may match events with the given
+ * cmd, dev and ch, ie if evspec_matchev() may succeed for such events
+ */
+static int
+filtidx_iscand(struct evspec *es, unsigned cmd, unsigned dev, unsigned ch)
+{
+	if (es->cmd == EVSPEC_EMPTY)
+		return 0;
+	if (es->cmd == EVSPEC_NOTE) {
+		if (cmd != EV_NON && cmd != EV_NOFF && cmd != EV_KAT)
+			return 0;
+	} else if (es->cmd != EVSPEC_ANY && es->cmd != cmd)
+		return 0;
+	if ((evinfo[es->cmd].flags & EV_HAS_DEV) &&
+	    (evinfo[cmd].flags & EV_HAS_DEV)) {
+		if (dev < es->dev_min || dev > es->dev_max)
+			return 0;
+	}
+	if ((evinfo[es->cmd].flags & EV_HAS_CH) &&
+	    (evinfo[cmd].flags & EV_HAS_CH)) {
+		if (ch < es->ch_min || ch > es->ch_max)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * split devices in classes: a new class starts at every device that
+ * begins or ends the device range of a rule, so all devices of a
+ * class match the same rules. Store the first device of each class
+ * in "first"
+ */
+static void
+filtidx_mkcls(struct filtidx *idx, struct filtnode *list, unsigned *first)
+{
+	struct filtnode *s;
+	unsigned dev;
+
+	idx->ndev = EV_MAXDEV + 1;
+	idx->devcls = xmalloc(idx->ndev * sizeof(unsigned), "filtidx");
+	for (dev = 0; dev < idx->ndev; dev++)
+		idx->devcls[dev] = 0;
+	for (s = list; s != NULL; s = s->next) {
+		if (s->es.dev_min < idx->ndev)
+			idx->devcls[s->es.dev_min] = 1;
+		if (s->es.dev_max + 1 < idx->ndev)
+			idx->devcls[s->es.dev_max + 1] = 1;
+	}
+	idx->ncls = 0;
+	for (dev = 0; dev < idx->ndev; dev++) {
+		if (dev == 0 || idx->devcls[dev])
+			first[idx->ncls++] = dev;
+		idx->devcls[dev] = idx->ncls - 1;
+	}
+}
+
+/*
+ * build the index of the given list of rules. Cells are indexed by
+ * "ncmd" commands, starting at "cmd"
+ */
+static void
+filtidx_build(struct filtidx *idx, struct filtnode *list,
+    unsigned cmd, unsigned ncmd)
+{
+	struct filtnode *s;
+	unsigned first[MAXNDEVS_LIMIT];
+	unsigned c, cls, ch, cell, n;
+
+	/*
+	 * count candidates of each cell
+	 */
+	filtidx_mkcls(idx, list, first);
+	idx->ncmd = ncmd;
+	idx->start = xmalloc((FILT_CELL(idx, ncmd, 0, 0) + 2) *
+	    sizeof(unsigned), "filtidx");
+	n = 0;
+	for (c = 0; c < ncmd; c++) {
+		for (cls = 0; cls < idx->ncls; cls++) {
+			for (ch = 0; ch < FILT_NCH; ch++) {
+				idx->start[FILT_CELL(idx, c, cls, ch)] = n;
+				for (s = list; s != NULL; s = s->next) {
+					if (filtidx_iscand(&s->es,
+						cmd + c, first[cls], ch))
+						n++;
+				}
+			}
+		}
+	}
+	idx->start[FILT_CELL(idx, ncmd, 0, 0)] = n;
+	for (s = list; s != NULL; s = s->next)
+		n++;
+	idx->start[FILT_CELL(idx, ncmd, 0, 0) + 1] = n;
+
+	/*
+	 * fill cells
+	 */
+	idx->cand = n > 0 ?
+	    xmalloc(n * sizeof(struct filtnode *), "filtidx") : NULL;
+	n = 0;
+	for (c = 0; c < ncmd; c++) {
+		for (cls = 0; cls < idx->ncls; cls++) {
+			for (ch = 0; ch < FILT_NCH; ch++) {
+				for (s = list; s != NULL; s = s->next) {
+					if (filtidx_iscand(&s->es,
+						cmd + c, first[cls], ch))
+						idx->cand[n++] = s;
+				}
+			}
+		}
+	}
+	for (s = list; s != NULL; s = s->next)
+		idx->cand[n++] = s;
+	if (filt_debug) {
+		cell = FILT_CELL(idx, ncmd, 0, 0);
+		logx(1, "%s: %u classes, %u cells, %u candidates", __func__,
+		    idx->ncls, cell, idx->start[cell]);
+	}
+}
+
+/*
+ * free the given index
+ */
+static void
+filtidx_done(struct filtidx *idx)
+{
+	xfree(idx->devcls);
+	xfree(idx->start);
+	if (idx->cand)
+		xfree(idx->cand);
+}
+
+/*
+ * return the candidate sources of the given cell and store
+ * their number in "rnum". Cells that are not indexed use the
+ * catch-all cell containing all sources.
+ */
+static struct filtnode **
+filtidx_lookup(struct filtidx *idx, unsigned c, unsigned dev, unsigned ch,
+    unsigned *rnum)
+{
+	unsigned cell;
+
+	if (c < idx->ncmd && dev < idx->ndev && ch < FILT_NCH)
+		cell = FILT_CELL(idx, c, idx->devcls[dev], ch);
+	else
+		cell = FILT_CELL(idx, idx->ncmd, 0, 0);
+	*rnum = idx->start[cell + 1] - idx->start[cell];
+	return idx->cand + idx->start[cell];
+}
+
+/*
+ * find how rules of the given list apply to events of the given
+ * set. If a single rule may match them, store it in "rs"
+ */
+static unsigned
+filt_mkact(struct filtnode *list, struct evspec *es, struct filtnode **rs)
+{
+	struct filtnode *s;
+
+	if (es->cmd != EVSPEC_NOTE)
+		return FILT_ACT_MATCH;
+	for (s = list; s != NULL; s = s->next) {
+		if (!evspec_isec(es, &s->es))
+			continue;
+		if (!evspec_in(es, &s->es))
+			return FILT_ACT_MATCH;
+		*rs = s;
+		return FILT_ACT_FIXED;
+	}
+	return FILT_ACT_NONE;
+}
+
+/*
+ * determine vcurve and transp rules of each map destination. As
+ * transp rules are matched after the velocity is changed, they are
+ * checked against the full velocity range
+ */
+static void
+filt_compileact(struct filt *o)
+{
+	struct filtnode *s, *d, *r;
+	struct evspec es;
+
+	for (s = o->map; s != NULL; s = s->next) {
+		for (d = s->dstlist; d != NULL; d = d->next) {
+			d->u.act.vel = filt_mkact(o->vcurve, &d->es, &r);
+			if (d->u.act.vel == FILT_ACT_FIXED)
+				d->u.act.nweight = r->u.vel.nweight;
+			es = d->es;
+			es.v1_min = evinfo[EVSPEC_NOTE].v1_min;
+			es.v1_max = evinfo[EVSPEC_NOTE].v1_max;
+			d->u.act.transp = filt_mkact(o->transp, &es, &r);
+			if (d->u.act.transp == FILT_ACT_FIXED)
+				d->u.act.plus = r->u.transp.plus;
+		}
+	}
+}
+
+/*
+ * build indexes of all rules of the filter, called before
+ * the filter is used, after rules were changed
+ */
+static void
+filt_compile(struct filt *o)
+{
+	filtidx_build(&o->mapidx, o->map, 0, EV_BEND + 1);
+	filtidx_build(&o->vcurveidx, o->vcurve, EV_NON, 1);
+	filtidx_build(&o->transpidx, o->transp, EV_NON, 1);
+	filtidx_build(&o->thinidx, o->thin, 0, EV_BEND + 1);
+	filt_compileact(o);
+	o->compiled = 1;
+}
+
+/*
+ * discard indexes, must be called whenever rules are changed
+ */
+static void
+filt_uncompile(struct filt *o)
+{
+	if (!o->compiled)
+		return;
+	filtidx_done(&o->mapidx);
+	filtidx_done(&o->vcurveidx);
+	filtidx_done(&o->transpidx);
+	filtidx_done(&o->thinidx);
+	o->compiled = 0;
+}
 
 /*
  * initialize a filter
@@ -152,6 +380,9 @@ filt_init(struct filt *o)
 	o->map = NULL;
 	o->vcurve = NULL;
 	o->transp = NULL;
+	o->thin = NULL;
+	o->compiled = 0;
+	statelist_init(&o->thinstate);
 }
 
 /*
@@ -160,12 +391,16 @@ filt_init(struct filt *o)
 void
 filt_reset(struct filt *o)
 {
+	filt_uncompile(o);
 	while (o->map)
 		filtnode_del(&o->map);
 	while (o->transp)
 		filtnode_del(&o->transp);
 	while (o->vcurve)
 		filtnode_del(&o->vcurve);
+	while (o->thin)
+		filtnode_del(&o->thin);
+	statelist_empty(&o->thinstate);
 }
 
 /*
@@ -175,7 +410,8 @@ void
 filt_done(struct filt *o)
 {
 	filt_reset(o);
-	o->map = o->transp = o->vcurve = (void *)0xdeadbeef;
+	statelist_done(&o->thinstate);
+	o->map = o->transp = o->vcurve = o->thin = (void *)0xdeadbeef;
 }
 
 /*
@@ -201,6 +437,125 @@ vcurve(unsigned nweight, unsigned x)
 	}
 }
 
+/*
+ * fill the given table with the velocities returned by vcurve() for
+ * all input velocities, so bulk edits don't divide for each event
+ */
+void
+vcurve_table(unsigned nweight, unsigned char *tab)
+{
+	unsigned x;
+
+	for (x = 0; x <= EV_MAXCOARSE; x++)
+		tab[x] = vcurve(nweight, x);
+}
+
+/*
+ * check if the given output event must be passed or dropped by the
+ * thin rules. Events of a continuous stream are dropped if both the
+ * time elapsed and the value change since the last event passed on
+ * the same stream are below the rule thresholds. Events terminating
+ * the stream are always passed.
+ */
+static unsigned
+filt_thinpass(struct filt *o, struct ev *ev)
+{
+	struct filtnode *s, **cand;
+	struct state *st;
+	unsigned ncand, j, val, last;
+
+	if (ev->cmd == EV_NOFF) {
+		st = statelist_lookup(&o->thinstate, ev);
+		if (st) {
+			statelist_rm(&o->thinstate, st);
+			state_del(st);
+		}
+		return 1;
+	}
+	if (!ev_contval(ev, &val))
+		return 1;
+	cand = filtidx_lookup(&o->thinidx, ev->cmd, ev->dev, ev->ch, &ncand);
+	for (j = 0; ; j++) {
+		if (j == ncand)
+			return 1;
+		s = cand[j];
+		if (evspec_matchev(&s->es, ev))
+			break;
+	}
+	st = statelist_lookup(&o->thinstate, ev);
+	if (ev_phase(ev) == EV_PHASE_LAST) {
+		if (st) {
+			statelist_rm(&o->thinstate, st);
+			state_del(st);
+		}
+		return 1;
+	}
+	if (st == NULL) {
+		st = state_new();
+		st->ev = *ev;
+		st->phase = ev_phase(ev);
+		statelist_add(&o->thinstate, st);
+	} else {
+		ev_contval(&st->ev, &last);
+		if ((unsigned)mux_wallclock - st->tic < s->u.thin.usec24 &&
+		    (val > last ? val - last : last - val) <
+		    (s->u.thin.delta << 7)) {
+			if (filt_debug)
+				logx(1, "%s: {ev:%p}: dropped", __func__, ev);
+			return 0;
+		}
+		st->ev = *ev;
+	}
+	st->tic = mux_wallclock;
+	return 1;
+}
+
+/*
+ * apply vcurve and transp rules of the given map destination
+ * to the given note event
+ */
+static void
+filt_act(struct filt *o, struct filtnode *d, struct ev *ev)
+{
+	struct filtnode *s, **cand;
+	unsigned ncand, j;
+
+	switch (d->u.act.vel) {
+	case FILT_ACT_FIXED:
+		ev->note_vel = vcurve(d->u.act.nweight, ev->note_vel);
+		break;
+	case FILT_ACT_MATCH:
+		cand = filtidx_lookup(&o->vcurveidx, EV_ISNOTE(ev) ? 0 : 1,
+		    ev->dev, ev->ch, &ncand);
+		for (j = 0; j < ncand; j++) {
+			s = cand[j];
+			if (!evspec_matchev(&s->es, ev))
+				continue;
+			ev->note_vel = vcurve(s->u.vel.nweight, ev->note_vel);
+			break;
+		}
+		break;
+	}
+	switch (d->u.act.transp) {
+	case FILT_ACT_FIXED:
+		ev->note_num += d->u.act.plus;
+		ev->note_num &= 0x7f;
+		break;
+	case FILT_ACT_MATCH:
+		cand = filtidx_lookup(&o->transpidx, EV_ISNOTE(ev) ? 0 : 1,
+		    ev->dev, ev->ch, &ncand);
+		for (j = 0; j < ncand; j++) {
+			s = cand[j];
+			if (!evspec_matchev(&s->es, ev))
+				continue;
+			ev->note_num += s->u.transp.plus;
+			ev->note_num &= 0x7f;
+			break;
+		}
+		break;
+	}
+}
+
 /*
  * match event against all sources and for each source
  * generate output events
@@ -208,17 +563,18 @@ vcurve(unsigned nweight, unsigned x)
 unsigned
 filt_do(struct filt *o, struct ev *in, struct ev *out)
 {
-	struct ev *ev;
-	struct filtnode *s;
+	struct filtnode *s, **cand;
 	struct filtnode *d;
-	unsigned nev, i;
+	unsigned nev, ncand, i, j;
 
+	if (!o->compiled)
+		filt_compile(o);
+	if (filt_debug)
+		logx(1, "%s: in = {ev:%p}", __func__, in);
 	nev = 0;
-	for (s = o->map;; s = s->next) {
-		if (s == NULL)
-			break;
-		if (filt_debug)
-			logx(1, "%s: in = {ev:%p}", __func__, in);
+	cand = filtidx_lookup(&o->mapidx, in->cmd, in->dev, in->ch, &ncand);
+	for (j = 0; j < ncand; j++) {
+		s = cand[j];
 		if (evspec_matchev(&s->es, in)) {
 			for (d = s->dstlist; d != NULL; d = d->next) {
 				if (d->es.cmd == EVSPEC_EMPTY)
@@ -230,29 +586,20 @@ filt_do(struct filt *o, struct ev *in, struct ev *out)
 					    "{ev:%p} -> {ev:%p}", __func__,
 					    &s->es, &d->es, in, &out[nev]);
 				}
+				if (EV_ISNOTE(in))
+					filt_act(o, d, &out[nev]);
 				nev++;
 			}
 			break;
 		}
 	}
-	if (!EV_ISNOTE(in))
+	if (o->thin == NULL)
 		return nev;
-	for (i = 0, ev = out; i < nev; i++, ev++) {
-		for (d = o->vcurve; d != NULL; d = d->next) {
-			if (!evspec_matchev(&d->es, ev))
-				continue;
-			ev->note_vel = vcurve(d->u.vel.nweight, ev->note_vel);
-			break;
-		}
-		for (d = o->transp; d != NULL; d = d->next) {
-			if (!evspec_matchev(&d->es, ev))
-				continue;
-			ev->note_num += d->u.transp.plus;
-			ev->note_num &= 0x7f;
-			break;
-		}
+	for (i = 0, j = 0; i < nev; i++) {
+		if (filt_thinpass(o, &out[i]))
+			out[j++] = out[i];
 	}
-	return nev;
+	return j;
 }
 
 /*
@@ -264,6 +611,7 @@ filt_mapdel(struct filt *f, struct evspec *from, struct evspec *to)
 	struct filtnode *s, **ps;
 	struct filtnode *d, **pd;
 
+	filt_uncompile(f);
 	for (ps = &f->map; (s = *ps) != NULL;) {
 		if (evspec_in(&s->es, from)) {
 			for (pd = &s->dstlist; (d = *pd) != NULL;) {
@@ -307,6 +655,7 @@ filt_mapnew(struct filt *f, struct evspec *from, struct evspec *to)
 	if (to->cmd != EVSPEC_EMPTY && !evspec_isamap(from, to))
 		return;
 
+	filt_uncompile(f);
 	s = filtnode_mksrc(&f->map, from);
 	filtnode_mkdst(s, to);
 }
@@ -316,6 +665,7 @@ filt_detach(struct filt *o)
 {
 	struct filtnode *list, *s;
 
+	filt_uncompile(o);
 	for (list = NULL; (s = o->map) != NULL;) {
 		o->map = s->next;
 		s->next = list;
@@ -395,6 +745,7 @@ filt_transp(struct filt *f, struct evspec *from, int plus)
 		return;
 	}
 
+	filt_uncompile(f);
 	s = filtnode_mksrc(&f->transp, from);
 	s->u.transp.plus = plus & 0x7f;
 }
@@ -408,10 +759,24 @@ filt_vcurve(struct filt *f, struct evspec *from, int weight)
 		logx(1, "%s: set must contain notes", __func__);
 		return;
 	}
+	filt_uncompile(f);
 	s = filtnode_mksrc(&f->vcurve, from);
 	s->u.vel.nweight = (64 - weight) & 0x7f;
 }
 
+void
+filt_thin(struct filt *f, struct evspec *from, unsigned usec24,
+    unsigned delta)
+{
+	struct filtnode *s;
+
+	filt_uncompile(f);
+	statelist_empty(&f->thinstate);
+	s = filtnode_mksrc(&f->thin, from);
+	s->u.thin.usec24 = usec24;
+	s->u.thin.delta = delta;
+}
+
 unsigned
 filt_evcnt(struct filt *f, unsigned cmd)
 {
@@ -435,6 +800,10 @@ filt_evcnt(struct filt *f, unsigned cmd)
 		if (s->es.cmd == cmd)
 			cnt++;
 	}
+	for (s = f->thin; s != NULL; s = s->next) {
+		if (s->es.cmd == cmd)
+			cnt++;
+	}
 
 	return cnt;
 }
@@ -18,6 +18,7 @@
 #define MIDISH_FILT_H
 
 #include "ev.h"
+#include "state.h"
 
 /*
  * source against which the input event is matched
@@ -33,18 +34,72 @@ struct filtnode {
 		struct {
 			int plus;
 		} transp;
+		struct {
+			unsigned usec24;	/* min time between events */
+			unsigned delta;		/* min value change */
+		} thin;
+		struct {
+			unsigned vel;		/* how to apply vcurve rules */
+			unsigned transp;	/* how to apply transp rules */
+			unsigned nweight;	/* weight, if FILT_ACT_FIXED */
+			int plus;		/* transposition, if fixed */
+		} act;
 	} u;
 };
 
+/*
+ * vcurve and transp rules applied to the events produced by a map
+ * destination are determined when rules are compiled. If the
+ * destination is included in a single rule, its parameters are
+ * stored in the destination node, else rules must be matched
+ * against each produced event.
+ */
+#define FILT_ACT_NONE	0		/* no rule applies */
+#define FILT_ACT_FIXED	1		/* the same rule always applies */
+#define FILT_ACT_MATCH	2		/* rule depends on the event */
+
 #define FILT_MAXNRULES 32
+#define FILT_THIN_MAXMS 10000
+
+/*
+ * compiled form of a list of rules. For each (cmd, dev, ch) cell, we
+ * store the list of sources that may match events of the cell, in
+ * the same order as in the list of rules. The extra cell after the
+ * last one contains all sources and is used for events that are not
+ * indexed.
+ *
+ * Devices that no rule tells apart are grouped in a single class, so
+ * the index size depends on the number of device ranges the rules use
+ * rather than on the number of devices.
+ */
+struct filtidx {
+	unsigned ncmd;			/* number of indexed commands */
+	unsigned ndev;			/* number of indexed devices */
+	unsigned ncls;			/* number of device classes */
+	unsigned *devcls;		/* class of each device */
+	unsigned *start;		/* first candidate of each cell */
+	struct filtnode **cand;		/* candidates grouped by cell */
+};
+
+#define FILT_NCH	(EV_MAXCH + 1)
+#define FILT_CELL(idx, cmd, cls, ch) \
+	(((cmd) * (idx)->ncls + (cls)) * FILT_NCH + (ch))
 
 struct filt {
 	struct filtnode *map;		/* root of map rules */
 	struct filtnode *vcurve;	/* root of vcurve rules */
 	struct filtnode *transp;	/* root of transp rules */
+	struct filtnode *thin;		/* root of thin rules */
+	unsigned compiled;		/* if indexes below are valid */
+	struct filtidx mapidx;		/* index of map rules */
+	struct filtidx vcurveidx;	/* index of vcurve rules */
+	struct filtidx transpidx;	/* index of transp rules */
+	struct filtidx thinidx;		/* index of thin rules */
+	struct statelist thinstate;	/* last event passed, per stream */
 };
 
 unsigned vcurve(unsigned, unsigned);
+void vcurve_table(unsigned, unsigned char *);
 
 void filt_init(struct filt *);
 void filt_done(struct filt *);
@@ -56,6 +111,7 @@ void filt_chgin(struct filt *, struct evspec *, struct evspec *, int);
 void filt_chgout(struct filt *, struct evspec *, struct evspec *, int);
 void filt_transp(struct filt *, struct evspec *, int);
 void filt_vcurve(struct filt *, struct evspec *, int);
+void filt_thin(struct filt *, struct evspec *, unsigned, unsigned);
 unsigned filt_evcnt(struct filt *, unsigned);
 
 struct filtnode *filtnode_new(struct evspec *, struct filtnode **);
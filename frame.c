@@ -181,6 +181,7 @@ seqptr_new(struct track *t)
 	sp = (struct seqptr *)pool_new(&seqptr_pool);
 	statelist_init(&sp->statelist);
 	sp->link = NULL;
+	sp->track = t;
 	sp->pos = t->first;
 	sp->delta = 0;
 	sp->tic = 0;
@@ -224,6 +225,39 @@ seqptr_link(struct seqptr *sp1, struct seqptr *sp2)
 	sp2->link = sp1;
 }
 
+/*
+ * discard saved positions of the track index that a change at the
+ * current position may affect, ie the ones at or after the previous
+ * event
+ */
+static void
+seqptr_unindex(struct seqptr *sp)
+{
+	track_unindexfrom(sp->track, sp->tic - sp->delta);
+}
+
+/*
+ * save for undo the next event, which is about to be modified, as
+ * 'shift' tics are inserted (or removed) before it
+ */
+static void
+seqptr_touch(struct seqptr *sp, int shift)
+{
+	track_undotouch(sp->track, sp->pos,
+	    sp->tic - sp->delta + sp->pos->delta, shift);
+}
+
+/*
+ * save for undo the given event at the given tic and the next one,
+ * as the event is about to be removed
+ */
+static void
+track_touchrm(struct track *t, struct seqev *se, unsigned tic)
+{
+	track_undotouch(t, se, tic, 0);
+	track_undotouch(t, se->next, tic + se->next->delta, 0);
+}
+
 /*
  * return the state structure of the next available event or NULL if
  * there is no next event in the current tick.  The state list is
@@ -261,6 +295,8 @@ seqptr_evdel(struct seqptr *sp, struct statelist *slist)
 	if (sp->delta != sp->pos->delta || sp->pos->ev.cmd == EV_NULL) {
 		return NULL;
 	}
+	seqptr_unindex(sp);
+	track_touchrm(sp->track, sp->pos, sp->tic);
 	if (slist)
 		st = statelist_update(slist, &sp->pos->ev);
 	else
@@ -286,6 +322,8 @@ seqptr_evput(struct seqptr *sp, struct ev *ev)
 	struct seqptr *link;
 	struct seqev *se;
 
+	seqptr_unindex(sp);
+	seqptr_touch(sp, 0);
 	se = seqev_new();
 	se->ev = *ev;
 	se->delta = sp->delta;
@@ -343,6 +381,9 @@ seqptr_ticdel(struct seqptr *sp, unsigned max, struct statelist *slist)
 	if (ntics > max) {
 		ntics = max;
 	}
+	seqptr_unindex(sp);
+	if (ntics > 0)
+		seqptr_touch(sp, -(int)ntics);
 	sp->pos->delta -= ntics;
 	if (slist != NULL && max > 0) {
 		statelist_outdate(slist);
@@ -369,6 +410,8 @@ seqptr_ticput(struct seqptr *sp, unsigned ntics)
 	if (ntics == 0)
 		return;
 
+	seqptr_unindex(sp);
+	seqptr_touch(sp, ntics);
 	sp->pos->delta += ntics;
 	sp->delta += ntics;
 	sp->tic += ntics;
@@ -382,6 +425,34 @@ seqptr_ticput(struct seqptr *sp, unsigned ntics)
 	}
 }
 
+/*
+ * same as seqptr_evdel(), but leave the event on the track. The
+ * caller then either removes it with seqptr_evdel(sp, NULL) or keeps
+ * it with seqptr_evget(); the later is the same as removing it and
+ * putting it back, except that the track is not modified
+ */
+struct state *
+seqptr_evpeek(struct seqptr *sp, struct statelist *slist)
+{
+	if (sp->delta != sp->pos->delta || sp->pos->ev.cmd == EV_NULL) {
+		return NULL;
+	}
+	return statelist_update(slist, &sp->pos->ev);
+}
+
+/*
+ * same as seqptr_ticdel() followed by seqptr_ticput() of the removed
+ * space, except that the track is not modified
+ */
+unsigned
+seqptr_ticpass(struct seqptr *sp, unsigned max, struct statelist *slist)
+{
+	if (slist != NULL && max > 0) {
+		statelist_outdate(slist);
+	}
+	return seqptr_ticskip(sp, max);
+}
+
 /*
  * move forward 'ntics', if the end-of-track is reached then return
  * the number of reamaining tics. Used for reading on a track
@@ -417,6 +488,107 @@ seqptr_seek(struct seqptr *sp, unsigned ntics)
 		seqptr_ticput(sp, ntics);
 }
 
+/*
+ * move the seqptr to the position saved in the given mark
+ */
+static void
+seqptr_markload(struct seqptr *sp, struct trackmark *m)
+{
+	statelist_empty(&sp->statelist);
+	statelist_copy(&sp->statelist, &m->statelist);
+	sp->pos = m->pos;
+	sp->delta = m->delta;
+	sp->tic = m->tic;
+}
+
+/*
+ * save the current position in a new mark and add it to the seek
+ * index of the track, the position must be after the last mark
+ */
+static void
+seqptr_marksave(struct seqptr *sp, unsigned key)
+{
+	struct trackmark *m;
+
+	m = xmalloc(sizeof(struct trackmark), "trackmark");
+	m->key = key;
+	m->tic = sp->tic;
+	m->delta = sp->delta;
+	m->pos = sp->pos;
+	statelist_copy(&m->statelist, &sp->statelist);
+	m->next = sp->track->marks;
+	sp->track->marks = m;
+}
+
+/*
+ * return the mark of the seek index with the largest key not greater
+ * than the given one, or NULL if there's none. The last mark of the
+ * index is stored in 'plast'. If the index uses the other key type,
+ * it's discarded first.
+ */
+static struct trackmark *
+track_findmark(struct track *t, unsigned meas, unsigned key,
+    struct trackmark **plast)
+{
+	struct trackmark *m;
+
+	if (t->marksmeas != meas) {
+		track_unindex(t);
+		t->marksmeas = meas;
+	}
+	for (m = t->marks; m != NULL; m = m->next) {
+		if (m->key <= key)
+			break;
+	}
+	*plast = t->marks;
+	return m;
+}
+
+/*
+ * same as seqptr_skip() on a seqptr just created with seqptr_new(),
+ * but use the seek index of the track to start
+ * from the closest saved position. If we move beyond the last saved
+ * position, new ones are saved every SEQPTR_MARKEVS events.
+ */
+unsigned
+seqptr_locate(struct seqptr *sp, unsigned ntics)
+{
+	struct track *t = sp->track;
+	struct trackmark *m, *last;
+	unsigned delta, nev;
+
+	if (sp->pos != t->first || sp->tic != 0) {
+		logx(1, "%s: seqptr not at the beginning of the track", __func__);
+		panic();
+	}
+	m = track_findmark(t, 0, ntics, &last);
+	if (m != NULL)
+		seqptr_markload(sp, m);
+	ntics -= sp->tic;
+	if (m != last)
+		return seqptr_skip(sp, ntics);
+
+	/*
+	 * same as seqptr_skip(), but save positions; the saved state
+	 * must be exactly the one seqptr_skip() would have, so only
+	 * save positions where seqptr_skip() may stop, ie on events
+	 */
+	nev = 0;
+	while (ntics > 0) {
+		while (seqptr_evget(sp))
+			nev++;
+		delta = seqptr_ticskip(sp, ntics);
+		if (delta == 0)
+			break;
+		ntics -= delta;
+		if (nev >= SEQPTR_MARKEVS && sp->delta == sp->pos->delta) {
+			seqptr_marksave(sp, sp->tic);
+			nev = 0;
+		}
+	}
+	return ntics;
+}
+
 
 /*
  * move the next frame of the current tick to the given track. Must
@@ -426,7 +598,7 @@ void
 seqptr_framerm(struct seqptr *sp, struct track *f)
 {
 	struct seqev **save_pos, *se, *spos, *fpos;
-	unsigned save_delta, sdelta, phase;
+	unsigned save_delta, sdelta, phase, tic;
 
 	if (sp->delta != sp->pos->delta) {
 		logx(1, "%s: not called at event position", __func__);
@@ -438,6 +610,7 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 	}
 
 	track_clear(f);
+	seqptr_unindex(sp);
 	fpos = f->first;
 
 	/*
@@ -452,12 +625,14 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 
 	spos = sp->pos;
 	sdelta = sp->delta;
+	tic = sp->tic;
 
 	phase = ev_phase(&spos->ev);
 
 	/* move event to frame track */
 	se = spos;
 	spos = se->next;
+	track_touchrm(sp->track, se, tic);
 	seqev_rm(se);
 	seqev_ins(fpos, se);
 
@@ -475,6 +650,7 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 
 		/* move to next event */
 		fpos->delta += spos->delta - sdelta;
+		tic += spos->delta - sdelta;
 		sdelta = spos->delta;
 
 		/* process next event */
@@ -484,6 +660,7 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 			/* move event to frame track */
 			se = spos;
 			spos = se->next;
+			track_touchrm(sp->track, se, tic);
 			seqev_rm(se);
 			seqev_ins(fpos, se);
 		} else {
@@ -510,7 +687,7 @@ void
 seqptr_frameadd(struct seqptr *sp, struct track *f)
 {
 	struct seqev *se, *spos, **save_pos;
-	unsigned ntics, offs, sdelta, save_delta;
+	unsigned ntics, offs, sdelta, save_delta, tic;
 
 	/*
 	 * Save current postition.
@@ -518,8 +695,11 @@ seqptr_frameadd(struct seqptr *sp, struct track *f)
 	save_pos = sp->pos->prev;
 	save_delta = sp->delta;
 
+	seqptr_unindex(sp);
+	track_unindex(f);
 	spos = sp->pos;
 	sdelta = sp->delta;
+	tic = sp->tic - sp->delta;
 	for (;;) {
 		if (f->first->ev.cmd == EV_NULL)
 			break;
@@ -543,24 +723,30 @@ seqptr_frameadd(struct seqptr *sp, struct track *f)
 
 			/* if reached the end, append space */
 			if (spos->ev.cmd == EV_NULL) {
+				track_undotouch(sp->track, spos,
+				    tic + spos->delta, 0);
 				spos->delta += offs;
 				sdelta += offs;
 				offs = 0;
 				break;
 			}
 
+			tic += spos->delta;
 			spos = spos->next;
 			sdelta = 0;
 		}
 
 		/* make the event the last of the tick */
 		while (sdelta == spos->delta && spos->ev.cmd != EV_NULL) {
+			tic += spos->delta;
 			sdelta = 0;
 			spos = spos->next;
 		}
 
+		track_undotouch(sp->track, spos, tic + spos->delta, 0);
 		se->delta = sdelta;
 		spos->delta -= sdelta;
+		tic += sdelta;
 		sdelta = 0;
 		/* link to the list */
 		se->next = spos;
@@ -625,32 +811,40 @@ seqptr_rmlast(struct seqptr *sp, struct state **pst)
 {
 	struct state *st = *pst;
 	struct seqev *i, *prev, *cur, *next;
+	unsigned tic, curtic;
 
 #ifdef FRAME_DEBUG
 	logx(1, "%s: {ev:%p}: removing last event", __func__, &st->ev);
 #endif
 	/*
-	 * start a the first event of the frame and iterate until the
-	 * current postion. Store in 'cur' the event to delete and in
-	 * 'prev' the event before 'cur' that belongs to the same
-	 * frame
+	 * start at the current position and iterate backward until
+	 * the first event of the frame. Store in 'cur' the event to
+	 * delete and in 'prev' the event before 'cur' that belongs to
+	 * the same frame. Frames may be very long (ex. controllers),
+	 * so don't iterate forward from the first event.
 	 */
-	i = cur = st->pos;
-	prev = NULL;
-	for (;;) {
-		i = i->next;
-		if (i == sp->pos) {
-			break;
-		}
-		if (state_match(st, &i->ev)) {
-			prev = cur;
+	i = sp->pos;
+	tic = sp->tic - sp->delta + sp->pos->delta;
+	cur = prev = NULL;
+	curtic = 0;
+	do {
+		tic -= i->delta;
+		i = seqev_prev(i);
+		if (i == st->pos || state_match(st, &i->ev)) {
+			if (cur != NULL) {
+				prev = i;
+				break;
+			}
 			cur = i;
+			curtic = tic;
 		}
-	}
+	} while (i != st->pos);
 	/*
 	 * remove the event from the track
 	 * (but not the blank space)
 	 */
+	track_unindex(sp->track);
+	track_touchrm(sp->track, cur, curtic);
 	next = cur->next;
 	next->delta += cur->delta;
 	if (next == sp->pos) {
@@ -684,21 +878,26 @@ seqptr_rmprev(struct seqptr *sp, struct state **pst)
 {
 	struct state *st = *pst;
 	struct seqev *i, *next;
+	unsigned tic;
 
 #ifdef FRAME_DEBUG
 	logx(1, "%s: {ev:%p}: removing whole frame", __func__, &st->ev);
 #endif
 	/*
 	 * start a the first event of the frame and iterate until the
-	 * current postion removing all events of the frame.
+	 * current postion removing all events of the frame. 'tic' is
+	 * the position of the event preceding 'i'
 	 */
 	i = st->pos;
+	tic = st->tic - i->delta;
 	for (;;) {
 		if (state_match(st, &i->ev)) {
 			/*
 			 * remove the event from the track
 			 * (but not the blank space)
 			 */
+			track_unindex(sp->track);
+			track_touchrm(sp->track, i, tic + i->delta);
 			next = i->next;
 			next->delta += i->delta;
 			if (next == sp->pos) {
@@ -709,6 +908,7 @@ seqptr_rmprev(struct seqptr *sp, struct state **pst)
 			seqev_del(i);
 			i = next;
 		} else {
+			tic += i->delta;
 			i = i->next;
 		}
 		if (i == sp->pos) {
@@ -752,6 +952,48 @@ seqptr_evmerge1(struct seqptr *pd, struct state *s1)
 	return sd;
 }
 
+/*
+ * same as seqptr_evdel() followed by seqptr_evmerge1() on the deleted
+ * event, but if the event is to be stored again in the track, leave
+ * it in place rather than deleting and allocating it again. The state
+ * of the event in 'slist' is returned, or NULL if there's no next
+ * event in the current tick.
+ */
+static struct state *
+seqptr_evremerge1(struct seqptr *pd, struct statelist *slist)
+{
+	struct state *s1, *sd;
+
+	if (pd->delta != pd->pos->delta || pd->pos->ev.cmd == EV_NULL)
+		return NULL;
+	s1 = statelist_update(slist, &pd->pos->ev);
+
+	/*
+	 * ignore bogus events
+	 */
+	if (s1->flags & (STATE_BOGUS | STATE_NESTED))
+		goto drop;
+
+	sd = statelist_lookup(&pd->statelist, &s1->ev);
+
+	if (sd != NULL) {
+		if (sd->tag == 0 && !(sd->phase & EV_PHASE_LAST))
+			goto drop;
+	} else if (!(s1->phase & EV_PHASE_FIRST))
+		goto drop;
+
+	if (sd != NULL && state_eq(sd, &s1->ev)) {
+		sd->tag = 1;
+		goto drop;
+	}
+	sd = seqptr_evget(pd);
+	sd->tag = 1;
+	return s1;
+drop:
+	(void)seqptr_evdel(pd, NULL);
+	return s1;
+}
+
 /*
  * merge high priority event: if ev2 conflicts with low priority events
  * in the track, discard them and store ev2. This routine must be
@@ -838,14 +1080,11 @@ track_merge(struct track *dst, struct track *src)
 		 * on 'dst' by merging them with the state table of
 		 * 'src'. The 'orglist' state table is updated so it
 		 * always contain the exact state of the original
-		 * 'dst' track.
+		 * 'dst' track. Events that are put back are not
+		 * moved.
 		 */
-		for(;;) {
-			s = seqptr_evdel(pd, &orglist);
-			if (s == NULL)
-				break;
-			seqptr_evmerge1(pd, s);
-		}
+		while (seqptr_evremerge1(pd, &orglist) != NULL)
+			; /* nothing */
 
 		/*
 		 * move all events from 'src' to 'dst' by merging them
@@ -875,8 +1114,9 @@ track_merge(struct track *dst, struct track *src)
 			break;
 		}
 		(void)seqptr_ticskip(p2, deltad);
-		(void)seqptr_ticdel(pd, deltad, &orglist);
-		seqptr_ticput(pd, deltad);
+		delta1 = seqptr_ticpass(pd, deltad, &orglist);
+		if (delta1 < deltad)
+			seqptr_ticput(pd, deltad - delta1);
 	}
 
 	statelist_done(&orglist);
@@ -920,7 +1160,7 @@ track_move(struct track *src, unsigned start, unsigned len,
 	 * go to the start position and tag all frames as
 	 * not being copied and not being erased
 	 */
-	(void)seqptr_skip(sp, start);
+	(void)seqptr_locate(sp, start);
 	statelist_dup(&slist, &sp->statelist);
 	for (st = slist.first; st != NULL; st = st->next) {
        		st->tag = TAG_KEEP;
@@ -944,7 +1184,7 @@ track_move(struct track *src, unsigned start, unsigned len,
 	 *
 	 */
 	for (;;) {
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
 		if ((st->phase & EV_PHASE_FIRST) ||
@@ -958,9 +1198,10 @@ track_move(struct track *src, unsigned start, unsigned len,
 		}
 		if (copy && (st->tag & TAG_COPY))
 			seqptr_evput(dp, &st->ev);
-		if (!blank || (st->tag & TAG_KEEP)) {
-			seqptr_evput(sp, &st->ev);
-		}
+		if (!blank || (st->tag & TAG_KEEP))
+			(void)seqptr_evget(sp);
+		else
+			(void)seqptr_evdel(sp, NULL);
 	}
 
 	/*
@@ -981,14 +1222,13 @@ track_move(struct track *src, unsigned start, unsigned len,
 	 * tag/copy/erase frames during 'len' tics
 	 */
 	for (;;) {
-		delta = seqptr_ticdel(sp, len, &slist);
+		delta = seqptr_ticpass(sp, len, &slist);
 		if (copy)
 			seqptr_ticput(dp, delta);
-		seqptr_ticput(sp, delta);
 		len -= delta;
 		if (len == 0)
 			break;
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST) {
@@ -997,9 +1237,10 @@ track_move(struct track *src, unsigned start, unsigned len,
 		if (copy && (st->tag & TAG_COPY)) {
 			seqptr_evput(dp, &st->ev);
 		}
-		if (!blank || (st->tag & TAG_KEEP)) {
-			seqptr_evput(sp, &st->ev);
-		}
+		if (!blank || (st->tag & TAG_KEEP))
+			(void)seqptr_evget(sp);
+		else
+			(void)seqptr_evdel(sp, NULL);
 	}
 
 	/*
@@ -1021,7 +1262,7 @@ track_move(struct track *src, unsigned start, unsigned len,
 	 * avoid being restored
 	 */
 	for (;;) {
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
 		if ((st->phase & EV_PHASE_FIRST) ||
@@ -1033,9 +1274,10 @@ track_move(struct track *src, unsigned start, unsigned len,
 		if (copy && (st->tag & TAG_COPY)) {
 			seqptr_evput(dp, &st->ev);
 		}
-		if (!blank || (st->tag & TAG_KEEP)) {
-			seqptr_evput(sp, &st->ev);
-		}
+		if (!blank || (st->tag & TAG_KEEP))
+			(void)seqptr_evget(sp);
+		else
+			(void)seqptr_evdel(sp, NULL);
 
 	}
 
@@ -1053,11 +1295,10 @@ track_move(struct track *src, unsigned start, unsigned len,
 	 * canceled (note events)
 	 */
 	for (;;) {
-		delta = seqptr_ticdel(sp, ~0U, &slist);
+		delta = seqptr_ticpass(sp, ~0U, &slist);
 		if (copy)
 			seqptr_ticput(dp, delta);
-		seqptr_ticput(sp, delta);
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST) {
@@ -1067,9 +1308,10 @@ track_move(struct track *src, unsigned start, unsigned len,
 		if (copy && (st->tag & TAG_COPY)) {
 			seqptr_evput(dp, &st->ev);
 		}
-		if (!blank || (st->tag & TAG_KEEP)) {
-			seqptr_evput(sp, &st->ev);
-		}
+		if (!blank || (st->tag & TAG_KEEP))
+			(void)seqptr_evget(sp);
+		else
+			(void)seqptr_evdel(sp, NULL);
 	}
 
 	statelist_done(&slist);
@@ -1108,7 +1350,7 @@ track_quantize(struct track *src, struct evspec *es,
 	 * go to start position and untag all events
 	 * (tagged = will be quantized)
 	 */
-	(void)seqptr_skip(sp, start);
+	(void)seqptr_locate(sp, start);
 	statelist_dup(&slist, &sp->statelist);
 	for (st = slist.first; st != NULL; st = st->next) {
 		st->tag = 0;
@@ -1124,12 +1366,11 @@ track_quantize(struct track *src, struct evspec *es,
 	fluct = 0;
 	notes = 0;
 	for (;;) {
-		delta = seqptr_ticdel(sp, start + len - tic, &slist);
-		seqptr_ticput(sp, delta);
+		delta = seqptr_ticpass(sp, start + len - tic, &slist);
 		tic += delta;
 		if (tic >= start + len)
 			break;
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
 
@@ -1161,29 +1402,28 @@ track_quantize(struct track *src, struct evspec *es,
 				st->tag = 0;
 		}
 		if (st->tag) {
+			(void)seqptr_evdel(sp, NULL);
 			seqptr_evput(qp, &st->ev);
-		} else {
-			seqptr_evput(sp, &st->ev);
-		}
+		} else
+			(void)seqptr_evget(sp);
 	}
 
 	/*
 	 * finish quantised (tagged) events
 	 */
 	for (;;) {
-		delta = seqptr_ticdel(sp, ~0U, &slist);
-		seqptr_ticput(sp, delta);
-		st = seqptr_evdel(sp, &slist);
+		delta = seqptr_ticpass(sp, ~0U, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST)
 			st->tag = 0;
 		seqptr_ticput(qp, delta);
 		if (st->tag) {
+			(void)seqptr_evdel(sp, NULL);
 			seqptr_evput(qp, &st->ev);
-		} else {
-			seqptr_evput(sp, &st->ev);
-		}
+		} else
+			(void)seqptr_evget(sp);
 	}
 	track_merge(src, &qt);
 	statelist_done(&slist);
@@ -1216,7 +1456,7 @@ track_quantize_frame(struct track *src, struct evspec *es,
 	/*
 	 * go to start position
 	 */
-	if (seqptr_skip(sp, start) > 0) {
+	if (seqptr_locate(sp, start) > 0) {
 		seqptr_del(sp);
 		return;
 	}
@@ -1352,7 +1592,7 @@ track_prescale(struct track *t, unsigned oldunit, unsigned newunit)
 		err = delta % round;
 		delta -= err;
 		seqptr_ticput(sp, delta);
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL) {
 			break;
 		}
@@ -1360,16 +1600,18 @@ track_prescale(struct track *t, unsigned oldunit, unsigned newunit)
 		case EV_TEMPO:
 			ev.cmd = st->ev.cmd;
 			ev.tempo_usec24 = st->ev.tempo_usec24 * oldunit / newunit;
+			(void)seqptr_evdel(sp, NULL);
 			seqptr_evput(sp, &ev);
 			break;
 		case EV_TIMESIG:
 			ev.cmd = st->ev.cmd;
 			ev.timesig_beats = st->ev.timesig_beats;
 			ev.timesig_tics = st->ev.timesig_tics * newunit / oldunit;
+			(void)seqptr_evdel(sp, NULL);
 			seqptr_evput(sp, &ev);
 			break;
 		default:
-			seqptr_evput(sp, &st->ev);
+			(void)seqptr_evget(sp);
 			break;
 		}
 	}
@@ -1384,38 +1626,299 @@ track_prescale(struct track *t, unsigned oldunit, unsigned newunit)
 void
 track_scale(struct track *t, unsigned oldunit, unsigned newunit)
 {
+	struct seqev *se;
+
+	/*
+	 * only the blank space between events changes, so scale
+	 * deltas in place
+	 */
+	track_undoall(t);
+	track_unindex(t);
+	for (se = t->first; se != NULL; se = se->next)
+		se->delta = newunit * se->delta / oldunit;
+}
+
+/*
+ * transpose the given track
+ */
+void
+track_transpose(struct track *src, unsigned start, unsigned len,
+    struct evspec *es, int halftones)
+{
+	struct xform op;
+
+	op.type = XFORM_TRANSP;
+	op.arg = halftones;
+	track_xform(src, start, len, es, &op, 1);
+}
+
+/*
+ * apply velocity curve to given track
+ */
+void
+track_vcurve(struct track *src, unsigned start, unsigned len,
+    struct evspec *es, int weight)
+{
+	unsigned delta, tic;
 	struct seqptr *sp;
-	struct statelist slist;
 	struct state *st;
-	unsigned delta;
+	struct statelist slist;
+	struct ev ev;
+	unsigned char vtab[EV_MAXCOARSE + 1];
 
-	sp = seqptr_new(t);
-	statelist_init(&slist);
+	/* put weight from -63:63 to 1:127 range */
+	vcurve_table((64 - weight) & 0x7f, vtab);
+
+	sp = seqptr_new(src);
+	statelist_dup(&slist, &sp->statelist);
+	tic = 0;
+
+	/*
+	 * go through all events, rewriting selected ones whose
+	 * velocity changes
+	 */
 	for (;;) {
-		delta = newunit * seqptr_ticdel(sp, ~0U, &slist);
-		seqptr_ticput(sp, delta / oldunit);
-		st = seqptr_evdel(sp, &slist);
+		delta = seqptr_ticpass(sp, ~0U, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
-		seqptr_evput(sp, &st->ev);
+		tic += delta;
+		if ((st->phase & EV_PHASE_FIRST) &&
+		    tic >= start && tic < start + len &&
+		    EV_ISNOTE(&st->ev) && state_inspec(st, es) &&
+		    vtab[st->ev.note_vel] != st->ev.note_vel) {
+			ev = st->ev;
+			ev.note_vel = vtab[ev.note_vel];
+			(void)seqptr_evdel(sp, NULL);
+			seqptr_evput(sp, &ev);
+		} else
+			(void)seqptr_evget(sp);
 	}
+
 	statelist_done(&slist);
 	seqptr_del(sp);
 }
 
 /*
- * transpose the given track
+ * remove events of continuous streams (controllers, bender,
+ * aftertouch) that are closer than "tics" to the last event kept on
+ * the stream and whose value differs by less than "delta" (in 7-bit
+ * units) from it. The first and last events of each stream and the
+ * events where the stream changes direction (extremes) are kept.
+ *
+ * During the first pass, the private list contains one state per
+ * stream: "ev" and "tic" are the last event kept and its position;
+ * "pos" is the event being held, i.e. not known yet if it's an
+ * extreme, "tag" is its number and "nevents" its position. Events to
+ * remove are marked in the "del" array and removed by the second pass.
  */
 void
-track_transpose(struct track *src, unsigned start, unsigned len,
-    struct evspec *es, int halftones)
+track_thin(struct track *src, unsigned start, unsigned len,
+    struct evspec *es, unsigned tics, unsigned delta)
 {
-	unsigned delta, tic;
+	struct seqptr *sp;
+	struct state *st, *t;
+	struct statelist slist, tlist;
+	unsigned char *del;
+	unsigned tic, num, nev, val, ref, held;
+
+	nev = track_numev(src);
+	if (nev == 0)
+		return;
+	del = xmalloc(nev, "track_thin");
+	for (num = 0; num < nev; num++)
+		del[num] = 0;
+	delta <<= 7;
+
+	statelist_init(&tlist);
+	sp = seqptr_new(src);
+	statelist_dup(&slist, &sp->statelist);
+	tic = num = 0;
+	for (;;) {
+		tic += seqptr_ticpass(sp, ~0U, &slist);
+		st = seqptr_evpeek(sp, &slist);
+		if (st == NULL)
+			break;
+		t = statelist_lookup(&tlist, &sp->pos->ev);
+		if (tic < start || tic >= start + len ||
+		    !ev_contval(&sp->pos->ev, &val) ||
+		    !state_inspec(st, es)) {
+			/*
+			 * a note-off ends the aftertouch stream
+			 */
+			if (t && sp->pos->ev.cmd == EV_NOFF) {
+				statelist_rm(&tlist, t);
+				state_del(t);
+			}
+		} else if (t == NULL || st->phase == EV_PHASE_FIRST ||
+		    st->phase == EV_PHASE_LAST) {
+			/*
+			 * end of stream, the held event is kept
+			 */
+			if (t) {
+				statelist_rm(&tlist, t);
+				state_del(t);
+			}
+			if (st->phase != EV_PHASE_LAST) {
+				t = state_new();
+				t->ev = sp->pos->ev;
+				t->tic = tic;
+				t->pos = NULL;
+				statelist_add(&tlist, t);
+			}
+		} else {
+			ev_contval(&t->ev, &ref);
+			if (t->pos) {
+				ev_contval(&t->pos->ev, &held);
+				if ((held > ref && val < held) ||
+				    (held < ref && val > held)) {
+					t->ev = t->pos->ev;
+					t->tic = t->nevents;
+					ref = held;
+				} else
+					del[t->tag] = 1;
+				t->pos = NULL;
+			}
+			if (tic - t->tic < tics &&
+			    (val > ref ? val - ref : ref - val) < delta) {
+				t->pos = sp->pos;
+				t->tag = num;
+				t->nevents = tic;
+			} else {
+				t->ev = sp->pos->ev;
+				t->tic = tic;
+			}
+		}
+		(void)seqptr_evget(sp);
+		num++;
+	}
+	statelist_empty(&tlist);
+	statelist_done(&tlist);
+	statelist_done(&slist);
+	seqptr_del(sp);
+
+	sp = seqptr_new(src);
+	statelist_dup(&slist, &sp->statelist);
+	for (num = 0; ; num++) {
+		(void)seqptr_ticpass(sp, ~0U, &slist);
+		st = seqptr_evpeek(sp, &slist);
+		if (st == NULL)
+			break;
+		if (del[num])
+			(void)seqptr_evdel(sp, NULL);
+		else
+			(void)seqptr_evget(sp);
+	}
+	statelist_done(&slist);
+	seqptr_del(sp);
+	xfree(del);
+}
+
+/*
+ * apply the given transformation to the event; velocity curves
+ * apply to the first event of the frame only
+ */
+static void
+xform_apply(struct xform *op, struct ev *ev, unsigned first)
+{
+	struct ev in;
+
+	switch (op->type) {
+	case XFORM_TRANSP:
+		ev->note_num += (128 + op->arg);
+		ev->note_num &= 0x7f;
+		break;
+	case XFORM_VCURVE:
+		if (first)
+			ev->note_vel = op->vtab[ev->note_vel];
+		break;
+	case XFORM_EVMAP:
+		in = *ev;
+		ev_map(&in, &op->from, &op->to, ev);
+		break;
+	}
+}
+
+/*
+ * return the bitmap of transformations that apply to the frame
+ * starting with the given state. Each transformation is matched
+ * against the event as modified by the previous ones
+ */
+static unsigned
+xform_match(struct xform *ops, unsigned nops,
+    struct evspec *es, struct state *st)
+{
+	struct state cur;
+	unsigned i, mask;
+
+	cur.ev = st->ev;
+	mask = 0;
+	for (i = 0; i < nops; i++) {
+		if (!state_inspec(&cur, es))
+			continue;
+		if (ops[i].type == XFORM_EVMAP) {
+			if (!state_inspec(&cur, &ops[i].from))
+				continue;
+		} else {
+			if (!EV_ISNOTE(&cur.ev))
+				continue;
+
+			/*
+			 * skip no-ops, so unchanged frames are not
+			 * rewritten and not saved for undo
+			 */
+			if (ops[i].type == XFORM_TRANSP &&
+			    ops[i].arg % 128 == 0)
+				continue;
+			if (ops[i].type == XFORM_VCURVE &&
+			    ops[i].vtab[cur.ev.note_vel] == cur.ev.note_vel)
+				continue;
+		}
+		xform_apply(ops + i, &cur.ev, 1);
+		mask |= 1 << i;
+	}
+	return mask;
+}
+
+/*
+ * apply the transformations of the given bitmap to the event
+ */
+static void
+xform_ev(struct xform *ops, unsigned nops, unsigned mask,
+    struct ev *ev, unsigned first)
+{
+	unsigned i;
+
+	for (i = 0; i < nops; i++) {
+		if (mask & (1 << i))
+			xform_apply(ops + i, ev, first);
+	}
+}
+
+/*
+ * apply the given list of transformations to the selection in a
+ * single pass, as if they were applied one after the other
+ */
+void
+track_xform(struct track *src, unsigned start, unsigned len,
+    struct evspec *es, struct xform *ops, unsigned nops)
+{
+	unsigned delta, tic, first;
 	struct track qt;
 	struct seqptr *sp, *qp;
 	struct state *st;
 	struct statelist slist;
 	struct ev ev;
+	unsigned i;
+
+	if (nops > XFORM_MAX) {
+		logx(1, "%s: too many transformations", __func__);
+		panic();
+	}
+	for (i = 0; i < nops; i++) {
+		if (ops[i].type == XFORM_VCURVE)
+			vcurve_table((64 - ops[i].arg) & 0x7f, ops[i].vtab);
+	}
 
 	track_init(&qt);
 	sp = seqptr_new(src);
@@ -1423,9 +1926,9 @@ track_transpose(struct track *src, unsigned start, unsigned len,
 
 	/*
 	 * go to t start position and untag all frames
-	 * (tagged = will be transposed)
+	 * (tag = bitmap of transformations to apply)
 	 */
-	(void)seqptr_skip(sp, start);
+	(void)seqptr_locate(sp, start);
 	statelist_dup(&slist, &sp->statelist);
 	for (st = slist.first; st != NULL; st = st->next) {
 		st->tag = 0;
@@ -1434,54 +1937,47 @@ track_transpose(struct track *src, unsigned start, unsigned len,
 	tic = start;
 
 	/*
-	 * go ahead and copy all events to transpose during 'len' tics,
+	 * go ahead and copy all events to transform during 'len' tics,
 	 */
 	for (;;) {
-		delta = seqptr_ticdel(sp, len, &slist);
-		seqptr_ticput(sp, delta);
+		delta = seqptr_ticpass(sp, len, &slist);
 		seqptr_ticput(qp, delta);
 		tic += delta;
 		if (tic >= start + len)
 			break;
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
-		if (st->phase & EV_PHASE_FIRST) {
-			if (EV_ISNOTE(&st->ev) && state_inspec(st, es))
-				st->tag = 1;
-			else
-				st->tag = 0;
-		}
+		first = st->phase & EV_PHASE_FIRST;
+		if (first)
+			st->tag = xform_match(ops, nops, es, st);
 		if (st->tag) {
 			ev = st->ev;
-			ev.note_num += (128 + halftones);
-			ev.note_num &= 0x7f;
+			xform_ev(ops, nops, st->tag, &ev, first);
+			(void)seqptr_evdel(sp, NULL);
 			seqptr_evput(qp, &ev);
-		} else {
-			seqptr_evput(sp, &st->ev);
-		}
+		} else
+			(void)seqptr_evget(sp);
 	}
 
 	/*
-	 * finish transposed (tagged) frames
+	 * finish transformed (tagged) frames
 	 */
 	for (;;) {
-		delta = seqptr_ticdel(sp, ~0U, &slist);
-		seqptr_ticput(sp, delta);
+		delta = seqptr_ticpass(sp, ~0U, &slist);
 		seqptr_ticput(qp, delta);
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL)
 			break;
 		if (st->phase & EV_PHASE_FIRST)
 			st->tag = 0;
 		if (st->tag) {
 			ev = st->ev;
-			ev.note_num += (128 + halftones);
-			ev.note_num &= 0x7f;
+			xform_ev(ops, nops, st->tag, &ev, 0);
+			(void)seqptr_evdel(sp, NULL);
 			seqptr_evput(qp, &ev);
-		} else {
-			seqptr_evput(sp, &st->ev);
-		}
+		} else
+			(void)seqptr_evget(sp);
 	}
 	track_merge(src, &qt);
 	statelist_done(&slist);
@@ -1490,51 +1986,6 @@ track_transpose(struct track *src, unsigned start, unsigned len,
 	track_done(&qt);
 }
 
-/*
- * apply velocity curve to given track
- */
-void
-track_vcurve(struct track *src, unsigned start, unsigned len,
-    struct evspec *es, int weight)
-{
-	unsigned delta, tic;
-	struct seqptr *sp;
-	struct state *st;
-	struct statelist slist;
-	struct ev ev;
-
-	/* put weight from -63:63 to 1:127 range */
-	weight = (64 - weight) & 0x7f;
-
-	sp = seqptr_new(src);
-	statelist_dup(&slist, &sp->statelist);
-	tic = 0;
-
-	/*
-	 * rewrite all events, modifying selected ones
-	 */
-	for (;;) {
-		delta = seqptr_ticdel(sp, ~0U, &slist);
-		seqptr_ticput(sp, delta);
-		st = seqptr_evdel(sp, &slist);
-		if (st == NULL)
-			break;
-		tic += delta;
-		if ((st->phase & EV_PHASE_FIRST) &&
-		    tic >= start && tic < start + len &&
-		    EV_ISNOTE(&st->ev) && state_inspec(st, es)) {
-			ev = st->ev;
-			ev.note_vel = vcurve(weight, ev.note_vel);
-			seqptr_evput(sp, &ev);
-		} else {
-			seqptr_evput(sp, &st->ev);
-		}
-	}
-
-	statelist_done(&slist);
-	seqptr_del(sp);
-}
-
 /*
  * rewrite the track frame-by-frame
  */
@@ -1588,20 +2039,20 @@ track_check(struct track *src)
 	struct seqptr *sp;
 	struct state *dst, *st, *stnext;
 	struct statelist slist;
-	unsigned delta;
 
 	sp = seqptr_new(src);
 	statelist_init(&slist);
 
 	/*
-	 * reconstruct the track skipping bogus events,
-	 * see statelist_update() for definition of bogus
+	 * go through the track removing bogus events, see
+	 * statelist_update() for definition of bogus. Other events
+	 * are left in place, so consistent parts of the track are
+	 * not modified
 	 */
 	for (;;) {
-		delta = seqptr_ticdel(sp, ~0U, &slist);
-		seqptr_ticput(sp, delta);
+		(void)seqptr_ticpass(sp, ~0U, &slist);
 
-		st = seqptr_evdel(sp, &slist);
+		st = seqptr_evpeek(sp, &slist);
 		if (st == NULL) {
 			break;
 		}
@@ -1622,11 +2073,12 @@ track_check(struct track *src)
 			 */
 			dst = statelist_lookup(&sp->statelist, &st->ev);
 			if (dst == NULL || !state_eq(dst, &st->ev)) {
-				seqptr_evput(sp, &st->ev);
-			} else {
-				logx(1, "%s: {ev:%p}: duplicated", __func__, &st->ev);
+				(void)seqptr_evget(sp);
+				continue;
 			}
+			logx(1, "%s: {ev:%p}: duplicated", __func__, &st->ev);
 		}
+		(void)seqptr_evdel(sp, NULL);
 	}
 
 	/*
@@ -1708,6 +2160,45 @@ seqptr_skipmeasure(struct seqptr *sp, unsigned meas)
 	return 0;
 }
 
+/*
+ * same as seqptr_skipmeasure() on a seqptr just created with
+ * seqptr_new(), but use the seek index of the
+ * track to start from the closest saved measure. If we move beyond
+ * the last saved measure, new ones are saved every SEQPTR_MARKMEAS
+ * measures.
+ */
+unsigned
+seqptr_locmeasure(struct seqptr *sp, unsigned meas)
+{
+	struct track *t = sp->track;
+	struct trackmark *m, *last;
+	unsigned delta, k;
+
+	if (sp->pos != t->first || sp->tic != 0) {
+		logx(1, "%s: seqptr not at the beginning of the track", __func__);
+		panic();
+	}
+	m = track_findmark(t, 1, meas, &last);
+	if (m != NULL)
+		seqptr_markload(sp, m);
+	k = (m != NULL) ? m->key : 0;
+	if (m != last)
+		return seqptr_skipmeasure(sp, meas - k);
+	for (; k < meas; k++) {
+		delta = seqptr_skipmeasure(sp, 1);
+		if (delta > 0) {
+			/*
+			 * end-of-track, count the remaining measures
+			 * with the current time signature
+			 */
+			return delta + seqptr_skipmeasure(sp, meas - k - 1);
+		}
+		if ((k + 1) % SEQPTR_MARKMEAS == 0)
+			seqptr_marksave(sp, k + 1);
+	}
+	return 0;
+}
+
 /*
  * convert a measure number to a tic number using
  * meta-events from the given track
@@ -1719,7 +2210,7 @@ track_findmeasure(struct track *t, unsigned m)
 	unsigned tic;
 
 	sp = seqptr_new(t);
-	tic  = seqptr_skipmeasure(sp, m);
+	tic  = seqptr_locmeasure(sp, m);
 	tic += sp->tic;
 	seqptr_del(sp);
 
@@ -1742,7 +2233,7 @@ track_timeinfo(struct track *t, unsigned meas, unsigned *abs,
 	unsigned tic;
 
 	sp = seqptr_new(t);
-	tic  = seqptr_skipmeasure(sp, meas);
+	tic  = seqptr_locmeasure(sp, meas);
 	tic += sp->tic;
 
 	/*
@@ -1778,7 +2269,7 @@ track_settempo(struct track *t, unsigned measure, unsigned tempo)
 	 * go to the requested position, insert blank if necessary
 	 */
 	sp = seqptr_new(t);
-	tic = seqptr_skipmeasure(sp, measure);
+	tic = seqptr_locmeasure(sp, measure);
 	if (tic) {
 		seqptr_ticput(sp, tic);
 	}
@@ -1950,81 +2441,12 @@ void
 track_evmap(struct track *src, unsigned start, unsigned len,
     struct evspec *es, struct evspec *from, struct evspec *to)
 {
-	unsigned delta, tic;
-	struct track qt;
-	struct seqptr *sp, *qp;
-	struct state *st;
-	struct statelist slist;
-	struct ev ev;
+	struct xform op;
 
 	if (!evspec_isamap(from, to))
 		return;
-
-	track_init(&qt);
-	sp = seqptr_new(src);
-	qp = seqptr_new(&qt);
-
-	/*
-	 * go to t start position and untag all frames
-	 * (tagged = will be mapped)
-	 */
-	(void)seqptr_skip(sp, start);
-	statelist_dup(&slist, &sp->statelist);
-	for (st = slist.first; st != NULL; st = st->next) {
-		st->tag = 0;
-	}
-	seqptr_seek(qp, start);
-	tic = start;
-
-	/*
-	 * go ahead and copy all events to map during 'len' tics,
-	 */
-	for (;;) {
-		delta = seqptr_ticdel(sp, len, &slist);
-		seqptr_ticput(sp, delta);
-		seqptr_ticput(qp, delta);
-		tic += delta;
-		if (tic >= start + len)
-			break;
-		st = seqptr_evdel(sp, &slist);
-		if (st == NULL)
-			break;
-		if (st->phase & EV_PHASE_FIRST) {
-			if (state_inspec(st, es) && state_inspec(st, from))
-				st->tag = 1;
-			else
-				st->tag = 0;
-		}
-		if (st->tag) {
-			ev_map(&st->ev, from, to, &ev);
-			seqptr_evput(qp, &ev);
-		} else {
-			seqptr_evput(sp, &st->ev);
-		}
-	}
-
-	/*
-	 * finish mapped (tagged) frames
-	 */
-	for (;;) {
-		delta = seqptr_ticdel(sp, ~0U, &slist);
-		seqptr_ticput(sp, delta);
-		seqptr_ticput(qp, delta);
-		st = seqptr_evdel(sp, &slist);
-		if (st == NULL)
-			break;
-		if (st->phase & EV_PHASE_FIRST)
-			st->tag = 0;
-		if (st->tag) {
-			ev_map(&st->ev, from, to, &ev);
-			seqptr_evput(qp, &ev);
-		} else {
-			seqptr_evput(sp, &st->ev);
-		}
-	}
-	track_merge(src, &qt);
-	statelist_done(&slist);
-	seqptr_del(sp);
-	seqptr_del(qp);
-	track_done(&qt);
+	op.type = XFORM_EVMAP;
+	op.from = *from;
+	op.to = *to;
+	track_xform(src, start, len, es, &op, 1);
 }
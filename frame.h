@@ -22,13 +22,38 @@
 struct seqptr {
 	struct statelist statelist;
 	struct seqptr *link;		/* opposite direction seqptr */
+	struct track *track;		/* track we're moving on */
 	struct seqev *pos;		/* next event (current position) */
 	unsigned delta;			/* tics until the next event */
 	unsigned tic;			/* absolute tic of the current pos */
 };
 
+/*
+ * number of events (or measures) between saved positions of the seek
+ * index, see seqptr_locate() and seqptr_locmeasure()
+ */
+#define SEQPTR_MARKEVS	256
+#define SEQPTR_MARKMEAS	8
+
+/*
+ * per-event transformation, see track_xform()
+ */
+struct xform {
+#define XFORM_TRANSP	0		/* transpose by 'arg' halftones */
+#define XFORM_VCURVE	1		/* velocity curve of weight 'arg' */
+#define XFORM_EVMAP	2		/* map 'from' evspec to 'to' */
+	unsigned type;
+	int arg;
+	struct evspec from, to;
+	unsigned char vtab[EV_MAXCOARSE + 1];	/* curve, see vcurve_table() */
+};
+
+/*
+ * max number of transformations applied at once
+ */
+#define XFORM_MAX	16
+
 struct track;
-struct evspec;
 
 void	      seqptr_pool_init(unsigned);
 void	      seqptr_pool_done(void);
@@ -39,15 +64,20 @@ int	      seqptr_eot(struct seqptr *);
 struct state *seqptr_evget(struct seqptr *);
 struct state *seqptr_evdel(struct seqptr *, struct statelist *);
 struct state *seqptr_evput(struct seqptr *, struct ev *);
+struct state *seqptr_evpeek(struct seqptr *, struct statelist *);
 unsigned      seqptr_ticskip(struct seqptr *, unsigned);
 unsigned      seqptr_ticdel(struct seqptr *, unsigned,
 			    struct statelist *);
 void	      seqptr_ticput(struct seqptr *, unsigned);
+unsigned      seqptr_ticpass(struct seqptr *, unsigned,
+			    struct statelist *);
 unsigned      seqptr_skip(struct seqptr *, unsigned);
 void	      seqptr_seek(struct seqptr *, unsigned);
+unsigned      seqptr_locate(struct seqptr *, unsigned);
 struct state *seqptr_getsign(struct seqptr *, unsigned *, unsigned *);
 struct state *seqptr_gettempo(struct seqptr *, unsigned long *);
 unsigned      seqptr_skipmeasure(struct seqptr *, unsigned);
+unsigned      seqptr_locmeasure(struct seqptr *, unsigned);
 struct state *seqptr_evmerge1(struct seqptr *, struct state *);
 unsigned      seqptr_evmerge2(struct seqptr *,
     struct statelist *, struct ev *, struct ev *);
@@ -74,6 +104,10 @@ void	 track_evmap(struct track *, unsigned, unsigned,
 	 struct evspec *, struct evspec *, struct evspec *);
 void	 track_vcurve(struct track *, unsigned, unsigned,
 	 struct evspec *, int);
+void	 track_thin(struct track *, unsigned, unsigned,
+	 struct evspec *, unsigned, unsigned);
+void	 track_xform(struct track *, unsigned, unsigned,
+	 struct evspec *, struct xform *, unsigned);
 void	 track_check(struct track *);
 void	 track_rewrite(struct track *);
 void     track_confev(struct track *, struct ev *);
@@ -140,6 +140,16 @@ struct help help_list[] = {
 	"the -63..63 range. Applies only to note events of current "
 	"selection of the current track (see ev command)."},
 
+	{"tthin",
+	"tthin tics delta\n"
+	"\n"
+	"Thin controller, bender and aftertouch streams of the current "
+	"selection of the current track (see ev command): events closer "
+	"than the given number of tics to the previous kept event and "
+	"whose value changed by less than delta (in the 0..127 range) "
+	"are removed. The first and last events of each stream and "
+	"the events where the stream changes direction are kept."},
+
 	{"tevmap",
 	"tevmap source dest\n"
 	"\n"
@@ -148,6 +158,16 @@ struct help help_list[] = {
 	"Both event sets must have the same number of devices, "
 	"channels, notes, controllers etc.."},
 
+	{"tapply",
+	"tapply oplist\n"
+	"\n"
+	"Apply the given list of functions to the current selection of the "
+	"current track, as a single change that can be undone at once. Each "
+	"list item is a {func args ...} list, where func is one of ttransp, "
+	"tvcurve, tevmap, tquanta or tquantf, taking the same arguments as "
+	"the function itself. Consecutive ttransp, tvcurve and tevmap "
+	"items are applied in a single pass, as if applied one by one."},
+
 	{"mute",
 	"mute trackname\n"
 	"\n"
@@ -394,6 +414,15 @@ struct help help_list[] = {
 	"negative then sensitivity is decreased. If it's positive then "
 	"sensitivity is increased. If it's zero the velocity is unchanged."},
 
+	{"fthin",
+	"fthin evspec millisecs delta\n"
+	"\n"
+	"Thin the given controller, bender and aftertouch streams: "
+	"events closer than the given number of milliseconds to the "
+	"previous passed event and whose value changed by less than "
+	"delta (in the 0..127 range) are dropped. Events ending a "
+	"stream are always passed."},
+
 	{"xnew",
 	"xnew sysexname\n"
 	"\n"
@@ -486,6 +515,26 @@ struct help help_list[] = {
 	"\n"
 	"Stop performance and release MIDI devices."},
 
+	{"render",
+	"render trackname\n"
+	"\n"
+	"Play the song from the current position to its end as fast as "
+	"possible, without using MIDI devices, and store all events "
+	"that would be sent to the output in a new track. Loop mode, tap "
+	"mode and external clock sources can't be used. If a song is "
+	"staged, play the current measure, then the staged song, as "
+	"songswap would."},
+
+	{"dryrun",
+	"dryrun\n"
+	"\n"
+	"Play the song from the current position to its end as render "
+	"does, and print how much each device would be loaded: events "
+	"and bytes sent, peak events and bytes per tick, peak bytes per "
+	"millisecond, peak time to transmit a tick, and the number of "
+	"ticks that take longer to transmit than they last. Measures "
+	"where devices are overloaded are listed."},
+
 	{"ev",
 	"ev evspec\n"
 	"\n"
@@ -549,6 +598,21 @@ struct help help_list[] = {
 	"\n"
 	"Disable loop mode."},
 
+	{"recdefer",
+	"recdefer bool\n"
+	"\n"
+	"If true, events are only captured as they are recorded, and they "
+	"are merged into the recorded track at the next tick, so dense "
+	"input is not slowed down by track editing. In loop mode, events "
+	"are merged at once. Default is false."},
+
+	{"sxwait",
+	"sxwait bool\n"
+	"\n"
+	"Sysex banks and channel config are sent in the background, at the "
+	"rate of each device. If true, playback starts only once they are "
+	"sent. If false, it starts immediately. Default is true."},
+
 	{"ct",
 	"ct trackname\n"
 	"\n"
@@ -692,7 +756,8 @@ struct help help_list[] = {
 	"save filename\n"
 	"\n"
 	"Save the song into the given file. The file name is a "
-	"quoted string."},
+	"quoted string. If it ends with ``.msb'', track events are "
+	"saved in binary form, which is faster to load."},
 
 	{"load",
 	"load filename\n"
@@ -700,6 +765,22 @@ struct help help_list[] = {
 	"Load the song from the given file. The file name is a "
 	"quoted string. The current song will be overwritten."},
 
+	{"songstage",
+	"songstage filename\n"
+	"\n"
+	"Load the song from the given file as the next song, without "
+	"changing the current one, which may be playing. "
+	"See songswap."},
+
+	{"songswap",
+	"songswap\n"
+	"\n"
+	"Replace the current song by the one loaded with songstage. If "
+	"the current song is playing, wait for the end of the current "
+	"measure, then start playing the next song from its current "
+	"position. Devices are not closed in between. Songs can't be "
+	"swapped while recording."},
+
 	{"reset",
 	"reset\n"
 	"\n"
@@ -749,7 +830,11 @@ struct help help_list[] = {
 	"If nil is given instead of the path, then the port is not "
 	"connected to any existing port}, this allows other ALSA sequencer "
 	"clients to subscribe to it and to provide events to midish or to "
-	"consume events midish sends to the port."},
+	"consume events midish sends to the port.\n"
+	"\n"
+	"Paths of the form udp:host:port[:lport] are network devices: "
+	"events are sent as UDP datagrams to the given host and port, and "
+	"received on the local port lport (by default the same as port)."},
 
 	{"ddel",
 	"ddel devnum\n"
@@ -781,6 +866,27 @@ struct help help_list[] = {
 	"(MIDI ticks, MIDI start and MIDI stop events). Useful to "
 	"synchronize an external sequencer to midish."},
 
+	{"dcoalesce",
+	"dcoalesce devlist\n"
+	"\n"
+	"Configure the given devices to coalesce input controller, pitch "
+	"bend and aftertouch values: of the values received on a "
+	"controller at once, only the last one is processed. Notes and "
+	"other messages are not affected and the order of the messages "
+	"of each channel is preserved."},
+
+	{"dnodup",
+	"dnodup devlist\n"
+	"\n"
+	"Configure the given devices to not transmit controller, "
+	"pitch bend and channel aftertouch messages with the same "
+	"value as the last one sent on the channel. Useful to save "
+	"bandwidth of slow links when several sources send the "
+	"same values. Data entry, parameter number and 14-bit "
+	"controllers are always sent. Values are forgotten when the "
+	"device is opened, when playback stops and when sysex messages "
+	"are sent."},
+
 	{"dclkrx",
 	"dclkrx devnum\n"
 	"\n"
@@ -797,10 +903,45 @@ struct help help_list[] = {
 	"MIDI device. Default value is 96 ticks. This is the standard MIDI "
 	"value and its not recommended to change it."},
 
+	{"dclkpll",
+	"dclkpll devnum bool\n"
+	"\n"
+	"If true, and the device is the clock source, smooth the received "
+	"MIDI clock with a phase-locked loop: ticks are generated by "
+	"the internal timer following the average tempo of the master, "
+	"so jitter of the received ticks is not passed to the outputs. "
+	"The jitter is displayed by tickstat."},
+
+	{"dlatency",
+	"dlatency devnum millisecs\n"
+	"\n"
+	"Schedule events sent to the MIDI device the given number of "
+	"milliseconds ahead, so the timing is done by the system and not "
+	"affected by midish scheduling delays. Only supported by the ALSA "
+	"backend, 0 (the default) disables it."},
+
+	{"dcomp",
+	"dcomp devnum millisecs\n"
+	"\n"
+	"Set the latency of the MIDI device, ex. the USB or audio buffer "
+	"latency of a synthesizer. The output of the devices with less "
+	"latency is delayed, so that events of the same tick sound at "
+	"the same time on all devices. The default is 0."},
+
+	{"drate",
+	"drate devnum bytes_per_sec\n"
+	"\n"
+	"Limit the data sent to the MIDI device to the given number of "
+	"bytes per second, 3125 for a MIDI serial link. Messages that "
+	"don't fit are queued: notes first, then controllers, then sysex "
+	"messages. 0 (the default) disables the limit."},
+
 	{"dinfo",
 	"dinfo devnum\n"
 	"\n"
-	"Print some information about the MIDI device."},
+	"Print some information about the MIDI device, link statistics "
+	"for network devices and the number of bytes dropped because the "
+	"device was too slow to accept them."},
 
 	{"dixctl",
 	"dixctl devnum ctlset\n"
@@ -954,6 +1095,7 @@ struct help help_list[] = {
 	"    mixout - show conflicts in the output MIDI merger\n"
 	"    norm - show events in the input normalizer\n"
 	"    pool - show pool usage on exit\n"
+	"    prof - profile procs, see procstat\n"
 	"    song - show start/stop events\n"
 	"    timo - show timer internal errors\n"
 	"    mem - show memory usage"},
@@ -968,6 +1110,71 @@ struct help help_list[] = {
 	"\n"
 	"Abort (and core-dump)."},
 
+	{"tickstat",
+	"tickstat\n"
+	"\n"
+	"Display histograms of tick lateness (time between the ideal "
+	"tick time and the time it was processed) and tick processing "
+	"time (time to play the tick and send the resulting events), "
+	"in microseconds. Buckets give the number of ticks below the "
+	"given duration. If the received clock is smoothed (see dclkpll) "
+	"the phase error of the received ticks is displayed as well."},
+
+	{"tickstatreset",
+	"tickstatreset\n"
+	"\n"
+	"Clear tick lateness, processing time and clock jitter "
+	"histograms."},
+
+	{"procstat",
+	"procstat\n"
+	"\n"
+	"Display, for each proc and builtin called while profiling is "
+	"enabled (with ``debug prof 1''), the number of calls, the "
+	"time spent in it including and excluding nested calls "
+	"(in microseconds), and the number of values it allocated, "
+	"excluding nested calls. Procs are sorted by exclusive time."},
+
+	{"procstatreset",
+	"procstatreset\n"
+	"\n"
+	"Clear proc profiling counters."},
+
+	{"poolstat",
+	"poolstat\n"
+	"\n"
+	"Display, for each memory pool, the number of items in use, "
+	"the peak number of items used, the number of allocated items "
+	"and the allocated memory in kilobytes. The last line gives "
+	"the memory used by the undo buffers."},
+
+	{"poolstatreset",
+	"poolstatreset\n"
+	"\n"
+	"Set the peak usage of pools to their current usage."},
+
+	{"poolwarn",
+	"poolwarn percent\n"
+	"\n"
+	"Display a warning whenever the peak usage of a pool reaches "
+	"the given percentage of its size, i.e. when it's about to grow. "
+	"If 0, warnings are disabled, which is the default."},
+
+	{"trace",
+	"trace bool\n"
+	"\n"
+	"If true, clear the trace buffer and start recording the clock, "
+	"tick, timeout, output event and device flush activity in it. "
+	"Only the most recent records are kept. If false, stop "
+	"recording."},
+
+	{"tracesave",
+	"tracesave filename\n"
+	"\n"
+	"Save the trace buffer in the given file, in the Chrome trace "
+	"event format, which can be opened with chrome://tracing or "
+	"Perfetto."},
+
 	{"shut",
 	"shut\n"
 	"\n"
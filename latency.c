@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * latency.c
+ *
+ * measure the time midish takes to pass input events to the output.
+ * Notes are written to a raw MIDI device (ex. a fifo) midish reads,
+ * and the time until the same note comes back on the raw device
+ * midish writes is measured. Typical use:
+ *
+ *	mkfifo in.fifo out.fifo
+ *	midish-lat in.fifo out.fifo &
+ *	midish -b <<EOF
+ *	load "heavy.msh"
+ *	dnew 0 "in.fifo" ro
+ *	dnew 1 "out.fifo" wo
+ *	fnew f
+ *	fmap {any 0} {any 1}
+ *	p
+ *	EOF
+ *
+ * The song is loaded first since loading replaces the filters. Notes
+ * are sent one at a time, so channel and device changes made by the
+ * filter don't matter. Latency percentiles are printed in
+ * microseconds, as tab separated fields.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LAT_MAXN	100000
+
+long long *lat_tab;
+unsigned lat_n, lat_nlost;
+
+/*
+ * return the current time in microseconds
+ */
+long long
+lat_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return 1000000LL * ts.tv_sec + ts.tv_nsec / 1000;
+}
+
+/*
+ * parse the given bytes and return 1 if they contain a note-on
+ * with the given number. The parser state is kept in 'status',
+ * 'data' and 'ndata'
+ */
+int
+lat_parse(unsigned char *buf, unsigned len, unsigned num,
+    unsigned *status, unsigned char *data, unsigned *ndata)
+{
+	unsigned c;
+	int found = 0;
+
+	for (; len > 0; len--, buf++) {
+		c = *buf;
+		if (c >= 0xf8)
+			continue;
+		if (c & 0x80) {
+			*status = (c < 0xf0) ? c : 0;
+			*ndata = 0;
+			continue;
+		}
+		if (*status == 0)
+			continue;
+		data[(*ndata)++] = c;
+		if ((*status & 0xe0) == 0xc0) {
+			/* program change, channel aftertouch */
+			*ndata = 0;
+			continue;
+		}
+		if (*ndata < 2)
+			continue;
+		*ndata = 0;
+		if ((*status & 0xf0) == 0x90 && data[0] == num && data[1] != 0)
+			found = 1;
+	}
+	return found;
+}
+
+int
+lat_cmp(const void *p1, const void *p2)
+{
+	long long v1 = *(const long long *)p1, v2 = *(const long long *)p2;
+
+	return (v1 > v2) - (v1 < v2);
+}
+
+/*
+ * return the given percentile of the sorted latencies
+ */
+long long
+lat_pct(unsigned pct)
+{
+	unsigned i;
+
+	i = (lat_n * pct + 99) / 100;
+	return lat_tab[i > 0 ? i - 1 : 0];
+}
+
+/*
+ * write the given 3-byte message
+ */
+void
+lat_send(int fd, unsigned s, unsigned d0, unsigned d1)
+{
+	unsigned char msg[3];
+
+	msg[0] = s;
+	msg[1] = d0;
+	msg[2] = d1;
+	if (write(fd, msg, 3) != 3) {
+		perror("write");
+		exit(1);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char buf[1024], data[2];
+	unsigned count = 1000, interval = 10, timeout = 1000;
+	unsigned i, num, status, ndata;
+	struct pollfd pfd;
+	long long start, now;
+	int ch, ifd, ofd, n;
+	char *end;
+
+	while ((ch = getopt(argc, argv, "i:n:t:")) != -1) {
+		switch (ch) {
+		case 'i':
+			interval = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0')
+				goto err;
+			break;
+		case 'n':
+			count = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' ||
+			    count == 0 || count > LAT_MAXN)
+				goto err;
+			break;
+		case 't':
+			timeout = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || timeout == 0)
+				goto err;
+			break;
+		default:
+			goto err;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2) {
+	err:
+		fputs("usage: midish-lat [-i msec] [-n count] [-t msec] "
+		    "outdev indev\n", stderr);
+		return 1;
+	}
+
+	/*
+	 * open the input first without blocking, so it doesn't matter
+	 * in which order midish opens its devices
+	 */
+	ifd = open(argv[1], O_RDONLY | O_NONBLOCK);
+	if (ifd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	ofd = open(argv[0], O_WRONLY);
+	if (ofd < 0) {
+		perror(argv[0]);
+		return 1;
+	}
+	lat_tab = malloc(count * sizeof(long long));
+	if (lat_tab == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	status = ndata = 0;
+	pfd.fd = ifd;
+	pfd.events = POLLIN;
+	for (i = 0; i < count; i++) {
+		num = 36 + i % 48;
+		start = lat_usec();
+		lat_send(ofd, 0x90, num, 100);
+		for (;;) {
+			now = lat_usec();
+			if (now - start >= timeout * 1000LL) {
+				lat_nlost++;
+				break;
+			}
+			n = poll(&pfd, 1, timeout - (now - start) / 1000);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("poll");
+				return 1;
+			}
+			if (n == 0)
+				continue;
+			n = read(ifd, buf, sizeof(buf));
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				perror("read");
+				return 1;
+			}
+			if (n == 0) {
+				fputs("midish closed the device\n", stderr);
+				return 1;
+			}
+			if (lat_parse(buf, n, num, &status, data, &ndata)) {
+				lat_tab[lat_n++] = lat_usec() - start;
+				break;
+			}
+		}
+		lat_send(ofd, 0x80, num, 64);
+		if (interval > 0)
+			usleep(interval * 1000);
+	}
+	close(ofd);
+	close(ifd);
+
+	printf("# sent\tlost\tmin\tp50\tp90\tp99\tmax\n");
+	if (lat_n == 0) {
+		printf("%u\t%u\t-\t-\t-\t-\t-\n", count, lat_nlost);
+		return 1;
+	}
+	qsort(lat_tab, lat_n, sizeof(long long), lat_cmp);
+	printf("%u\t%u\t%lld\t%lld\t%lld\t%lld\t%lld\n", count, lat_nlost,
+	    lat_tab[0], lat_pct(50), lat_pct(90), lat_pct(99),
+	    lat_tab[lat_n - 1]);
+	return 0;
+}
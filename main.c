@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "utils.h"
@@ -37,12 +38,27 @@ main(int argc, char **argv)
 {
 	int ch;
 	unsigned exitcode;
+	long ndevs;
+	char *end;
 
-	while ((ch = getopt(argc, argv, "bv")) != -1) {
+	while ((ch = getopt(argc, argv, "bd:rv")) != -1) {
 		switch (ch) {
 		case 'b':
 			user_flag_batch = 1;
 			break;
+		case 'd':
+			ndevs = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' ||
+			    ndevs < 1 || ndevs > MAXNDEVS_LIMIT) {
+				fprintf(stderr, "%s: bad number of devices\n",
+				    optarg);
+				return 1;
+			}
+			ev_ndevs = ndevs;
+			break;
+		case 'r':
+			user_flag_rt = 1;
+			break;
 		case 'v':
 			user_flag_verb = 1;
 			break;
@@ -54,7 +70,7 @@ main(int argc, char **argv)
 	argv += optind;
 	if (argc >= 1) {
 	err:
-		fputs("usage: midish [-bv]\n", stderr);
+		fputs("usage: midish [-brv] [-d ndevs]\n", stderr);
 		return 0;
 	}
 
@@ -18,6 +18,9 @@
  * machine and OS dependent code
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* for ppoll() */
+#endif
 #include <sys/param.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -26,6 +29,13 @@
 #ifdef __APPLE__
 #include <mach/mach_time.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+#if defined(__linux__) || defined(__OpenBSD__) || defined(__FreeBSD__)
+#define USE_PPOLL
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
@@ -35,6 +45,7 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <sched.h>
 #include <time.h>
 
 #include "defs.h"
@@ -46,7 +57,11 @@
 #include "tty.h"
 #include "utils.h"
 
-#define TIMER_USEC	1000
+/*
+ * max time to wait for, in nanoseconds. Must be smaller than the
+ * largest clock delta accepted by mux_mdep_wait()
+ */
+#define TIMER_MAXNSEC	500000000LL
 
 #ifndef RC_NAME
 #define RC_NAME		"midishrc"
@@ -57,13 +72,45 @@
 #endif
 
 #define MIDI_BUFSIZE	1024
-#define MAXFDS		(DEFAULT_MAXNDEVS + 1)
+#define MAXFDS		(2 * MAXNDEVS_LIMIT + 2)
+
+/*
+ * size of the buffer for commands read from a pipe, and max time to
+ * spend running them before servicing MIDI devices
+ */
+#define CONS_BUFSIZE	0x4000
+#define CONS_MAXNSEC	1000000LL
 
 volatile sig_atomic_t int_flag = 0, resize_flag = 0, cont_flag = 0, usr1_flag = 0;
 struct timespec ts, ts_last;
 
 int cons_eof, cons_isatty, cons_quit;
 
+/*
+ * commands read from a pipe, but not processed yet
+ */
+static unsigned char cons_buf[CONS_BUFSIZE];
+static unsigned cons_start, cons_end;
+
+#ifdef USE_EPOLL
+/*
+ * descriptors of input devices are kept in a persistent epoll set,
+ * which is polled as a single descriptor, and ready descriptors map
+ * directly to their device. The set is rebuilt only when a device is
+ * opened or closed. Descriptors epoll doesn't support (ex. regular
+ * files) are passed to poll() as usual
+ */
+#define MDEP_MAXDEVFDS	4
+
+static int mdep_epfd = -1;
+static int mdep_devchg = 1;
+static struct pollfd mdep_devpfds[MAXNDEVS_LIMIT][MDEP_MAXDEVFDS];
+static unsigned mdep_devnfds[MAXNDEVS_LIMIT];
+static unsigned char mdep_devdone[MAXNDEVS_LIMIT];
+static struct mididev *mdep_polldevs[MAXNDEVS_LIMIT];
+static unsigned mdep_npolldevs;
+#endif
+
 #if defined(__APPLE__) && !defined(CLOCK_MONOTONIC)
 #define CLOCK_MONOTONIC 0
 
@@ -82,15 +129,6 @@ clock_gettime(int which, struct timespec *ts)
 }
 #endif
 
-/*
- * handler for SIGALRM, invoked periodically
- */
-void
-mdep_sigalrm(int i)
-{
-	/* nothing to do, we only want poll() to return EINTR */
-}
-
 void
 mdep_sigwinch(int s)
 {
@@ -115,8 +153,7 @@ mdep_sigusr1(int s)
 void
 mux_mdep_open(void)
 {
-	static struct sigaction sa;
-	struct itimerval it;
+	struct sched_param param;
 	sigset_t set;
 
 	sigemptyset(&set);
@@ -129,20 +166,12 @@ mux_mdep_open(void)
 		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
 		exit(1);
 	}
-        sa.sa_flags = SA_RESTART;
-        sa.sa_handler = mdep_sigalrm;
-        sigfillset(&sa.sa_mask);
-        if (sigaction(SIGALRM, &sa, NULL) < 0) {
-		logx(1, "%s: sigaction: %s", __func__, strerror(errno));
-		exit(1);
-	}
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_usec = TIMER_USEC;
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_usec = TIMER_USEC;
-	if (setitimer(ITIMER_REAL, &it, NULL) < 0) {
-		logx(1, "%s: setitimer: %s", __func__, strerror(errno));
-		exit(1);
+	if (user_flag_rt) {
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			logx(1, "%s: couldn't use real-time scheduling: %s",
+			    __func__, strerror(errno));
+		}
 	}
 }
 
@@ -152,32 +181,268 @@ mux_mdep_open(void)
 void
 mux_mdep_close(void)
 {
-	struct itimerval it;
-
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_usec = 0;
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_usec = 0;
-	if (setitimer(ITIMER_REAL, &it, NULL) < 0) {
-		logx(1, "%s: setitimer: %s", __func__, strerror(errno));
+	struct sched_param param;
+
+	/*
+	 * there's no periodic timer to stop, just go back to
+	 * normal scheduling
+	 */
+	if (user_flag_rt && sched_getscheduler(0) == SCHED_FIFO) {
+		param.sched_priority = 0;
+		if (sched_setscheduler(0, SCHED_OTHER, &param) < 0) {
+			logx(1, "%s: couldn't restore scheduling: %s",
+			    __func__, strerror(errno));
+		}
+	}
+}
+
+/*
+ * return the monotonic clock value in nanoseconds, used for
+ * measurements only
+ */
+unsigned long long
+mux_mdep_nsec(void)
+{
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t) < 0) {
+		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
+		panic();
+	}
+	return 1000000000ULL * t.tv_sec + t.tv_nsec;
+}
+
+/*
+ * return the number of nanoseconds between the last clock update
+ * and the given time. Warning: because of system clock changes this
+ * value can be negative.
+ */
+long long
+mdep_nsec(struct timespec *t)
+{
+	return 1000000000LL * (t->tv_sec - ts_last.tv_sec) +
+	    (t->tv_nsec - ts_last.tv_nsec);
+}
+
+/*
+ * advance the mux clock to the current time
+ */
+void
+mdep_clockupdate(void)
+{
+	long long delta_nsec;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
+		panic();
+	}
+	delta_nsec = mdep_nsec(&ts);
+	if (delta_nsec > 0) {
+		ts_last = ts;
+		if (delta_nsec < 1000000000LL) {
+			/*
+			 * update the current position,
+			 * (time unit = 24th of microsecond)
+			 */
+			mux_timercb(24 * delta_nsec / 1000);
+		} else {
+			/*
+			 * delta is too large (eg. the program was
+			 * suspended and then resumed), just ignore it
+			 */
+			logx(1, "ignored huge clock delta");
+		}
+	}
+}
+
+/*
+ * return true if the next clock tick or timeout is due, or if
+ * commands were run for too long without polling MIDI devices
+ */
+static int
+cons_mdep_due(void)
+{
+	struct timespec t;
+	unsigned long delta;
+	long long due_nsec;
+
+	if (!mux_isopen)
+		return 0;
+	due_nsec = CONS_MAXNSEC;
+	if (mux_nextdelta(&delta) && (1000LL * delta + 23) / 24 < due_nsec)
+		due_nsec = (1000LL * delta + 23) / 24;
+	if (clock_gettime(CLOCK_MONOTONIC, &t) < 0) {
+		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
+		panic();
+	}
+	return mdep_nsec(&t) >= due_nsec;
+}
+
+/*
+ * run the commands read from the pipe. Whole blocks are processed at
+ * once, but we stop at the end of a line once MIDI devices need to be
+ * serviced, the remaining input is processed by the next call
+ */
+static void
+cons_mdep_input(void)
+{
+	int c;
+
+	while (cons_start < cons_end) {
+		c = cons_buf[cons_start++];
+		user_onchar(NULL, c);
+		if (c == '\n' && cons_mdep_due())
+			break;
+	}
+}
+
+/*
+ * called when a device is opened or closed, so the set of descriptors
+ * to poll is rebuilt
+ */
+void
+mux_mdep_devchg(void)
+{
+#ifdef USE_EPOLL
+	mdep_devchg = 1;
+#endif
+}
+
+#ifdef USE_EPOLL
+/*
+ * rebuild the epoll set from the list of open input devices
+ */
+static void
+mdep_devregister(void)
+{
+	struct epoll_event ee;
+	struct mididev *dev;
+	struct pollfd *pfd;
+	unsigned i, n;
+
+	if (mdep_epfd >= 0)
+		close(mdep_epfd);
+	mdep_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (mdep_epfd < 0) {
+		logx(1, "%s: epoll_create1: %s", __func__, strerror(errno));
 		exit(1);
 	}
+	mdep_npolldevs = 0;
+	for (dev = mididev_list; dev != NULL; dev = dev->next) {
+		dev->pfd = NULL;
+		if (!(dev->mode & MIDIDEV_MODE_IN) || dev->eof)
+			continue;
+		if (dev->ops->nfds(dev) > MDEP_MAXDEVFDS) {
+			logx(1, "%u: too many descriptors", dev->unit);
+			continue;
+		}
+		pfd = mdep_devpfds[dev->unit];
+		n = dev->ops->pollfd(dev, pfd, POLLIN);
+		for (i = 0; i < n; i++) {
+			ee.events = 0;
+			if (pfd[i].events & POLLIN)
+				ee.events |= EPOLLIN;
+			if (pfd[i].events & POLLOUT)
+				ee.events |= EPOLLOUT;
+			ee.data.u32 = dev->unit * MDEP_MAXDEVFDS + i;
+			if (epoll_ctl(mdep_epfd, EPOLL_CTL_ADD,
+				pfd[i].fd, &ee) < 0)
+				break;
+			pfd[i].revents = 0;
+		}
+		if (i < n) {
+			/*
+			 * not supported by epoll, remove already added
+			 * descriptors and use poll()
+			 */
+			while (i-- > 0)
+				epoll_ctl(mdep_epfd, EPOLL_CTL_DEL, pfd[i].fd, NULL);
+			mdep_polldevs[mdep_npolldevs++] = dev;
+		}
+		mdep_devnfds[dev->unit] = n;
+		dev->pfd = pfd;
+	}
+	mdep_devchg = 0;
+}
+#endif
+
+/*
+ * process the events reported for the given device
+ */
+static void
+mdep_devio(struct mididev *dev, unsigned char *midibuf)
+{
+	int revents, res;
+
+	revents = dev->ops->revents(dev, dev->pfd);
+	if (revents & POLLIN) {
+		res = dev->ops->read(dev, midibuf, MIDI_BUFSIZE);
+		if (dev->eof) {
+			mux_mdep_devchg();
+			mux_errorcb(dev->unit);
+			return;
+		}
+		if (res > 0) {
+			mididev_isensreset(dev);
+			mididev_inputcb(dev, midibuf, res);
+		}
+	}
+	if (revents & POLLHUP) {
+		dev->eof = 1;
+		mux_mdep_devchg();
+		mux_errorcb(dev->unit);
+	}
+}
+
+/*
+ * wait for events on the given descriptors for the given number of
+ * nanoseconds, or forever if it's negative. Without ppoll(), the
+ * timeout is rounded up to the next millisecond
+ */
+static int
+mdep_poll(struct pollfd *pfds, nfds_t nfds, long long nsec)
+{
+#ifdef USE_PPOLL
+	struct timespec ts;
+
+	if (nsec < 0)
+		return ppoll(pfds, nfds, NULL, NULL);
+	ts.tv_sec = nsec / 1000000000;
+	ts.tv_nsec = nsec % 1000000000;
+	return ppoll(pfds, nfds, &ts, NULL);
+#else
+	if (nsec < 0)
+		return poll(pfds, nfds, -1);
+	return poll(pfds, nfds, (nsec + 999999) / 1000000);
+#endif
 }
 
 /*
- * wait until an input device becomes readable or
- * until the next clock tick. Then process all events.
- * Return 0 if interrupted by a signal
+ * wait until an input device becomes readable or until the next
+ * clock tick or timeout is due. Then process all events.
+ * Return 0 if interrupted by a signal.
+ *
+ * There's no periodic timer: the deadline of the next tick or
+ * timeout is computed and the time until it is passed to
+ * mdep_poll(), so we wake up when the next event is due, or
+ * earlier if there's input.
  */
 int
 mux_mdep_wait(int docons)
 {
-	int i, res, revents;
+	int res, revents;
 	nfds_t nfds;
 	struct pollfd *pfd, *tty_pfds, pfds[MAXFDS];
 	struct mididev *dev;
 	unsigned char midibuf[MIDI_BUFSIZE];
-	long long delta_nsec;
+#ifdef USE_EPOLL
+	struct epoll_event evs[MAXNDEVS_LIMIT];
+	struct pollfd *epfd;
+	unsigned i, j, unit;
+	int nev;
+#endif
+	unsigned long delta;
+	long long wait_nsec;
 
 	nfds = 0;
 	if (docons && !cons_eof) {
@@ -228,6 +493,20 @@ mux_mdep_wait(int docons)
 			}
 		}
 	}
+#ifdef USE_EPOLL
+	if (mdep_devchg)
+		mdep_devregister();
+	epfd = &pfds[nfds++];
+	epfd->fd = mdep_epfd;
+	epfd->events = POLLIN;
+	for (i = 0; i < mdep_npolldevs; i++) {
+		dev = mdep_polldevs[i];
+		pfd = &pfds[nfds];
+		memcpy(pfd, dev->pfd,
+		    mdep_devnfds[dev->unit] * sizeof(struct pollfd));
+		nfds += mdep_devnfds[dev->unit];
+	}
+#else
 	for (dev = mididev_list; dev != NULL; dev = dev->next) {
 		if (!(dev->mode & MIDIDEV_MODE_IN) || dev->eof) {
 			dev->pfd = NULL;
@@ -237,68 +516,134 @@ mux_mdep_wait(int docons)
 		nfds += dev->ops->pollfd(dev, pfd, POLLIN);
 		dev->pfd = pfd;
 	}
+#endif
+
+	/*
+	 * devices with queued output are polled until they accept it
+	 */
+	for (dev = mididev_list; dev != NULL; dev = dev->next) {
+		dev->opfd = NULL;
+		if (dev->oqused == 0 || dev->eof ||
+		    nfds + dev->ops->nfds(dev) > MAXFDS)
+			continue;
+		pfd = &pfds[nfds];
+		nfds += dev->ops->pollfd(dev, pfd, POLLOUT);
+		dev->opfd = pfd;
+	}
 
 	/*
 	 * if editor was hiddent to write to std{err,out}, show it
 	 */
 	el_show();
 
-	res = poll(pfds, nfds, -1);
+	/*
+	 * flush messages to the front-end (like "+ready") before
+	 * waiting, they are not flushed after each command
+	 */
+	fflush(stdout);
+
+	/*
+	 * compute the number of nanoseconds to wait
+	 */
+	wait_nsec = -1;
+	if (mux_isopen) {
+		if (mux_nextdelta(&delta))
+			wait_nsec = (1000LL * delta + 23) / 24;
+		if (wait_nsec < 0 || wait_nsec > TIMER_MAXNSEC)
+			wait_nsec = TIMER_MAXNSEC;
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+			logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
+			panic();
+		}
+		wait_nsec -= mdep_nsec(&ts);
+		if (wait_nsec < 0)
+			wait_nsec = 0;
+	}
+
+	/*
+	 * if there are commands to run, don't wait, just service
+	 * MIDI devices
+	 */
+	if (tty_pfds && !cons_isatty && cons_start < cons_end)
+		wait_nsec = 0;
+	res = mdep_poll(pfds, nfds, wait_nsec);
 	if (res < 0 && errno != EINTR) {
 		logx(1, "%s: poll: %s", __func__, strerror(errno));
 		exit(1);
 	}
-	if (res > 0) {
-		for (dev = mididev_list; dev != NULL; dev = dev->next) {
-			pfd = dev->pfd;
-			if (pfd == NULL)
+
+	/*
+	 * advance the clock before processing input, so input
+	 * events are processed at the right time
+	 */
+	if (mux_isopen)
+		mdep_clockupdate();
+	if (res > 0)
+		mux_inputstart();
+#ifdef USE_EPOLL
+	if (res > 0 && (epfd->revents & POLLIN)) {
+		nev = epoll_wait(mdep_epfd, evs, MAXNDEVS_LIMIT, 0);
+		if (nev < 0 && errno != EINTR) {
+			logx(1, "%s: epoll_wait: %s", __func__, strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < nev; i++) {
+			unit = evs[i].data.u32 / MDEP_MAXDEVFDS;
+			j = evs[i].data.u32 % MDEP_MAXDEVFDS;
+			pfd = &mdep_devpfds[unit][j];
+			if (evs[i].events & EPOLLIN)
+				pfd->revents |= POLLIN;
+			if (evs[i].events & EPOLLOUT)
+				pfd->revents |= POLLOUT;
+			if (evs[i].events & EPOLLHUP)
+				pfd->revents |= POLLHUP;
+			if (evs[i].events & EPOLLERR)
+				pfd->revents |= POLLERR;
+		}
+		for (i = 0; i < nev; i++) {
+			unit = evs[i].data.u32 / MDEP_MAXDEVFDS;
+			if (mdep_devdone[unit])
 				continue;
-			revents = dev->ops->revents(dev, pfd);
-			if (revents & POLLIN) {
-				res = dev->ops->read(dev, midibuf, MIDI_BUFSIZE);
-				if (dev->eof) {
-					mux_errorcb(dev->unit);
-					continue;
-				}
-				if (dev->isensto > 0) {
-					dev->isensto = MIDIDEV_ISENSTO;
-				}
-				mididev_inputcb(dev, midibuf, res);
-			}
-			if (revents & POLLHUP) {
-				dev->eof = 1;
-				mux_errorcb(dev->unit);
-			}
+			mdep_devdone[unit] = 1;
+			dev = mididev_byunit[unit];
+			if (dev != NULL && !dev->eof && dev->pfd != NULL)
+				mdep_devio(dev, midibuf);
+			for (j = 0; j < MDEP_MAXDEVFDS; j++)
+				mdep_devpfds[unit][j].revents = 0;
 		}
+		for (i = 0; i < nev; i++)
+			mdep_devdone[evs[i].data.u32 / MDEP_MAXDEVFDS] = 0;
 	}
-	if (mux_isopen) {
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
-			logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
-			panic();
+	if (res > 0) {
+		pfd = epfd + 1;
+		for (i = 0; i < mdep_npolldevs; i++) {
+			dev = mdep_polldevs[i];
+			dev->pfd = pfd;
+			pfd += mdep_devnfds[dev->unit];
+			if (!dev->eof)
+				mdep_devio(dev, midibuf);
+			dev->pfd = mdep_devpfds[dev->unit];
 		}
-
-		/*
-		 * number of micro-seconds between now and the last
-		 * time we called poll(). Warning: because of system
-		 * clock changes this value can be negative.
-		 */
-		delta_nsec = 1000000000LL * (ts.tv_sec - ts_last.tv_sec);
-		delta_nsec += ts.tv_nsec - ts_last.tv_nsec;
-		if (delta_nsec > 0) {
-			ts_last = ts;
-			if (delta_nsec < 1000000000LL) {
-				/*
-				 * update the current position,
-				 * (time unit = 24th of microsecond)
-				 */
-				mux_timercb(24 * delta_nsec / 1000);
-			} else {
-				/*
-				 * delta is too large (eg. the program was
-				 * suspended and then resumed), just ignore it
-				 */
-					logx(1, "ignored huge clock delta");
-			}
+	}
+#else
+	if (res > 0) {
+		for (dev = mididev_list; dev != NULL; dev = dev->next) {
+			if (dev->pfd != NULL)
+				mdep_devio(dev, midibuf);
+		}
+	}
+#endif
+	if (res > 0)
+		mux_inputdone();
+	if (res > 0) {
+		for (dev = mididev_list; dev != NULL; dev = dev->next) {
+			if (dev->opfd == NULL || dev->eof)
+				continue;
+			revents = dev->ops->revents(dev, dev->opfd);
+			if (revents & (POLLOUT | POLLHUP | POLLERR))
+				mididev_oqdrain(dev);
+			if (dev->eof)
+				mux_mdep_devchg();
 		}
 	}
 	log_flush();
@@ -319,8 +664,10 @@ mux_mdep_wait(int docons)
 			 * POLLIN anymore. So then we've to use POLLHUP to
 			 * detect the EOF.
 			 */
-			if (tty_pfds->revents & POLLIN) {
-				res = read(STDIN_FILENO, midibuf, MIDI_BUFSIZE);
+			if (cons_start < cons_end) {
+				/* finish the previous block first */
+			} else if (tty_pfds->revents & POLLIN) {
+				res = read(STDIN_FILENO, cons_buf, CONS_BUFSIZE);
 				if (res < 0) {
 					cons_eof = 1;
 					logx(1, "stdin: %s", strerror(errno));
@@ -328,13 +675,14 @@ mux_mdep_wait(int docons)
 					cons_eof = 1;
 					user_onchar(NULL, -1);
 				} else {
-					for (i = 0; i < res; i++)
-						user_onchar(NULL, midibuf[i]);
+					cons_start = 0;
+					cons_end = res;
 				}
 			} else if (tty_pfds->revents & POLLHUP) {
 				cons_eof = 1;
 				user_onchar(NULL, -1);
 			}
+			cons_mdep_input();
 		}
 	}
 	return 1;
@@ -352,6 +700,8 @@ mux_sleep(unsigned millisecs)
 	int res, delta_msec;
 	struct timespec ts;
 
+	if (mux_offline)
+		return;
 	if (clock_gettime(CLOCK_MONOTONIC, &ts_last) < 0) {
 		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
 		exit(1);
@@ -391,6 +741,21 @@ cons_mdep_sigint(int s)
 	int_flag = 1;
 }
 
+/*
+ * return 1 if ^C was hit, in which case long operations (loading
+ * files, script loops) must be aborted. The interrupt is consumed,
+ * so it isn't handled again by mux_mdep_wait()
+ */
+int
+cons_interrupted(void)
+{
+	if (!int_flag)
+		return 0;
+	int_flag = 0;
+	logx(1, "interrupted");
+	return 1;
+}
+
 void
 cons_init(struct el_ops *el_ops, void *el_arg)
 {
@@ -484,41 +849,63 @@ exec_runrcfile(struct exec *o)
 	return 1;
 }
 
-void
-user_oncompl_path(char *text, int *rstart, int *rend)
+/*
+ * entries of the last directory scanned by user_oncompl_path(), as
+ * NUL terminated strings, so that hitting TAB again in the same
+ * directory doesn't require to stat() all files again. It's valid
+ * until the modification time of the directory changes
+ */
+static char compl_dir[PATH_MAX + 1];
+static time_t compl_dirmtime;
+static char *compl_dirbuf;
+static size_t compl_dirused, compl_dirsize;
+static int compl_dirvalid;
+
+/*
+ * append an entry to the directory cache
+ */
+static void
+compl_diradd(char *name, size_t len)
+{
+	char *newbuf;
+
+	if (compl_dirused + len + 1 > compl_dirsize) {
+		compl_dirsize = compl_dirsize == 0 ? 0x1000 : 2 * compl_dirsize;
+		while (compl_dirused + len + 1 > compl_dirsize)
+			compl_dirsize *= 2;
+		newbuf = xmalloc(compl_dirsize, "compl_dir");
+		if (compl_dirbuf != NULL) {
+			memcpy(newbuf, compl_dirbuf, compl_dirused);
+			xfree(compl_dirbuf);
+		}
+		compl_dirbuf = newbuf;
+	}
+	memcpy(compl_dirbuf + compl_dirused, name, len);
+	compl_dirused += len;
+	compl_dirbuf[compl_dirused++] = 0;
+}
+
+/*
+ * scan the directory with the given path into the cache, return 0
+ * if it couldn't be opened
+ */
+static int
+compl_dirscan(char *str)
 {
-	char str[PATH_MAX + 1];
 	struct dirent *dent;
 	DIR *dirp;
 	struct stat sb;
 	size_t len, path_len;
-	int dir_start, dir_end, start, end;
-
-	dir_start = *rstart;
-	start = end = *rend;
-	while (1) {
-		if (start == dir_start) {
-			dir_end = start;
-			str[0] = '.';
-			str[1] = 0;
-			break;
-		}
-		if (text[start - 1] == '/') {
-			dir_end = start;
-			len = dir_end - dir_start;
-			if (len >= PATH_MAX)
-				return;
-			memcpy(str, text + dir_start, len);
-			str[len] = 0;
-			break;
-		}
-		start--;
-	}
 
+	compl_dirvalid = 0;
+	compl_dirused = 0;
+	if (stat(str, &sb) == -1)
+		return 0;
 	dirp = opendir(str);
 	if (dirp == NULL)
-		return;
+		return 0;
 	path_len = strlen(str);
+	memcpy(compl_dir, str, path_len + 1);
 	str[path_len++] = '/';
 	while (1) {
 		dent = readdir(dirp);
@@ -539,10 +926,64 @@ user_oncompl_path(char *text, int *rstart, int *rend)
 			str[path_len + len++] = '/';
 		else
 			continue;
-		str[path_len + len] = 0;
-		el_compladd(str + path_len);
+		compl_diradd(str + path_len, len);
 	}
 	closedir(dirp);
+	str[path_len - 1] = 0;
+
+	/*
+	 * the modification time has a 1 second resolution, so
+	 * don't reuse the listing of a directory modified during
+	 * the last second: it may change without mtime changing
+	 */
+	if (stat(str, &sb) != -1 && time(NULL) - sb.st_mtime > 1) {
+		compl_dirmtime = sb.st_mtime;
+		compl_dirvalid = 1;
+	}
+	return 1;
+}
+
+void
+user_oncompl_path(char *text, int *rstart, int *rend)
+{
+	char str[PATH_MAX + 1];
+	struct stat sb;
+	size_t len;
+	char *p, *end_buf;
+	int dir_start, dir_end, start, end;
+
+	dir_start = *rstart;
+	start = end = *rend;
+	while (1) {
+		if (start == dir_start) {
+			dir_end = start;
+			str[0] = '.';
+			str[1] = 0;
+			break;
+		}
+		if (text[start - 1] == '/') {
+			dir_end = start;
+			len = dir_end - dir_start;
+			if (len >= PATH_MAX)
+				return;
+			memcpy(str, text + dir_start, len);
+			str[len] = 0;
+			break;
+		}
+		start--;
+	}
+
+	if (!compl_dirvalid || strcmp(compl_dir, str) != 0 ||
+	    stat(str, &sb) == -1 || sb.st_mtime != compl_dirmtime) {
+		if (!compl_dirscan(str))
+			return;
+	}
+
+	end_buf = compl_dirbuf + compl_dirused;
+	for (p = compl_dirbuf; p < end_buf; p += len + 1) {
+		len = strlen(p);
+		el_compladd(p);
+	}
 
 	*rstart = start;
 	*rend = end;
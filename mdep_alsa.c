@@ -26,18 +26,31 @@
 #include <alsa/asoundlib.h>
 #include "utils.h"
 #include "mididev.h"
+#include "mux.h"
 #include "str.h"
 
+/*
+ * all devices are ports of a single sequencer client, so there's only
+ * one file descriptor to poll and input events are dispatched to the
+ * device their destination port belongs to. The port number is the
+ * device number
+ */
 struct alsa {
 	struct mididev mididev;		/* device stuff */
-	snd_seq_t *seq_handle;		/* sequencer connection */
+	snd_seq_t *seq_handle;		/* shared connection, if open */
 	int port;			/* port id of midish endpoint */
 	char *path;			/* e.g. "128:0", translated in dst */
 	snd_midi_event_t *iparser;	/* midi input event parser */
 	snd_midi_event_t *oparser;	/* midi output event parser */
-	int nfds;
+	int queue;			/* queue for scheduled output */
 };
 
+snd_seq_t *alsa_seq;			/* the shared client */
+unsigned alsa_nref;			/* number of devices using it */
+int alsa_npfds;				/* number of its poll descriptors */
+struct alsa *alsa_poll;			/* device polling it, see alsa_polldev() */
+unsigned alsa_pollok;			/* if alsa_poll is up to date */
+
 void	 alsa_open(struct mididev *);
 unsigned alsa_read(struct mididev *, unsigned char *, unsigned);
 unsigned alsa_write(struct mididev *, unsigned char *, unsigned);
@@ -55,7 +68,8 @@ struct devops alsa_ops = {
 	alsa_pollfd,
 	alsa_revents,
 	alsa_close,
-	alsa_del
+	alsa_del,
+	NULL
 };
 
 void
@@ -84,6 +98,7 @@ alsa_new(char *path, unsigned mode)
 	dev->path = (path != NULL) ? str_new(path) : NULL;
 	dev->seq_handle = NULL;
 	dev->port = -1;
+	dev->queue = -1;
 	dev->iparser = NULL;
 	dev->oparser = NULL;
 	return (struct mididev *)&dev->mididev;
@@ -100,30 +115,89 @@ alsa_del(struct mididev *addr)
 	xfree(dev);
 }
 
+/*
+ * get a reference to the shared client, open it if it's not open yet
+ */
+snd_seq_t *
+alsa_seqref(void)
+{
+	snd_seq_t *seq;
+
+	if (alsa_nref == 0) {
+		/*
+		 * alsa displays annoying ``Interrupted system call''
+		 * messages caused by poll(4) system call being
+		 * interrupted by signals, which is not an error. So,
+		 * add an error handler that ignores EINTR.
+		 */
+		(void)snd_lib_error_set_handler(alsa_err);
+
+		if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
+			logx(1, "%s: could not open ALSA sequencer", __func__);
+			return NULL;
+		}
+		if (snd_seq_set_client_name(seq, "midish") < 0) {
+			logx(1, "%s: could set client name", __func__);
+			(void)snd_seq_close(seq);
+			return NULL;
+		}
+		alsa_seq = seq;
+		alsa_npfds = snd_seq_poll_descriptors_count(seq, POLLIN);
+	}
+	alsa_nref++;
+	alsa_pollok = 0;
+	return alsa_seq;
+}
+
+/*
+ * release a reference to the shared client, close it if it's not used
+ * anymore
+ */
+void
+alsa_sequnref(void)
+{
+	alsa_pollok = 0;
+	if (--alsa_nref > 0)
+		return;
+	(void)snd_seq_close(alsa_seq);
+	alsa_seq = NULL;
+}
+
+/*
+ * return the device that polls the shared client on behalf of all
+ * devices: the first open input device. It's looked up only when
+ * devices get or release the shared client, or when it fails
+ */
+struct alsa *
+alsa_polldev(void)
+{
+	struct mididev *i;
+
+	if (alsa_pollok && (alsa_poll == NULL || !alsa_poll->mididev.eof))
+		return alsa_poll;
+	alsa_poll = NULL;
+	for (i = mididev_list; i != NULL; i = i->next) {
+		if (i->ops == &alsa_ops && (i->mode & MIDIDEV_MODE_IN) &&
+		    !i->eof && ((struct alsa *)i)->seq_handle) {
+			alsa_poll = (struct alsa *)i;
+			break;
+		}
+	}
+	alsa_pollok = 1;
+	return alsa_poll;
+}
+
 void
 alsa_open(struct mididev *addr)
 {
 	struct alsa *dev = (struct alsa *)addr;
 	struct snd_seq_addr dst;
+	snd_seq_port_info_t *pinfo;
 	unsigned int mode;
 	char name[32];
 
-	/*
-	 * alsa displays annoying ``Interrupted system call'' messages caused
-	 * by poll(4) system call being interrupted by SIGALRM, which is not
-	 * an error. So, add an error handler that ignores EINTR.
-	 */
-	(void)snd_lib_error_set_handler(alsa_err);
-
-	if (snd_seq_open(&dev->seq_handle, "default",
-		SND_SEQ_OPEN_DUPLEX, 0) < 0) {
-		logx(1, "%s: could not open ALSA sequencer", __func__);
-		dev->mididev.eof = 1;
-		return;
-	}
-	snprintf(name, sizeof(name), "midish/%u", dev->mididev.unit);
-	if (snd_seq_set_client_name(dev->seq_handle, name) < 0) {
-		logx(1, "%s: could set client name", __func__);
+	dev->seq_handle = alsa_seqref();
+	if (dev->seq_handle == NULL) {
 		dev->mididev.eof = 1;
 		return;
 	}
@@ -140,13 +214,26 @@ alsa_open(struct mididev *addr)
 	}
 	if (dev->mididev.mode == (MIDIDEV_MODE_IN | MIDIDEV_MODE_OUT))
 		mode |= SND_SEQ_PORT_CAP_DUPLEX;
-	dev->port = snd_seq_create_simple_port(dev->seq_handle, "default", mode,
+
+	/*
+	 * use the device number as port number, so that port addresses
+	 * don't depend on the order devices are opened
+	 */
+	snprintf(name, sizeof(name), "midish/%u", dev->mididev.unit);
+	snd_seq_port_info_alloca(&pinfo);
+	snd_seq_port_info_set_port(pinfo, dev->mididev.unit);
+	snd_seq_port_info_set_port_specified(pinfo, 1);
+	snd_seq_port_info_set_name(pinfo, name);
+	snd_seq_port_info_set_capability(pinfo, mode);
+	snd_seq_port_info_set_type(pinfo,
 	    SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
-	if (dev->port < 0) {
+	snd_seq_port_info_set_midi_channels(pinfo, 16);
+	if (snd_seq_create_port(dev->seq_handle, pinfo) < 0) {
 		logx(1, "%s: could not create port", __func__);
 		dev->mididev.eof = 1;
 		return;
 	}
+	dev->port = snd_seq_port_info_get_port(pinfo);
 
 	/*
 	 * now we have the port, create parsers
@@ -193,7 +280,25 @@ alsa_open(struct mididev *addr)
 			return;
 		}
 	}
-	dev->nfds = snd_seq_poll_descriptors_count(dev->seq_handle, POLLIN);
+
+	/*
+	 * if output is to be delayed, start a queue to schedule
+	 * events on it, so the kernel does the timing
+	 */
+	if ((dev->mididev.mode & MIDIDEV_MODE_OUT) && dev->mididev.odelay > 0) {
+		dev->queue = snd_seq_alloc_queue(dev->seq_handle);
+		if (dev->queue < 0) {
+			logx(1, "%s: couldn't allocate queue", __func__);
+			dev->mididev.eof = 1;
+			return;
+		}
+		if (snd_seq_start_queue(dev->seq_handle, dev->queue, NULL) < 0 ||
+		    snd_seq_drain_output(dev->seq_handle) < 0) {
+			logx(1, "%s: couldn't start queue", __func__);
+			dev->mididev.eof = 1;
+			return;
+		}
+	}
 }
 
 void
@@ -209,44 +314,69 @@ alsa_close(struct mididev *addr)
 		snd_midi_event_free(dev->oparser);
 		dev->oparser = NULL;
 	}
-	if (dev->port) {
-		snd_seq_delete_simple_port(dev->seq_handle, dev->port);
-		dev->port = -1;
+	if (dev->queue >= 0) {
+		/*
+		 * wait for events scheduled on the queue to be sent,
+		 * otherwise they are discarded and notes may stick
+		 */
+		if (!dev->mididev.eof)
+			(void)snd_seq_sync_output_queue(dev->seq_handle);
+		(void)snd_seq_free_queue(dev->seq_handle, dev->queue);
+		dev->queue = -1;
+	}
+	if (dev->seq_handle) {
+		if (dev->port >= 0) {
+			snd_seq_delete_simple_port(dev->seq_handle, dev->port);
+			dev->port = -1;
+		}
+		dev->seq_handle = NULL;
+		alsa_sequnref();
 	}
-	(void)snd_seq_close(dev->seq_handle);
-	dev->seq_handle = NULL;
 	dev->mididev.eof = 1;
 }
 
+/*
+ * read all events pending on the shared client and pass them to the
+ * device of their destination port. Nothing is returned to the caller,
+ * input is processed by calling mididev_inputcb() directly
+ */
 unsigned
 alsa_read(struct mididev *addr, unsigned char *buf, unsigned count)
 {
-	struct alsa *dev = (struct alsa *)addr;
-	unsigned todo = count;
+	struct alsa *dev = (struct alsa *)addr, *d;
+	struct mididev *md;
 	snd_seq_event_t *ev;
+	unsigned char ibuf[MIDIDEV_BUFLEN];
 	long len;
 	int err;
 
-	if (!dev->seq_handle || !dev->iparser)
+	if (!dev->seq_handle)
 		return 0;
 
-	while (todo > 0 &&
-	    snd_seq_event_input_pending(dev->seq_handle, 1) > 0) {
+	while (snd_seq_event_input_pending(dev->seq_handle, 1) > 0) {
 		err = snd_seq_event_input(dev->seq_handle, &ev);
 		if (err < 0) {
 			logx(1, "%s: snd_seq_event_input() failed", __func__);
 			dev->mididev.eof = 1;
 			return 0;
 		}
-		len = snd_midi_event_decode(dev->iparser, buf, todo, ev);
-		if (len < 0) {
+		if (ev->dest.port >= ev_ndevs)
+			continue;
+		md = mididev_byunit[ev->dest.port];
+		if (md == NULL || md->ops != &alsa_ops || md->eof)
+			continue;
+		d = (struct alsa *)md;
+		if (!d->iparser)
+			continue;
+		len = snd_midi_event_decode(d->iparser, ibuf, sizeof(ibuf), ev);
+		if (len <= 0) {
 			/* fails for ALSA specific stuff we dont care about */
 			continue;
 		}
-		todo -= len;
-		buf += len;
+		mididev_isensreset(md);
+		mididev_inputcb(md, ibuf, len);
 	}
-	return count - todo;
+	return 0;
 }
 
 unsigned
@@ -255,11 +385,23 @@ alsa_write(struct mididev *addr, unsigned char *buf, unsigned count)
 	struct alsa *dev = (struct alsa *)addr;
 	unsigned todo = count;
 	snd_seq_event_t ev;
+	snd_seq_real_time_t delay;
+	unsigned long long nsec;
 	long len;
 
 	if (!dev->seq_handle || !dev->oparser)
 		return 0;
 
+	/*
+	 * if a queue is used, events of the current tick are scheduled
+	 * relative to the ideal tick time, so the time we're late is
+	 * absorbed
+	 */
+	nsec = (dev->mididev.odelay > mux_late) ?
+	    1000ULL * (dev->mididev.odelay - mux_late) / 24 : 0;
+	delay.tv_sec = nsec / 1000000000ULL;
+	delay.tv_nsec = nsec % 1000000000ULL;
+
 	while (todo > 0) {
 		/*
 		 * encode to sequencer commands
@@ -274,23 +416,38 @@ alsa_write(struct mididev *addr, unsigned char *buf, unsigned count)
 		todo -= len;
 		if (ev.type == SND_SEQ_EVENT_NONE)
 			continue;
-		snd_seq_ev_set_direct(&ev);
+		if (dev->queue >= 0)
+			snd_seq_ev_schedule_real(&ev, dev->queue, 1, &delay);
+		else
+			snd_seq_ev_set_direct(&ev);
 		snd_seq_ev_set_dest(&ev, SND_SEQ_ADDRESS_SUBSCRIBERS, 255);
 		snd_seq_ev_set_source(&ev, dev->port);
-		if (snd_seq_event_output_direct(dev->seq_handle, &ev) < 0) {
+		if (snd_seq_event_output(dev->seq_handle, &ev) < 0) {
 			dev->mididev.eof = 1;
 			return 0;
 		}
 	}
+
+	/*
+	 * events were buffered, send them with a single system call
+	 */
+	if (snd_seq_drain_output(dev->seq_handle) < 0) {
+		dev->mididev.eof = 1;
+		return 0;
+	}
 	return count;
 }
 
+/*
+ * only one device polls the shared client, others have no
+ * descriptors
+ */
 unsigned
 alsa_nfds(struct mididev *addr)
 {
 	struct alsa *dev = (struct alsa *)addr;
 
-	return dev->nfds;
+	return (dev == alsa_polldev()) ? alsa_npfds : 0;
 }
 
 unsigned
@@ -302,6 +459,8 @@ alsa_pollfd(struct mididev *addr, struct pollfd *pfd, int events)
 		logx(1, "%s: no handle", __func__);
 		return 0;
 	}
+	if (dev != alsa_polldev())
+		return 0;
 	return snd_seq_poll_descriptors(dev->seq_handle, pfd, INT_MAX, events);
 }
 
@@ -315,8 +474,10 @@ alsa_revents(struct mididev *addr, struct pollfd *pfd)
 		logx(1, "%s: no handle", __func__);
 		return 0;
 	}
+	if (dev != alsa_polldev())
+		return 0;
 	if (snd_seq_poll_descriptors_revents(dev->seq_handle,
-		pfd, dev->nfds, &revents) < 0) {
+		pfd, alsa_npfds, &revents) < 0) {
 		logx(1, "%s: snd_..._revents() failed", __func__);
 		return 0;
 	}
@@ -49,7 +49,8 @@ struct devops raw_ops = {
 	raw_pollfd,
 	raw_revents,
 	raw_close,
-	raw_del
+	raw_del,
+	NULL
 };
 
 struct mididev *
@@ -100,6 +101,19 @@ raw_open(struct mididev *addr)
 		dev->mididev.eof = 1;
 		return;
 	}
+
+	/*
+	 * don't block if the device is slow, data it doesn't accept
+	 * is queued
+	 */
+	if ((dev->mididev.mode & MIDIDEV_MODE_OUT) &&
+	    fcntl(dev->fd, F_SETFL, O_NONBLOCK) < 0) {
+		logx(1, "%s: %s", dev->path, strerror(errno));
+		(void)close(dev->fd);
+		dev->fd = -1;
+		dev->mididev.eof = 1;
+		return;
+	}
 }
 
 void
@@ -121,6 +135,8 @@ raw_read(struct mididev *addr, unsigned char *buf, unsigned count)
 
 	res = read(dev->fd, buf, count);
 	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
 		logx(1, "%s: %s", dev->path, strerror(errno));
 		dev->mididev.eof = 1;
 		return 0;
@@ -136,6 +152,8 @@ raw_write(struct mididev *addr, unsigned char *buf, unsigned count)
 
 	res = write(dev->fd, buf, count);
 	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
 		logx(1, "%s: %s", dev->path, strerror(errno));
 		dev->mididev.eof = 1;
 		return 0;
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * network MIDI devices, using UDP datagrams.
+ *
+ * The device path is "host:port[:lport]": data is sent to the given
+ * host and port, and if the device is readable, it's received on the
+ * local port "lport" (by default the same as "port"), from the given
+ * host only.
+ *
+ * Each datagram carries the bytes of a single output buffer flush,
+ * ie. all events of a tick, preceded by the following header:
+ *
+ *	2 bytes		magic, "MI"
+ *	2 bytes		sequence number, to detect lost datagrams
+ *	4 bytes		time in microseconds the data is to be played
+ *
+ * big endian. Time stamps are relative to an arbitrary origin, so
+ * receivers can measure and compensate the network jitter. Running
+ * status is not used, so a lost datagram doesn't corrupt the next ones.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "utils.h"
+#include "mididev.h"
+#include "mux.h"
+#include "str.h"
+#include "textio.h"
+
+#define UDP_HDRLEN	8
+#define UDP_MAGIC0	'M'
+#define UDP_MAGIC1	'I'
+#define UDP_DATALEN	MIDIDEV_BUFLEN
+
+struct udp {
+	struct mididev mididev;		/* device stuff */
+	char *path;			/* eg. "host:port" */
+	int fd;				/* socket */
+	unsigned oseq;			/* next sequence number to send */
+	unsigned iseq;			/* next sequence number expected */
+	unsigned isync;			/* got at least one datagram */
+	unsigned itransit;		/* last arrival - play time */
+	unsigned ijitter;		/* jitter estimate (x16) */
+	unsigned long nsent, nrecv;	/* datagrams sent, received */
+	unsigned long nlost, ndrop;	/* lost and dropped datagrams */
+};
+
+void	 udp_open(struct mididev *);
+unsigned udp_read(struct mididev *, unsigned char *, unsigned);
+unsigned udp_write(struct mididev *, unsigned char *, unsigned);
+unsigned udp_nfds(struct mididev *);
+unsigned udp_pollfd(struct mididev *, struct pollfd *, int);
+int	 udp_revents(struct mididev *, struct pollfd *);
+void	 udp_close(struct mididev *);
+void	 udp_del(struct mididev *);
+void	 udp_stat(struct mididev *, struct textout *);
+
+struct devops udp_ops = {
+	udp_open,
+	udp_read,
+	udp_write,
+	udp_nfds,
+	udp_pollfd,
+	udp_revents,
+	udp_close,
+	udp_del,
+	udp_stat
+};
+
+/*
+ * return the current time, in microseconds
+ */
+static unsigned
+udp_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
+		panic();
+	}
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * split "host:port[:lport]" and resolve the given address. Return 0
+ * on error
+ */
+static int
+udp_getaddr(char *path, struct addrinfo **res, char *lport, size_t lportsz)
+{
+	struct addrinfo hints;
+	char host[NI_MAXHOST], *p, *port, *lp;
+	int error;
+
+	if (strlen(path) >= sizeof(host)) {
+		logx(1, "%s: address too long", path);
+		return 0;
+	}
+	strcpy(host, path);
+	p = strchr(host, ':');
+	if (p == NULL) {
+		logx(1, "%s: port number expected", path);
+		return 0;
+	}
+	*p++ = 0;
+	port = p;
+	lp = strchr(port, ':');
+	if (lp != NULL)
+		*lp++ = 0;
+	else
+		lp = port;
+	if (strlen(lp) >= lportsz) {
+		logx(1, "%s: bad local port", path);
+		return 0;
+	}
+	strcpy(lport, lp);
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	error = getaddrinfo(host, port, &hints, res);
+	if (error) {
+		logx(1, "%s: %s", path, gai_strerror(error));
+		return 0;
+	}
+	return 1;
+}
+
+struct mididev *
+udp_new(char *path, unsigned mode)
+{
+	struct udp *dev;
+
+	if (path == NULL) {
+		logx(1, "address must be set for udp devices");
+		return NULL;
+	}
+	dev = xmalloc(sizeof(struct udp), "udp");
+	mididev_init(&dev->mididev, &udp_ops, mode);
+	dev->mididev.runst = 0;
+	dev->path = str_new(path);
+	dev->fd = -1;
+	return (struct mididev *)&dev->mididev;
+}
+
+void
+udp_del(struct mididev *addr)
+{
+	struct udp *dev = (struct udp *)addr;
+
+	mididev_done(&dev->mididev);
+	str_delete(dev->path);
+	xfree(dev);
+}
+
+void
+udp_open(struct mididev *addr)
+{
+	struct udp *dev = (struct udp *)addr;
+	struct addrinfo *ai, lhints, *lai;
+	char lport[NI_MAXSERV];
+	int error;
+
+	dev->oseq = 0;
+	dev->isync = 0;
+	dev->ijitter = 0;
+	dev->nsent = dev->nrecv = dev->nlost = dev->ndrop = 0;
+	if (!udp_getaddr(dev->path, &ai, lport, sizeof(lport))) {
+		dev->mididev.eof = 1;
+		return;
+	}
+	dev->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (dev->fd < 0) {
+		logx(1, "%s: socket: %s", dev->path, strerror(errno));
+		goto bad_free;
+	}
+	if (dev->mididev.mode & MIDIDEV_MODE_IN) {
+		memset(&lhints, 0, sizeof(struct addrinfo));
+		lhints.ai_family = ai->ai_family;
+		lhints.ai_socktype = SOCK_DGRAM;
+		lhints.ai_flags = AI_PASSIVE;
+		error = getaddrinfo(NULL, lport, &lhints, &lai);
+		if (error) {
+			logx(1, "%s: %s", lport, gai_strerror(error));
+			goto bad_close;
+		}
+		if (bind(dev->fd, lai->ai_addr, lai->ai_addrlen) < 0) {
+			logx(1, "%s: bind: %s", dev->path, strerror(errno));
+			freeaddrinfo(lai);
+			goto bad_close;
+		}
+		freeaddrinfo(lai);
+	}
+	if (connect(dev->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		logx(1, "%s: connect: %s", dev->path, strerror(errno));
+		goto bad_close;
+	}
+	if (fcntl(dev->fd, F_SETFL, O_NONBLOCK) < 0) {
+		logx(1, "%s: fcntl: %s", dev->path, strerror(errno));
+		goto bad_close;
+	}
+	freeaddrinfo(ai);
+	return;
+bad_close:
+	close(dev->fd);
+	dev->fd = -1;
+bad_free:
+	freeaddrinfo(ai);
+	dev->mididev.eof = 1;
+}
+
+void
+udp_close(struct mididev *addr)
+{
+	struct udp *dev = (struct udp *)addr;
+
+	if (dev->fd < 0)
+		return;
+	(void)close(dev->fd);
+	dev->fd = -1;
+}
+
+/*
+ * return true if the error is caused by the network or the remote
+ * end, in which case the datagram is lost, but the link is still
+ * usable
+ */
+static int
+udp_softerr(int err)
+{
+	return err == EAGAIN || err == EINTR || err == ENOBUFS ||
+	    err == ECONNREFUSED || err == EHOSTUNREACH || err == ENETUNREACH;
+}
+
+unsigned
+udp_read(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	struct udp *dev = (struct udp *)addr;
+	unsigned char pkt[UDP_HDRLEN + UDP_DATALEN];
+	unsigned seq, ts, transit, d, n;
+	ssize_t res;
+
+	res = recv(dev->fd, pkt, sizeof(pkt), 0);
+	if (res < 0) {
+		if (udp_softerr(errno))
+			return 0;
+		logx(1, "%s: %s", dev->path, strerror(errno));
+		dev->mididev.eof = 1;
+		return 0;
+	}
+	if (res < UDP_HDRLEN || pkt[0] != UDP_MAGIC0 || pkt[1] != UDP_MAGIC1) {
+		dev->ndrop++;
+		return 0;
+	}
+	seq = (pkt[2] << 8) | pkt[3];
+	ts = ((unsigned)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+	dev->nrecv++;
+
+	/*
+	 * count skipped sequence numbers as lost, but deliver late
+	 * datagrams anyway
+	 */
+	if (dev->isync) {
+		d = (seq - dev->iseq) & 0xffff;
+		if (d < 0x8000) {
+			dev->nlost += d;
+			dev->iseq = (seq + 1) & 0xffff;
+		}
+	} else
+		dev->iseq = (seq + 1) & 0xffff;
+
+	/*
+	 * estimate the jitter as in RFC 3550: the mean deviation of
+	 * the difference between arrival times and play times
+	 */
+	transit = udp_now() - ts;
+	if (dev->isync) {
+		d = transit - dev->itransit;
+		if ((int)d < 0)
+			d = -d;
+		dev->ijitter += d - ((dev->ijitter + 8) >> 4);
+	}
+	dev->itransit = transit;
+	dev->isync = 1;
+
+	n = res - UDP_HDRLEN;
+	if (n > count)
+		n = count;
+	memcpy(buf, pkt + UDP_HDRLEN, n);
+	return n;
+}
+
+unsigned
+udp_write(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	struct udp *dev = (struct udp *)addr;
+	unsigned char pkt[UDP_HDRLEN + UDP_DATALEN];
+	unsigned ts, n;
+	ssize_t res;
+
+	/*
+	 * events of the current tick are stamped with the ideal tick
+	 * time, plus the device latency
+	 */
+	ts = udp_now() + ((long)dev->mididev.odelay - (long)mux_late) / 24;
+	n = (count > UDP_DATALEN) ? UDP_DATALEN : count;
+	pkt[0] = UDP_MAGIC0;
+	pkt[1] = UDP_MAGIC1;
+	pkt[2] = dev->oseq >> 8;
+	pkt[3] = dev->oseq & 0xff;
+	pkt[4] = ts >> 24;
+	pkt[5] = (ts >> 16) & 0xff;
+	pkt[6] = (ts >> 8) & 0xff;
+	pkt[7] = ts & 0xff;
+	memcpy(pkt + UDP_HDRLEN, buf, n);
+	dev->oseq = (dev->oseq + 1) & 0xffff;
+
+	res = send(dev->fd, pkt, UDP_HDRLEN + n, 0);
+	if (res < 0) {
+		if (errno == EAGAIN) {
+			dev->oseq = (dev->oseq - 1) & 0xffff;
+			return 0;
+		}
+		if (udp_softerr(errno)) {
+			dev->ndrop++;
+			return n;
+		}
+		logx(1, "%s: %s", dev->path, strerror(errno));
+		dev->mididev.eof = 1;
+		return 0;
+	}
+	dev->nsent++;
+	return n;
+}
+
+unsigned
+udp_nfds(struct mididev *addr)
+{
+	return 1;
+}
+
+unsigned
+udp_pollfd(struct mididev *addr, struct pollfd *pfd, int events)
+{
+	struct udp *dev = (struct udp *)addr;
+
+	pfd->fd = dev->fd;
+	pfd->events = events;
+	pfd->revents = 0;
+	return 1;
+}
+
+int
+udp_revents(struct mididev *addr, struct pollfd *pfd)
+{
+	int revents = pfd->revents;
+
+	/*
+	 * errors reported by the remote end are not fatal, read the
+	 * socket to clear them
+	 */
+	if (revents & (POLLHUP | POLLERR))
+		revents = (revents & ~(POLLHUP | POLLERR)) | POLLIN;
+	return revents;
+}
+
+void
+udp_stat(struct mididev *addr, struct textout *f)
+{
+	struct udp *dev = (struct udp *)addr;
+
+	textout_putstr(f, "# link: ");
+	textout_putlong(f, dev->nsent);
+	textout_putstr(f, " sent, ");
+	textout_putlong(f, dev->nrecv);
+	textout_putstr(f, " received, ");
+	textout_putlong(f, dev->nlost);
+	textout_putstr(f, " lost, ");
+	textout_putlong(f, dev->ndrop);
+	textout_putstr(f, " dropped, jitter ");
+	textout_putlong(f, dev->ijitter >> 4);
+	textout_putstr(f, "us\n");
+}
@@ -29,6 +29,7 @@ metro_init(struct metro *o)
 {
 	o->mode = 0;
 	o->mask = (1 << SONG_REC);
+	o->on = 0;
 	o->hi.cmd = EV_NON;
 	o->hi.dev = DEFAULT_METRO_DEV;
 	o->hi.ch  = DEFAULT_METRO_CHAN;
@@ -82,7 +83,7 @@ metro_tocb(void *addr)
 void
 metro_tic(struct metro *o, unsigned beat, unsigned tic)
 {
-	if ((o->mask & (1 << o->mode)) && tic == 0) {
+	if (o->on && tic == 0) {
 		/*
 		 * if the last metronome click is sounding
 		 * abord the timeout and stop the click
@@ -123,9 +124,10 @@ metro_shut(struct metro *o)
 void
 metro_setmode(struct metro *o, unsigned mode)
 {
-	if ((o->mask & (1 << o->mode)) && !(o->mask & (1 << mode)))
+	if (o->on && !(o->mask & (1 << mode)))
 		metro_shut(o);
 	o->mode = mode;
+	o->on = (o->mask & (1 << mode)) != 0;
 }
 
 /*
@@ -134,9 +136,10 @@ metro_setmode(struct metro *o, unsigned mode)
 void
 metro_setmask(struct metro *o, unsigned mask)
 {
-	if ((o->mask & (1 << o->mode)) && !(mask & (1 << o->mode)))
+	if (o->on && !(mask & (1 << o->mode)))
 		metro_shut(o);
 	o->mask = mask;
+	o->on = (mask & (1 << o->mode)) != 0;
 }
 
 unsigned
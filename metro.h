@@ -23,6 +23,7 @@
 struct metro {
 	unsigned mode;		/* same as song->mode */
 	unsigned mask;		/* enabled if (mask | mode) != 0 */
+	unsigned on;		/* mask contains the current mode */
 	struct ev hi, lo;	/* high and low click note-on events */
 	struct ev *ev;		/* event currently sounding (or NULL) */
 	struct timo to;		/* timeout for the noteoff */
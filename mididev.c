@@ -43,6 +43,7 @@
  *
  */
 
+#include <string.h>
 #include "utils.h"
 #include "defs.h"
 #include "mididev.h"
@@ -54,6 +55,7 @@
 #include "mux.h"
 #include "timo.h"
 #include "conv.h"
+#include "trace.h"
 
 #define MIDI_SYSEXSTART	0xf0
 #define MIDI_QFRAME	0xf1
@@ -74,7 +76,25 @@ unsigned mididev_evlen[] = { 2, 2, 2, 2, 1, 1, 2, 0 };
 #define MIDIDEV_EVLEN(status) (mididev_evlen[((status) >> 4) & 7])
 
 struct mididev *mididev_list, *mididev_clksrc, *mididev_mtcsrc;
-struct mididev *mididev_byunit[DEFAULT_MAXNDEVS];
+struct mididev **mididev_byunit;
+
+/*
+ * devices with data in their output buffer, and stats about the
+ * output: number of bytes and number of write() calls
+ */
+struct mididev *mididev_olist;
+unsigned mididev_nbytes, mididev_nwrites;
+
+void mtc_timo(void *);
+void mididev_isenscb(void *);
+void mididev_osenscb(void *);
+void mididev_oratecb(void *);
+void mididev_dqcb(void *);
+void mididev_oqueue(struct mididev *);
+void mididev_ounqueue(struct mididev *);
+static void mididev_ocharge(struct mididev *, unsigned);
+static void mididev_odrain(struct mididev *, int);
+static void mididev_dqwrite(struct mididev *);
 
 /*
  * initialize the mtc "parser" to a state, when a full message or 2 complete
@@ -87,7 +107,7 @@ mtc_init(struct mtc *mtc)
 	mtc->qfr = 0;
 	mtc->pos = 0xdeadbeef;
 	mtc->state = MTC_STOP;
-	mtc->timo = 0;
+	timo_set(&mtc->timo, mtc_timo, mtc);
 };
 
 /*
@@ -121,8 +141,10 @@ mtc_setfps(struct mtc *mtc, unsigned id)
  * called when timeout expires, ie MTC stopped
  */
 void
-mtc_timo(struct mtc *mtc)
+mtc_timo(void *addr)
 {
+	struct mtc *mtc = (struct mtc *)addr;
+
 	if (mididev_debug)
 		logx(1, "%s: stopped", __func__);
 	mtc->state = MTC_STOP;
@@ -157,7 +179,8 @@ mtc_tick(struct mtc *mtc, unsigned data)
 	mtc->nibble[mtc->qfr++] = data & 0xf;
 	if (mtc->qfr < 8)
 		return;
-	mtc->timo = 24000000 / 4;
+	timo_del(&mtc->timo);
+	timo_add(&mtc->timo, 24000000 / 4);
 	pos = mtc->tps * 4 * (mtc->nibble[0] +  (mtc->nibble[1]      << 4)) +
 	    MTC_SEC *        (mtc->nibble[2] +  (mtc->nibble[3]      << 4)) +
 	    MTC_SEC * 60 *   (mtc->nibble[4] +  (mtc->nibble[5]      << 4)) +
@@ -191,11 +214,9 @@ mtc_full(struct mtc *mtc, struct sysex *x)
 {
 	unsigned char *data;
 
-	if (x->first == NULL ||
-	    x->first->next != NULL ||
-	    x->first->used != 10)
+	if (x->used != 10)
 		return;
-	data = x->first->data;
+	data = x->data;
 	if (data[1] != 0x7f ||
 	    data[2] != 0x7f ||
 	    data[3] != 0x01 ||
@@ -227,6 +248,7 @@ mididev_init(struct mididev *o, struct devops *ops, unsigned mode)
 	 */
 	o->ops = ops;
 	o->sendclk = 0;
+	o->clkpll = 0;
 	o->sendmmc = 1;
 	o->ticrate = DEFAULT_TPU;
 	o->ticdelta = 0xdeadbeef;
@@ -245,6 +267,27 @@ mididev_init(struct mididev *o, struct devops *ops, unsigned mode)
 	o->isysex = NULL;
 	o->runst = 1;
 	o->sync = 0;
+	o->odelay = 0;
+	o->olatency = 0;
+	o->ocomp = 0;
+	o->onodup = 0;
+	o->icoalesce = 0;
+	mididev_shadowreset(o);
+	o->orate = 0;
+	o->oload = 0;
+	o->otime = 0;
+	o->nnoteq = o->nctlq = o->oxused = 0;
+	o->oqstart = o->oqused = 0;
+	o->noverrun = 0;
+	o->oinsysex = 0;
+	o->dqstart = o->dqused = 0;
+	o->dqfirst = o->dqnblk = 0;
+	o->opfd = NULL;
+	o->oprev = NULL;
+	timo_set(&o->isensto, mididev_isenscb, o);
+	timo_set(&o->osensto, mididev_osenscb, o);
+	timo_set(&o->orateto, mididev_oratecb, o);
+	timo_set(&o->dqto, mididev_dqcb, o);
 }
 
 /*
@@ -256,6 +299,7 @@ mididev_done(struct mididev *o)
 {
 	if (mux_isopen)
 		mididev_close(o);
+	mididev_ounqueue(o);
 }
 
 /*
@@ -268,8 +312,20 @@ mididev_open(struct mididev *o)
 	o->oused = 0;
 	o->istatus = o->ostatus = 0;
 	o->isysex = NULL;
+	mididev_shadowreset(o);
+	o->oload = 0;
+	o->otime = timo_abstime;
+	o->nnoteq = o->nctlq = o->oxused = 0;
+	o->oqstart = o->oqused = 0;
+	o->noverrun = 0;
+	o->oinsysex = 0;
+	o->dqstart = o->dqused = 0;
+	o->dqfirst = o->dqnblk = 0;
 	mtc_init(&o->imtc);
 	o->ops->open(o);
+	mux_mdep_devchg();
+	if (o->mode & MIDIDEV_MODE_OUT)
+		timo_add(&o->osensto, MIDIDEV_OSENSTO);
 }
 
 /*
@@ -278,9 +334,372 @@ mididev_open(struct mididev *o)
 void
 mididev_close(struct mididev *o)
 {
+	unsigned i;
+
+	mididev_odrain(o, 1);
 	mididev_flush(o);
+	while (o->dqnblk > 0)
+		mididev_dqwrite(o);
+	timo_del(&o->dqto);
+
+	/*
+	 * give the device up to 1 second to accept queued data
+	 */
+	for (i = 0; i < 100 && o->oqused > 0 && !o->eof; i++) {
+		mux_sleep(10);
+		mididev_oqdrain(o);
+	}
+	if (o->oqused > 0) {
+		logx(1, "%u: %u bytes not sent", o->unit, o->oqused);
+		o->oqused = 0;
+	}
+	timo_del(&o->isensto);
+	timo_del(&o->osensto);
+	timo_del(&o->imtc.timo);
 	o->ops->close(o);
 	o->eof = 1;
+	mux_mdep_devchg();
+}
+
+/*
+ * called when no input was received during MIDIDEV_ISENSTO,
+ * while active sensing is enabled
+ */
+void
+mididev_isenscb(void *addr)
+{
+	struct mididev *o = (struct mididev *)addr;
+
+	logx(1, "%u: sensing timeout, disabled", o->unit);
+}
+
+/*
+ * called when nothing was sent during MIDIDEV_OSENSTO, send
+ * an active sensing message
+ */
+void
+mididev_osenscb(void *addr)
+{
+	struct mididev *o = (struct mididev *)addr;
+
+	mididev_putack(o);
+	mididev_flush(o);
+	if (!o->osensto.set)
+		timo_add(&o->osensto, MIDIDEV_OSENSTO);
+}
+
+/*
+ * restart the input active sensing timeout, if it's enabled. Called
+ * every time input is received
+ */
+void
+mididev_isensreset(struct mididev *o)
+{
+	if (o->isensto.set) {
+		timo_del(&o->isensto);
+		timo_add(&o->isensto, MIDIDEV_ISENSTO);
+	}
+}
+
+/*
+ * add the device to the list of devices to flush, called when
+ * the first byte is stored in the output buffer
+ */
+void
+mididev_oqueue(struct mididev *o)
+{
+	if (o->oprev != NULL)
+		return;
+	o->onext = mididev_olist;
+	if (o->onext)
+		o->onext->oprev = &o->onext;
+	o->oprev = &mididev_olist;
+	mididev_olist = o;
+}
+
+/*
+ * remove the device from the list of devices to flush
+ */
+void
+mididev_ounqueue(struct mididev *o)
+{
+	if (o->oprev == NULL)
+		return;
+	if (o->onext)
+		o->onext->oprev = o->oprev;
+	*o->oprev = o->onext;
+	o->oprev = NULL;
+}
+
+/*
+ * write as much as possible of the given data, until the device
+ * doesn't accept more. Return the number of bytes written
+ */
+static unsigned
+mididev_trywrite(struct mididev *o, unsigned char *buf, unsigned todo)
+{
+	unsigned count, done = 0;
+
+	while (todo > 0) {
+		count = o->ops->write(o, buf, todo);
+		mididev_nwrites++;
+		if (o->eof || count == 0)
+			break;
+		todo -= count;
+		buf += count;
+		done += count;
+	}
+	return done;
+}
+
+/*
+ * write the output queue to the device, until either the queue is
+ * empty or the device doesn't accept more data
+ */
+void
+mididev_oqdrain(struct mididev *o)
+{
+	unsigned count, n;
+
+	while (o->oqused > 0 && !o->eof) {
+		n = MIDIDEV_OQLEN - o->oqstart;
+		if (n > o->oqused)
+			n = o->oqused;
+		count = mididev_trywrite(o, o->oq + o->oqstart, n);
+		o->oqstart = (o->oqstart + count) % MIDIDEV_OQLEN;
+		o->oqused -= count;
+		if (count < n)
+			break;
+	}
+	if (o->oqused == 0)
+		o->oqstart = 0;
+}
+
+/*
+ * update the 'oinsysex' flag with the given data, which will be sent
+ */
+static void
+mididev_osxstate(struct mididev *o, unsigned char *buf, unsigned len)
+{
+	unsigned c;
+
+	while (len > 0) {
+		c = buf[--len];
+		if (c >= 0x80 && c < 0xf8) {
+			o->oinsysex = (c == 0xf0);
+			return;
+		}
+	}
+}
+
+/*
+ * drop data that doesn't fit in the output queue. The receiver may
+ * not have got the last values sent, so forget them, and resend the
+ * status byte of the next message
+ */
+static void
+mididev_odrop(struct mididev *o, unsigned len)
+{
+	if (o->noverrun == 0)
+		logx(1, "%u: output overrun, data dropped", o->unit);
+	o->noverrun += len;
+	o->ostatus = 0;
+	mididev_shadowreset(o);
+}
+
+/*
+ * write the given data to the device; the part the device can't
+ * accept without blocking is queued, so a slow device doesn't delay
+ * the others
+ */
+static void
+mididev_owrite(struct mididev *o, unsigned char *buf, unsigned todo)
+{
+	unsigned count, end, n;
+
+	if (mididev_debug && todo > 0) {
+		logx(1, "%s: %u: %u: {hexdump:%p,%u}", __func__,
+		    timo_abstime / 24, o->unit, buf, todo);
+	}
+	mididev_nbytes += todo;
+	if (o->oqused > 0)
+		mididev_oqdrain(o);
+
+	/*
+	 * if data is still queued, the block can't be written now, so
+	 * drop it as a whole if it doesn't fit, rather than cutting
+	 * messages
+	 */
+	if (o->oqused > 0 && todo > MIDIDEV_OQLEN - o->oqused) {
+		mididev_odrop(o, todo);
+		return;
+	}
+	if (o->oqused == 0) {
+		count = mididev_trywrite(o, buf, todo);
+		if (count < todo && todo - count > MIDIDEV_OQLEN) {
+			/*
+			 * the block is larger than the queue and only
+			 * partially written: drop the rest, but terminate
+			 * the sysex being sent, if any
+			 */
+			mididev_osxstate(o, buf, count);
+			mididev_odrop(o, todo - count);
+			if (o->oinsysex && !o->eof) {
+				o->oq[0] = 0xf7;
+				o->oqused = 1;
+				o->oinsysex = 0;
+			}
+			return;
+		}
+		mididev_osxstate(o, buf, todo);
+		buf += count;
+		todo -= count;
+	} else
+		mididev_osxstate(o, buf, todo);
+	if (todo == 0 || o->eof)
+		return;
+	while (todo > 0) {
+		end = (o->oqstart + o->oqused) % MIDIDEV_OQLEN;
+		n = MIDIDEV_OQLEN - end;
+		if (n > todo)
+			n = todo;
+		memcpy(o->oq + end, buf, n);
+		o->oqused += n;
+		buf += n;
+		todo -= n;
+	}
+}
+
+/*
+ * write the first block of the delay line to the device. If the
+ * block wraps, it's copied in a single buffer, so mididev_owrite()
+ * drops it as a whole on overrun, rather than only its second half
+ */
+static void
+mididev_dqwrite(struct mididev *o)
+{
+	struct mididev_dqblk *b = &o->dqblk[o->dqfirst];
+	unsigned char buf[MIDIDEV_DQLEN];
+	unsigned n;
+
+	n = MIDIDEV_DQLEN - o->dqstart;
+	if (n >= b->len)
+		mididev_owrite(o, o->dq + o->dqstart, b->len);
+	else {
+		memcpy(buf, o->dq + o->dqstart, n);
+		memcpy(buf + n, o->dq, b->len - n);
+		mididev_owrite(o, buf, b->len);
+	}
+	o->dqstart = (o->dqstart + b->len) % MIDIDEV_DQLEN;
+	o->dqused -= b->len;
+	o->dqfirst = (o->dqfirst + 1) % MIDIDEV_DQNBLK;
+	o->dqnblk--;
+}
+
+/*
+ * schedule the writing of the first block of the delay line
+ */
+static void
+mididev_dqsched(struct mididev *o)
+{
+	int delta;
+
+	if (o->dqto.set || o->dqnblk == 0)
+		return;
+	delta = o->dqblk[o->dqfirst].time - timo_abstime;
+	timo_add(&o->dqto, delta > 0 ? delta : 1);
+}
+
+/*
+ * called when the first block of the delay line is due, write it
+ * and the following ones that are due as well
+ */
+void
+mididev_dqcb(void *addr)
+{
+	struct mididev *o = (struct mididev *)addr;
+
+	while (o->dqnblk > 0 &&
+	    (int)(o->dqblk[o->dqfirst].time - timo_abstime) <= 0)
+		mididev_dqwrite(o);
+	mididev_dqsched(o);
+}
+
+/*
+ * store the given data in the delay line, to be written 'ocomp'
+ * after the ideal time of the current tick. If the delay line is
+ * full, the oldest data is written early
+ */
+static void
+mididev_dqput(struct mididev *o, unsigned char *buf, unsigned todo)
+{
+	struct mididev_dqblk *b;
+	unsigned time, end, n;
+
+	if (todo > MIDIDEV_DQLEN) {
+		while (o->dqnblk > 0)
+			mididev_dqwrite(o);
+		mididev_owrite(o, buf, todo);
+		return;
+	}
+	time = timo_abstime +
+	    (o->ocomp > mux_late ? o->ocomp - mux_late : 0);
+	if (o->dqnblk > 0) {
+		b = &o->dqblk[(o->dqfirst + o->dqnblk - 1) % MIDIDEV_DQNBLK];
+		if ((int)(time - b->time) < 0)
+			time = b->time;
+	} else
+		b = NULL;
+	if (b == NULL || b->time != time) {
+		if (o->dqnblk == MIDIDEV_DQNBLK)
+			mididev_dqwrite(o);
+		b = &o->dqblk[(o->dqfirst + o->dqnblk) % MIDIDEV_DQNBLK];
+		b->time = time;
+		b->len = 0;
+		o->dqnblk++;
+	}
+	while (todo > MIDIDEV_DQLEN - o->dqused) {
+		if (o->dqnblk == 1) {
+			/*
+			 * only the block being filled remains:
+			 * write what it contains and restart it
+			 */
+			mididev_dqwrite(o);
+			b = &o->dqblk[o->dqfirst];
+			b->time = time;
+			b->len = 0;
+			o->dqnblk = 1;
+			break;
+		}
+		mididev_dqwrite(o);
+	}
+	while (todo > 0) {
+		end = (o->dqstart + o->dqused) % MIDIDEV_DQLEN;
+		n = MIDIDEV_DQLEN - end;
+		if (n > todo)
+			n = todo;
+		memcpy(o->dq + end, buf, n);
+		o->dqused += n;
+		b->len += n;
+		buf += n;
+		todo -= n;
+	}
+	mididev_dqsched(o);
+}
+
+/*
+ * write the given data to the device, through the delay line if
+ * the output is delayed
+ */
+static void
+mididev_write(struct mididev *o, unsigned char *buf, unsigned todo)
+{
+	if (todo == 0)
+		return;
+	if (o->ocomp > 0 || o->dqnblk > 0)
+		mididev_dqput(o, buf, todo);
+	else
+		mididev_owrite(o, buf, todo);
 }
 
 /*
@@ -289,38 +708,73 @@ mididev_close(struct mididev *o)
 void
 mididev_flush(struct mididev *o)
 {
-	unsigned count, todo;
-	unsigned char *buf;
-
+	if (trace_on) {
+		trace_put(TRACE_MIDIDEV_FLUSH, TRACE_BEGIN,
+		    o->unit, o->oused, 0, 0);
+	}
 	if (!o->eof) {
-		if (mididev_debug && o->oused > 0) {
-			logx(1, "%s: %u: %u: {hexdump:%p,%u}", __func__,
-			    timo_abstime / 24, o->unit, o->obuf, o->oused);
+		mididev_write(o, o->obuf, o->oused);
+		if (o->oused && o->osensto.set) {
+			timo_del(&o->osensto);
+			timo_add(&o->osensto, MIDIDEV_OSENSTO);
 		}
-		todo = o->oused;
-		buf = o->obuf;
-		while (todo > 0) {
-			count = o->ops->write(o, buf, todo);
-			if (o->eof)
-				break;
-			todo -= count;
-			buf += count;
-		}
-		if (o->oused)
-			o->osensto = MIDIDEV_OSENSTO;
 	}
 	o->oused = 0;
+	mididev_ounqueue(o);
+	if (trace_on)
+		trace_put(TRACE_MIDIDEV_FLUSH, TRACE_END, 0, 0, 0, 0);
+}
+
+/*
+ * flush all devices with pending output data in a single pass,
+ * devices with empty buffers are not on the list
+ */
+void
+mididev_flushall(void)
+{
+	while (mididev_olist)
+		mididev_flush(mididev_olist);
+}
+
+/*
+ * decode the voice message stored in the parser state, and pass it to
+ * mux_evcb()
+ */
+static void
+mididev_inputev(struct mididev *o)
+{
+	struct ev ev;
+
+	ev.cmd = o->istatus >> 4;
+	ev.dev = o->unit;
+	ev.ch = o->istatus & 0x0f;
+	if (ev.cmd == EV_NON && o->idata[1] == 0) {
+		ev.cmd = EV_NOFF;
+		ev.note_num = o->idata[0];
+		ev.note_vel = EV_NOFF_DEFAULTVEL;
+	} else if (ev.cmd == EV_BEND) {
+		ev.bend_val = ((unsigned)o->idata[1] << 7) + o->idata[0];
+	} else {
+		ev.v0 = o->idata[0];
+		ev.v1 = o->idata[1];
+	}
+	mux_evcb(o->unit, &ev);
 }
 
 /*
  * mididev_inputcb is called when midi data becomes available
  * it calls mux_evcb
+ *
+ * runs of data bytes are processed in a single inner loop: voice
+ * messages under running status are decoded without going through
+ * the status byte dispatch, and sysex data is copied as a block.
+ * Output caused by the input is flushed once, at the end
  */
 void
 mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 {
-	struct ev ev;
-	unsigned data;
+	unsigned char *end, *p;
+	unsigned data, len;
 
 	if (!(o->mode & MIDIDEV_MODE_IN)) {
 		logx(1, "received data from output only device");
@@ -330,10 +784,42 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 		logx(1, "%s: %u: %u: {hexdump:%p,%u}", __func__,
 		    timo_abstime / 24, o->unit, buf, count);
 	}
-	while (count != 0) {
-		data = *buf;
-		count--;
-		buf++;
+	mux_flushdefer++;
+	end = buf + count;
+	while (buf != end) {
+		data = *buf++;
+		if (data < 0x80) {
+			if (o->istatus >= 0x80 && o->istatus < 0xf0) {
+				len = MIDIDEV_EVLEN(o->istatus);
+				for (;;) {
+					o->idata[o->icount++] = data;
+					if (o->icount == len) {
+						o->icount = 0;
+						mididev_inputev(o);
+					}
+					if (buf == end || *buf >= 0x80)
+						break;
+					data = *buf++;
+				}
+			} else if (o->istatus == MIDI_SYSEXSTART) {
+				for (p = buf; p != end && *p < 0x80; p++)
+					; /* nothing */
+				sysex_add(o->isysex, data);
+				sysex_addbuf(o->isysex, buf, p - buf);
+				buf = p;
+			} else if (o->istatus == MIDI_QFRAME) {
+				/*
+				 * NOTE: MIDI uses running status only for
+				 *	 voice events so, if you add new system
+				 *	 common messages here don't forget to
+				 *	 reset the running status
+				 */
+				if (o == mididev_mtcsrc)
+					mtc_tick(&o->imtc, data);
+				o->istatus = 0;
+			}
+			continue;
+		}
 		if (data >= 0xf8) {
 			switch(data) {
 			case MIDI_TIC:
@@ -359,7 +845,7 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 				}
 				break;
 			}
-		} else if (data >= 0x80) {
+		} else {
 			if (mididev_debug &&
 			    o->istatus >= 0x80 &&  o->icount > 0 &&
 			    o->icount < MIDIDEV_EVLEN(o->istatus)) {
@@ -404,40 +890,10 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 				}
 				break;
 			}
-		} else if (o->istatus >= 0x80 && o->istatus < 0xf0) {
-			o->idata[o->icount] = (unsigned char)data;
-			o->icount++;
-
-			if (o->icount == MIDIDEV_EVLEN(o->istatus)) {
-				o->icount = 0;
-				ev.cmd = o->istatus >> 4;
-				ev.dev = o->unit;
-				ev.ch = o->istatus & 0x0f;
-				if (ev.cmd == EV_NON && o->idata[1] == 0) {
-					ev.cmd = EV_NOFF;
-					ev.note_num = o->idata[0];
-					ev.note_vel = EV_NOFF_DEFAULTVEL;
-				} else if (ev.cmd == EV_BEND) {
-					ev.bend_val = ((unsigned)o->idata[1] << 7) + o->idata[0];
-				} else {
-					ev.v0 = o->idata[0];
-					ev.v1 = o->idata[1];
-				}
-				mux_evcb(o->unit, &ev);
-			}
-		} else if (o->istatus == MIDI_SYSEXSTART) {
-			sysex_add(o->isysex, data);
-		} else if (o->istatus == MIDI_QFRAME) {
-			/*
-			 * NOTE: MIDI uses running status only for voice events
-			 *	 so, if you add new system common messages
-			 *       here don't forget to reset the running status
-			 */
-			if (o == mididev_mtcsrc)
-				mtc_tick(&o->imtc, data);
-			o->istatus = 0;
 		}
 	}
+	mux_flushdefer--;
+	mux_flush();
 }
 
 /*
@@ -453,6 +909,8 @@ mididev_out(struct mididev *o, unsigned data)
 	if (o->oused == MIDIDEV_BUFLEN) {
 		mididev_flush(o);
 	}
+	if (o->oused == 0)
+		mididev_oqueue(o);
 	o->obuf[o->oused] = (unsigned char)data;
 	o->oused++;
 }
@@ -461,6 +919,7 @@ void
 mididev_putstart(struct mididev *o)
 {
 	mididev_out(o, MIDI_START);
+	mididev_ocharge(o, 1);
 	if (o->sync)
 		mididev_flush(o);
 }
@@ -469,6 +928,7 @@ void
 mididev_putstop(struct mididev *o)
 {
 	mididev_out(o, MIDI_STOP);
+	mididev_ocharge(o, 1);
 	if (o->sync)
 		mididev_flush(o);
 }
@@ -477,6 +937,7 @@ void
 mididev_puttic(struct mididev *o)
 {
 	mididev_out(o, MIDI_TIC);
+	mididev_ocharge(o, 1);
 	if (o->sync)
 		mididev_flush(o);
 }
@@ -485,53 +946,117 @@ void
 mididev_putack(struct mididev *o)
 {
 	mididev_out(o, MIDI_ACK);
+	mididev_ocharge(o, 1);
 	if (o->sync)
 		mididev_flush(o);
 }
 
 /*
- * convert a voice event to byte stream and queue
- * it for sending
+ * forget the values sent, so next events are sent even if they
+ * are the same. Must be called whenever the receiver state may
+ * have been changed by other means
  */
 void
-mididev_putev(struct mididev *o, struct ev *ev)
+mididev_shadowreset(struct mididev *o)
 {
-	unsigned char *p;
-	unsigned s;
+	unsigned i, j;
 
-	if (EV_ISSX(ev)) {
-		o->ostatus = 0;
-		p = evinfo[ev->cmd].pattern;
-		for (;;) {
-			switch (*p) {
-			case EV_PATV0_HI:
-				mididev_out(o, ev->v0 >> 7);
-				break;
-			case EV_PATV0_LO:
-				mididev_out(o, ev->v0 & 0x7f);
-				break;
-			case EV_PATV1_HI:
-				mididev_out(o, ev->v1 >> 7);
-				break;
-			case EV_PATV1_LO:
-				mididev_out(o, ev->v1 & 0x7f);
-				break;
-			default:
-				mididev_out(o, *p);
-				if (*p == 0xf7)
-					goto end;
-			}
-			p++;
-		}
+	for (i = 0; i < 16; i++) {
+		for (j = 0; j < 128; j++)
+			o->octl[i][j] = MIDIDEV_NOVAL;
+		o->obend[i] = MIDIDEV_NOVAL;
+		o->ocat[i] = MIDIDEV_NOVAL;
 	}
-	if (!EV_ISVOICE(ev)) {
-		return;
+}
+
+/*
+ * return 1 if the given event only sets a value, that the next event
+ * of the same type and channel overwrites. Data entry and parameter
+ * number controllers are not, because their meaning depends on
+ * previous controllers; neither are 14-bit controllers, because
+ * receivers may reset the fine part when the coarse part is sent.
+ */
+static int
+mididev_iscont(struct mididev *o, struct ev *ev)
+{
+	unsigned num;
+
+	switch (ev->cmd) {
+	case EV_KAT:
+	case EV_CAT:
+	case EV_BEND:
+		return 1;
+	case EV_CTL:
+		num = ev->ctl_num;
+		if (num >= 120)
+			return 0;
+		if (num == 6 || num == 38 || (num >= 96 && num <= 101))
+			return 0;
+		if (num < 64 && (o->oxctlset & (1 << (num & 31))))
+			return 0;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * return 1 if the given event may change the receiver state, and
+ * thus must be sent, and record its value.
+ */
+static int
+mididev_shadowchg(struct mididev *o, struct ev *ev)
+{
+	unsigned short *pval;
+	unsigned val, i;
+
+	if (ev->cmd == EV_CTL && ev->ctl_num == 121) {
+		/* reset all controllers */
+		for (i = 0; i < 120; i++)
+			o->octl[ev->ch][i] = MIDIDEV_NOVAL;
+		o->obend[ev->ch] = MIDIDEV_NOVAL;
+		o->ocat[ev->ch] = MIDIDEV_NOVAL;
+		return 1;
 	}
+	if (!mididev_iscont(o, ev))
+		return 1;
+	switch (ev->cmd) {
+	case EV_CTL:
+		pval = &o->octl[ev->ch][ev->ctl_num];
+		val = ev->ctl_val;
+		break;
+	case EV_BEND:
+		pval = &o->obend[ev->ch];
+		val = ev->bend_val;
+		break;
+	case EV_CAT:
+		pval = &o->ocat[ev->ch];
+		val = ev->cat_val;
+		break;
+	default:
+		return 1;
+	}
+	if (*pval == val)
+		return 0;
+	*pval = val;
+	return 1;
+}
+
+/*
+ * convert a voice event to byte stream and store it in the output
+ * buffer, return the number of bytes stored
+ */
+static unsigned
+mididev_evout(struct mididev *o, struct ev *ev)
+{
+	unsigned s, n = 0;
+
 	if (ev->cmd == EV_NOFF) {
 		s = ev->ch + (EV_NON << 4);
 		if (!o->runst || s != o->ostatus) {
 			o->ostatus = s;
 			mididev_out(o, s);
+			n++;
 		}
 		mididev_out(o, ev->note_num);
 		mididev_out(o, 0);
@@ -540,6 +1065,7 @@ mididev_putev(struct mididev *o, struct ev *ev)
 		if (!o->runst || s != o->ostatus) {
 			o->ostatus = s;
 			mididev_out(o, s);
+			n++;
 		}
 		mididev_out(o, ev->bend_val & 0x7f);
 		mididev_out(o, ev->bend_val >> 7);
@@ -548,30 +1074,77 @@ mididev_putev(struct mididev *o, struct ev *ev)
 		if (!o->runst || s != o->ostatus) {
 			o->ostatus = s;
 			mididev_out(o, s);
+			n++;
 		}
 		mididev_out(o, ev->v0);
 		if (MIDIDEV_EVLEN(s) == 2) {
 			mididev_out(o, ev->v1);
 		}
 	}
-end:
-	if (o->sync)
-		mididev_flush(o);
+	return n + MIDIDEV_EVLEN(s);
 }
 
 /*
- * queue raw data for sending
+ * return the number of bytes mididev_evout() or mididev_putev() would
+ * send for the given event. 'status' holds the running status, as
+ * 'ostatus' does; the device may be NULL, in which case defaults
+ * are used. Nothing is sent, this is for bandwidth estimates
  */
-void
-mididev_sendraw(struct mididev *o, unsigned char *buf, unsigned len)
+unsigned
+mididev_evsize(struct mididev *o, struct ev *ev, unsigned *status)
 {
-	if (!(o->mode & MIDIDEV_MODE_OUT)) {
+	unsigned char *p;
+	unsigned s, n;
+
+	if (EV_ISSX(ev)) {
+		p = evinfo[ev->cmd].pattern;
+		for (n = 0; n < EV_PATSIZE; n++, p++) {
+			if (*p == 0xf7) {
+				n++;
+				break;
+			}
+		}
+		*status = 0;
+		return n;
+	}
+	s = ev->ch + (((ev->cmd == EV_NOFF) ? EV_NON : ev->cmd) << 4);
+	n = MIDIDEV_EVLEN(s);
+	if ((o != NULL && !o->runst) || s != *status) {
+		*status = s;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * store raw data in the output buffer, large blocks are written
+ * directly
+ */
+static void
+mididev_rawout(struct mididev *o, unsigned char *buf, unsigned len)
+{
+	/*
+	 * large blocks (ex. bulk dumps) don't fit in the buffer, so
+	 * write them directly instead of copying them in pieces
+	 */
+	if (len >= MIDIDEV_BUFLEN) {
+		mididev_flush(o);
+		if (!o->eof) {
+			mididev_write(o, buf, len);
+			if (o->osensto.set) {
+				timo_del(&o->osensto);
+				timo_add(&o->osensto, MIDIDEV_OSENSTO);
+			}
+		}
+		o->ostatus = 0;
 		return;
 	}
 	while (len > 0) {
 		if (o->oused == MIDIDEV_BUFLEN) {
 			mididev_flush(o);
 		}
+		if (o->oused == 0)
+			mididev_oqueue(o);
 		o->obuf[o->oused] = *buf;
 		o->oused++;
 		len--;
@@ -581,10 +1154,291 @@ mididev_sendraw(struct mididev *o, unsigned char *buf, unsigned len)
 	 * since we don't parse the buffer, reset running status
 	 */
 	o->ostatus = 0;
+}
+
+/*
+ * account for the given number of bytes sent, if the output rate
+ * is limited: decrease the amount of data not transmitted yet by the
+ * time elapsed, then add the time needed to transmit the given bytes
+ */
+static void
+mididev_ocharge(struct mididev *o, unsigned nbytes)
+{
+	unsigned elapsed;
+
+	if (o->orate == 0)
+		return;
+	elapsed = timo_abstime - o->otime;
+	o->otime = timo_abstime;
+	o->oload = (o->oload > elapsed) ? o->oload - elapsed : 0;
+	o->oload += (unsigned long long)nbytes * 24000000 / o->orate;
+}
+
+/*
+ * send the most urgent queued message: notes first, then
+ * controllers, then raw data. Voice events are never queued after
+ * raw data, so this preserves their order. Return 0 if the queues
+ * are empty
+ */
+static int
+mididev_osendone(struct mididev *o)
+{
+	unsigned n;
+
+	if (o->nnoteq > 0) {
+		n = mididev_evout(o, &o->noteq[0]);
+		o->nnoteq--;
+		memmove(o->noteq, o->noteq + 1, o->nnoteq * sizeof(struct ev));
+	} else if (o->nctlq > 0) {
+		n = mididev_evout(o, &o->ctlq[0]);
+		o->nctlq--;
+		memmove(o->ctlq, o->ctlq + 1, o->nctlq * sizeof(struct ev));
+	} else if (o->oxused > 0) {
+		n = o->oxused;
+		mididev_rawout(o, o->oxbuf, n);
+		o->oxused = 0;
+	} else
+		return 0;
+	mididev_ocharge(o, n);
+	return 1;
+}
+
+/*
+ * send queued messages as long as the modeled link is not busy for
+ * more than MIDIDEV_OWIN, and schedule the sending of the remaining
+ * ones. If 'force' is set, send everything now
+ */
+static void
+mididev_odrain(struct mididev *o, int force)
+{
+	unsigned long long delta;
+
+	mididev_ocharge(o, 0);
+	for (;;) {
+		if (!force && o->orate != 0 && o->oload >= MIDIDEV_OWIN)
+			break;
+		if (!mididev_osendone(o))
+			break;
+	}
+	if (o->nnoteq > 0 || o->nctlq > 0 || o->oxused > 0) {
+		if (!o->orateto.set) {
+			delta = o->oload - MIDIDEV_OWIN + 1;
+			timo_add(&o->orateto, delta < ~0U ? delta : ~0U);
+		}
+	} else if (o->orateto.set)
+		timo_del(&o->orateto);
 	if (o->sync)
 		mididev_flush(o);
 }
 
+/*
+ * called when the modeled link becomes free, send pending messages
+ */
+void
+mididev_oratecb(void *addr)
+{
+	struct mididev *o = (struct mididev *)addr;
+
+	mididev_odrain(o, 0);
+	mididev_flush(o);
+}
+
+/*
+ * add an event to the note queue, if it's full send messages to free
+ * an entry
+ */
+static void
+mididev_onoteq(struct mididev *o, struct ev *ev)
+{
+	while (o->nnoteq == MIDIDEV_NQEV)
+		mididev_osendone(o);
+	o->noteq[o->nnoteq++] = *ev;
+}
+
+/*
+ * queue a voice event for sending. Notes and program changes are sent
+ * first, and the controllers of their channel that were queued before
+ * them are moved to the note queue, so that the order of the messages
+ * of a channel is preserved. Continuous controllers not sent yet are
+ * replaced by the next value.
+ */
+static void
+mididev_oenq(struct mididev *o, struct ev *ev)
+{
+	struct ev *q;
+	unsigned i, j;
+
+	/*
+	 * raw data is sent after the voice events queued before it, so
+	 * flush it before queueing a newer event that would overtake it
+	 */
+	while (o->oxused > 0)
+		mididev_osendone(o);
+
+	if (ev->cmd == EV_NON || ev->cmd == EV_NOFF || ev->cmd == EV_PC) {
+		for (i = 0, j = 0; i < o->nctlq; i++) {
+			if (o->ctlq[i].ch == ev->ch)
+				mididev_onoteq(o, &o->ctlq[i]);
+			else
+				o->ctlq[j++] = o->ctlq[i];
+		}
+		o->nctlq = j;
+		mididev_onoteq(o, ev);
+		return;
+	}
+	if (mididev_iscont(o, ev)) {
+		for (i = o->nctlq; i-- > 0; ) {
+			q = &o->ctlq[i];
+			if (q->ch != ev->ch)
+				continue;
+			if (q->cmd == ev->cmd && (ev->cmd == EV_BEND ||
+			    ev->cmd == EV_CAT || q->v0 == ev->v0)) {
+				*q = *ev;
+				return;
+			}
+			if (!mididev_iscont(o, q))
+				break;
+		}
+	}
+	while (o->nctlq == MIDIDEV_NQEV)
+		mididev_osendone(o);
+	o->ctlq[o->nctlq++] = *ev;
+}
+
+/*
+ * convert a voice event to byte stream and queue
+ * it for sending
+ */
+void
+mididev_putev(struct mididev *o, struct ev *ev)
+{
+	unsigned char buf[EV_PATSIZE], *p;
+	unsigned n;
+
+	if (EV_ISSX(ev)) {
+		p = evinfo[ev->cmd].pattern;
+		for (n = 0; n < EV_PATSIZE; n++, p++) {
+			switch (*p) {
+			case EV_PATV0_HI:
+				buf[n] = ev->v0 >> 7;
+				break;
+			case EV_PATV0_LO:
+				buf[n] = ev->v0 & 0x7f;
+				break;
+			case EV_PATV1_HI:
+				buf[n] = ev->v1 >> 7;
+				break;
+			case EV_PATV1_LO:
+				buf[n] = ev->v1 & 0x7f;
+				break;
+			default:
+				buf[n] = *p;
+			}
+			if (*p == 0xf7) {
+				n++;
+				break;
+			}
+		}
+		mididev_sendraw(o, buf, n);
+		return;
+	}
+	if (!EV_ISVOICE(ev)) {
+		return;
+	}
+	if (o->onodup && !mididev_shadowchg(o, ev))
+		return;
+	if (o->orate) {
+		mididev_oenq(o, ev);
+		mididev_odrain(o, 0);
+		return;
+	}
+	mididev_evout(o, ev);
+	if (o->sync)
+		mididev_flush(o);
+}
+
+/*
+ * queue raw data for sending
+ */
+void
+mididev_sendraw(struct mididev *o, unsigned char *buf, unsigned len)
+{
+	if (!(o->mode & MIDIDEV_MODE_OUT)) {
+		return;
+	}
+
+	/*
+	 * raw data (ex. sysex) may change anything
+	 */
+	if (o->onodup)
+		mididev_shadowreset(o);
+
+	/*
+	 * if the output rate is limited, raw data is sent after the
+	 * queued voice events. If it doesn't fit in the queue, send
+	 * everything now
+	 */
+	if (o->orate) {
+		if (o->oxused + len > MIDIDEV_BUFLEN) {
+			mididev_odrain(o, 1);
+			mididev_rawout(o, buf, len);
+			mididev_ocharge(o, len);
+		} else {
+			memcpy(o->oxbuf + o->oxused, buf, len);
+			o->oxused += len;
+		}
+		mididev_odrain(o, 0);
+		return;
+	}
+	mididev_rawout(o, buf, len);
+	if (o->sync)
+		mididev_flush(o);
+}
+
+/*
+ * set the maximum output rate in bytes per second, 0 means no limit.
+ * Queued messages are sent immediately
+ */
+void
+mididev_setrate(struct mididev *o, unsigned rate)
+{
+	mididev_odrain(o, 1);
+	o->orate = rate;
+	o->oload = 0;
+	o->otime = timo_abstime;
+}
+
+/*
+ * delay the output of each device by the difference between the
+ * largest latency and its own latency, so all devices sound at the
+ * same time
+ */
+static void
+mididev_compupdate(void)
+{
+	struct mididev *i;
+	unsigned max;
+
+	max = 0;
+	for (i = mididev_list; i != NULL; i = i->next) {
+		if ((i->mode & MIDIDEV_MODE_OUT) && i->olatency > max)
+			max = i->olatency;
+	}
+	for (i = mididev_list; i != NULL; i = i->next)
+		i->ocomp = max - i->olatency;
+}
+
+/*
+ * set the latency of the device to compensate, in 24th of
+ * microseconds
+ */
+void
+mididev_setlatency(struct mididev *o, unsigned latency)
+{
+	o->olatency = latency;
+	mididev_compupdate();
+}
+
 /*
  * initialize the device table
  */
@@ -592,7 +1446,10 @@ void
 mididev_listinit(void)
 {
 	unsigned i;
-	for (i = 0; i < DEFAULT_MAXNDEVS; i++) {
+
+	mididev_byunit = xmalloc(ev_ndevs * sizeof(struct mididev *),
+	    "mididev_byunit");
+	for (i = 0; i < ev_ndevs; i++) {
 		mididev_byunit[i] = NULL;
 	}
 	mididev_list = NULL;
@@ -609,13 +1466,14 @@ mididev_listdone(void)
 	unsigned i;
 	struct mididev *dev;
 
-	for (i = 0; i < DEFAULT_MAXNDEVS; i++) {
+	for (i = 0; i < ev_ndevs; i++) {
 		dev = mididev_byunit[i];
 		if (dev != NULL) {
 			dev->ops->del(dev);
 			mididev_byunit[i] = NULL;
 		}
 	}
+	xfree(mididev_byunit);
 	mididev_clksrc = NULL;
 	mididev_list = NULL;
 }
@@ -628,7 +1486,7 @@ mididev_attach(unsigned unit, char *path, unsigned mode)
 {
 	struct mididev *dev;
 
-	if (unit >= DEFAULT_MAXNDEVS) {
+	if (unit >= ev_ndevs) {
 		logx(1, "given unit is too large");
 		return 0;
 	}
@@ -636,19 +1494,24 @@ mididev_attach(unsigned unit, char *path, unsigned mode)
 		logx(1, "device already exists");
 		return 0;
 	}
+	if (path != NULL && strncmp(path, "udp:", 4) == 0) {
+		dev = udp_new(path + 4, mode);
+	} else {
 #if defined(USE_SNDIO)
-	dev = sndio_new(path, mode);
+		dev = sndio_new(path, mode);
 #elif defined(USE_ALSA)
-	dev = alsa_new(path, mode);
+		dev = alsa_new(path, mode);
 #else
-	dev = raw_new(path, mode);
+		dev = raw_new(path, mode);
 #endif
+	}
 	if (dev == NULL)
 		return 0;
 	dev->next = mididev_list;
 	mididev_list = dev;
 	mididev_byunit[unit] = dev;
 	dev->unit = unit;
+	mididev_compupdate();
 	return 1;
 }
 
@@ -660,7 +1523,7 @@ mididev_detach(unsigned unit)
 {
 	struct mididev **i, *dev;
 
-	if (unit >= DEFAULT_MAXNDEVS || mididev_byunit[unit] == NULL) {
+	if (unit >= ev_ndevs || mididev_byunit[unit] == NULL) {
 		logx(1, "no such device");
 		return 0;
 	}
@@ -677,6 +1540,7 @@ mididev_detach(unsigned unit)
 			*i = dev->next;
 			dev->ops->del(dev);
 			mididev_byunit[unit] = NULL;
+			mididev_compupdate();
 			return 1;
 		}
 	}
@@ -17,6 +17,9 @@
 #ifndef MIDISH_MIDIDEV_H
 #define MIDISH_MIDIDEV_H
 
+#include "ev.h"
+#include "timo.h"
+
 /*
  * timeouts for active sensing
  * (as usual units are 24th of microsecond)
@@ -34,10 +37,26 @@
  * device output buffer length in bytes
  */
 #define MIDIDEV_BUFLEN	0x400
+#define MIDIDEV_OQLEN	0x1000
+
+/*
+ * size in bytes and in blocks of the delay line used for latency
+ * compensation
+ */
+#define MIDIDEV_DQLEN	0x1000
+#define MIDIDEV_DQNBLK	256
+
+/*
+ * if the output rate is limited, max number of queued events of each
+ * kind, and max time the data sent but not transmitted yet may take
+ * on the wire
+ */
+#define MIDIDEV_NQEV	128
+#define MIDIDEV_OWIN	(2 * 24 * 1000)
 
 struct pollfd;
 struct mididev;
-struct ev;
+struct textout;
 
 struct devops {
 	/*
@@ -77,6 +96,10 @@ struct devops {
 	 * free the mididev structure and associated resources
 	 */
 	void (*del)(struct mididev *);
+	/*
+	 * print link statistics, NULL if there are none
+	 */
+	void (*stat)(struct mididev *, struct textout *);
 };
 
 /*
@@ -91,7 +114,7 @@ struct mtc {
 #define MTC_START	1		/* got a full frame but no tick yet */
 #define MTC_RUN		2		/* got at least 1 tick */
 	unsigned state;			/* one of above */
-	unsigned timo;
+	struct timo timo;		/* to detect when MTC stops */
 };
 
 struct mididev {
@@ -102,6 +125,7 @@ struct mididev {
 	 */
 	struct pollfd *pfd;
 	struct mididev *next;
+	struct mididev *onext, **oprev;	/* list of devices to flush */
 
 	/*
 	 * device settings
@@ -109,14 +133,20 @@ struct mididev {
 	unsigned unit;			/* index in the mididev table */
 	unsigned ticrate, ticdelta;	/* tick rate (default 96) */
 	unsigned sendclk;		/* send MIDI clock */
+	unsigned clkpll;		/* smooth received clock with a PLL */
 	unsigned sendmmc;		/* send MMC start/stop/relocate */
-	unsigned isensto, osensto;	/* active sensing timeouts */
+	struct timo isensto, osensto;	/* active sensing timeouts */
 	unsigned mode;			/* read, write */
 	unsigned ixctlset, oxctlset;	/* bitmap of 14bit controllers */
 	unsigned ievset, oevset;	/* bitmap of CONV_{XPC,NRPN,RPN} */
 	unsigned eof;			/* i/o error pending */
 	unsigned runst;			/* use running status for output */
 	unsigned sync;			/* flush buffer after each message */
+	unsigned odelay;		/* output scheduling delay, if supported */
+	unsigned olatency;		/* latency of the device to compensate */
+	unsigned onodup;		/* drop events not changing anything */
+	unsigned icoalesce;		/* coalesce input controller values */
+	unsigned orate;			/* max output bytes per second */
 
 	/*
 	 * midi events parser state
@@ -129,33 +159,86 @@ struct mididev {
 	unsigned 	  oused;		/* bytes in obuf */
 	unsigned	  ostatus;		/* output running status */
 	unsigned char	  obuf[MIDIDEV_BUFLEN];	/* output buffer */
+
+	/*
+	 * last values sent, if 'onodup' is set, or MIDIDEV_NOVAL
+	 */
+#define MIDIDEV_NOVAL	0xffff
+	unsigned short	  octl[16][128];	/* controller values */
+	unsigned short	  obend[16];		/* pitch bend values */
+	unsigned short	  ocat[16];		/* channel aftertouch values */
+
+	/*
+	 * output queues, used only if 'orate' is set: messages wait
+	 * there until the link has time to transmit them
+	 */
+	struct timo	  orateto;		/* to send queued messages */
+	unsigned long long oload;		/* time to transmit data sent */
+	unsigned	  otime;		/* time 'oload' was updated */
+	unsigned	  nnoteq, nctlq, oxused;
+	struct ev	  noteq[MIDIDEV_NQEV];	/* notes, program changes */
+	struct ev	  ctlq[MIDIDEV_NQEV];	/* controllers, bend, aftertouch */
+	unsigned char	  oxbuf[MIDIDEV_BUFLEN];	/* sysex, raw data */
+
+	/*
+	 * data the device didn't accept yet, written when it becomes
+	 * writable. Blocks that don't fit are dropped and counted
+	 */
+	struct pollfd	 *opfd;			/* if polled for output */
+	unsigned	  oqstart, oqused;
+	unsigned long	  noverrun;		/* bytes dropped */
+	unsigned	  oinsysex;		/* sent data ends in a sysex */
+	unsigned char	  oq[MIDIDEV_OQLEN];
+
+	/*
+	 * delay line: output of devices with less latency than the
+	 * others is delayed by 'ocomp', so all devices sound at the
+	 * same time. Data is stored in blocks written at the same time
+	 */
+	unsigned	  ocomp;		/* delay added to the output */
+	struct timo	  dqto;			/* to write the next block */
+	unsigned	  dqstart, dqused;	/* bytes in dq[] */
+	unsigned	  dqfirst, dqnblk;	/* blocks in dqblk[] */
+	struct mididev_dqblk {
+		unsigned time;			/* when to write it */
+		unsigned len;			/* bytes in the block */
+	} dqblk[MIDIDEV_DQNBLK];
+	unsigned char	  dq[MIDIDEV_DQLEN];
 };
 
 void mididev_init(struct mididev *, struct devops *, unsigned);
 void mididev_done(struct mididev *);
 void mididev_flush(struct mididev *);
+void mididev_shadowreset(struct mididev *);
+void mididev_flushall(void);
+void mididev_oqdrain(struct mididev *);
 void mididev_putstart(struct mididev *);
 void mididev_putstop(struct mididev *);
 void mididev_puttic(struct mididev *);
 void mididev_putack(struct mididev *);
 void mididev_putev(struct mididev *, struct ev *);
+unsigned mididev_evsize(struct mididev *, struct ev *, unsigned *);
 void mididev_sendraw(struct mididev *, unsigned char *, unsigned);
+void mididev_setrate(struct mididev *, unsigned);
+void mididev_setlatency(struct mididev *, unsigned);
 void mididev_open(struct mididev *);
 void mididev_close(struct mididev *);
 void mididev_inputcb(struct mididev *, unsigned char *, unsigned);
-
-void mtc_timo(struct mtc *); /* XXX, use timeouts */
+void mididev_isensreset(struct mididev *);
 
 extern unsigned mididev_debug;
 
 extern struct mididev *mididev_list;
+extern struct mididev *mididev_olist;
+extern unsigned mididev_nbytes, mididev_nwrites;
 extern struct mididev *mididev_clksrc;
 extern struct mididev *mididev_mtcsrc;
-extern struct mididev *mididev_byunit[];
+extern struct mididev **mididev_byunit;
 
 struct mididev *raw_new(char *, unsigned);
 struct mididev *alsa_new(char *, unsigned);
 struct mididev *sndio_new(char *, unsigned);
+struct mididev *udp_new(char *, unsigned);
 
 void mididev_listinit(void);
 void mididev_listdone(void);
@@ -30,6 +30,12 @@
  * realtime while a track using the same controller is playing (input
  * ID is zero, and has precedence over tracks).
  *
+ * States of notes, controllers, bender, aftertouch and program
+ * changes are indexed by a table of slots, one per (dev, ch, cmd,
+ * note/ctl), allocated per channel on first use. Slots whose state
+ * may be purged are on the expiry list, so the timeout doesn't walk
+ * all states. States of other events (NRPN, RPN, sysex patterns) are
+ * few, they are kept in a separate list which is walked.
  */
 
 #include "utils.h"
@@ -39,20 +45,47 @@
 #include "mux.h"
 #include "timo.h"
 #include "state.h"
+#include "trace.h"
 
 #define MIXOUT_TIMO (1000000UL)
 #define MIXOUT_MAXTICS 24
 
+/*
+ * slots of a channel: notes, controllers, then bender, channel
+ * aftertouch and program change
+ */
+#define MIXOUT_SLOT_CTL		128
+#define MIXOUT_SLOT_BEND	256
+#define MIXOUT_SLOT_CAT		257
+#define MIXOUT_SLOT_XPC		258
+#define MIXOUT_NSLOTS		259
+
+struct mixout_slot {
+	struct state *st;			/* first matching state */
+	struct mixout_slot *enext, **eprev;	/* expiry list */
+};
+
 void mixout_timocb(void *);
 
-struct statelist mixout_slist;
+struct statelist mixout_slist;		/* states indexed by slots */
+struct statelist mixout_xlist;		/* other states */
+struct mixout_slot **mixout_chans;	/* slots of each (dev, ch) */
+struct mixout_slot *mixout_elist;	/* slots with states to purge */
 struct timo mixout_timo;
 unsigned mixout_debug = 0;
 
 void
 mixout_start(void)
 {
+	unsigned i;
+
 	statelist_init(&mixout_slist);
+	statelist_init(&mixout_xlist);
+	mixout_chans = xmalloc(ev_ndevs * 16 * sizeof(struct mixout_slot *),
+	    "mixout_chans");
+	for (i = 0; i < ev_ndevs * 16; i++)
+		mixout_chans[i] = NULL;
+	mixout_elist = NULL;
 	timo_set(&mixout_timo, mixout_timocb, NULL);
 	timo_add(&mixout_timo, MIXOUT_TIMO);
 	if (mixout_debug)
@@ -62,23 +95,114 @@ mixout_start(void)
 void
 mixout_stop(void)
 {
+	unsigned i;
+
 	if (mixout_debug)
 		logx(1, "%s", __func__);
 
 	timo_del(&mixout_timo);
 	statelist_done(&mixout_slist);
+	statelist_done(&mixout_xlist);
+	for (i = 0; i < ev_ndevs * 16; i++) {
+		if (mixout_chans[i])
+			xfree(mixout_chans[i]);
+	}
+	xfree(mixout_chans);
+}
+
+/*
+ * return the slot of the given event, allocating the slots of its
+ * channel if needed, or NULL if the event is not indexed
+ */
+static struct mixout_slot *
+mixout_getslot(struct ev *ev)
+{
+	struct mixout_slot **chan, *s;
+	unsigned i;
+
+	switch (ev->cmd) {
+	case EV_NON:
+	case EV_NOFF:
+	case EV_KAT:
+		i = ev->note_num;
+		break;
+	case EV_XCTL:
+		i = MIXOUT_SLOT_CTL + ev->ctl_num;
+		break;
+	case EV_BEND:
+		i = MIXOUT_SLOT_BEND;
+		break;
+	case EV_CAT:
+		i = MIXOUT_SLOT_CAT;
+		break;
+	case EV_XPC:
+		i = MIXOUT_SLOT_XPC;
+		break;
+	default:
+		return NULL;
+	}
+	if (ev->dev >= ev_ndevs)
+		return NULL;
+	chan = &mixout_chans[ev->dev * 16 + ev->ch];
+	if (*chan == NULL) {
+		*chan = xmalloc(MIXOUT_NSLOTS * sizeof(struct mixout_slot),
+		    "mixout_slot");
+		for (s = *chan; s != *chan + MIXOUT_NSLOTS; s++) {
+			s->st = NULL;
+			s->eprev = NULL;
+		}
+	}
+	return *chan + i;
+}
+
+/*
+ * put the slot on the expiry list if its state may be purged,
+ * remove it otherwise
+ */
+static void
+mixout_expchg(struct mixout_slot *s)
+{
+	if (s->st != NULL && (s->st->phase & EV_PHASE_LAST)) {
+		if (s->eprev != NULL)
+			return;
+		s->enext = mixout_elist;
+		if (s->enext)
+			s->enext->eprev = &s->enext;
+		s->eprev = &mixout_elist;
+		mixout_elist = s;
+	} else {
+		if (s->eprev == NULL)
+			return;
+		if (s->enext)
+			s->enext->eprev = s->eprev;
+		*s->eprev = s->enext;
+		s->eprev = NULL;
+	}
 }
 
 void
 mixout_putev(struct ev *ev, unsigned id)
 {
+	struct mixout_slot *slot;
+	struct statelist *list;
 	struct state *os;
 	struct ev ca;
 
 	if (mixout_debug >= 3)
 		logx(1, "%s: {ev:%p} (%u)", __func__, ev, id);
+	if (trace_on) {
+		trace_put(TRACE_MIXOUT_PUTEV, TRACE_MARK,
+		    ev->cmd, ev->dev, ev->ch, ev->v0);
+	}
 
-	os = statelist_lookup(&mixout_slist, ev);
+	slot = mixout_getslot(ev);
+	if (slot != NULL) {
+		list = &mixout_slist;
+		os = slot->st;
+	} else {
+		list = &mixout_xlist;
+		os = statelist_lookup(list, ev);
+	}
 	if (os != NULL && os->tag != id) {
 		if (os->tag < id) {
 			if (mixout_debug) {
@@ -92,15 +216,19 @@ mixout_putev(struct ev *ev, unsigned id)
 				logx(1, "%s: {ev:%p} (%d): will kick older {ev:%p} (%d)",
 				    __func__, ev, id, &os->ev, os->tag);
 			}
-			statelist_update(&mixout_slist, &ca);
+			statelist_update(list, &ca);
 			mux_putev(&ca);
 		}
 		if (mixout_debug)
 			logx(1, "%s: {ev:%p}: won", __func__, ev);
 	}
-	os = statelist_update(&mixout_slist, ev);
+	os = statelist_update(list, ev);
 	os->tag = id;
 	os->tic = 0;
+	if (slot != NULL) {
+		slot->st = os;
+		mixout_expchg(slot);
+	}
 	if ((os->flags & (STATE_BOGUS | STATE_NESTED)) == 0)
 		mux_putev(ev);
 	else {
@@ -109,30 +237,54 @@ mixout_putev(struct ev *ev, unsigned id)
 	}
 }
 
+/*
+ * return true if the given state is no more used and may be purged,
+ * else age it
+ */
+static int
+mixout_expired(struct state *i)
+{
+	if (i->phase == EV_PHASE_LAST)
+		return 1;
+	if (i->phase == (EV_PHASE_FIRST | EV_PHASE_LAST)) {
+		if (i->tic >= MIXOUT_MAXTICS) {
+			if (mixout_debug >= 2)
+				logx(1, "%s: {state:%p}: timed out", __func__, i);
+			return 1;
+		}
+		i->flags &= ~STATE_CHANGED;
+		i->tic++;
+	}
+	return 0;
+}
+
 void
 mixout_timocb(void *addr)
 {
+	struct mixout_slot *s, *snext;
 	struct state *i, *inext;
+	struct ev ev;
 
-	for (i = mixout_slist.first; i != NULL; i = inext) {
+	/*
+	 * purge states that are no more used, if a nested frame is
+	 * purged, the slot gets the state of the enclosing one
+	 */
+	for (s = mixout_elist; s != NULL; s = snext) {
+		snext = s->enext;
+		i = s->st;
+		if (!mixout_expired(i))
+			continue;
+		ev = i->ev;
+		statelist_rm(&mixout_slist, i);
+		state_del(i);
+		s->st = statelist_lookup(&mixout_slist, &ev);
+		mixout_expchg(s);
+	}
+	for (i = mixout_xlist.first; i != NULL; i = inext) {
 		inext = i->next;
-		/*
-		 * purge states that are no more used
-		 */
-		if (i->phase == EV_PHASE_LAST) {
-			statelist_rm(&mixout_slist, i);
+		if (mixout_expired(i)) {
+			statelist_rm(&mixout_xlist, i);
 			state_del(i);
-		} else if (i->phase == (EV_PHASE_FIRST | EV_PHASE_LAST)) {
-			if (i->tic >= MIXOUT_MAXTICS) {
-				if (mixout_debug >= 2)
-					logx(1, "%s: {state:%p}: timed out", __func__, i);
-
-				statelist_rm(&mixout_slist, i);
-				state_del(i);
-			} else {
-				i->flags &= ~STATE_CHANGED;
-				i->tic++;
-			}
 		}
 	}
 	timo_add(&mixout_timo, MIXOUT_TIMO);
@@ -70,6 +70,7 @@
 
 #include "norm.h"
 #include "mixout.h"
+#include "trace.h"
 
 /*
  * MUX_START_DELAY:
@@ -79,6 +80,14 @@
  */
 #define MUX_START_DELAY	  (24000000UL / 3)
 
+/*
+ * loop gains of the external clock PLL: on each received tick the
+ * phase error is corrected by 1/MUX_PLL_KP and the tick length by
+ * 1/MUX_PLL_KI of the error
+ */
+#define MUX_PLL_KP	8
+#define MUX_PLL_KI	64
+
 unsigned mux_isopen = 0;
 unsigned mux_debug = 0;
 unsigned mux_ticrate;
@@ -89,7 +98,47 @@ unsigned mux_manualstart = 1;
 void *mux_addr;
 unsigned long mux_wallclock;
 
-struct statelist mux_istate, mux_ostate;
+/*
+ * time elapsed since the ideal time of the tick being processed, or 0
+ * when not processing a tick. Used by devices that schedule output
+ */
+unsigned long mux_late;
+
+/*
+ * if non-zero, mux_flush() does nothing, so that output caused by a
+ * block of input is written with a single flush at the end
+ */
+unsigned mux_flushdefer;
+
+/*
+ * if non-zero, devices are not used: the clock is driven by
+ * song_render() as fast as possible, and output events are passed
+ * to song_rendercb() instead of being sent
+ */
+unsigned mux_offline;
+
+struct conv mux_istate, mux_ostate;
+
+/*
+ * tick lateness (against the ideal tick time) and tick processing
+ * time (from the tick to the end of the output flush)
+ */
+struct muxhist mux_latehist, mux_prochist, mux_clkhist;
+
+/*
+ * external clock PLL state. If the clock source has 'clkpll' set,
+ * received ticks only update the estimated tick length and phase
+ * error, and our ticks are generated by the timer, as for the
+ * internal clock. 'mux_pllacc' is the master position minus ours,
+ * in units of 1 / (mux_ticrate * ticrate of the source) whole notes
+ */
+#define MUX_PLL_OFF	0		/* no tick received yet */
+#define MUX_PLL_WAIT	1		/* got first tick */
+#define MUX_PLL_LOCK	2		/* ticks generated by the PLL */
+unsigned mux_pllstate;
+unsigned long mux_plllast;
+long mux_pllacc;
+unsigned long long mux_plllen;	/* tick length, x256 */
 
 const char *mux_phasestr[] = {"STARTWAIT", "START", "FIRST", "NEXT", "STOP"};
 
@@ -101,6 +150,7 @@ void mux_mdep_close(void);
 
 void mux_sendstop(void);
 void mux_chgphase(unsigned phase);
+void mux_plltick(unsigned long);
 
 /*
  * initialize all structures and open all midi devices
@@ -111,8 +161,8 @@ mux_open(void)
 	struct mididev *i;
 
 	timo_init();
-	statelist_init(&mux_istate);
-	statelist_init(&mux_ostate);
+	conv_init(&mux_istate);
+	conv_init(&mux_ostate);
 	mixout_start();
 	norm_start();
 
@@ -133,17 +183,18 @@ mux_open(void)
 	mux_isopen = 1;
 	for (i = mididev_list; i != NULL; i = i->next) {
 		i->ticdelta = i->ticrate;
-		i->isensto = 0;
-		i->osensto = MIDIDEV_OSENSTO;
-		mididev_open(i);
+		if (!mux_offline)
+			mididev_open(i);
 	}
-	mux_mdep_open();
+	if (!mux_offline)
+		mux_mdep_open();
 
 	mux_curpos = 0;
 	mux_nextpos = 0;
 	mux_reqphase = MUX_STOP;
 	mux_phase = MUX_STOP;
 	mux_wallclock = 0;
+	mux_pllstate = MUX_PLL_OFF;
 	log_sync = 0;
 }
 
@@ -159,20 +210,52 @@ mux_close(void)
 	norm_stop();
 	mixout_stop();
 	mux_flush();
-	for (i = mididev_list; i != NULL; i = i->next) {
-		if (i->isysex) {
-			logx(1, "lost incomplete sysex");
-			sysex_del(i->isysex);
+	if (!mux_offline) {
+		for (i = mididev_list; i != NULL; i = i->next) {
+			if (i->isysex) {
+				logx(1, "lost incomplete sysex");
+				sysex_del(i->isysex);
+			}
+			mididev_close(i);
 		}
-		mididev_close(i);
+		mux_mdep_close();
 	}
-	mux_mdep_close();
 	mux_isopen = 0;
-	statelist_done(&mux_ostate);
-	statelist_done(&mux_istate);
+	conv_done(&mux_ostate);
+	conv_done(&mux_istate);
 	timo_done();
 }
 
+/*
+ * clear the given histogram
+ */
+void
+muxhist_reset(struct muxhist *h)
+{
+	unsigned i;
+
+	for (i = 0; i < MUX_NHIST; i++)
+		h->cnt[i] = 0;
+	h->n = 0;
+	h->max = 0;
+}
+
+/*
+ * add the given duration (in microseconds) to the histogram
+ */
+void
+muxhist_add(struct muxhist *h, unsigned usec)
+{
+	unsigned i;
+
+	for (i = 0; i < MUX_NHIST - 1 && (usec >> i) != 0; i++)
+		; /* nothing */
+	h->cnt[i]++;
+	h->n++;
+	if (h->max < usec)
+		h->max = usec;
+}
+
 /*
  * change the current phase
  */
@@ -194,6 +277,9 @@ mux_sendtic(void)
 {
 	struct mididev *i;
 
+	if (mux_offline)
+		return;
+
 	for (i = mididev_list; i != NULL; i = i->next) {
 		if (i->sendclk && i != mididev_clksrc) {
 			while (i->ticdelta >= mux_ticrate) {
@@ -213,6 +299,9 @@ mux_sendstart(void)
 {
 	struct mididev *i;
 
+	if (mux_offline)
+		return;
+
 	for (i = mididev_list; i != NULL; i = i->next) {
 		if (i->sendclk && i != mididev_clksrc) {
 			i->ticdelta = i->ticrate;
@@ -235,6 +324,9 @@ mux_sendstop(void)
 {
 	struct mididev *i;
 
+	if (mux_offline)
+		return;
+
 	for (i = mididev_list; i != NULL; i = i->next) {
 		if (i->sendclk && i != mididev_clksrc) {
 			mididev_putstop(i);
@@ -265,10 +357,14 @@ mux_putev(struct ev *ev)
 		panic();
 	}
 	unit = ev->dev;
-	if (unit >= DEFAULT_MAXNDEVS) {
+	if (unit >= ev_ndevs) {
 		logx(0, "%s: {ev:%p}: bad dev number", __func__, ev);
 		panic();
 	}
+	if (mux_offline) {
+		song_rendercb(usong, ev);
+		return;
+	}
 	dev = mididev_byunit[unit];
 	if (dev != NULL) {
 		nev = conv_unpackev(&mux_ostate,
@@ -288,10 +384,10 @@ mux_sendraw(unsigned unit, unsigned char *buf, unsigned len)
 {
 	struct mididev *dev;
 
-	if (unit >= DEFAULT_MAXNDEVS) {
+	if (unit >= ev_ndevs) {
 		return;
 	}
-	if (len == 0) {
+	if (len == 0 || mux_offline) {
 		return;
 	}
 	dev = mididev_byunit[unit];
@@ -356,6 +452,7 @@ mux_mtctick(unsigned delta)
 	mux_curpos += delta;
 
 	while (mux_curpos >= mux_nextpos) {
+		muxhist_add(&mux_latehist, (mux_curpos - mux_nextpos) / 24);
 		mux_curpos -= mux_nextpos;
 		mux_nextpos = mux_ticlength;
 
@@ -363,9 +460,12 @@ mux_mtctick(unsigned delta)
 		 * if in manual mode, dont trigger the 0-th tick (ie
 		 * the start signal).
 		 */
-		if (!mux_manualstart || mux_phase != MUX_START)
+		if (!mux_manualstart || mux_phase != MUX_START) {
+			mux_late = mux_curpos;
 			mux_ticcb();
+		}
 	}
+	mux_late = 0;
 }
 
 /*
@@ -394,49 +494,25 @@ mux_mtcstop(void)
 void
 mux_timercb(unsigned long delta)
 {
-	struct mididev *dev;
+	if (trace_on)
+		trace_put(TRACE_MUX_TIMERCB, TRACE_BEGIN, delta, 0, 0, 0);
 
 	/*
 	 * update wall clock
 	 */
 	mux_wallclock += delta;
 
-
 	/*
 	 * run expired timeouts
 	 */
 	timo_update(delta);
 
-	/*
-	 * handle timeouts not using the timo.c interface
-	 * XXX: convert this to timo_xxx() routines
-	 */
-	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		if (dev->isensto) {
-			if (dev->isensto <= delta) {
-				dev->isensto = 0;
-				logx(1, "%u: sensing timeout, disabled", dev->unit);
-			} else {
-				dev->isensto -= delta;
-			}
-		}
-		if (dev->osensto) {
-			if (dev->osensto <= delta) {
-				mididev_putack(dev);
-				mididev_flush(dev);
-				dev->osensto = MIDIDEV_OSENSTO;
-			} else {
-				dev->osensto -= delta;
-			}
-		}
-		if (dev->imtc.timo) {
-			if (dev->imtc.timo <= delta) {
-				dev->imtc.timo = 0;
-				mtc_timo(&dev->imtc);
-			} else {
-				dev->imtc.timo -= delta;
-			}
-		}
+	if (mux_pllstate == MUX_PLL_LOCK) {
+		if (mux_phase == MUX_FIRST || mux_phase == MUX_NEXT)
+			mux_plltick(delta);
+		if (trace_on)
+			trace_put(TRACE_MUX_TIMERCB, TRACE_END, 0, 0, 0, 0);
+		return;
 	}
 
 	/*
@@ -465,6 +541,158 @@ mux_timercb(unsigned long delta)
 			break;
 		}
 	}
+	if (trace_on)
+		trace_put(TRACE_MUX_TIMERCB, TRACE_END, 0, 0, 0, 0);
+}
+
+/*
+ * store in 'delta' the time until mux_timercb() must be called next,
+ * ie until the next internally generated tick or the next timeout.
+ * Return 0 if there's nothing to wait for
+ */
+int
+mux_nextdelta(unsigned long *delta)
+{
+	unsigned tdelta;
+	int ret = 0;
+
+	if ((!mididev_mtcsrc && !mididev_clksrc) ||
+	    mux_pllstate == MUX_PLL_LOCK) {
+		switch (mux_phase) {
+		case MUX_START:
+		case MUX_FIRST:
+		case MUX_NEXT:
+			*delta = (mux_curpos < mux_nextpos) ?
+			    mux_nextpos - mux_curpos : 0;
+			ret = 1;
+			break;
+		}
+	}
+	if (timo_next(&tdelta)) {
+		if (!ret || tdelta < *delta)
+			*delta = tdelta;
+		ret = 1;
+	}
+	return ret;
+}
+
+/*
+ * process one of our ticks
+ */
+static void
+mux_dotick(void)
+{
+	unsigned long long t0;
+
+	if (mux_phase == MUX_FIRST) {
+		mux_chgphase(MUX_NEXT);
+	} else if (mux_phase == MUX_START) {
+		mux_curpos = 0;
+		mux_nextpos = mux_ticlength;
+		mux_chgphase(MUX_FIRST);
+	}
+	if (mux_phase == MUX_NEXT) {
+		t0 = mux_mdep_nsec();
+		mux_curtic++;
+		mux_sendtic();
+		song_movecb(usong);
+		muxhist_add(&mux_prochist,
+		    (mux_mdep_nsec() - t0) / 1000);
+	} else if (mux_phase == MUX_FIRST) {
+		mux_curtic = 0;
+		mux_sendtic();
+		song_startcb(usong);
+	}
+}
+
+/*
+ * called periodically by the timer if the external clock is smoothed
+ * by the PLL, generate ticks at the estimated tick length
+ */
+void
+mux_plltick(unsigned long delta)
+{
+	struct mididev *src = mididev_clksrc;
+
+	mux_curpos += delta;
+	while (mux_curpos >= mux_nextpos) {
+		/*
+		 * if the master stopped sending ticks, don't run
+		 * more than 2 of its ticks ahead
+		 */
+		if (mux_pllacc - (long)src->ticrate < -2L * mux_ticrate) {
+			mux_curpos = mux_nextpos;
+			break;
+		}
+		muxhist_add(&mux_latehist, (mux_curpos - mux_nextpos) / 24);
+		mux_curpos -= mux_nextpos;
+		mux_nextpos = mux_plllen >> 8;
+		mux_pllacc -= src->ticrate;
+		mux_late = mux_curpos;
+		mux_dotick();
+	}
+	mux_late = 0;
+}
+
+/*
+ * called when a MIDI TICK is received from the clock source and the
+ * PLL is used. The first two ticks are processed as usual and give
+ * the initial tick length. Then, for each tick, the phase error
+ * between the master and our ticks is measured and used to correct
+ * the time of our next tick and our tick length
+ */
+static void
+mux_pllcb(void)
+{
+	struct mididev *src = mididev_clksrc;
+	unsigned long long len;
+	long err, adj;
+
+	if (mux_pllstate == MUX_PLL_OFF) {
+		if (mux_phase == MUX_FIRST || mux_phase == MUX_NEXT) {
+			mux_plllast = mux_wallclock;
+			mux_pllstate = MUX_PLL_WAIT;
+		}
+		return;
+	}
+	if (mux_pllstate == MUX_PLL_WAIT) {
+		len = (unsigned long long)(mux_wallclock - mux_plllast) *
+		    src->ticrate * 256 / mux_ticrate;
+		if (len < 256 * 24)
+			len = 256 * 24;
+		mux_plllen = len;
+		mux_pllacc = src->ticdelta - mux_ticrate;
+		mux_curpos = 0;
+		mux_nextpos = mux_plllen >> 8;
+		mux_pllstate = MUX_PLL_LOCK;
+		if (mux_debug)
+			logx(1, "%s: locked, tick = %llu", __func__, len >> 8);
+		return;
+	}
+	mux_pllacc += mux_ticrate;
+	err = (long long)mux_pllacc * (long long)(mux_plllen >> 8) /
+	    src->ticrate - (long long)mux_curpos;
+	muxhist_add(&mux_clkhist, (err < 0 ? -err : err) / 24);
+
+	/*
+	 * if the master is ahead, our ticks are too long
+	 */
+	len = mux_plllen - (long long)err * 256 * src->ticrate /
+	    ((long long)MUX_PLL_KI * mux_ticrate);
+	if ((long long)len < 256 * 24)
+		len = 256 * 24;
+	mux_plllen = len;
+
+	/*
+	 * move the next tick to absorb part of the phase error
+	 */
+	adj = err / MUX_PLL_KP;
+	if (adj > 0) {
+		mux_nextpos = (mux_nextpos - mux_curpos > adj) ?
+		    mux_nextpos - adj : mux_curpos;
+	} else
+		mux_nextpos -= adj;
+	mux_plltick(0);
 }
 
 /*
@@ -473,32 +701,29 @@ mux_timercb(unsigned long delta)
 void
 mux_ticcb(void)
 {
+	if (trace_on)
+		trace_put(TRACE_MUX_TICCB, TRACE_BEGIN, mux_phase, 0, 0, 0);
+	if (mux_pllstate == MUX_PLL_LOCK) {
+		mux_pllcb();
+		if (trace_on)
+			trace_put(TRACE_MUX_TICCB, TRACE_END, 0, 0, 0, 0);
+		return;
+	}
 	for (;;) {
 		if (mididev_clksrc != NULL &&
 		    mididev_clksrc->ticdelta < mididev_clksrc->ticrate) {
 			mididev_clksrc->ticdelta += mux_ticrate;
 			break;
 		}
-		if (mux_phase == MUX_FIRST) {
-			mux_chgphase(MUX_NEXT);
-		} else if (mux_phase == MUX_START) {
-			mux_curpos = 0;
-			mux_nextpos = mux_ticlength;
-			mux_chgphase(MUX_FIRST);
-		}
-		if (mux_phase == MUX_NEXT) {
-			mux_curtic++;
-			mux_sendtic();
-			song_movecb(usong);
-		} else if (mux_phase == MUX_FIRST) {
-			mux_curtic = 0;
-			mux_sendtic();
-			song_startcb(usong);
-		}
+		mux_dotick();
 		if (mididev_clksrc == NULL)
 			break;
 		mididev_clksrc->ticdelta -= mididev_clksrc->ticrate;
 	}
+	if (mididev_clksrc != NULL && mididev_clksrc->clkpll)
+		mux_pllcb();
+	if (trace_on)
+		trace_put(TRACE_MUX_TICCB, TRACE_END, 0, 0, 0, 0);
 }
 
 /*
@@ -523,6 +748,7 @@ mux_startcb(void)
 		mux_nextpos = mux_ticlength;
 		song_gotocb(usong, LOC_MTC, 0);
 	}
+	mux_pllstate = MUX_PLL_OFF;
 	mux_chgphase(MUX_START);
 	mux_sendstart();
 	mux_flush();
@@ -538,6 +764,7 @@ mux_stopcb(void)
 		logx(1, "%s: got stop", __func__);
 	if (mux_phase >= MUX_START && mux_phase <= MUX_NEXT)
 		mux_sendstop();
+	mux_pllstate = MUX_PLL_OFF;
 	mux_chgphase(mux_reqphase);
 	song_stopcb(usong);
 	mux_flush();
@@ -551,9 +778,9 @@ mux_ackcb(unsigned unit)
 {
 	struct mididev *dev = mididev_byunit[unit];
 
-	if (dev->isensto == 0) {
+	if (!dev->isensto.set) {
 		logx(1, "%u: sensing enabled", dev->unit);
-		dev->isensto = MIDIDEV_ISENSTO;
+		timo_add(&dev->isensto, MIDIDEV_ISENSTO);
 	}
 }
 
@@ -599,15 +826,14 @@ mux_sysexcb(unsigned unit, struct sysex *sysex)
 	struct ev ev;
 	unsigned cmd;
 
-	if (sysex->first != NULL &&
-	    sysex->first->next == NULL) {
-		data = sysex->first->data;
+	if (sysex->used > 0 && sysex->size == CHUNK_SIZE) {
+		data = sysex->data;
 
 		/*
 		 * discard real-time messages, that should not be
 		 * recorded
 		 */
-		if (sysex->first->used >= 6 &&
+		if (sysex->used >= 6 &&
 		    data[0] == 0xf0 &&
 		    data[1] == 0x7f &&
 		    data[3] == 1) {
@@ -655,18 +881,48 @@ mux_sysexcb(unsigned unit, struct sysex *sysex)
 }
 
 /*
- * flush all devices
+ * flush all devices having pending data
  */
 void
 mux_flush(void)
 {
-	struct mididev *dev;
+	unsigned nbytes, nwrites;
 
-	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		mididev_flush(dev);
+	if (mux_flushdefer || mux_offline)
+		return;
+	nbytes = mididev_nbytes;
+	nwrites = mididev_nwrites;
+	mididev_flushall();
+	if (mux_debug && mididev_nwrites != nwrites) {
+		logx(1, "%s: %u: %u bytes, %u writes", __func__,
+		    timo_abstime / 24, mididev_nbytes - nbytes,
+		    mididev_nwrites - nwrites);
 	}
 }
 
+/*
+ * called before processing the input of the devices that woke up
+ * poll(), so the output is written once all of it is processed
+ */
+void
+mux_inputstart(void)
+{
+	mux_flushdefer++;
+}
+
+/*
+ * called once the input of all devices is processed: pass coalesced
+ * events and write the output
+ */
+void
+mux_inputdone(void)
+{
+	mux_flushdefer--;
+	if (mux_isopen)
+		norm_inputdone();
+	mux_flush();
+}
+
 /*
  * return the current phase
  */
@@ -729,7 +985,7 @@ mux_startreq(int manualstart)
 	}
 
 	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		if (dev->sendmmc)
+		if (dev->sendmmc && !mux_offline)
 			mididev_sendraw(dev, mmc_start, sizeof(mmc_start));
 	}
 }
@@ -748,7 +1004,8 @@ mux_stopreq(void)
 		mux_stopcb();
 
 	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		if (dev->sendmmc)
+		mididev_shadowreset(dev);
+		if (dev->sendmmc && !mux_offline)
 			mididev_sendraw(dev, mmc_stop, sizeof(mmc_stop));
 	}
 }
@@ -780,7 +1037,7 @@ mux_gotoreq(unsigned mmcpos)
 	mmc_reloc[12] = 0xf7;
 
 	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		if (dev->sendmmc)
+		if (dev->sendmmc && !mux_offline)
 			mididev_sendraw(dev, mmc_reloc, sizeof(mmc_reloc));
 	}
 }
@@ -25,6 +25,19 @@
 
 #define MUX_LINESIZE		1024
 
+/*
+ * histogram of durations: the i-th bucket counts durations of less
+ * than 2^i microseconds (but not less than 2^(i-1)), the last bucket
+ * counts all longer durations
+ */
+#define MUX_NHIST		16
+
+struct muxhist {
+	unsigned cnt[MUX_NHIST];	/* number of samples per bucket */
+	unsigned n;			/* total number of samples */
+	unsigned max;			/* max duration (microseconds) */
+};
+
 struct ev;
 struct sysex;
 
@@ -44,12 +57,17 @@ extern struct song *usong;
 extern unsigned mux_isopen;
 extern unsigned mux_manualstart;
 extern unsigned long mux_wallclock;
+extern unsigned long mux_late;
+extern unsigned mux_flushdefer;
+extern unsigned mux_offline;
+extern struct muxhist mux_latehist, mux_prochist, mux_clkhist;
 
 void song_startcb(struct song *);
 void song_stopcb(struct song *);
 void song_movecb(struct song *);
 void song_evcb(struct song *, struct ev *);
 void song_sysexcb(struct song *, struct sysex *);
+void song_rendercb(struct song *, struct ev *);
 unsigned song_gotocb(struct song *, int, unsigned);
 
 struct norm;
@@ -67,6 +85,8 @@ void mux_close(void);
 void mux_run(void);
 void mux_sleep(unsigned);
 void mux_flush(void);
+void mux_inputstart(void);
+void mux_inputdone(void);
 void mux_shut(void);
 void mux_putev(struct ev *);
 void mux_sendraw(unsigned, unsigned char *, unsigned);
@@ -78,6 +98,10 @@ void mux_startreq(int);
 void mux_stopreq(void);
 void mux_gotoreq(unsigned);
 int mux_mdep_wait(int); /* XXX: hide this prototype */
+int mux_nextdelta(unsigned long *);
+unsigned long long mux_mdep_nsec(void);
+void mux_mdep_devchg(void);
+void muxhist_reset(struct muxhist *);
 
 /*
  * call-backs called by midi device drivers
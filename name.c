@@ -21,6 +21,8 @@
 #include "utils.h"
 #include "name.h"
 
+#define NAMEIDX_MINSIZE	16
+
 void
 name_init(struct name *o, char *name)
 {
@@ -146,8 +148,95 @@ name_lookup(struct name **first, char *str)
 	for (i = *first; i != NULL; i = i->next) {
 		if (i->str == NULL)
 			continue;
-		if (str_eq(i->str, str))
+		if (i->str[0] == str[0] && str_eq(i->str, str))
 			return i;
 	}
 	return 0;
 }
+
+/*
+ * return a hash of the given string, to index names in hash tables;
+ * the caller keeps the number of low bits it needs
+ */
+unsigned
+name_hash(char *str)
+{
+	unsigned h = 0;
+
+	while (*str != '\0')
+		h = h * 31 + (unsigned char)*str++;
+	return h ^ (h >> 16);
+}
+
+/*
+ * initialize an empty index, large enough to store the given number
+ * of names without being resized
+ */
+void
+nameidx_init(struct nameidx *o, unsigned n)
+{
+	unsigned i, size;
+
+	for (size = NAMEIDX_MINSIZE; size < 2 * n; size *= 2)
+		; /* nothing */
+	o->tab = xmalloc(size * sizeof(struct name *), "nameidx");
+	for (i = 0; i < size; i++)
+		o->tab[i] = NULL;
+	o->mask = size - 1;
+	o->n = 0;
+}
+
+void
+nameidx_done(struct nameidx *o)
+{
+	xfree(o->tab);
+}
+
+/*
+ * add a name to the index. If there's already a name with the same
+ * string, the first one is kept so lookups return the same names as
+ * name_lookup() on the list
+ */
+void
+nameidx_add(struct nameidx *o, struct name *v)
+{
+	struct name **oldtab;
+	unsigned i, oldmask;
+
+	if (2 * (o->n + 1) > o->mask + 1) {
+		oldtab = o->tab;
+		oldmask = o->mask;
+		nameidx_init(o, o->n + 1);
+		for (i = 0; i <= oldmask; i++) {
+			if (oldtab[i] != NULL)
+				nameidx_add(o, oldtab[i]);
+		}
+		xfree(oldtab);
+	}
+	for (i = name_hash(v->str) & o->mask;
+	     o->tab[i] != NULL;
+	     i = (i + 1) & o->mask) {
+		if (str_eq(o->tab[i]->str, v->str))
+			return;
+	}
+	o->tab[i] = v;
+	o->n++;
+}
+
+/*
+ * return the name with the given string or NULL if not found
+ */
+struct name *
+nameidx_lookup(struct nameidx *o, char *str)
+{
+	struct name *v;
+	unsigned i;
+
+	for (i = name_hash(str) & o->mask;
+	     (v = o->tab[i]) != NULL;
+	     i = (i + 1) & o->mask) {
+		if (str_eq(v->str, str))
+			return v;
+	}
+	return NULL;
+}
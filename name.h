@@ -29,6 +29,16 @@ struct name {
 	struct name *next;
 };
 
+/*
+ * hash index of names, as an open addressing table; it doesn't own
+ * the names it points to
+ */
+struct nameidx {
+	struct name **tab;		/* table of 'mask + 1' entries */
+	unsigned mask;
+	unsigned n;			/* number of names in the table */
+};
+
 void	     name_init(struct name *, char *);
 void	     name_done(struct name *);
 struct name *name_new(char *);
@@ -42,5 +52,11 @@ void	     name_empty(struct name **);
 void         name_cat(struct name **, struct name **);
 unsigned     name_eq(struct name **, struct name **);
 struct name *name_lookup(struct name **, char *);
+unsigned     name_hash(char *);
+
+void	     nameidx_init(struct nameidx *, unsigned);
+void	     nameidx_done(struct nameidx *);
+void	     nameidx_add(struct nameidx *, struct name *);
+struct name *nameidx_lookup(struct nameidx *, char *);
 
 #endif /* MIDISH_NAME_H */
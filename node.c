@@ -27,6 +27,7 @@
 #include "cons.h"
 #include "user.h"
 #include "textio.h"
+#include "mux.h"
 
 struct node *
 node_new(struct node_vmt *vmt, struct data *data)
@@ -37,6 +38,9 @@ node_new(struct node_vmt *vmt, struct data *data)
 	o->vmt = vmt;
 	o->data = data;
 	o->list = o->next = NULL;
+	o->var = NULL;
+	o->frame = 0;
+	o->proc = NULL;
 	return o;
 }
 
@@ -145,6 +149,33 @@ node_exec(struct node *o, struct exec *x, struct data **r)
 	return result;
 }
 
+/*
+ * find the variable the node refers to. Variables are never deleted
+ * while their locals list is in use, and once a name is resolved, new
+ * variables of the same name can't be created in the same frame, so
+ * the variable found is cached until another frame is entered
+ */
+static struct var *
+node_varlookup(struct node *o, struct exec *x)
+{
+	if (o->frame != x->frame || o->var == NULL) {
+		o->var = exec_varlookup(x, o->data->val.ref);
+		o->frame = x->frame;
+	}
+	return o->var;
+}
+
+/*
+ * create a new variable the node refers to, and cache it
+ */
+static struct var *
+node_varnew(struct node *o, struct exec *x, struct data *data)
+{
+	o->var = var_new(x->locals, o->data->val.ref, data);
+	o->frame = x->frame;
+	return o->var;
+}
+
 /*
  * execute an unary operator ( '-', '!', '~')
  */
@@ -210,8 +241,7 @@ node_exec_proc(struct node *o, struct exec *x, struct data **r)
 		name_empty(&p->args);
 		node_delete(p->code);
 	} else {
-		p = proc_new(o->data->val.list->val.ref);
-		name_insert((struct name **)&x->procs, (struct name *)p);
+		p = exec_newproc(x, o->data->val.list->val.ref);
 	}
 	p->args = args;
 	p->code = o->list;
@@ -234,6 +264,15 @@ node_exec_slist(struct node *o, struct exec *x, struct data **r)
 			/* stop on ERR, BREAK, CONTINUE, RETURN, EXIT */
 			return result;
 		}
+
+		/*
+		 * calls leave their return value, only the last one
+		 * is the value of the list
+		 */
+		if (i->next != NULL && *r != NULL) {
+			data_delete(*r);
+			*r = NULL;
+		}
 	}
 	return RESULT_OK;
 }
@@ -275,7 +314,7 @@ node_exec_var(struct node *o, struct exec *x, struct data **r)
 {
 	struct var *v;
 
-	v = exec_varlookup(x, o->data->val.ref);
+	v = node_varlookup(o, x);
 	if (v == NULL) {
 		logx(1, "%s: %s: no such variable", x->procname, o->data->val.ref);
 		return RESULT_ERR;
@@ -319,15 +358,26 @@ node_exec_call(struct node *o, struct exec *x, struct data **r)
 	struct node *argv;
 	struct var *valist;
 	char *procname_save;
-	unsigned result;
+	unsigned long oldframe;
+	unsigned long long t0, time, subtime;
+	unsigned long d0, ndatas, subdatas;
+	unsigned result, prof;
 
 	newlocals = NULL;
 	result = RESULT_ERR;
 
-	p = exec_proclookup(x, o->data->val.ref);
+	/*
+	 * procs are never deleted (redefining one replaces its code),
+	 * so once found, the proc may be used by next calls
+	 */
+	p = o->proc;
 	if (p == NULL) {
-		logx(1, "%s: no such proc", o->data->val.ref);
-		goto finish;
+		p = exec_proclookup(x, o->data->val.ref);
+		if (p == NULL) {
+			logx(1, "%s: no such proc", o->data->val.ref);
+			goto finish;
+		}
+		o->proc = p;
 	}
 	valist = NULL;
 	argv = o->list;
@@ -360,9 +410,35 @@ node_exec_call(struct node *o, struct exec *x, struct data **r)
 	}
 	oldlocals = x->locals;
 	x->locals = &newlocals;
+	oldframe = x->frame;
+	x->frame = ++x->nframes;
 	procname_save = x->procname;
 	x->procname = p->name.str;
+
+	/*
+	 * time and allocations of nested calls are accumulated in
+	 * x->subxxx, so they can be subtracted from ours
+	 */
+	prof = exec_prof;
+	if (prof) {
+		subtime = x->subtime;
+		subdatas = x->subdatas;
+		x->subtime = 0;
+		x->subdatas = 0;
+		d0 = data_nnew;
+		t0 = mux_mdep_nsec();
+	}
 	result = node_exec(p->code, x, r);
+	if (prof) {
+		time = mux_mdep_nsec() - t0;
+		ndatas = data_nnew - d0;
+		p->ncalls++;
+		p->incltime += time;
+		p->excltime += time - x->subtime;
+		p->ndatas += ndatas - x->subdatas;
+		x->subtime = subtime + time;
+		x->subdatas = subdatas + ndatas;
+	}
 	if (result != RESULT_ERR) {
 		if (*r == NULL) {	/* we always return something */
 			*r = data_newnil();
@@ -372,6 +448,7 @@ node_exec_call(struct node *o, struct exec *x, struct data **r)
 		}
 	}
 	x->locals = oldlocals;
+	x->frame = oldframe;
 	x->procname = procname_save;
 finish:
 	var_empty(&newlocals);
@@ -414,15 +491,29 @@ node_exec_for(struct node *o, struct exec *x, struct data **r)
 	}
 	if (list->type != DATA_LIST && list->type != DATA_RANGE) {
 		logx(1, "%s: argument to 'for' must be a list or range", x->procname);
+		data_delete(list);
 		return RESULT_ERR;
 	}
-	v = exec_varlookup(x, o->data->val.ref);
+	v = node_varlookup(o, x);
 	if (v == NULL) {
-		v = var_new(x->locals, o->data->val.ref, data_newnil());
+		v = node_varnew(o, x, data_newnil());
 	}
 	result = RESULT_OK;
 	if (list->type == DATA_LIST) {
 		for (i = list->val.list; i != NULL; i = i->next) {
+			if (cons_interrupted()) {
+				result = RESULT_ERR;
+				break;
+			}
+
+			/*
+			 * free the value of the previous iteration, the
+			 * one of the last iteration is the value of "for"
+			 */
+			if (*r != NULL) {
+				data_delete(*r);
+				*r = NULL;
+			}
 			data_assign(v->data, i);
 			result = node_exec(o->list->next, x, r);
 			if (result == RESULT_CONTINUE) {
@@ -437,6 +528,14 @@ node_exec_for(struct node *o, struct exec *x, struct data **r)
 		if (list->val.range.min <= list->val.range.max) {
 			i = data_newlong(list->val.range.min);
 			while (1) {
+				if (cons_interrupted()) {
+					result = RESULT_ERR;
+					break;
+				}
+				if (*r != NULL) {
+					data_delete(*r);
+					*r = NULL;
+				}
 				data_assign(v->data, i);
 				result = node_exec(o->list->next, x, r);
 				if (result == RESULT_CONTINUE) {
@@ -481,9 +580,9 @@ node_exec_assign(struct node *o, struct exec *x, struct data **r)
 	if (node_exec(o->list, x, &expr) == RESULT_ERR) {
 		return RESULT_ERR;
 	}
-	v = exec_varlookup(x, o->data->val.ref);
+	v = node_varlookup(o, x);
 	if (v == NULL) {
-		v = var_new(x->locals, o->data->val.ref, expr);
+		v = node_varnew(o, x, expr);
 	} else {
 		data_delete(v->data);
 		v->data = expr;
@@ -507,17 +606,24 @@ unsigned
 node_exec_list(struct node *o, struct exec *x, struct data **r)
 {
 	struct node *arg;
-	struct data *d;
+	struct data *d, **last;
 
 	*r = data_newlist(NULL);
 
+	/*
+	 * append to the end of the list directly, rather than with
+	 * data_listadd() which would walk the list for each item
+	 */
+	last = &(*r)->val.list;
 	for (arg = o->list; arg != NULL; arg = arg->next) {
 		if (node_exec(arg, x, &d) == RESULT_ERR) {
 			data_delete(*r);
 			*r = NULL;
 			return RESULT_ERR;
 		}
-		data_listadd(*r, d);
+		d->next = NULL;
+		*last = d;
+		last = &d->next;
 	}
 	return RESULT_OK;
 }
@@ -529,21 +635,26 @@ unsigned
 node_exec_range(struct node *o, struct exec *x, struct data **r)
 {
 	struct data *min, *max;
+	unsigned result;
 
-	if (!node_exec(o->list, x, &min))
+	if (node_exec(o->list, x, &min) == RESULT_ERR)
 		return RESULT_ERR;
-	if (!node_exec(o->list->next, x, &max))
+	if (node_exec(o->list->next, x, &max) == RESULT_ERR) {
+		data_delete(min);
 		return RESULT_ERR;
+	}
+	result = RESULT_ERR;
 	if (min->type != DATA_LONG || max->type != DATA_LONG) {
 		logx(1, "cannot create a range with non integers");
-		return RESULT_ERR;
-	}
-	if (min->val.num > max->val.num) {
+	} else if (min->val.num > max->val.num) {
 		logx(1, "max > min, cant create a valid range");
-		return RESULT_ERR;
+	} else {
+		*r = data_newrange(min->val.num, max->val.num);
+		result = RESULT_OK;
 	}
-	*r = data_newrange(min->val.num, max->val.num);
-	return RESULT_OK;
+	data_delete(min);
+	data_delete(max);
+	return result;
 }
 
 unsigned
@@ -683,6 +794,167 @@ node_exec_bitnot(struct node *o, struct exec *x, struct data **r)
 	return node_exec_unary(o, x, r, data_bitnot);
 }
 
+/*
+ * constant folding: binary operators that may be evaluated at parse
+ * time. Arithmetic ones are folded only on integers, for which they
+ * can't fail; the others accept any type
+ */
+struct node_foldop {
+	struct node_vmt *vmt;
+	unsigned (*func)(struct data *, struct data *);
+	unsigned anytype;
+} node_foldops[] = {
+	{ &node_vmt_add, data_add, 0 },
+	{ &node_vmt_sub, data_sub, 0 },
+	{ &node_vmt_mul, data_mul, 0 },
+	{ &node_vmt_div, data_div, 0 },
+	{ &node_vmt_mod, data_mod, 0 },
+	{ &node_vmt_lshift, data_lshift, 0 },
+	{ &node_vmt_rshift, data_rshift, 0 },
+	{ &node_vmt_bitand, data_bitand, 0 },
+	{ &node_vmt_bitor, data_bitor, 0 },
+	{ &node_vmt_bitxor, data_bitxor, 0 },
+	{ &node_vmt_lt, data_lt, 0 },
+	{ &node_vmt_le, data_le, 0 },
+	{ &node_vmt_gt, data_gt, 0 },
+	{ &node_vmt_ge, data_ge, 0 },
+	{ &node_vmt_eq, data_eq, 1 },
+	{ &node_vmt_neq, data_neq, 1 },
+	{ &node_vmt_and, data_and, 1 },
+	{ &node_vmt_or, data_or, 1 },
+	{ NULL, NULL, 0 }
+};
+
+/*
+ * replace the given node by a node with the given vmt and data,
+ * keeping its position in the list it belongs to
+ */
+static struct node *
+node_fold_replace(struct node **po, struct node_vmt *vmt, struct data *data)
+{
+	struct node *n;
+
+	n = node_new(vmt, data);
+	n->next = (*po)->next;
+	node_delete(*po);
+	*po = n;
+	return n;
+}
+
+/*
+ * evaluate the given expression node, if all its arguments are
+ * constants and the evaluation can't fail. On success the node is
+ * replaced by a constant and 1 is returned
+ */
+static unsigned
+node_fold_expr(struct node **po)
+{
+	struct node *o = *po, *i;
+	struct node_foldop *op;
+	struct data *a, *b, **last;
+
+	if (o->vmt == &node_vmt_list) {
+		for (i = o->list; i != NULL; i = i->next) {
+			if (i->vmt != &node_vmt_cst)
+				return 0;
+		}
+		a = data_newlist(NULL);
+		last = &a->val.list;
+		for (i = o->list; i != NULL; i = i->next) {
+			b = data_newnil();
+			data_assign(b, i->data);
+			*last = b;
+			last = &b->next;
+		}
+		node_fold_replace(po, &node_vmt_cst, a);
+		return 1;
+	}
+	if (o->list == NULL || o->list->vmt != &node_vmt_cst)
+		return 0;
+	a = o->list->data;
+	if (o->vmt == &node_vmt_not ||
+	    ((o->vmt == &node_vmt_neg || o->vmt == &node_vmt_bitnot) &&
+	    a->type == DATA_LONG)) {
+		b = data_newnil();
+		data_assign(b, a);
+		if (o->vmt == &node_vmt_not)
+			data_not(b);
+		else if (o->vmt == &node_vmt_neg)
+			data_neg(b);
+		else
+			data_bitnot(b);
+		node_fold_replace(po, &node_vmt_cst, b);
+		return 1;
+	}
+	if (o->list->next == NULL || o->list->next->vmt != &node_vmt_cst)
+		return 0;
+	b = o->list->next->data;
+	if (o->vmt == &node_vmt_range) {
+		if (a->type != DATA_LONG || b->type != DATA_LONG ||
+		    a->val.num > b->val.num)
+			return 0;
+		node_fold_replace(po, &node_vmt_cst,
+		    data_newrange(a->val.num, b->val.num));
+		return 1;
+	}
+	for (op = node_foldops; ; op++) {
+		if (op->vmt == NULL)
+			return 0;
+		if (op->vmt == o->vmt)
+			break;
+	}
+	if (!op->anytype) {
+		if (a->type != DATA_LONG || b->type != DATA_LONG)
+			return 0;
+		if ((op->func == data_div || op->func == data_mod) &&
+		    b->val.num == 0)
+			return 0;
+	}
+	a = data_newnil();
+	data_assign(a, o->list->data);
+	if (!op->func(a, b)) {
+		data_delete(a);
+		return 0;
+	}
+	node_fold_replace(po, &node_vmt_cst, a);
+	return 1;
+}
+
+/*
+ * simplify the tree once parsed: evaluate expressions whose arguments
+ * are constants and remove 'if' branches that can't be reached, so
+ * they are not evaluated each time the code runs (for instance, the
+ * body of a loop or of a proc)
+ */
+void
+node_fold(struct node **po)
+{
+	struct node *o, **pi, *n;
+
+	if (*po == NULL)
+		return;
+	for (pi = &(*po)->list; *pi != NULL; pi = &(*pi)->next)
+		node_fold(pi);
+	o = *po;
+	if (o->vmt == &node_vmt_if && o->list->vmt == &node_vmt_cst) {
+		if (data_eval(o->list->data))
+			pi = &o->list->next;
+		else
+			pi = &o->list->next->next;
+		n = *pi;
+		if (n == NULL) {
+			node_fold_replace(po, &node_vmt_nop, NULL);
+			return;
+		}
+		*pi = n->next;
+		n->next = o->next;
+		node_delete(o);
+		*po = n;
+		return;
+	}
+	node_fold_expr(po);
+}
+
 struct node_vmt
 node_vmt_proc = { "proc", node_exec_proc },
 node_vmt_slist = { "slist", node_exec_slist },
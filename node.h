@@ -25,6 +25,9 @@ struct node {
 	struct node_vmt *vmt;
 	struct data *data;
 	struct node *next, *list;
+	struct var *var;		/* variable the node refers to... */
+	unsigned long frame;		/* ...in this frame, see exec.h */
+	struct proc *proc;		/* proc the call node refers to */
 };
 
 struct node_vmt {
@@ -37,6 +40,7 @@ void	     node_delete(struct node *);
 void	     node_log(struct node *, unsigned);
 void	     node_insert(struct node **, struct node *);
 void	     node_replace(struct node **, struct node *);
+void	     node_fold(struct node **);
 unsigned     node_exec(struct node *, struct exec *, struct data **);
 
 
@@ -20,6 +20,13 @@
  * a stateful midi normalizer. It's used to normalize/sanitize midi
  * input
  *
+ * For devices with input coalescing enabled, continuous values
+ * (controllers, bender, aftertouch) that don't start or end a frame
+ * are not passed immediately: only the latest value of each
+ * controller is kept in its state and passed at the end of the poll
+ * wakeup, by norm_inputdone(). Other events of the same channel pass
+ * the pending values first, so the order of the messages of each
+ * channel is preserved.
  */
 
 #include "utils.h"
@@ -29,11 +36,13 @@
 #include "mux.h"
 #include "filt.h"
 #include "mixout.h"
+#include "mididev.h"
 
 struct song;
 
 #define TAG_PASS 1
 #define TAG_PENDING 2
+#define TAG_COALESCED 4
 
 /*
  * timeout for throtteling: 1 tick at 60 bpm
@@ -43,6 +52,7 @@ struct song;
 unsigned norm_debug = 0;
 struct statelist norm_slist;		/* state of the normilizer */
 struct timo norm_timo;			/* for throtteling */
+unsigned norm_ncoalesced;		/* states with TAG_COALESCED set */
 
 /* --------------------------------------------------------------------- */
 
@@ -68,6 +78,7 @@ void
 norm_start(void)
 {
 	statelist_init(&norm_slist);
+	norm_ncoalesced = 0;
 	timo_set(&norm_timo, norm_timocb, NULL);
 	timo_add(&norm_timo, NORM_TIMO);
 	if (norm_debug) {
@@ -100,6 +111,7 @@ norm_stop(void)
 	}
 	timo_del(&norm_timo);
 	statelist_done(&norm_slist);
+	norm_ncoalesced = 0;
 }
 
 /*
@@ -116,6 +128,10 @@ norm_shut(void)
 		snext = s->next;
 		if (!(s->tag & TAG_PASS))
 			continue;
+		if (s->tag & TAG_COALESCED) {
+			s->tag &= ~TAG_COALESCED;
+			norm_ncoalesced--;
+		}
 		if (state_cancel(s, &ca)) {
 			if (norm_debug) {
 				logx(1, "%s: {ev:%p}: cancelled by: {ev:%p}",
@@ -150,6 +166,10 @@ norm_kill(struct ev *ev)
 		 * EV_PHASE_LAST, so the state can be deleted if
 		 * necessary
 		 */
+		if (st->tag & TAG_COALESCED) {
+			st->tag &= ~TAG_COALESCED;
+			norm_ncoalesced--;
+		}
 		if (state_cancel(st, &ca)) {
 			st = statelist_update(&norm_slist, &ca);
 			norm_putev(&st->ev);
@@ -159,6 +179,94 @@ norm_kill(struct ev *ev)
 	}
 }
 
+/*
+ * pass the event of the given state, unless throttled: if we played
+ * more than MAXEV events skip this event only if it doesnt change the
+ * phase of the frame
+ */
+static void
+norm_pass(struct state *st)
+{
+	if (st->nevents > NORM_MAXEV &&
+	    (st->phase == EV_PHASE_NEXT ||
+	     st->phase == (EV_PHASE_FIRST | EV_PHASE_LAST))) {
+		st->tag |= TAG_PENDING;
+		return;
+	}
+	norm_putev(&st->ev);
+	st->nevents++;
+}
+
+/*
+ * return true if the event of the state may be coalesced with the
+ * next ones of the same state, ie it's a continuous value that
+ * doesn't start or end a frame
+ */
+static int
+norm_iscont(struct state *st)
+{
+	struct mididev *dev;
+
+	if (st->ev.dev >= ev_ndevs)
+		return 0;
+	dev = mididev_byunit[st->ev.dev];
+	if (dev == NULL || !dev->icoalesce)
+		return 0;
+	switch (st->ev.cmd) {
+	case EV_KAT:
+	case EV_CAT:
+	case EV_BEND:
+		return st->phase == EV_PHASE_NEXT;
+	case EV_XCTL:
+	case EV_NRPN:
+	case EV_RPN:
+		return st->phase == EV_PHASE_NEXT ||
+		    st->phase == (EV_PHASE_FIRST | EV_PHASE_LAST);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * pass the coalesced events of the channel of the given state, so
+ * they are sent before it
+ */
+static void
+norm_passchan(struct state *st)
+{
+	struct state *i;
+
+	for (i = norm_slist.first; i != NULL; i = i->next) {
+		if (!(i->tag & TAG_COALESCED) || i->ev.dev != st->ev.dev ||
+		    (EV_ISVOICE(&st->ev) && i->ev.ch != st->ev.ch))
+			continue;
+		i->tag &= ~TAG_COALESCED;
+		norm_ncoalesced--;
+		if (i != st)
+			norm_pass(i);
+	}
+}
+
+/*
+ * pass all coalesced events, called once all the input of the poll
+ * wakeup is processed
+ */
+void
+norm_inputdone(void)
+{
+	struct state *i;
+
+	if (norm_ncoalesced == 0)
+		return;
+	for (i = norm_slist.first; i != NULL; i = i->next) {
+		if (!(i->tag & TAG_COALESCED))
+			continue;
+		i->tag &= ~TAG_COALESCED;
+		norm_pass(i);
+	}
+	norm_ncoalesced = 0;
+}
+
 /*
  * give an event to the normalizer for processing
  */
@@ -166,6 +274,7 @@ void
 norm_evcb(struct ev *ev)
 {
 	struct state *st;
+	struct ev held;
 
 	if (norm_debug) {
 		logx(1, "%s: {ev:%p}", __func__, ev);
@@ -177,22 +286,38 @@ norm_evcb(struct ev *ev)
 	}
 #endif
 
+	/*
+	 * if a value is held for this event, save it before the state
+	 * is updated, so it's not lost if the new frame is dropped
+	 */
+	if (norm_ncoalesced > 0) {
+		st = statelist_lookup(&norm_slist, ev);
+		if (st != NULL && (st->tag & TAG_COALESCED))
+			held = st->ev;
+	}
+
 	/*
 	 * create/update state for this event
 	 */
 	st = statelist_update(&norm_slist, ev);
 	if (st->phase & EV_PHASE_FIRST) {
-		if (st->flags & STATE_NEW)
+		if (st->flags & STATE_NEW) {
 			st->nevents = 0;
+			st->tag = 0;
+		}
 
 		if (st->flags & (STATE_BOGUS | STATE_NESTED)) {
+			if (st->tag & TAG_COALESCED) {
+				norm_ncoalesced--;
+				norm_putev(&held);
+			}
 			st->tag = 0;
 			if (norm_debug) {
 				logx(1, "%s: {ev:%p}: bogus/nested frame", __func__, ev);
 			}
 			norm_kill(ev);
 		} else
-			st->tag = TAG_PASS;
+			st->tag = TAG_PASS | (st->tag & TAG_COALESCED);
 	}
 
 	/*
@@ -202,19 +327,20 @@ norm_evcb(struct ev *ev)
 		return;
 
 	/*
-	 * throttling: if we played more than MAXEV
-	 * events skip this event only if it doesnt change the
-	 * phase of the frame
+	 * keep the value if it may be replaced by the next one,
+	 * else pass the pending values of the channel first
 	 */
-	if (st->nevents > NORM_MAXEV &&
-	    (st->phase == EV_PHASE_NEXT ||
-	     st->phase == (EV_PHASE_FIRST | EV_PHASE_LAST))) {
-		st->tag |= TAG_PENDING;
+	if (norm_iscont(st)) {
+		if (!(st->tag & TAG_COALESCED)) {
+			st->tag |= TAG_COALESCED;
+			norm_ncoalesced++;
+		}
 		return;
 	}
+	if (norm_ncoalesced > 0)
+		norm_passchan(st);
 
-	norm_putev(&st->ev);
-	st->nevents++;
+	norm_pass(st);
 }
 
 /*
@@ -29,6 +29,7 @@ void norm_putev(struct ev *);
 
 void norm_evcb(struct ev *);
 void norm_timercb(void);
+void norm_inputdone(void);
 
 extern unsigned norm_debug;
 
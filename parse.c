@@ -603,6 +603,7 @@ parse_err(struct parse *p, char *msg)
 void
 parse_found(struct parse *p)
 {
+	node_fold(&p->root);
 	if (parse_debug)
 		node_log(p->root, 0);
 
@@ -15,10 +15,11 @@
  */
 
 /*
- * a pool is a large memory block (the pool) that is split into
- * small blocks of equal size (pools entries). Its used for
- * fast allocation of pool entries. Free enties are on a singly
- * linked list
+ * a pool is a set of large memory blocks (the slabs) that are split
+ * into small blocks of equal size (pool entries). It is used for
+ * fast allocation of pool entries. Free entries are on a singly
+ * linked list. Slabs are allocated only when all entries are used, so
+ * the pool grows as needed and never runs out of entries
  */
 
 #include "utils.h"
@@ -27,13 +28,35 @@
 unsigned pool_debug = 0;
 
 /*
- * initialises a pool of "itemnum" elements of size "itemsize"
+ * list of all initialized pools, in initialization order
+ */
+struct pool *pool_list = NULL;
+
+/*
+ * percentage of the pool size at which a warning is displayed if
+ * the peak usage reaches it, 0 means no warnings
+ */
+unsigned pool_warn = 0;
+
+/*
+ * calculate the usage to warn at: the first usage above 'pool_warn'
+ * percent of the current pool size
+ */
+static void
+pool_setmark(struct pool *o)
+{
+	o->warnmark = (pool_warn > 0) ?
+	    (o->itemnum * pool_warn + 99) / 100 : 0;
+}
+
+/*
+ * initialises a pool of elements of size "itemsize", allocated
+ * by "slabnum" elements
  */
 void
-pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
+pool_init(struct pool *o, char *name, unsigned itemsize, unsigned slabnum)
 {
-	unsigned i;
-	unsigned char *p;
+	struct pool **p;
 
 	/*
 	 * round item size to sizeof unsigned
@@ -44,57 +67,113 @@ pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
 	itemsize += sizeof(unsigned) - 1;
 	itemsize &= ~(sizeof(unsigned) - 1);
 
-	o->data = xmalloc(itemsize * itemnum, "pool");
-	if (!o->data) {
-		logx(1, "%s: %s: out of memory", __func__, name);
-		panic();
-	}
 	o->first = NULL;
+	o->next = o->end = NULL;
+	o->slabs = NULL;
 	o->itemsize = itemsize;
-	o->itemnum = itemnum;
+	o->itemnum = 0;
+	o->slabnum = slabnum > 0 ? slabnum : 1;
 	o->name = name;
-#ifdef POOL_DEBUG
 	o->maxused = 0;
 	o->used = 0;
+	o->warnmark = 0;
+#ifdef POOL_DEBUG
 	o->newcnt = 0;
 #endif
-
-	/*
-	 * create a linked list of all entries
-	 */
-	p = o->data;
-	for (i = itemnum; i != 0; i--) {
-		((struct poolent *)p)->next = o->first;
-		o->first = (struct poolent *)p;
-		p += itemsize;
-		o->itemnum++;
-	}
+	for (p = &pool_list; *p != NULL; p = &(*p)->nextpool)
+		; /* nothing */
+	o->nextpool = NULL;
+	*p = o;
 }
 
-
 /*
  * free the given pool
  */
 void
 pool_done(struct pool *o)
 {
-	xfree(o->data);
+	struct poolslab *s;
+	struct pool **p;
+
 #ifdef POOL_DEBUG
 	if (o->used != 0) {
 		logx(1, "%s: %s: WARNING: %u items still allocated", __func__, o->name, o->used);
 	}
-	if (pool_debug) {
+	if (pool_debug && o->itemnum > 0) {
 		logx(1, "%s: %s: using %dkB, max = %d%%, allocs = %d%%", __func__,
 		    o->name, (1023 + o->itemnum * o->itemsize) / 1024,
 		    100 * o->maxused / o->itemnum,
 		    100 * o->newcnt / o->itemnum);
 	}
 #endif
+	while ((s = o->slabs) != NULL) {
+		o->slabs = s->next;
+		xfree(s);
+	}
+	o->first = NULL;
+	o->next = o->end = NULL;
+	o->itemnum = 0;
+	for (p = &pool_list; *p != NULL; p = &(*p)->nextpool) {
+		if (*p == o) {
+			*p = o->nextpool;
+			break;
+		}
+	}
 }
 
 /*
- * allocate an entry from the pool: just unlink
- * it from the free list and return the pointer
+ * set the percentage of the pool size at which warnings are
+ * displayed, and recalculate the marks of all pools
+ */
+void
+pool_setwarn(unsigned pct)
+{
+	struct pool *o;
+
+	pool_warn = pct;
+	for (o = pool_list; o != NULL; o = o->nextpool)
+		pool_setmark(o);
+}
+
+/*
+ * reset peak usage of all pools to the current usage, so warnings
+ * are displayed again
+ */
+void
+pool_statreset(void)
+{
+	struct pool *o;
+
+	for (o = pool_list; o != NULL; o = o->nextpool)
+		o->maxused = o->used;
+}
+
+/*
+ * allocate a new slab and make it the current one
+ */
+static void
+pool_grow(struct pool *o)
+{
+	struct poolslab *s;
+
+	s = xmalloc(sizeof(struct poolslab) + o->slabnum * o->itemsize,
+	    "pool");
+	s->next = o->slabs;
+	o->slabs = s;
+	o->next = (unsigned char *)(s + 1);
+	o->end = o->next + o->slabnum * o->itemsize;
+	o->itemnum += o->slabnum;
+	pool_setmark(o);
+	if (pool_debug) {
+		logx(1, "%s: %s: grown to %u items", __func__,
+		    o->name, o->itemnum);
+	}
+}
+
+/*
+ * allocate an entry from the pool: just unlink it from the free
+ * list and return the pointer. If the free list is empty, take
+ * the next never used entry, the current slab
  */
 void *
 pool_new(struct pool *o)
@@ -106,22 +185,33 @@ pool_new(struct pool *o)
 
 	struct poolent *e;
 
-	if (!o->first) {
-		logx(1, "%s: %s: pool is empty", __func__, o->name);
-		panic();
+	if (o->first) {
+		/*
+		 * unlink from the free list
+		 */
+		e = o->first;
+		o->first = e->next;
+	} else {
+		if (o->next == o->end)
+			pool_grow(o);
+		e = (struct poolent *)o->next;
+		o->next += o->itemsize;
 	}
 
 	/*
-	 * unlink from the free list
+	 * the warning is displayed when the peak usage reaches the
+	 * mark, so only once until the pool grows or is rearmed
 	 */
-	e = o->first;
-	o->first = e->next;
-
-#ifdef POOL_DEBUG
-	o->newcnt++;
 	o->used++;
-	if (o->used > o->maxused)
+	if (o->used > o->maxused) {
 		o->maxused = o->used;
+		if (o->maxused == o->warnmark) {
+			logx(1, "%s: %s: %u of %u items used", __func__,
+			    o->name, o->used, o->itemnum);
+		}
+	}
+#ifdef POOL_DEBUG
+	o->newcnt++;
 
 	/*
 	 * overwrite the entry with garbage so any attempt to use
@@ -153,7 +243,6 @@ pool_del(struct pool *o, void *p)
 		logx(1, "%s: %s: pool is full", __func__, o->name);
 		panic();
 	}
-	o->used--;
 
 	/*
 	 * overwrite the entry with garbage so any attempt to use a
@@ -163,6 +252,8 @@ pool_del(struct pool *o, void *p)
 	for (i = o->itemsize; i > 0; i--)
 		*(buf++) = 0xdf;
 #endif
+	o->used--;
+
 	/*
 	 * link on the free list
 	 */
@@ -27,26 +27,45 @@ struct poolent {
 };
 
 /*
- * the pool is a linked list of 'itemnum' blocks of size
- * 'itemsize'. The pool name is for debugging prurposes only
+ * memory block containing 'slabnum' pool entries
+ */
+struct poolslab {
+	struct poolslab *next;
+};
+
+/*
+ * the pool is a set of slabs of 'slabnum' blocks of size
+ * 'itemsize'. Freed entries are on a linked list; entries never
+ * used are taken from the current slab. Slabs are allocated as
+ * the pool grows. The pool name is for debugging prurposes only
  */
 struct pool {
-	unsigned char *data;	/* memory block of the pool */
 	struct poolent *first;	/* head of linked list */
-#ifdef POOL_DEBUG
+	unsigned char *next;	/* next never used entry */
+	unsigned char *end;	/* end of the current slab */
+	struct poolslab *slabs;	/* list of allocated slabs */
+	struct pool *nextpool;	/* next pool in pool_list */
 	unsigned maxused;	/* max pool usage */
 	unsigned used;		/* current pool usage */
+	unsigned warnmark;	/* usage to warn at, see pool_setwarn() */
+#ifdef POOL_DEBUG
 	unsigned newcnt;	/* current items allocated */
 #endif
 	unsigned itemnum;	/* total number of entries */
 	unsigned itemsize;	/* size of a sigle entry */
+	unsigned slabnum;	/* number of entries per slab */
 	char *name;		/* name of the pool */
 };
 
 void  pool_init(struct pool *, char *, unsigned, unsigned);
 void  pool_done(struct pool *);
+void  pool_setwarn(unsigned);
+void  pool_statreset(void);
 
 void *pool_new(struct pool *);
 void  pool_del(struct pool *, void *);
 
+extern struct pool *pool_list;
+extern unsigned pool_warn;
+
 #endif /* MIDISH_POOL_H */
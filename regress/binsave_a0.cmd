@@ -0,0 +1,3 @@
+load "tundo.msh"
+save "binsave_a0.tmp.msb"
+load "binsave_a0.tmp.msb"
@@ -0,0 +1,13 @@
+proc name x {
+	return $x
+}
+proc lastname {
+	for k in {a b} {
+		name $k
+	}}
+proc lastnum {
+	for k in 1..3 {
+		name $k
+	}}
+tnew [lastname]
+g [lastnum]
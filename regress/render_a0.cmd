@@ -0,0 +1,2 @@
+load "tevmap.msh"
+render r
@@ -0,0 +1,130 @@
+#
+# midish (unknown release)
+#
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	songtrk t {
+		mute 0
+		track {
+			48
+			non {0 0} 65 100
+			96
+			kat {0 0} 65 123
+			48
+			noff {0 0} 65 100
+			48
+			non {0 1} 66 100
+			96
+			kat {0 1} 66 123
+			48
+			noff {0 1} 66 100
+			48
+			xctl {0 0} 7 8192 # 64
+			48
+			xctl {0 0} 7 8320 # 65
+			48
+			xctl {0 1} 10 8192 # 64
+			48
+			xctl {0 1} 10 8320 # 65
+			48
+			cat {0 0} 64
+			48
+			cat {0 0} 0
+			48
+			cat {0 1} 64
+			48
+			cat {0 1} 0
+			48
+			xpc {0 0} 64 1
+			48
+			xpc {0 0} 65 2
+			48
+			nrpn {0 0} 1 64
+			48
+			nrpn {0 0} 2 65
+			48
+			rpn {0 0} 3 66
+			48
+			rpn {0 0} 4 67
+			48
+			bend {0 0} 0 0
+			48
+			bend {0 0} 0 64
+			48
+			bend {0 1} 63 63
+			48
+			bend {0 1} 0 64
+		}
+	}
+	songtrk r {
+		mute 0
+		track {
+			48
+			non {0 0} 65 100
+			96
+			kat {0 0} 65 123
+			48
+			noff {0 0} 65 100
+			48
+			non {0 1} 66 100
+			96
+			kat {0 1} 66 123
+			48
+			noff {0 1} 66 100
+			48
+			xctl {0 0} 7 8192 # 64
+			48
+			xctl {0 0} 7 8320 # 65
+			48
+			xctl {0 1} 10 8192 # 64
+			48
+			xctl {0 1} 10 8320 # 65
+			48
+			cat {0 0} 64
+			48
+			cat {0 0} 0
+			48
+			cat {0 1} 64
+			48
+			cat {0 1} 0
+			48
+			xpc {0 0} 64 1
+			48
+			xpc {0 0} 65 2
+			48
+			nrpn {0 0} 1 64
+			48
+			nrpn {0 0} 2 65
+			48
+			rpn {0 0} 3 66
+			48
+			rpn {0 0} 4 67
+			48
+			bend {0 0} 0 0
+			48
+			bend {0 0} 0 64
+			48
+			bend {0 1} 63 63
+			48
+			bend {0 1} 0 64
+		}
+	}
+	curtrk r
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..15 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
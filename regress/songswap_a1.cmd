@@ -0,0 +1,3 @@
+load "tevmap.msh"
+songstage "tundo.msh"
+render r
@@ -0,0 +1,4 @@
+load "tevmap.msh"
+ct t; g 0; sel 100; setq 24
+tapply {{tquanta 50} {ttransp 2} {tevmap {note {0 0}} {note {1 1}}} {tvcurve 20}}
+g 0; sel 0; setq nil; ct nil; ci nil; co nil
@@ -0,0 +1,3 @@
+load "thin.msh"
+ct t; g 0; sel 100; tthin 12 4
+g 0; sel 0; ct nil
@@ -0,0 +1,76 @@
+#
+# midish (unknown release)
+#
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	songtrk t {
+		mute 0
+		track {
+			bend {0 0} 0 64
+			4
+			bend {0 0} 0 65
+			12
+			bend {0 0} 0 68
+			12
+			bend {0 0} 0 71
+			12
+			bend {0 0} 0 74
+			8
+			bend {0 0} 0 76
+			12
+			bend {0 0} 0 73
+			12
+			bend {0 0} 0 70
+			8
+			bend {0 0} 0 69
+			8
+			bend {0 0} 0 71
+			12
+			bend {0 0} 0 68
+			12
+			bend {0 0} 0 65
+			4
+			bend {0 0} 0 64
+			4
+			xctl {0 1} 7 12800 # 100
+			4
+			xctl {0 1} 7 13312 # 104
+			4
+			xctl {0 1} 7 13824 # 108
+			4
+			xctl {0 1} 7 14336 # 112
+			4
+			xctl {0 1} 7 14848 # 116
+			4
+			xctl {0 1} 7 15104 # 118
+			4
+			xctl {0 1} 7 14336 # 112
+			4
+			xctl {0 1} 7 13568 # 106
+			4
+			xctl {0 1} 7 12800 # 100
+			4
+			xctl {0 1} 7 12032 # 94
+			2
+			xctl {0 1} 7 11648 # 91
+			98
+		}
+	}
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..15 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
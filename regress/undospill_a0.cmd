@@ -0,0 +1,63 @@
+load "tundo.msh"
+ct t
+let n = 5
+for k in {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15} {
+	g 0; sel $n; tcopy; g $n; tpaste; let n = $n * 2
+}
+g 0; sel $n
+for k in {1 2 3 4} {
+	tevmap {xctl {0 0} 7} {xctl {0 1} 7}
+	tevmap {xctl {0 1} 7} {xctl {0 0} 7}
+}
+for k in {1 2 3 4 5 6 7 8} {
+	u
+}
+for k in {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15} {
+	u
+}
+g 0; sel 0; ct nil; ci nil; co nil
+tnew s
+ct t; g 0; sel 5; tcopy; ct s; g 0; tpaste
+let n = 5
+for k in {1 2 3 4 5 6 7 8 9 10 11 12 13} {
+	g 0; sel $n; tcopy; g $n; tpaste; let n = $n * 2
+}
+ct t
+let n = 5
+for k in {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15} {
+	g 0; sel $n; tcopy; g $n; tpaste; let n = $n * 2
+}
+g 0; sel $n
+ct s; tevmap {xctl {0 0} 7} {xctl {0 1} 7}
+ct t; tevmap {xctl {0 0} 7} {xctl {0 1} 7}
+ct s
+for k in {1 2 3 4 5 6 7} {
+	tevmap {xctl {0 1} 7} {xctl {0 2} 7}
+	tevmap {xctl {0 2} 7} {xctl {0 1} 7}
+}
+tevmap {xctl {0 1} 7} {xctl {0 2} 7}
+ct t; tclr
+ct s; tevmap {xctl {0 2} 7} {xctl {0 1} 7}
+tevmap {xctl {0 1} 7} {xctl {0 2} 7}
+for k in {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19} {
+	u
+}
+ct t; tevmap {xctl {0 0} 7} {xctl {0 3} 7}
+ct s
+for k in {1 2 3 4 5 6 7} {
+	tevmap {xctl {0 1} 7} {xctl {0 4} 7}
+	tevmap {xctl {0 4} 7} {xctl {0 1} 7}
+}
+tevmap {xctl {0 1} 7} {xctl {0 4} 7}
+ct t; tclr
+ct s
+for k in {1 2 3} {
+	tevmap {xctl {0 4} 7} {xctl {0 5} 7}
+	tevmap {xctl {0 5} 7} {xctl {0 4} 7}
+}
+for k in {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24} {
+	u
+}
+ct s; g 5; sel $n; tclr
+ct t; g 5; sel $n; tclr
+g 0; sel 0; ct nil; ci nil; co nil
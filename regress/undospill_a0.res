@@ -0,0 +1,49 @@
+#
+# midish (unknown release)
+#
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	songtrk t {
+		mute 0
+		track {
+			96
+			xctl {0 0} 7 1 # 0
+			96
+			xctl {0 0} 7 2 # 0
+			96
+			xctl {0 0} 7 3 # 0
+			96
+			xctl {0 0} 7 4 # 0
+		}
+	}
+	songtrk s {
+		mute 0
+		track {
+			96
+			xctl {0 0} 7 1 # 0
+			96
+			xctl {0 0} 7 2 # 0
+			96
+			xctl {0 0} 7 3 # 0
+			96
+			xctl {0 0} 7 4 # 0
+		}
+	}
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..15 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
@@ -15,6 +15,8 @@
  */
 
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
 #include "utils.h"
 #include "name.h"
 #include "mididev.h"
@@ -29,6 +31,36 @@
 
 #define FORMAT_VERSION	1
 
+/*
+ * binary projects (.msb files) are made of the text project, with
+ * all track events omitted, followed by the events of all tracks
+ * stored as arrays of fixed-size records, and a trailer:
+ *
+ *	track:	kind (1 byte), name length (1 byte), name,
+ *		number of events (4 bytes), events
+ *	event:	delta (4 bytes), cmd, dev, ch, padding (1 byte each),
+ *		v0 and v1 (4 bytes each)
+ *	trailer: offset of the first track (4 bytes), version
+ *		(4 bytes), magic (4 bytes)
+ *
+ * Numbers are stored as little endian. The end-of-track is stored
+ * as the last event, so tracks have at least one event.
+ */
+#define BIN_VERSION	1
+#define BIN_MAGIC	"msb\n"
+#define BIN_SUFFIX	".msb"
+#define BIN_EVSIZE	16
+#define BIN_TRAILSIZE	12
+#define BIN_META	0	/* meta track */
+#define BIN_IN		1	/* conf track of an input */
+#define BIN_OUT		2	/* conf track of an output */
+#define BIN_TRK		3	/* song track */
+
+/*
+ * if set, track_output() doesn't write events, see song_savebin()
+ */
+static unsigned track_output_noev = 0;
+
 void
 chan_output(unsigned dev, unsigned ch, struct textout *f)
 {
@@ -199,7 +231,7 @@ track_output(struct track *t, struct textout *f)
 	textout_putstr(f, "{\n");
 	textout_shiftright(f);
 
-	for (i = t->first; i != NULL; i = i->next) {
+	for (i = t->first; !track_output_noev && i != NULL; i = i->next) {
 		if (i->delta != 0) {
 			textout_putlong(f, i->delta);
 			textout_putstr(f, "\n");
@@ -253,6 +285,15 @@ filt_output(struct filt *o, struct textout *f)
 		textout_putlong(f, (64 - d->u.vel.nweight) & 0x7f);
 		textout_putstr(f, "\n");
 	}
+	for (d = o->thin; d != NULL; d = d->next) {
+		textout_putstr(f, "thin ");
+		evspec_output(&d->es, f);
+		textout_putstr(f, " ");
+		textout_putlong(f, d->u.thin.usec24 / 24000);
+		textout_putstr(f, " ");
+		textout_putlong(f, d->u.thin.delta);
+		textout_putstr(f, "\n");
+	}
 	textout_shiftleft(f);
 	textout_putstr(f, "}");
 }
@@ -260,7 +301,6 @@ filt_output(struct filt *o, struct textout *f)
 void
 sysex_output(struct sysex *o, struct textout *f)
 {
-	struct chunk *c;
 	unsigned i, col;
 	textout_putstr(f, "{\n");
 	textout_shiftright(f);
@@ -272,17 +312,15 @@ sysex_output(struct sysex *o, struct textout *f)
 	textout_putstr(f, "data\t");
 	textout_shiftright(f);
 	col = 0;
-	for (c = o->first; c != NULL; c = c->next) {
-		for (i = 0; i < c->used; i++) {
-			textout_putbyte(f, c->data[i]);
-			if (i + 1 < c->used || c->next != NULL) {
-				col++;
-				if (col >= 8) {
-					col = 0;
-					textout_putstr(f, " \\\n");
-				} else {
-					textout_putstr(f, " ");
-				}
+	for (i = 0; i < o->used; i++) {
+		textout_putbyte(f, o->data[i]);
+		if (i + 1 < o->used) {
+			col++;
+			if (col >= 8) {
+				col = 0;
+				textout_putstr(f, " \\\n");
+			} else {
+				textout_putstr(f, " ");
 			}
 		}
 	}
@@ -1189,7 +1227,7 @@ load_track(struct load *o, struct track *t)
 {
 	unsigned delta;
 	struct seqev *pos, *se;
-	struct statelist slist;
+	struct conv conv;
 	struct ev ev, rev;
 	struct mididev *dev;
 	unsigned int xctlset, evset;
@@ -1201,28 +1239,31 @@ load_track(struct load *o, struct track *t)
 		return 0;
 	}
 	track_clear(t);
-	statelist_init(&slist);
+	conv_init(&conv);
 	pos = t->first;
 	for (;;) {
 		if (!load_getsym(o)) {
-			statelist_done(&slist);
+			conv_done(&conv);
 			return 0;
 		}
 		if (o->id == TOK_ENDLINE) {
-			/* nothing */
+			if (cons_interrupted()) {
+				conv_done(&conv);
+				return 0;
+			}
 		} else if (o->id == TOK_RBRACE) {
 			break;
 		} else if (o->id == TOK_NUM) {
 			load_ungetsym(o);
 			if (!load_delta(o, &delta)) {
-				statelist_done(&slist);
+				conv_done(&conv);
 				return 0;
 			}
 			pos->delta += delta;
 		} else {
 			load_ungetsym(o);
 			if (!load_ev(o, &ev)) {
-				statelist_done(&slist);
+				conv_done(&conv);
 				return 0;
 			}
 			if (ev.cmd != EV_NULL) {
@@ -1242,7 +1283,7 @@ load_track(struct load *o, struct track *t)
 					xctlset = 0;
 					evset = CONV_XPC | CONV_NRPN | CONV_RPN;
 				}
-				if (conv_packev(&slist, xctlset, evset,
+				if (conv_packev(&conv, xctlset, evset,
 					&ev, &rev)) {
 					se = seqev_new();
 					se->ev = rev;
@@ -1251,7 +1292,7 @@ load_track(struct load *o, struct track *t)
 			}
 		}
 	}
-	statelist_done(&slist);
+	conv_done(&conv);
 	return 1;
 }
 
@@ -1529,6 +1570,15 @@ load_rule(struct load *o, struct filt *f)
 			return 0;
 		}
 		filt_vcurve(f, &to, ukeyplus);
+	} else if (str_eq(o->strval, "thin")) {
+		if (!load_evspec(o, &to)) {
+			return 0;
+		}
+		if (!load_long(o, 0, FILT_THIN_MAXMS, &ictl) ||
+		    !load_long(o, 0, EV_MAXCOARSE, &octl)) {
+			return 0;
+		}
+		filt_thin(f, &to, ictl * 24000, octl);
 	} else {
 		load_ungetsym(o);
 		if (!load_ukline(o)) {
@@ -1754,6 +1804,7 @@ load_songchan(struct load *o, struct song *s, struct songchan *i)
 					return 0;
 				i->dev = val;
 				i->ch = val2;
+				song_idxreset(s);
 				if (!load_nl(o))
 					return 0;
 			} else if (str_eq(o->strval, "curinput")) {
@@ -2249,6 +2300,7 @@ load_song(struct load *o, struct song *s)
 				} else {
 					i->dev = num;
 					i->ch = num2;
+					song_idxreset(s);
 				}
 				if (!load_nl(o))
 					return 0;
@@ -2295,11 +2347,292 @@ load_song(struct load *o, struct song *s)
 	return 1;
 }
 
+/* ------------------------------------------------ binary format --- */
+
+/*
+ * return true if the file name has the suffix of binary projects
+ */
+static unsigned
+song_isbin(char *name)
+{
+	size_t len, slen;
+
+	len = strlen(name);
+	slen = strlen(BIN_SUFFIX);
+	return len >= slen && strcmp(name + len - slen, BIN_SUFFIX) == 0;
+}
+
+static void
+bin_put32(unsigned char *p, unsigned val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+static unsigned
+bin_get32(unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+/*
+ * append the events of the given track to the binary file
+ */
+static void
+track_outputbin(struct track *t, unsigned kind, char *name, FILE *f)
+{
+	unsigned char *buf, *p;
+	struct seqev *i;
+	size_t len, namelen;
+	unsigned nev;
+
+	namelen = (name != NULL) ? strlen(name) : 0;
+	nev = track_numev(t);
+	len = 2 + namelen + 4 + (size_t)nev * BIN_EVSIZE;
+	buf = xmalloc(len, "msb");
+	p = buf;
+	*p++ = kind;
+	*p++ = namelen;
+	if (namelen > 0)
+		memcpy(p, name, namelen);
+	p += namelen;
+	bin_put32(p, nev);
+	p += 4;
+	for (i = t->first; i != NULL; i = i->next) {
+		bin_put32(p, i->delta);
+		p[4] = i->ev.cmd;
+		p[5] = i->ev.dev;
+		p[6] = i->ev.ch;
+		p[7] = 0;
+		bin_put32(p + 8, i->ev.v0);
+		bin_put32(p + 12, i->ev.v1);
+		p += BIN_EVSIZE;
+	}
+	fwrite(buf, 1, len, f);
+	xfree(buf);
+}
+
+/*
+ * append the events of all tracks and the trailer to the file
+ * containing the text project
+ */
+static void
+song_outputbin(struct song *o, FILE *f)
+{
+	unsigned char trailer[BIN_TRAILSIZE];
+	struct songtrk *t;
+	struct songchan *i;
+	long offs;
+
+	offs = ftell(f);
+	track_outputbin(&o->meta, BIN_META, NULL, f);
+	SONG_FOREACH_CHAN(o, i) {
+		track_outputbin(&i->conf, i->isinput ? BIN_IN : BIN_OUT,
+		    i->name.str, f);
+	}
+	SONG_FOREACH_TRK(o, t) {
+		track_outputbin(&t->track, BIN_TRK, t->name.str, f);
+	}
+	bin_put32(trailer, offs);
+	bin_put32(trailer + 4, BIN_VERSION);
+	memcpy(trailer + 8, BIN_MAGIC, 4);
+	fwrite(trailer, 1, BIN_TRAILSIZE, f);
+}
+
+/*
+ * return 1 if the given decoded event is within the ranges the
+ * text loader accepts, see load_ev()
+ */
+static int
+bin_evcheck(struct ev *ev)
+{
+	struct evinfo *ei;
+
+	if (ev->cmd == EV_NULL || ev->cmd >= EV_NUMCMD ||
+	    evinfo[ev->cmd].ev == NULL)
+		return 0;
+	ei = evinfo + ev->cmd;
+	switch (ev->cmd) {
+	case EV_TEMPO:
+		return ev->tempo_usec24 >= TEMPO_MIN &&
+		    ev->tempo_usec24 <= TEMPO_MAX;
+	case EV_TIMESIG:
+		return ev->timesig_beats >= 1 &&
+		    ev->timesig_beats <= TIMESIG_BEATS_MAX &&
+		    ev->timesig_tics >= 1 &&
+		    ev->timesig_tics <= TIMESIG_TICS_MAX;
+	}
+	if (ev->dev > EV_MAXDEV)
+		return 0;
+	if (EV_ISVOICE(ev) && ev->ch > EV_MAXCH)
+		return 0;
+	if (ev->cmd == EV_XPC)
+		return (ev->pc_bank <= EV_MAXFINE || ev->pc_bank == EV_UNDEF) &&
+		    ev->pc_prog <= EV_MAXCOARSE;
+	if (ei->nparams >= 1 && ev->v0 > ei->v0_max)
+		return 0;
+	if (ei->nparams >= 2 && ev->v1 > ei->v1_max)
+		return 0;
+	return 1;
+}
+
+/*
+ * decode track events from the given buffer, and return the number
+ * of bytes used, or 0 on error
+ */
+static size_t
+track_inputbin(struct track *t, unsigned char *buf, size_t len)
+{
+	struct seqev *se;
+	struct ev ev;
+	unsigned char *p;
+	unsigned nev, delta;
+
+	if (len < 4)
+		goto bad;
+	nev = bin_get32(buf);
+	if (nev == 0 || nev > (len - 4) / BIN_EVSIZE)
+		goto bad;
+	track_clear(t);
+	for (p = buf + 4; ; p += BIN_EVSIZE) {
+		delta = bin_get32(p);
+		ev.cmd = p[4];
+		ev.dev = p[5];
+		ev.ch = p[6];
+		ev.v0 = bin_get32(p + 8);
+		ev.v1 = bin_get32(p + 12);
+		t->eot.delta += delta;
+		if (--nev == 0)
+			break;
+		if (!bin_evcheck(&ev)) {
+			track_clear(t);
+			goto bad;
+		}
+		se = seqev_new();
+		se->ev = ev;
+		seqev_ins(&t->eot, se);
+	}
+	if (ev.cmd != EV_NULL) {
+		track_clear(t);
+		goto bad;
+	}
+	return p + BIN_EVSIZE - buf;
+bad:
+	logx(1, "corrupted track events");
+	return 0;
+}
+
+/*
+ * load the events of all tracks of a binary project, whose text part
+ * is already loaded
+ */
+static unsigned
+song_inputbin(struct song *o, char *filename)
+{
+	unsigned char trailer[BIN_TRAILSIZE], *buf, *p, *end;
+	char name[TOK_MAXLEN + 1];
+	struct songtrk *t;
+	struct songchan *i;
+	struct track *dst;
+	unsigned kind, namelen;
+	long offs, size;
+	size_t used;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		logx(1, "%s: failed to open file", filename);
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) < 0 ||
+	    (size = ftell(f)) < BIN_TRAILSIZE ||
+	    fseek(f, size - BIN_TRAILSIZE, SEEK_SET) < 0 ||
+	    fread(trailer, 1, BIN_TRAILSIZE, f) != BIN_TRAILSIZE ||
+	    memcmp(trailer + 8, BIN_MAGIC, 4) != 0) {
+		logx(1, "%s: not a binary project", filename);
+		fclose(f);
+		return 0;
+	}
+	if (bin_get32(trailer + 4) > BIN_VERSION) {
+		logx(1, "%s: binary format not supported", filename);
+		fclose(f);
+		return 0;
+	}
+	offs = bin_get32(trailer);
+	size -= BIN_TRAILSIZE;
+	if (offs > size || fseek(f, offs, SEEK_SET) < 0) {
+		logx(1, "%s: bad track offset", filename);
+		fclose(f);
+		return 0;
+	}
+	size -= offs;
+	buf = xmalloc(size > 0 ? size : 1, "msb");
+	if (fread(buf, 1, size, f) != (size_t)size) {
+		logx(1, "%s: failed to read tracks", filename);
+		goto err;
+	}
+	p = buf;
+	end = buf + size;
+	while (p < end) {
+		if (end - p < 2 || (namelen = p[1]) > TOK_MAXLEN ||
+		    end - p < 2 + namelen) {
+			logx(1, "%s: corrupted track header", filename);
+			goto err;
+		}
+		kind = p[0];
+		memcpy(name, p + 2, namelen);
+		name[namelen] = 0;
+		p += 2 + namelen;
+		dst = NULL;
+		i = NULL;
+		switch (kind) {
+		case BIN_META:
+			dst = &o->meta;
+			break;
+		case BIN_IN:
+		case BIN_OUT:
+			i = song_chanlookup(o, name, kind == BIN_IN);
+			if (i != NULL)
+				dst = &i->conf;
+			break;
+		case BIN_TRK:
+			t = song_trklookup(o, name);
+			if (t != NULL)
+				dst = &t->track;
+			break;
+		}
+		if (dst == NULL) {
+			logx(1, "%s: %s: no such track", filename, name);
+			goto err;
+		}
+		used = track_inputbin(dst, p, end - p);
+		if (used == 0)
+			goto err;
+		p += used;
+		if (i != NULL)
+			track_setchan(dst, i->dev, i->ch);
+	}
+	xfree(buf);
+	fclose(f);
+	return 1;
+err:
+	xfree(buf);
+	fclose(f);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
 void
 song_save(struct song *o, char *name)
 {
 	struct textout *f;
+	FILE *bf;
+	unsigned bin;
 
+	bin = song_isbin(name);
 	f = textout_new(name);
 	if (f == NULL) {
 		return;
@@ -2309,9 +2642,20 @@ song_save(struct song *o, char *name)
 	    "# " VERSION "\n"
 	    "#\n"
 	    );
+	track_output_noev = bin;
 	song_output(o, f);
+	track_output_noev = 0;
 	textout_putstr(f, "\n");
 	textout_delete(f);
+	if (bin) {
+		bf = fopen(name, "a");
+		if (bf == NULL) {
+			logx(1, "%s: failed to open output file", name);
+			return;
+		}
+		song_outputbin(o, bf);
+		fclose(bf);
+	}
 }
 
 unsigned
@@ -2327,5 +2671,7 @@ song_load(struct song *o, char *filename)
 		res = load_song(&p, o);
 	}
 	load_done(&p);
+	if (res != 0 && song_isbin(filename))
+		res = song_inputbin(o, filename);
 	return res;
 }
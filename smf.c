@@ -39,9 +39,17 @@ unsigned smf_evlen[] = { 2, 2, 2, 2, 1, 1, 2, 0 };
 
 /* --------------------------------------------- chunk read/write --- */
 
+/*
+ * chunks are kept in memory: when reading, the whole chunk is loaded
+ * by smf_getheader(); when writing, it's built by smf_putxxx
+ * routines and then written by smf_putchunk(). This way, stdio is
+ * not used for each byte
+ */
 struct smf
 {
 	FILE *file;
+	unsigned char *data;		/* current chunk data */
+	unsigned size;			/* allocated size of 'data' */
 	unsigned length, index;		/* current chunk length/position */
 };
 
@@ -57,6 +65,8 @@ smf_open(struct smf *o, char *path, char *mode)
 		logx(1, "%s: failed to open file", path);
 		return 0;
 	}
+	o->data = NULL;
+	o->size = 0;
 	o->length = 0;
 	o->index = 0;
 	return 1;
@@ -68,21 +78,46 @@ smf_open(struct smf *o, char *path, char *mode)
 void
 smf_close(struct smf *o)
 {
+	if (o->data)
+		xfree(o->data);
 	fclose(o->file);
 }
 
+/*
+ * make room for 'n' more bytes in the chunk buffer
+ */
+static void
+smf_grow(struct smf *o, unsigned n)
+{
+	unsigned char *data;
+
+	if (o->index + n <= o->size)
+		return;
+	o->size = 2 * o->size;
+	if (o->size < o->index + n)
+		o->size = o->index + n;
+	data = xmalloc(o->size, "smfchunk");
+	if (o->data) {
+		memcpy(data, o->data, o->index);
+		xfree(o->data);
+	}
+	o->data = data;
+}
+
 /*
  * read a 32bit fixed-size number, return 0 on error
  */
 unsigned
 smf_get32(struct smf *o, unsigned *val)
 {
-	unsigned char buf[4];
-	if (o->index + 4 > o->length || fread(buf, 1, 4, o->file) != 4) {
+	unsigned char *p;
+
+	if (o->length - o->index < 4) {
 		logx(1, "failed to read 32bit number");
 		return 0;
 	}
-	*val = (buf[0] << 24) + (buf[1] << 16) + (buf[2] << 8) + buf[3];
+	p = o->data + o->index;
+	*val = (p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
 	o->index += 4;
 	return 1;
 }
@@ -93,12 +128,14 @@ smf_get32(struct smf *o, unsigned *val)
 unsigned
 smf_get24(struct smf *o, unsigned *val)
 {
-	unsigned char buf[4];
-	if (o->index + 3 > o->length || fread(buf, 1, 3, o->file) != 3) {
+	unsigned char *p;
+
+	if (o->length - o->index < 3) {
 		logx(1, "failed to read 24bit number");
 		return 0;
 	}
-	*val = (buf[0] << 16) + (buf[1] << 8) + buf[2];
+	p = o->data + o->index;
+	*val = (p[0] << 16) + (p[1] << 8) + p[2];
 	o->index += 3;
 	return 1;
 }
@@ -109,12 +146,14 @@ smf_get24(struct smf *o, unsigned *val)
 unsigned
 smf_get16(struct smf *o, unsigned *val)
 {
-	unsigned char buf[4];
-	if (o->index + 2 > o->length || fread(buf, 1, 2, o->file) != 2) {
+	unsigned char *p;
+
+	if (o->length - o->index < 2) {
 		logx(1, "failed to read 16bit number");
 		return 0;
 	}
-	*val =  (buf[0] << 8) + buf[1];
+	p = o->data + o->index;
+	*val =  (p[0] << 8) + p[1];
 	o->index += 2;
 	return 1;
 }
@@ -125,13 +164,11 @@ smf_get16(struct smf *o, unsigned *val)
 unsigned
 smf_getc(struct smf *o, unsigned *res)
 {
-	int c;
-	if (o->index + 1 > o->length || (c = fgetc(o->file)) < 0) {
+	if (o->index == o->length) {
 		logx(1, "failed to read one byte");
 		return 0;
 	}
-	o->index++;
-	*res = c & 0xff;
+	*res = o->data[o->index++];
 	return 1;
 }
 
@@ -146,11 +183,11 @@ smf_getvar(struct smf *o, unsigned *val)
 	*val = 0;
 	bits = 0;
 	for (;;) {
-		if (o->index + 1 > o->length || (c = fgetc(o->file)) == EOF) {
+		if (o->index == o->length) {
 			logx(1, "failed to read varlength number");
 			return 0;
 		}
-		o->index++;
+		c = o->data[o->index++];
 		*val += (c & 0x7f);
 		if (!(c & 0x80)) {
 			break;
@@ -171,19 +208,21 @@ smf_getvar(struct smf *o, unsigned *val)
 
 /*
  * read a chunk header, compare it with ethe given 4-byte header and
- * initialize the smf structure so that other smf_getxxx can work.
+ * load the chunk data so that other smf_getxxx can work.
  * return 0 on error
  */
 unsigned
 smf_getheader(struct smf *o, char *hdr)
 {
-	char buf[4];
+	unsigned char buf[8];
 	unsigned len;
+	long pos, end;
+
 	if (o->index != o->length) {
 		logx(1, "chunk not finished");
 		return 0;
 	}
-	if (fread(buf, 1, 4, o->file) != 4) {
+	if (fread(buf, 1, 8, o->file) != 8) {
 		logx(1, "failed to read header");
 		return 0;
 	}
@@ -191,9 +230,26 @@ smf_getheader(struct smf *o, char *hdr)
 		logx(1, "header corrupted");
 		return 0;
 	}
-	o->index = 0;
-	o->length = 4;
-	if (!smf_get32(o, &len)) {
+	len = (buf[4] << 24) + (buf[5] << 16) + (buf[6] << 8) + buf[7];
+
+	/*
+	 * check the chunk fits in the file before allocating it
+	 */
+	if ((pos = ftell(o->file)) < 0 ||
+	    fseek(o->file, 0, SEEK_END) < 0 ||
+	    (end = ftell(o->file)) < 0 ||
+	    fseek(o->file, pos, SEEK_SET) < 0) {
+		logx(1, "failed to get file size");
+		return 0;
+	}
+	if (len > end - pos) {
+		logx(1, "chunk truncated");
+		return 0;
+	}
+	o->index = o->length = 0;
+	smf_grow(o, len);
+	if (fread(o->data, 1, len, o->file) != len) {
+		logx(1, "failed to read chunk");
 		return 0;
 	}
 	o->index = 0;
@@ -202,10 +258,9 @@ smf_getheader(struct smf *o, char *hdr)
 }
 
 /*
- * in smf_putxxx routines there is a 'unsigned *used' argument if
- * (used == NULL) then data is not written in the smf structure, only
- * *user is incremented by the number of bytes that would be written
- * otherwise.  This is used to determine chunk's length
+ * in smf_putxxx routines, data is appended to the chunk being
+ * written, which is kept in memory. Then, since its length is known,
+ * smf_putchunk() writes it in the file
  */
 
 
@@ -213,66 +268,48 @@ smf_getheader(struct smf *o, char *hdr)
  * put a fixed-size 32-bit number
  */
 void
-smf_put32(struct smf *o, unsigned *used, unsigned val)
+smf_put32(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 4;
-	} else {
-		if (o->index + 4 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		buf[0] = (val >> 24) & 0xff;
-		buf[1] = (val >> 16) & 0xff;
-		buf[2] = (val >> 8) & 0xff;
-		buf[3] = val & 0xff;
-		fwrite(buf, 1, 4, o->file);
-		o->index += 4;
-	}
+	unsigned char *p;
+
+	smf_grow(o, 4);
+	p = o->data + o->index;
+	p[0] = (val >> 24) & 0xff;
+	p[1] = (val >> 16) & 0xff;
+	p[2] = (val >> 8) & 0xff;
+	p[3] = val & 0xff;
+	o->index += 4;
 }
 
 /*
  * put a fixed-size 24-bit number
  */
 void
-smf_put24(struct smf *o, unsigned *used, unsigned val)
+smf_put24(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 3;
-	} else {
-		if (o->index + 3 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		buf[0] = (val >> 16) & 0xff;
-		buf[1] = (val >> 8) & 0xff;
-		buf[2] = val & 0xff;
-		fwrite(buf, 1, 3, o->file);
-		o->index += 3;
-	}
+	unsigned char *p;
+
+	smf_grow(o, 3);
+	p = o->data + o->index;
+	p[0] = (val >> 16) & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = val & 0xff;
+	o->index += 3;
 }
 
 /*
  * put a fixed-size 16-bit number
  */
 void
-smf_put16(struct smf *o, unsigned *used, unsigned val)
+smf_put16(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 2;
-	} else {
-		if (o->index + 2 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		buf[0] = (val >> 8) & 0xff;
-		buf[1] = val & 0xff;
-		fwrite(buf, 1, 2, o->file);
-		o->index += 2;
-	}
+	unsigned char *p;
+
+	smf_grow(o, 2);
+	p = o->data + o->index;
+	p[0] = (val >> 8) & 0xff;
+	p[1] = val & 0xff;
+	o->index += 2;
 }
 
 
@@ -280,18 +317,10 @@ smf_put16(struct smf *o, unsigned *used, unsigned val)
  * put a fixed-size 8-bit number
  */
 void
-smf_putc(struct smf *o, unsigned *used, unsigned val)
+smf_putc(struct smf *o, unsigned val)
 {
-	if (used) {
-		(*used) ++;
-	} else {
-		if (o->index + 1 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		fputc((int)val & 0xff, o->file);
-		o->index++;
-	}
+	smf_grow(o, 1);
+	o->data[o->index++] = val & 0xff;
 }
 
 
@@ -299,28 +328,19 @@ smf_putc(struct smf *o, unsigned *used, unsigned val)
  * put a variable length number
  */
 void
-smf_putvar(struct smf *o, unsigned *used, unsigned val)
+smf_putvar(struct smf *o, unsigned val)
 {
 #define MAXBYTES 5			/* 32bit / 7bit = 4bytes + 4bit */
-	unsigned char buf[MAXBYTES];
-	unsigned index = 0, bits;
+	unsigned bits;
 	for (bits = 7; bits < MAXBYTES * 7; bits += 7) {
 		if (val < (1U << bits)) {
+			smf_grow(o, bits / 7);
 			bits -= 7;
 			for (; bits != 0; bits -= 7) {
-				buf[index++] = ((val >> bits) & 0x7f) | 0x80;
-			}
-			buf[index++] = val & 0x7f;
-			if (used) {
-				(*used) += index;
-			} else {
-				if (o->index + index > o->length) {
-					logx(1, "%s: bad chunk length", __func__);
-					panic();
-				}
-				o->index += index;
-				fwrite(buf, 1, index, o->file);
+				o->data[o->index++] =
+				    ((val >> bits) & 0x7f) | 0x80;
 			}
+			o->data[o->index++] = val & 0x7f;
 			return;
 		}
 	}
@@ -330,16 +350,21 @@ smf_putvar(struct smf *o, unsigned *used, unsigned val)
 }
 
 /*
- * put the given chunk header with the given magic and size field
+ * write the chunk being built with the given magic and start a new
+ * one
  */
 void
-smf_putheader(struct smf *o, char *hdr, unsigned len)
+smf_putchunk(struct smf *o, char *hdr)
 {
-	fwrite(hdr, 1, 4, o->file);
-	o->length = 4;
-	o->index = 0;
-	smf_put32(o, NULL, len);
-	o->length = len;
+	unsigned char buf[8];
+
+	memcpy(buf, hdr, 4);
+	buf[4] = (o->index >> 24) & 0xff;
+	buf[5] = (o->index >> 16) & 0xff;
+	buf[6] = (o->index >> 8) & 0xff;
+	buf[7] = o->index & 0xff;
+	fwrite(buf, 1, 8, o->file);
+	fwrite(o->data, 1, o->index, o->file);
 	o->index = 0;
 }
 
@@ -347,16 +372,16 @@ smf_putheader(struct smf *o, char *hdr, unsigned len)
  * store a track in the smf
  */
 void
-smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
+smf_puttrack(struct smf *o, struct song *s, struct track *t)
 {
 	struct seqev *pos;
 	unsigned status, newstatus, delta, chan, denom;
 	struct ev rev[CONV_NUMREV];
-	struct statelist slist;
+	struct conv conv;
 	unsigned i, nev;
 
 
-	statelist_init(&slist);
+	conv_init(&conv);
 	delta = 0;
 	status = 0;
 	for (pos = t->first; pos != NULL; pos = pos->next) {
@@ -365,34 +390,34 @@ smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
 			break;
 		}
 		if (EV_ISVOICE(&pos->ev)) {
-			nev = conv_unpackev(&slist, 0U,
+			nev = conv_unpackev(&conv, 0U,
 			    CONV_XPC | CONV_NRPN | CONV_RPN, &pos->ev, rev);
 			for (i = 0; i < nev; i++) {
-				smf_putvar(o, used, delta);
+				smf_putvar(o, delta);
 				delta = 0;
 				chan = rev[i].ch;
 				newstatus = (rev[i].cmd << 4) + (chan & 0x0f);
 				if (newstatus != status) {
 					status = newstatus;
-					smf_putc(o, used, status);
+					smf_putc(o, status);
 				}
 				if (rev[i].cmd == EV_BEND) {
-					smf_putc(o, used, rev[i].bend_val & 0x7f);
-					smf_putc(o, used, rev[i].bend_val >> 7);
+					smf_putc(o, rev[i].bend_val & 0x7f);
+					smf_putc(o, rev[i].bend_val >> 7);
 				} else {
-					smf_putc(o, used, rev[i].v0);
+					smf_putc(o, rev[i].v0);
 					if (SMF_EVLEN(status) == 2) {
-						smf_putc(o, used, rev[i].v1);
+						smf_putc(o, rev[i].v1);
 					}
 				}
 			}
 		} else if (pos->ev.cmd == EV_TEMPO) {
-			smf_putvar(o, used, delta);
+			smf_putvar(o, delta);
 			delta = 0;
-			smf_putc(o, used, 0xff);
-			smf_putc(o, used, 0x51);
-			smf_putc(o, used, 0x03);
-			smf_put24(o, used, pos->ev.tempo_usec24 * s->tics_per_unit / 96);
+			smf_putc(o, 0xff);
+			smf_putc(o, 0x51);
+			smf_putc(o, 0x03);
+			smf_put24(o, pos->ev.tempo_usec24 * s->tics_per_unit / 96);
 		} else if (pos->ev.cmd == EV_TIMESIG) {
 			denom = s->tics_per_unit / pos->ev.timesig_tics;
 			switch(denom) {
@@ -415,69 +440,62 @@ smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
 				logx(1, "%s: bad time signature", __func__);
 				panic();
 			}
-			smf_putvar(o, used, delta);
+			smf_putvar(o, delta);
 			delta = 0;
-			smf_putc(o, used, 0xff);
-			smf_putc(o, used, 0x58);
-			smf_putc(o, used, 0x04);
-			smf_putc(o, used, pos->ev.timesig_beats);
-			smf_putc(o, used, denom);
+			smf_putc(o, 0xff);
+			smf_putc(o, 0x58);
+			smf_putc(o, 0x04);
+			smf_putc(o, pos->ev.timesig_beats);
+			smf_putc(o, denom);
 			/* metronome tics per metro beat */
-			smf_putc(o, used, pos->ev.timesig_tics);
+			smf_putc(o, pos->ev.timesig_tics);
 			/* metronome 1/32 notes per 24 tics */
-			smf_putc(o, used, 8 * s->tics_per_unit / 96);
+			smf_putc(o, 8 * s->tics_per_unit / 96);
 		}
 
 	}
-	smf_putvar(o, used, delta);
-	smf_putc(o, used, 0xff);
-	smf_putc(o, used, 0x2f);
-	smf_putc(o, used, 0x00);
-	statelist_done(&slist);
+	smf_putvar(o, delta);
+	smf_putc(o, 0xff);
+	smf_putc(o, 0x2f);
+	smf_putc(o, 0x00);
+	conv_done(&conv);
 }
 
 /*
  * store a sysex in the smf
  */
 void
-smf_putsysex(struct smf *o, unsigned *used, struct sysex *sx)
+smf_putsysex(struct smf *o, struct sysex *sx)
 {
-	struct chunk *c;
-	unsigned i, first;
-
-	first = 1;
-	for (c = sx->first; c != NULL; c = c->next) {
-		for (i = 0; i < c->used; i++) {
-			if (first) {
-				first = 0;
-			} else {
-				smf_putc(o, used, c->data[i]);
-			}
-		}
-	}
+	unsigned len;
+
+	/*
+	 * the length doesn't include the leading 0xf0 byte
+	 */
+	len = sx->used > 0 ? sx->used - 1 : 0;
+	smf_putvar(o, len);
+	smf_grow(o, len);
+	memcpy(o->data + o->index, sx->data + 1, len);
+	o->index += len;
 }
 
 /*
  * store a sysex back in the smf
  */
 void
-smf_putsx(struct smf *o, unsigned *used, struct song *s, struct songsx *songsx)
+smf_putsx(struct smf *o, struct song *s, struct songsx *songsx)
 {
-	unsigned sysexused;
 	struct sysex *sx;
 
 	for (sx = songsx->sx.first; sx != NULL; sx = sx->next) {
-		sysexused = 0;
-		smf_putvar(o, used, 0);
-		smf_putc(o, used, 0xf0);
-		smf_putsysex(o, &sysexused, sx);
-		smf_putvar(o, used, sysexused);
-		smf_putsysex(o, used, sx);
-	}
-	smf_putvar(o, used, 0);
-	smf_putc(o, used, 0xff);
-	smf_putc(o, used, 0x2f);
-	smf_putc(o, used, 0x00);
+		smf_putvar(o, 0);
+		smf_putc(o, 0xf0);
+		smf_putsysex(o, sx);
+	}
+	smf_putvar(o, 0);
+	smf_putc(o, 0xff);
+	smf_putc(o, 0x2f);
+	smf_putc(o, 0x00);
 }
 
 /*
@@ -490,7 +508,7 @@ song_exportsmf(struct song *o, char *filename)
 	struct songtrk *t;
 	struct songchan *i;
 	struct songsx *s;
-	unsigned ntrks, nchan, nsx, used;
+	unsigned ntrks, nchan, nsx;
 
 	if (!smf_open(&f, filename, "w")) {
 		return 0;
@@ -513,27 +531,23 @@ song_exportsmf(struct song *o, char *filename)
 	/*
 	 * write the header
 	 */
-	smf_putheader(&f, smftype_header, 6);
-	smf_put16(&f, NULL, 1);				/* format = 1 */
-	smf_put16(&f, NULL, nsx + ntrks + nchan + 1);	/* +1 -> meta track */
-	smf_put16(&f, NULL, o->tics_per_unit / 4);		/* tics per quarter */
+	smf_put16(&f, 1);				/* format = 1 */
+	smf_put16(&f, nsx + ntrks + nchan + 1);		/* +1 -> meta track */
+	smf_put16(&f, o->tics_per_unit / 4);		/* tics per quarter */
+	smf_putchunk(&f, smftype_header);
 
 	/*
 	 * write the tempo track
 	 */
-	used = 0;
-	smf_puttrack(&f, &used, o, &o->meta);
-	smf_putheader(&f, smftype_track, used);
-	smf_puttrack(&f, NULL, o, &o->meta);
+	smf_puttrack(&f, o, &o->meta);
+	smf_putchunk(&f, smftype_track);
 
 	/*
 	 * write each sx
 	 */
 	SONG_FOREACH_SX(o, s) {
-		used = 0;
-		smf_putsx(&f, &used, o, s);
-		smf_putheader(&f, smftype_track, used);
-		smf_putsx(&f, NULL, o, s);
+		smf_putsx(&f, o, s);
+		smf_putchunk(&f, smftype_track);
 	}
 
 	/*
@@ -542,20 +556,30 @@ song_exportsmf(struct song *o, char *filename)
 	SONG_FOREACH_CHAN(o, i) {
 		if (i->isinput)
 			continue;
-		used = 0;
-		smf_puttrack(&f, &used, o, &i->conf);
-		smf_putheader(&f, smftype_track, used);
-		smf_puttrack(&f, NULL, o, &i->conf);
+		smf_puttrack(&f, o, &i->conf);
+		smf_putchunk(&f, smftype_track);
 	}
 
 	/*
-	 * write each track
+	 * write each track, reusing data from the previous export
+	 * if the track didn't change since. Edits drop the cached data
+	 * through undo_track_save(), see song_trkdirty()
 	 */
 	SONG_FOREACH_TRK(o, t) {
-		used = 0;
-		smf_puttrack(&f, &used, o, &t->track);
-		smf_putheader(&f, smftype_track, used);
-		smf_puttrack(&f, NULL, o, &t->track);
+		if (t->smf != NULL && t->smfunit == o->tics_per_unit) {
+			smf_grow(&f, t->smflen);
+			memcpy(f.data + f.index, t->smf, t->smflen);
+			f.index += t->smflen;
+		} else {
+			smf_puttrack(&f, o, &t->track);
+			if (t->smf)
+				xfree(t->smf);
+			t->smf = xmalloc(f.index, "smftrk");
+			memcpy(t->smf, f.data, f.index);
+			t->smflen = f.index;
+			t->smfunit = o->tics_per_unit;
+		}
+		smf_putchunk(&f, smftype_track);
 	}
 	smf_close(&f);
 	return 1;
@@ -567,17 +591,17 @@ song_exportsmf(struct song *o, char *filename)
 unsigned
 smf_getsysex(struct smf *o, struct sysex *sx)
 {
-	unsigned i, length, c;
+	unsigned length;
 
 	if (!smf_getvar(o, &length)) {
 		return 0;
 	}
-	for (i = 0; i < length; i++) {
-		if (!smf_getc(o, &c)) {
-			return 0;
-		}
-		sysex_add(sx, c);
+	if (length > o->length - o->index) {
+		logx(1, "sysex truncated");
+		return 0;
 	}
+	sysex_addbuf(sx, o->data + o->index, length);
+	o->index += length;
 	return 1;
 }
 
@@ -589,7 +613,7 @@ smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
 {
 	unsigned delta, i, status, type, length;
 	unsigned tempo, num, den, dummy;
-	struct statelist slist;
+	struct conv conv;
 	struct songsx *songsx;
 	struct seqev *pos, *se;
 	struct sysex *sx;
@@ -608,12 +632,14 @@ smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
 	if (songsx == NULL) {
 		songsx = song_sxnew(s, "smf");
 	}
-	statelist_init(&slist);
+	conv_init(&conv);
 	for (;;) {
 		if (o->index >= o->length) {
-			statelist_done(&slist);
+			conv_done(&conv);
 			return 1;
 		}
+		if (cons_interrupted())
+			goto err;
 		if (!smf_getvar(o, &delta)) {
 			goto err;
 		}
@@ -737,7 +763,7 @@ smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
 				xctlset = 0;
 				evset = CONV_XPC | CONV_NRPN | CONV_RPN;
 			}
-			if (conv_packev(&slist, xctlset, evset,
+			if (conv_packev(&conv, xctlset, evset,
 				&ev, &rev)) {
 				se = seqev_new();
 				se->ev = rev;
@@ -755,7 +781,7 @@ smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
 		}
 	}
  err:
-	statelist_done(&slist);
+	conv_done(&conv);
 	return 0;
 }
 
@@ -782,10 +808,9 @@ song_fix1(struct song *o)
 		tp = seqptr_new(&t->track);
 		statelist_init(&slist);
 		for (;;) {
-			delta = seqptr_ticdel(tp, ~0U, &slist);
-			seqptr_ticput(tp, delta);
+			delta = seqptr_ticpass(tp, ~0U, &slist);
 			seqptr_ticput(cp, delta);
-			st = seqptr_evdel(tp, &slist);
+			st = seqptr_evpeek(tp, &slist);
 			if (st == NULL) {
 				break;
 			}
@@ -793,10 +818,10 @@ song_fix1(struct song *o)
 				st->tag = EV_ISMETA(&st->ev) ? 1 : 0;
 			}
 			if (st->tag) {
+				(void)seqptr_evdel(tp, NULL);
 				seqptr_evput(cp, &st->ev);
-			} else {
-				seqptr_evput(tp, &st->ev);
-			}
+			} else
+				(void)seqptr_evget(tp);
 		}
 		statelist_done(&slist);
 		seqptr_del(tp);
@@ -824,11 +849,11 @@ void
 song_fix0(struct song *o)
 {
 	char trackname[MAXTRACKNAME];
-	struct seqptr *tp, *cp;
+	struct seqptr *tp, *cp[16];
 	struct state *st;
 	struct statelist slist;
 	struct songtrk *t, *smf;
-	unsigned delta;
+	unsigned tic, ctic[16];
 	unsigned i;
 
 	song_fix1(o);
@@ -839,35 +864,40 @@ song_fix0(struct song *o)
 	for (i = 1; i < 16; i++) {
 		snprintf(trackname, MAXTRACKNAME, "trk%02u", i);
 		t = song_trknew(o, trackname);
-		delta = 0;
-		cp = seqptr_new(&t->track);
-		tp = seqptr_new(&smf->track);
-		statelist_init(&slist);
-		for (;;) {
-			delta = seqptr_ticdel(tp, ~0U, &slist);
-			seqptr_ticput(tp, delta);
-			seqptr_ticput(cp, delta);
-			st = seqptr_evdel(tp, &slist);
-			if (st == NULL) {
-				break;
-			}
-			if (st->phase & EV_PHASE_FIRST) {
-				if (EV_ISVOICE(&st->ev) &&
-				    st->ev.ch == i) {
-					st->tag = 1;
-				} else {
-					st->tag = 0;
-				}
-			}
-			if (st->tag) {
-				seqptr_evput(cp, &st->ev);
-			} else {
-				seqptr_evput(tp, &st->ev);
-			}
+		cp[i] = seqptr_new(&t->track);
+		ctic[i] = 0;
+	}
+
+	/*
+	 * move voice events of channel 'i' to the i-th track in a
+	 * single pass; blank space is added to the destination
+	 * track only when an event is put on it
+	 */
+	tic = 0;
+	tp = seqptr_new(&smf->track);
+	statelist_init(&slist);
+	for (;;) {
+		tic += seqptr_ticpass(tp, ~0U, &slist);
+		st = seqptr_evpeek(tp, &slist);
+		if (st == NULL) {
+			break;
 		}
-		statelist_done(&slist);
-		seqptr_del(tp);
-		seqptr_del(cp);
+		if (st->phase & EV_PHASE_FIRST)
+			st->tag = EV_ISVOICE(&st->ev) ? st->ev.ch : 0;
+		if (st->tag) {
+			i = st->tag;
+			(void)seqptr_evdel(tp, NULL);
+			seqptr_ticput(cp[i], tic - ctic[i]);
+			ctic[i] = tic;
+			seqptr_evput(cp[i], &st->ev);
+		} else
+			(void)seqptr_evget(tp);
+	}
+	statelist_done(&slist);
+	seqptr_del(tp);
+	for (i = 1; i < 16; i++) {
+		seqptr_ticput(cp[i], tic - ctic[i]);
+		seqptr_del(cp[i]);
 	}
 }
 
@@ -990,7 +1020,6 @@ syx_export(char *path, struct sysexlist *l)
 {
 	FILE *f;
 	struct sysex *x;
-	struct chunk *c;
 	ssize_t n;
 
 	f = fopen(path, "w");
@@ -999,14 +1028,11 @@ syx_export(char *path, struct sysexlist *l)
 		return 0;
 	}
 	for (x = l->first; x != NULL; x = x->next) {
-		for (c = x->first; c != NULL; c = c->next) {
-			n = fwrite(c->data, 1, c->used, f);
-			if (n != c->used) {
-				logx(1, "%s: write failed", path);
-				fclose(f);
-				return 0;
-			}
-
+		n = fwrite(x->data, 1, x->used, f);
+		if (n != x->used) {
+			logx(1, "%s: write failed", path);
+			fclose(f);
+			return 0;
 		}
 	}
 	fclose(f);
@@ -27,12 +27,22 @@
 #include "mixout.h"
 #include "norm.h"
 #include "undo.h"
+#include "trace.h"
+#include "conv.h"
 
 #define TAG_OFF		0
 #define TAG_PLAY	1
 #define TAG_REC		2
 
+static void song_recdrain(struct song *);
+
 unsigned song_debug = 0;
+
+/*
+ * if set, song_setmode() doesn't close and reopen the mux, so the
+ * devices stay open while switching songs, see song_cut()
+ */
+static unsigned song_keepmux = 0;
 char *song_tap_modestr[3] = {"off", "start", "tempo"};
 
 /*
@@ -73,8 +83,12 @@ song_init(struct song *o)
 	o->chanlist = NULL;
 	o->filtlist = NULL;
 	o->sxlist = NULL;
+	o->idx_valid = 0;
 	o->undo = NULL;
 	o->undo_size = 0;
+	o->undo_file = NULL;
+	o->undo_fileend = 0;
+	o->undo_nspill = 0;
 	o->tics_per_unit = DEFAULT_TPU;
 	track_init(&o->meta);
 	track_init(&o->clip);
@@ -108,6 +122,16 @@ song_init(struct song *o)
 	o->curlen = 0;
 	o->curquant = 0;
 	o->loop = 0;
+	o->recdefer = 0;
+	o->recq_start = o->recq_used = 0;
+	o->renderptr = NULL;
+	o->renderofs = 0;
+	o->ana = NULL;
+	o->sxwait = 1;
+	o->sxstate = SONG_SX_DONE;
+	o->sxgo = SONG_SXGO_NONE;
+	timo_set(&o->sxto, song_sxcb, o);
+	o->cutreq = o->cutready = 0;
 	evspec_reset(&o->curev);
 	evspec_reset(&o->tap_evspec);
 	o->tap_evspec.cmd = EVSPEC_EMPTY;
@@ -137,6 +161,10 @@ song_done(struct song *o)
 		song_stop(o);
 	}
 	undo_clear(o, &o->undo);
+	if (o->undo_file) {
+		fclose(o->undo_file);
+		o->undo_file = NULL;
+	}
 	while (o->trklist) {
 		song_trkdel(o, (struct songtrk *)o->trklist);
 	}
@@ -149,6 +177,7 @@ song_done(struct song *o)
 	while (o->sxlist) {
 		song_sxdel(o, (struct songsx *)o->sxlist);
 	}
+	song_idxreset(o);
 	track_done(&o->meta);
 	track_done(&o->clip);
 	track_done(&o->rec);
@@ -160,6 +189,68 @@ song_done(struct song *o)
 	}
 }
 
+/*
+ * build the track, chan, filt and sysex indexes. They are used by
+ * lookups and kept up to date when items are added. Any other change
+ * to the lists, to the names or to the chan numbers must be followed
+ * by a call to song_idxreset()
+ */
+static void
+song_idxbuild(struct song *o)
+{
+	struct songtrk *t;
+	struct songchan *c, **pc;
+	struct songfilt *f;
+	struct songsx *x;
+	unsigned i;
+
+	nameidx_init(&o->trkidx, 0);
+	SONG_FOREACH_TRK(o, t)
+		nameidx_add(&o->trkidx, &t->name);
+	nameidx_init(&o->filtidx, 0);
+	SONG_FOREACH_FILT(o, f)
+		nameidx_add(&o->filtidx, &f->name);
+	nameidx_init(&o->sxidx, 0);
+	SONG_FOREACH_SX(o, x)
+		nameidx_add(&o->sxidx, &x->name);
+	nameidx_init(&o->chanidx[0], 0);
+	nameidx_init(&o->chanidx[1], 0);
+	o->chanmapsz = ev_ndevs * 16;
+	for (i = 0; i < 2; i++) {
+		o->chanmap[i] = xmalloc(o->chanmapsz *
+		    sizeof(struct songchan *), "chanmap");
+	}
+	for (i = 0; i < o->chanmapsz; i++)
+		o->chanmap[0][i] = o->chanmap[1][i] = NULL;
+	SONG_FOREACH_CHAN(o, c) {
+		nameidx_add(&o->chanidx[!!c->isinput], &c->name);
+		if (c->dev * 16 + c->ch < o->chanmapsz && c->ch < 16) {
+			pc = &o->chanmap[!!c->isinput][c->dev * 16 + c->ch];
+			if (*pc == NULL)
+				*pc = c;
+		}
+	}
+	o->idx_valid = 1;
+}
+
+/*
+ * discard the indexes, they will be rebuilt by the next lookup
+ */
+void
+song_idxreset(struct song *o)
+{
+	if (!o->idx_valid)
+		return;
+	nameidx_done(&o->trkidx);
+	nameidx_done(&o->filtidx);
+	nameidx_done(&o->sxidx);
+	nameidx_done(&o->chanidx[0]);
+	nameidx_done(&o->chanidx[1]);
+	xfree(o->chanmap[0]);
+	xfree(o->chanmap[1]);
+	o->idx_valid = 0;
+}
+
 /*
  * create a new track in the song
  */
@@ -173,8 +264,11 @@ song_trknew(struct song *o, char *name)
 	track_init(&t->track);
 	t->curfilt = NULL;
 	t->mute = 0;
+	t->smf = NULL;
 
 	name_add(&o->trklist, (struct name *)t);
+	if (o->idx_valid)
+		nameidx_add(&o->trkidx, &t->name);
 	song_getcurfilt(o, &t->curfilt);
 	song_setcurtrk(o, t);
 	return t;
@@ -190,18 +284,44 @@ song_trkdel(struct song *o, struct songtrk *t)
 		o->curtrk = NULL;
 	}
 	name_remove(&o->trklist, (struct name *)t);
+	song_idxreset(o);
 	track_done(&t->track);
+	if (t->smf)
+		xfree(t->smf);
 	name_done(&t->name);
 	xfree(t);
 }
 
+/*
+ * drop the cached SMF data of the song track using the given track,
+ * must be called whenever the track is about to change. Other
+ * tracks (meta, channel configuration) are ignored
+ */
+void
+song_trkdirty(struct song *o, struct track *track)
+{
+	struct songtrk *t;
+
+	SONG_FOREACH_TRK(o, t) {
+		if (&t->track == track) {
+			if (t->smf) {
+				xfree(t->smf);
+				t->smf = NULL;
+			}
+			break;
+		}
+	}
+}
+
 /*
  * return the track with the given name
  */
 struct songtrk *
 song_trklookup(struct song *o, char *name)
 {
-	return (struct songtrk *)name_lookup(&o->trklist, name);
+	if (!o->idx_valid)
+		song_idxbuild(o);
+	return (struct songtrk *)nameidx_lookup(&o->trkidx, name);
 }
 
 /*
@@ -211,7 +331,7 @@ struct songchan *
 song_channew(struct song *o, char *name, unsigned dev, unsigned ch, int input)
 {
 	struct songfilt *f;
-	struct songchan *c, *i;
+	struct songchan *c, *i, **pc;
 	struct evspec src, dst;
 
 	c = xmalloc(sizeof(struct songchan), "songchan");
@@ -221,6 +341,14 @@ song_channew(struct song *o, char *name, unsigned dev, unsigned ch, int input)
 	c->ch = ch;
 	c->isinput = input;
 	name_add(&o->chanlist, (struct name *)c);
+	if (o->idx_valid) {
+		nameidx_add(&o->chanidx[!!input], &c->name);
+		if (dev * 16 + ch < o->chanmapsz && ch < 16) {
+			pc = &o->chanmap[!!input][dev * 16 + ch];
+			if (*pc == NULL)
+				*pc = c;
+		}
+	}
 	if (input)
 		c->filt = NULL;
 	else {
@@ -258,6 +386,7 @@ song_chandel(struct song *o, struct songchan *c)
 			o->curout = NULL;
 	}
 	name_remove(&o->chanlist, (struct name *)c);
+	song_idxreset(o);
 	track_done(&c->conf);
 	name_done(&c->name);
 	if (c->filt != NULL)
@@ -271,14 +400,9 @@ song_chandel(struct song *o, struct songchan *c)
 struct songchan *
 song_chanlookup(struct song *o, char *name, int input)
 {
-	struct songchan *c;
-
-	SONG_FOREACH_CHAN(o, c) {
-		if (!!c->isinput == !!input && str_eq(c->name.str, name))
-			break;
-	}
-
-	return c;
+	if (!o->idx_valid)
+		song_idxbuild(o);
+	return (struct songchan *)nameidx_lookup(&o->chanidx[!!input], name);
 }
 
 /*
@@ -289,11 +413,15 @@ song_chanlookup_bynum(struct song *o, unsigned dev, unsigned ch, int input)
 {
 	struct songchan *c;
 
+	if (dev <= EV_MAXDEV && ch < 16) {
+		if (!o->idx_valid)
+			song_idxbuild(o);
+		return o->chanmap[!!input][dev * 16 + ch];
+	}
 	SONG_FOREACH_CHAN(o, c) {
 		if (!!c->isinput == !!input && c->dev == dev && c->ch == ch)
 			break;
 	}
-
 	return c;
 }
 
@@ -309,6 +437,8 @@ song_filtnew(struct song *o, char *name)
 	name_init(&f->name, name);
 	filt_init(&f->filt);
 	name_add(&o->filtlist, (struct name *)f);
+	if (o->idx_valid)
+		nameidx_add(&o->filtidx, &f->name);
 	song_setcurfilt(o, f);
 	return f;
 }
@@ -330,6 +460,7 @@ song_filtdel(struct song *o, struct songfilt *f)
 		}
 	}
 	name_remove(&o->filtlist, (struct name *)f);
+	song_idxreset(o);
 	filt_done(&f->filt);
 	name_done(&f->name);
 	xfree(f);
@@ -341,7 +472,9 @@ song_filtdel(struct song *o, struct songfilt *f)
 struct songfilt *
 song_filtlookup(struct song *o, char *name)
 {
-	return (struct songfilt *)name_lookup(&o->filtlist, name);
+	if (!o->idx_valid)
+		song_idxbuild(o);
+	return (struct songfilt *)nameidx_lookup(&o->filtidx, name);
 }
 
 /*
@@ -356,6 +489,8 @@ song_sxnew(struct song *o, char *name)
 	name_init(&x->name, name);
 	sysexlist_init(&x->sx);
 	name_add(&o->sxlist, (struct name *)x);
+	if (o->idx_valid)
+		nameidx_add(&o->sxidx, &x->name);
 	song_setcursx(o, x);
 	return x;
 }
@@ -370,6 +505,7 @@ song_sxdel(struct song *o, struct songsx *x)
 		o->cursx = NULL;
 	}
 	name_remove(&o->sxlist, (struct name *)x);
+	song_idxreset(o);
 	sysexlist_done(&x->sx);
 	name_done(&x->name);
 	xfree(x);
@@ -381,7 +517,9 @@ song_sxdel(struct song *o, struct songsx *x)
 struct songsx *
 song_sxlookup(struct song *o, char *name)
 {
-	return (struct songsx *)name_lookup(&o->sxlist, name);
+	if (!o->idx_valid)
+		song_idxbuild(o);
+	return (struct songsx *)nameidx_lookup(&o->sxidx, name);
 }
 
 /*
@@ -524,30 +662,93 @@ song_playconf(struct song *o)
 		seqptr_del(cp);
 	}
 	mux_flush();
-	mux_sleep(DEFAULT_CHANWAIT);
 }
 
 /*
- * send all sysex messages
+ * timeout call-back: send the next sysex message, and schedule the
+ * following one once the link had time to transmit it. When all
+ * messages are sent, send the chan config, and once devices had time
+ * to process it, move to the position and start playback if this
+ * was deferred
  */
 void
-song_playsysex(struct song *o)
+song_sxcb(void *addr)
 {
-	struct songsx *l;
+	struct song *o = (struct song *)addr;
+	struct mididev *dev;
 	struct sysex *s;
-	struct chunk *c;
-
-	SONG_FOREACH_SX(o, l) {
-		for (s = l->sx.first; s != NULL; s = s->next) {
-			for (c = s->first; c != NULL; c = c->next) {
-				mux_sendraw(s->unit, c->data, c->used);
-				mux_flush();
-			}
-			mux_sleep(DEFAULT_SXWAIT);
+	unsigned long long delta;
+	unsigned rate, go;
+
+	switch (o->sxstate) {
+	case SONG_SX_SEND:
+		while (o->sxnext == NULL && o->sxbank != NULL) {
+			o->sxbank = (struct songsx *)o->sxbank->name.next;
+			if (o->sxbank)
+				o->sxnext = o->sxbank->sx.first;
 		}
+		s = o->sxnext;
+		if (s == NULL) {
+			song_playconf(o);
+			o->sxstate = SONG_SX_CONF;
+			timo_add(&o->sxto, DEFAULT_CHANWAIT * 24 * 1000);
+			break;
+		}
+		o->sxnext = s->next;
+		mux_sendraw(s->unit, s->data, s->used);
+		mux_flush();
+		dev = (s->unit < ev_ndevs) ? mididev_byunit[s->unit] : NULL;
+		rate = (dev != NULL && dev->orate != 0) ?
+		    dev->orate : DEFAULT_SXRATE;
+		delta = (unsigned long long)s->used * 24000000 / rate;
+		if (delta < DEFAULT_SXWAIT * 24 * 1000)
+			delta = DEFAULT_SXWAIT * 24 * 1000;
+		timo_add(&o->sxto, delta < ~0U ? delta : ~0U);
+		break;
+	case SONG_SX_CONF:
+		o->sxstate = SONG_SX_DONE;
+		go = o->sxgo;
+		o->sxgo = SONG_SXGO_NONE;
+		if (go != SONG_SXGO_NONE)
+			song_goto(o, o->sxgopos);
+		if (go == SONG_SXGO_START)
+			mux_startreq(o->tap_mode != SONG_TAP_OFF);
+		mux_flush();
+		break;
 	}
 }
 
+/*
+ * start sending all sysex messages, then channel config messages,
+ * in the background
+ */
+void
+song_playsysex(struct song *o)
+{
+	o->sxstate = SONG_SX_SEND;
+	o->sxbank = (struct songsx *)o->sxlist;
+	o->sxnext = o->sxbank ? o->sxbank->sx.first : NULL;
+	song_sxcb(o);
+}
+
+/*
+ * move to the given measure and start the clock if 'start' is set.
+ * If sysex messages are still being sent and 'sxwait' is set, this
+ * is deferred until they are, see song_sxcb()
+ */
+static void
+song_gostart(struct song *o, unsigned measure, int start)
+{
+	if (o->sxwait && o->sxstate != SONG_SX_DONE) {
+		o->sxgo = start ? SONG_SXGO_START : SONG_SXGO_GOTO;
+		o->sxgopos = measure;
+		return;
+	}
+	song_goto(o, measure);
+	if (start)
+		mux_startreq(o->tap_mode != SONG_TAP_OFF);
+}
+
 /*
  * play a meta event
  */
@@ -578,6 +779,147 @@ song_metaput(struct song *o, struct state *s)
 	}
 }
 
+/*
+ * return true if track 't1' must play before track 't2'
+ */
+static int
+song_playq_before(struct songtrk *t1, struct songtrk *t2)
+{
+	if (t1->nexttic != t2->nexttic)
+		return t1->nexttic < t2->nexttic;
+	return t1->playidx < t2->playidx;
+}
+
+/*
+ * move down the given heap entry until the heap is ordered
+ */
+static void
+song_playq_down(struct song *o, unsigned i)
+{
+	struct songtrk *t;
+	unsigned c;
+
+	t = o->playq[i];
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= o->playq_n)
+			break;
+		if (c + 1 < o->playq_n &&
+		    song_playq_before(o->playq[c + 1], o->playq[c]))
+			c++;
+		if (!song_playq_before(o->playq[c], t))
+			break;
+		o->playq[i] = o->playq[c];
+		i = c;
+	}
+	o->playq[i] = t;
+}
+
+/*
+ * return the absolute tic of the next event of the track, or of its
+ * end-of-track
+ */
+static unsigned
+song_trknext(struct songtrk *t)
+{
+	struct seqptr *sp = t->trackptr;
+
+	return sp->tic + sp->pos->delta - sp->delta;
+}
+
+/*
+ * build the heap of tracks to play from the current track pointers
+ */
+static void
+song_playq_init(struct song *o)
+{
+	struct songtrk *t;
+	unsigned n, i;
+
+	n = 0;
+	SONG_FOREACH_TRK(o, t) {
+		t->playidx = n;
+		t->nexttic = song_trknext(t);
+		if (t->nexttic < o->abspos)
+			continue;
+		o->playq[n++] = t;
+	}
+	o->playq_n = n;
+	for (i = n / 2; i > 0; i--)
+		song_playq_down(o, i - 1);
+}
+
+/*
+ * move the track pointer to the current position; track pointers
+ * are lazily moved forward, so this must be called before using
+ * their state
+ */
+static void
+song_trksync(struct song *o, struct songtrk *t)
+{
+	(void)seqptr_ticskip(t->trackptr, o->abspos - t->trackptr->tic);
+}
+
+/*
+ * compute the events song_loop_track() would play at loop end, so
+ * that the loop wrap doesn't have to compare state lists. The state
+ * at loop end is obtained by playing the loop from its start state
+ * on a private track pointer
+ */
+static void
+song_loop_mkwrap(struct song *o, struct track *trk, struct seqptr *lp,
+    struct songwrap *w)
+{
+	struct seqptr *sp;
+	struct statelist *elist, *slist;
+	struct state *s, *d;
+	struct ev re;
+
+	slist = &lp->statelist;
+	sp = seqptr_new(trk);
+	elist = &sp->statelist;
+	statelist_done(elist);
+	statelist_dup(elist, slist);
+	sp->pos = lp->pos;
+	sp->delta = lp->delta;
+	sp->tic = lp->tic;
+	for (;;) {
+		while (seqptr_evget(sp) != NULL)
+			;
+		if (seqptr_ticskip(sp, o->loop_tend - sp->tic) == 0 ||
+		    sp->tic == o->loop_tend)
+			break;
+	}
+
+	w->nstates = elist->nstates;
+	w->ncancel = w->nrestore = 0;
+	w->cancel = xmalloc((elist->nstates + 1) * sizeof(struct ev),
+	    "songwrap");
+	w->restore = xmalloc((slist->nstates + 1) * sizeof(struct ev),
+	    "songwrap");
+	for (d = elist->first; d != NULL; d = d->next) {
+		if (statelist_lookup(slist, &d->ev) != NULL)
+			continue;
+		if (!state_cancel(d, &re))
+			continue;
+		w->cancel[w->ncancel++] = d->ev;
+	}
+	for (s = slist->first; s != NULL; s = s->next) {
+		d = statelist_lookup(elist, &s->ev);
+		if (d != NULL && state_eq(d, &s->ev))
+			continue;
+		if (!state_restore(s, &re))
+			continue;
+		w->restore[w->nrestore++] = re;
+	}
+	if (song_debug) {
+		logx(1, "%s: %u states, %u to cancel, %u to restore",
+		    __func__, w->nstates, w->ncancel, w->nrestore);
+	}
+	statelist_empty(elist);
+	seqptr_del(sp);
+}
+
 /*
  * save the state at the given start position, so that we can repeat
  * playback from there.
@@ -613,7 +955,7 @@ song_loop_init(struct song *o)
 
 	SONG_FOREACH_TRK(o, t) {
 		t->loop_trackptr = seqptr_new(&t->track);
-		seqptr_skip(t->loop_trackptr, o->loop_tstart);
+		seqptr_locate(t->loop_trackptr, o->loop_tstart);
 
 		/*
 		 * Drop notes, as we don't restore them
@@ -631,7 +973,10 @@ song_loop_init(struct song *o)
 		 * Drop terminated states
 		 */
 		statelist_outdate(slist);
+		song_loop_mkwrap(o, &t->track, t->loop_trackptr,
+		    &t->loop_wrap);
 	}
+	song_loop_mkwrap(o, &o->meta, o->loop_metaptr, &o->loop_metawrap);
 }
 
 /*
@@ -646,15 +991,65 @@ song_loop_done(struct song *o)
 		return;
 
 	seqptr_del(o->loop_metaptr);
+	xfree(o->loop_metawrap.cancel);
+	xfree(o->loop_metawrap.restore);
 	SONG_FOREACH_TRK(o, t) {
 		statelist_empty(&t->loop_trackptr->statelist);
 		seqptr_del(t->loop_trackptr);
+		xfree(t->loop_wrap.cancel);
+		xfree(t->loop_wrap.restore);
+	}
+}
+
+/*
+ * cancel the given state of the given track (or meta-track if NULL)
+ */
+static void
+song_loop_cancel(struct song *o, struct songtrk *t,
+    struct statelist *dlist, struct state *d)
+{
+	struct ev re;
+
+	if (!state_cancel(d, &re))
+		return;
+	statelist_update(dlist, &re);
+	if (d->tag) {
+		if (t != NULL)
+			mixout_putev(&d->ev, PRIO_TRACK);
+		else
+			song_metaput(o, d);
+	}
+}
+
+/*
+ * play the given restore event of the given track (or meta-track
+ * if NULL)
+ */
+static void
+song_loop_restore(struct song *o, struct songtrk *t,
+    struct statelist *dlist, struct ev *re)
+{
+	struct state *d;
+
+	d = statelist_update(dlist, re);
+	if (d->phase & EV_PHASE_FIRST) {
+		d->tag = (t != NULL) ?
+		    !t->mute : EV_ISMETA(&d->ev);
+	}
+	if (d->tag) {
+		if (t != NULL)
+			mixout_putev(&d->ev, PRIO_TRACK);
+		else
+			song_metaput(o, d);
 	}
 }
 
 /*
  * restore the given track (or meta-track if NULL) from its loop
- * state.
+ * state. If the state at loop end is the one computed when the loop
+ * was set, the precomputed events are played, else (e.g. notes
+ * started before the loop start are still playing) the state is
+ * compared to the loop start one
  */
 void
 song_loop_track(struct song *o, struct songtrk *t)
@@ -662,19 +1057,34 @@ song_loop_track(struct song *o, struct songtrk *t)
 	struct seqptr *sp, *lp;
 	struct statelist *dlist, *slist;
 	struct state *s, *d, *dnext;
+	struct songwrap *w;
 	struct ev re;
+	unsigned i;
 
 	if (t) {
 		sp = t->trackptr;
 		lp = t->loop_trackptr;
+		w = &t->loop_wrap;
 	} else {
 		sp = o->metaptr;
 		lp = o->loop_metaptr;
+		w = &o->loop_metawrap;
 	}
 
 	dlist = &sp->statelist;
 	slist = &lp->statelist;
 
+	if (dlist->nstates == w->nstates) {
+		for (i = 0; i < w->ncancel; i++) {
+			d = statelist_lookup(dlist, &w->cancel[i]);
+			if (d != NULL)
+				song_loop_cancel(o, t, dlist, d);
+		}
+		for (i = 0; i < w->nrestore; i++)
+			song_loop_restore(o, t, dlist, &w->restore[i]);
+		goto done;
+	}
+
 	/*
 	 * cancel states not present in loop state (this will cancel
 	 * all notes as their state is not saved)
@@ -682,17 +1092,8 @@ song_loop_track(struct song *o, struct songtrk *t)
 	for (d = dlist->first; d != NULL; d = dnext) {
 		dnext = d->next;
 		s = statelist_lookup(slist, &d->ev);
-		if (s != NULL)
-			continue;
-		if (!state_cancel(d, &re))
-			continue;
-		statelist_update(dlist, &re);
-		if (d->tag) {
-			if (t != NULL)
-				mixout_putev(&d->ev, PRIO_TRACK);
-			else
-				song_metaput(o, d);
-		}
+		if (s == NULL)
+			song_loop_cancel(o, t, dlist, d);
 	}
 
 	/*
@@ -704,19 +1105,10 @@ song_loop_track(struct song *o, struct songtrk *t)
 			continue;
 		if (!state_restore(s, &re))
 			continue;
-		d = statelist_update(dlist, &re);
-		if (d->phase & EV_PHASE_FIRST) {
-			d->tag = (t != NULL) ?
-			    !t->mute : EV_ISMETA(&d->ev);
-		}
-		if (d->tag) {
-			if (t != NULL)
-				mixout_putev(&d->ev, PRIO_TRACK);
-			else
-				song_metaput(o, d);
-		}
+		song_loop_restore(o, t, dlist, &re);
 	}
 
+done:
 	sp->pos = lp->pos;
 	sp->delta = lp->delta;
 	sp->tic = lp->tic;
@@ -753,12 +1145,17 @@ song_loop_repeat(struct song *o)
 	if (o->loop_mstart == o->loop_mend || o->abspos != o->loop_tend)
 		return 0;
 
+	SONG_FOREACH_TRK(o, t) {
+		song_trksync(o, t);
+	}
+
 	o->abspos = o->loop_tstart;
 	o->measure -= o->loop_mend - o->loop_mstart;
 
 	SONG_FOREACH_TRK(o, t) {
 		song_loop_track(o, t);
 	}
+	song_playq_init(o);
 
 	song_loop_track(o, NULL);
 
@@ -780,11 +1177,17 @@ void
 song_ticskip(struct song *o)
 {
 	struct ev ev;
-	struct songtrk *i;
 	struct state *s;
 	unsigned neot;
 	unsigned period;
 
+	/*
+	 * merge events captured during the tick, before the
+	 * record position moves
+	 */
+	if (o->mode >= SONG_REC)
+		song_recdrain(o);
+
 	/*
 	 * tempo_track
 	 */
@@ -799,9 +1202,13 @@ song_ticskip(struct song *o)
 		}
 	}
 	o->abspos++;
-	SONG_FOREACH_TRK(o, i) {
-		neot |= seqptr_ticskip(i->trackptr, 1);
-	}
+
+	/*
+	 * tracks are moved forward only when they have events to play
+	 * at the current tic, see song_ticplay().
+	 */
+	if (o->playq_n > 0)
+		neot = 1;
 	if (o->mode >= SONG_REC) {
 		if (o->playptr) {
 			seqptr_ticdel(o->playptr, 1, &o->rec_replay);
@@ -852,14 +1259,24 @@ song_ticplay(struct song *o)
 	if (o->tic == 0) {
 		cons_putpos(o->measure, o->beat, o->tic);
 	}
-	metro_tic(&o->metro, o->beat, o->tic);
-	SONG_FOREACH_TRK(o, i) {
+	if (o->metro.on && o->tic == 0)
+		metro_tic(&o->metro, o->beat, o->tic);
+	while (o->playq_n > 0 && o->playq[0]->nexttic == o->abspos) {
+		i = o->playq[0];
+		song_trksync(o, i);
 		while ((st = seqptr_evget(i->trackptr))) {
 			if (st->phase & EV_PHASE_FIRST)
 				st->tag = i->mute ? 0 : 1;
 			if (st->tag)
 				mixout_putev(&st->ev, PRIO_TRACK);
 		}
+		i->nexttic = song_trknext(i);
+		if (i->nexttic == o->abspos) {
+			/* end-of-track reached */
+			o->playq[0] = o->playq[--o->playq_n];
+		}
+		if (o->playq_n > 0)
+			song_playq_down(o, 0);
 	}
 
 	if (o->mode >= SONG_REC) {
@@ -956,8 +1373,10 @@ song_confcancel(struct statelist *slist, unsigned prio)
 void
 song_trkmute(struct song *s, struct songtrk *t)
 {
-	if (s->mode >= SONG_PLAY)
+	if (s->mode >= SONG_PLAY) {
+		song_trksync(s, t);
 		song_confcancel(&t->trackptr->statelist, PRIO_TRACK);
+	}
 	t->mute = 1;
 }
 
@@ -967,8 +1386,10 @@ song_trkmute(struct song *s, struct songtrk *t)
 void
 song_trkunmute(struct song *s, struct songtrk *t)
 {
-	if (s->mode >= SONG_PLAY)
+	if (s->mode >= SONG_PLAY) {
+		song_trksync(s, t);
 		song_confrestore(&t->trackptr->statelist, 1, PRIO_TRACK);
+	}
 	t->mute = 0;
 }
 
@@ -988,6 +1409,8 @@ song_mergerec(struct song *o)
 	struct ev ev;
 	unsigned period, offset;
 
+	song_recdrain(o);
+
 	/*
 	 * if there is no filter for recording there may be
 	 * unterminated frames, so finalize them.
@@ -1116,6 +1539,7 @@ song_stopcb(struct song *o)
 	 * stop all sounding notes
 	 */
 	SONG_FOREACH_TRK(o, t) {
+		song_trksync(o, t);
 		song_confcancel(&t->trackptr->statelist, PRIO_TRACK);
 	}
 }
@@ -1126,11 +1550,109 @@ song_stopcb(struct song *o)
 void
 song_movecb(struct song *o)
 {
-	if (o->mode >= SONG_PLAY) {
+	if (trace_on) {
+		trace_put(TRACE_SONG_MOVECB, TRACE_BEGIN,
+		    o->measure, o->beat, o->tic, 0);
+	}
+	if (o->mode >= SONG_PLAY && !o->cutready) {
 		(void)song_ticskip(o);
-		song_ticplay(o);
+		if (o->cutreq && o->beat == 0 && o->tic == 0) {
+			o->cutreq = 0;
+			o->cutready = 1;
+		} else
+			song_ticplay(o);
 	}
 	mux_flush();
+	if (trace_on)
+		trace_put(TRACE_SONG_MOVECB, TRACE_END, 0, 0, 0, 0);
+}
+
+/*
+ * update the state of the frame of the given input event, and
+ * return its tag. If this is the first event of the frame, 'canrec'
+ * tells whether the frame is recorded or only played
+ */
+static unsigned
+song_rectag(struct song *o, struct ev *ev, int canrec)
+{
+	struct state *s;
+
+	s = statelist_update(&o->rec_input, ev);
+	if (s->phase & EV_PHASE_FIRST) {
+		s->tic = 0;
+		if (s->flags & (STATE_BOGUS | STATE_NESTED))
+			s->tag = TAG_OFF;
+		else if (canrec)
+			s->tag = TAG_REC;
+		else
+			s->tag = TAG_PLAY;
+	}
+	return s->tag;
+}
+
+/*
+ * merge the given input event in the record track at the current
+ * position, and send events cancelling replayed frames it conflicts
+ * with
+ */
+static void
+song_recmerge(struct song *o, struct ev *ev)
+{
+	struct ev rev;
+
+	if (seqptr_evmerge2(o->recptr, &o->rec_replay, ev, &rev))
+		mixout_putev(&rev, 0);
+}
+
+/*
+ * merge into the record track the events captured since the last
+ * tick, in the order they were received
+ */
+static void
+song_recdrain(struct song *o)
+{
+	while (o->recq_used > 0) {
+		song_recmerge(o, &o->recq[o->recq_start]);
+		o->recq_start = (o->recq_start + 1) % SONG_RECQLEN;
+		o->recq_used--;
+	}
+	o->recq_start = 0;
+}
+
+/*
+ * store an input event to be recorded at the next tick; if the
+ * ring is full, merge the captured events now
+ */
+static void
+song_reccapture(struct song *o, struct ev *ev)
+{
+	if (o->recq_used == SONG_RECQLEN)
+		song_recdrain(o);
+	o->recq[(o->recq_start + o->recq_used) % SONG_RECQLEN] = *ev;
+	o->recq_used++;
+}
+
+/*
+ * record the given input event and send it to the output, unless
+ * its frame is dropped. Events are merged in the record track at
+ * once, or at the next tick if 'recdefer' is set. In loop mode,
+ * merging may cancel replayed frames, so events are always merged
+ * at once to send the cancelling events before the input event
+ */
+static void
+song_recev(struct song *o, struct ev *ev, int canrec)
+{
+	unsigned tag;
+
+	tag = song_rectag(o, ev, canrec);
+	if (tag == TAG_REC) {
+		if (o->recdefer && o->playptr == NULL)
+			song_reccapture(o, ev);
+		else
+			song_recmerge(o, ev);
+	}
+	if (tag == TAG_REC || tag == TAG_PLAY)
+		mixout_putev(ev, 0);
 }
 
 /*
@@ -1139,10 +1661,10 @@ song_movecb(struct song *o)
 void
 song_evcb(struct song *o, struct ev *ev)
 {
-	struct ev filtout[FILT_MAXNRULES], rev;
-	struct state *s;
+	struct ev filtout[FILT_MAXNRULES];
 	unsigned i, nev;
 	unsigned usec24;
+	int canrec;
 
 	if (o->tap_mode != SONG_TAP_OFF &&
 	    evspec_matchev(&o->tap_evspec, ev)) {
@@ -1192,30 +1714,14 @@ song_evcb(struct song *o, struct ev *ev)
 	 */
 	ev = filtout;
 	for (i = 0; i < nev; i++) {
-		if (o->mode >= SONG_REC) {
-			s = statelist_update(&o->rec_input, ev);
-			if (s->phase & EV_PHASE_FIRST) {
-				s->tic = 0;
-				if (s->flags & (STATE_BOGUS | STATE_NESTED)) {
-					s->tag = TAG_OFF;
-				} else if ((mux_getphase() >= MUX_START) &&
-				    (o->loop_mstart == o->loop_mend ||
-					o->abspos >= o->loop_tstart)) {
-					s->tag = TAG_REC;
-				} else
-					s->tag = TAG_PLAY;
-			}
-
-			if (s->tag == TAG_REC) {
-				if (seqptr_evmerge2(o->recptr,
-					&o->rec_replay, ev, &rev))
-					mixout_putev(&rev, 0);
-			}
-			if (s->tag == TAG_REC || s->tag == TAG_PLAY)
-				mixout_putev(ev, 0);
-
-		} else
+		if (o->mode < SONG_REC) {
 			mixout_putev(ev, 0);
+		} else {
+			canrec = (mux_getphase() >= MUX_START) &&
+			    (o->loop_mstart == o->loop_mend ||
+				o->abspos >= o->loop_tstart);
+			song_recev(o, ev, canrec);
+		}
 		ev++;
 	}
 }
@@ -1388,7 +1894,7 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 		 * allocate and restore new states
 		 */
 		t->trackptr = seqptr_new(&t->track);
-		seqptr_skip(t->trackptr, o->abspos);
+		seqptr_locate(t->trackptr, o->abspos);
 		for (s = t->trackptr->statelist.first; s != NULL; s = s->next)
 			s->tag = 0;
 		song_confrestore(&t->trackptr->statelist,
@@ -1400,6 +1906,7 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 		if (!seqptr_eot(t->trackptr))
 			o->complete = 0;
 	}
+	song_playq_init(o);
 
 	if (o->mode >= SONG_REC)
 		track_clear(&o->rec);
@@ -1423,6 +1930,7 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 	}
 	statelist_empty(&o->rec_input);
 	statelist_empty(&o->rec_replay);
+	o->recq_start = o->recq_used = 0;
 
 	/*
 	 * we've the tempo to be set, as in the LOC_MTC case, the return
@@ -1480,7 +1988,7 @@ void
 song_setmode(struct song *o, unsigned newmode)
 {
 	struct songtrk *t;
-	unsigned oldmode;
+	unsigned oldmode, ntrk;
 
 	oldmode = o->mode;
 	o->mode = newmode;
@@ -1502,6 +2010,8 @@ song_setmode(struct song *o, unsigned newmode)
 			statelist_empty(&t->trackptr->statelist);
 			seqptr_del(t->trackptr);
 		}
+		if (o->playq)
+			xfree(o->playq);
 		if (o->playptr)
 			seqptr_del(o->playptr);
 		statelist_empty(&o->rec_input);
@@ -1510,9 +2020,15 @@ song_setmode(struct song *o, unsigned newmode)
 		statelist_done(&o->rec_replay);
 		seqptr_del(o->recptr);
 		seqptr_del(o->metaptr);
+		if (o->sxto.set)
+			timo_del(&o->sxto);
+		o->sxstate = SONG_SX_DONE;
+		o->sxgo = SONG_SXGO_NONE;
+		o->cutreq = o->cutready = 0;
 		norm_shut();
 		mux_flush();
-		mux_close();
+		if (!song_keepmux)
+			mux_close();
 	}
 	if (oldmode < SONG_PLAY && newmode >= SONG_PLAY) {
 		o->tap_cnt = 0;
@@ -1526,26 +2042,32 @@ song_setmode(struct song *o, unsigned newmode)
 		o->tic = 0;
 
 		/*
-		 * get empty states
+		 * make tracks cache friendly, and get empty states
 		 */
+		ntrk = 0;
 		SONG_FOREACH_TRK(o, t) {
+			track_compact(&t->track);
 			t->trackptr = seqptr_new(&t->track);
+			ntrk++;
 		}
+		o->playq = (ntrk > 0) ?
+		    xmalloc(ntrk * sizeof(struct songtrk *), "playq") : NULL;
+		song_playq_init(o);
+		track_compact(&o->meta);
 		o->metaptr = seqptr_new(&o->meta);
 		o->recptr = seqptr_new(&o->rec);
 		o->playptr = NULL;
 		statelist_init(&o->rec_replay);
 		statelist_init(&o->rec_input);
 
-		mux_open();
+		if (!song_keepmux)
+			mux_open();
 		mux_chgticrate(o->tics_per_unit);
 
 		/*
 		 * send sysex messages and channel config messages
 		 */
 		song_playsysex(o);
-		song_playconf(o);
-		mux_flush();
 	}
 	if (newmode > oldmode)
 		metro_setmode(&o->metro, newmode);
@@ -1561,6 +2083,14 @@ song_goto(struct song *o, unsigned measure)
 	unsigned mmcpos, offs;
 
 	if (o->mode >= SONG_IDLE) {
+		/*
+		 * sysex not sent yet, just change the deferred position
+		 */
+		if (o->sxgo != SONG_SXGO_NONE) {
+			o->sxgopos = measure;
+			return;
+		}
+
 		/*
 		 * 1 measure of count-down for recording
 		 */
@@ -1608,8 +2138,7 @@ song_play(struct song *o)
 
 	m = (o->mode >= SONG_IDLE) ? o->measure : o->curpos;
 	song_setmode(o, SONG_PLAY);
-	song_goto(o, m);
-	mux_startreq(o->tap_mode != SONG_TAP_OFF);
+	song_gostart(o, m, 1);
 	mux_flush();
 
 	if (song_debug) {
@@ -1634,8 +2163,7 @@ song_record(struct song *o)
 
 	m = (o->mode >= SONG_IDLE) ? o->measure : o->curpos;
 	song_setmode(o, SONG_REC);
-	song_goto(o, m);
-	mux_startreq(o->tap_mode != SONG_TAP_OFF);
+	song_gostart(o, m, 1);
 	mux_flush();
 	if (song_debug) {
 		logx(1, "%s: waiting for a start event...", __func__);
@@ -1652,7 +2180,7 @@ song_idle(struct song *o)
 
 	m = (o->mode >= SONG_IDLE) ? o->measure : o->curpos;
 	song_setmode(o, SONG_IDLE);
-	song_goto(o,  m);
+	song_gostart(o, m, 0);
 	mux_flush();
 
 	if (song_debug) {
@@ -1660,6 +2188,302 @@ song_idle(struct song *o)
 	}
 }
 
+/*
+ * stop the song pointed by 'cur' and replace it by the next one,
+ * started in the same mode from its current position, without
+ * closing devices. The pointer is the one mux call-backs use, so it
+ * must be changed between both songs. Sysex and channel config of
+ * the next song are sent as usual, see song_gostart(). Recording
+ * is not continued, the next song is only played
+ */
+void
+song_cut(struct song **cur, struct song *next)
+{
+	unsigned mode;
+
+	mode = (*cur)->mode;
+	if (mode > SONG_PLAY)
+		mode = SONG_PLAY;
+	song_keepmux = (mode >= SONG_IDLE);
+	song_setmode(*cur, 0);
+	*cur = next;
+	song_setmode(next, mode);
+	song_keepmux = 0;
+	if (mode >= SONG_IDLE)
+		song_gostart(next, next->curpos, mode >= SONG_PLAY);
+	mux_flush();
+	cons_putpos(next->curpos, 0, 0);
+}
+
+/*
+ * conversion state used to split events as they would be sent on
+ * the wire, see song_anaev()
+ */
+static struct conv song_anaconv;
+
+/*
+ * end the current msec window of the dry run: update peaks
+ */
+static void
+song_anawin(struct song *o)
+{
+	struct songana *a = o->ana;
+	struct songanadev *d;
+	unsigned i;
+
+	for (i = 0; i < ev_ndevs; i++) {
+		d = a->dev + i;
+		if (d->winbytes > d->maxwin) {
+			d->maxwin = d->winbytes;
+			d->maxwinmeas = a->meas;
+		}
+		d->winbytes = 0;
+	}
+}
+
+/*
+ * end the current tick of the dry run: update peaks, and note
+ * devices that can't transmit the tick before the next one
+ */
+static void
+song_anatick(struct song *o)
+{
+	struct songana *a = o->ana;
+	struct songanadev *d;
+	struct songanahot *h;
+	struct songtrk *t;
+	unsigned i, nst, usec, ticusec;
+
+	ticusec = o->tempo_factor * o->tempo / 0x100 / 24;
+	for (i = 0; i < ev_ndevs; i++) {
+		d = a->dev + i;
+		if (d->tickev > d->maxev) {
+			d->maxev = d->tickev;
+			d->maxevmeas = a->meas;
+		}
+		if (d->tickbytes > d->maxbytes) {
+			d->maxbytes = d->tickbytes;
+			d->maxbytesmeas = a->meas;
+		}
+		usec = (unsigned long long)d->tickbytes * 1000000 / d->rate;
+		if (usec > d->maxusec)
+			d->maxusec = usec;
+		if (usec > ticusec) {
+			d->nover++;
+			for (h = a->hot + a->nhot; h != a->hot; ) {
+				h--;
+				if (h->dev == i)
+					break;
+			}
+			if (a->nhot > 0 && h->dev == i && h->measure == a->meas)
+				h->nticks++;
+			else if (a->nhot < SONG_NHOT) {
+				h = a->hot + a->nhot++;
+				h->dev = i;
+				h->measure = a->meas;
+				h->nticks = 1;
+			}
+		}
+		d->tickev = d->tickbytes = 0;
+	}
+	nst = 0;
+	SONG_FOREACH_TRK(o, t)
+		nst += t->trackptr->statelist.nstates;
+	if (nst > a->maxstates) {
+		a->maxstates = nst;
+		a->maxstatesmeas = a->meas;
+	}
+	a->nticks++;
+}
+
+/*
+ * account an event sent to the output during the dry run, as it
+ * would be converted and encoded for its device
+ */
+static void
+song_anaev(struct song *o, struct ev *ev)
+{
+	struct songana *a = o->ana;
+	struct songanadev *d;
+	struct mididev *dev;
+	struct ev rev[CONV_NUMREV];
+	unsigned i, n, nev;
+
+	if (o->abspos != a->tic) {
+		if (a->tic != ~0U)
+			song_anatick(o);
+		a->tic = o->abspos;
+		a->meas = o->measure;
+	}
+	if (mux_wallclock / 24000 != a->win) {
+		song_anawin(o);
+		a->win = mux_wallclock / 24000;
+	}
+	d = a->dev + ev->dev;
+	dev = mididev_byunit[ev->dev];
+	if (EV_ISSX(ev)) {
+		rev[0] = *ev;
+		nev = 1;
+	} else {
+		nev = conv_unpackev(&song_anaconv,
+		    dev ? dev->oxctlset : 0, dev ? dev->oevset : 0, ev, rev);
+	}
+	for (i = 0; i < nev; i++) {
+		n = mididev_evsize(dev, &rev[i], &d->status);
+		d->tickbytes += n;
+		d->winbytes += n;
+		d->nbytes += n;
+		d->tickev++;
+		d->nev++;
+	}
+}
+
+/*
+ * call-back called in offline mode for every event sent to the
+ * output, store it in the render track at the current position
+ */
+void
+song_rendercb(struct song *o, struct ev *ev)
+{
+	if (o->ana)
+		song_anaev(o, ev);
+	if (o->renderptr == NULL)
+		return;
+	seqptr_ticput(o->renderptr,
+	    o->abspos + o->renderofs - o->renderptr->tic);
+	seqptr_evput(o->renderptr, ev);
+}
+
+/*
+ * run the clock offline until the given song completes or, if 'cut'
+ * is set, until it's ready to be cut
+ */
+static void
+song_renderrun(struct song *o, int cut)
+{
+	unsigned long delta;
+
+	while (cut ? !o->cutready : !o->complete) {
+		if (!mux_nextdelta(&delta)) {
+			logx(1, "%s: clock not running", __func__);
+			break;
+		}
+		mux_timercb(delta);
+	}
+}
+
+/*
+ * play the song from the current position to its end, without using
+ * devices and as fast as possible, and store everything sent to the
+ * output in the given track
+ */
+void
+song_render(struct song *o, struct track *dst)
+{
+	mux_offline = 1;
+	o->renderptr = (dst != NULL) ? seqptr_new(dst) : NULL;
+	song_play(o);
+	song_renderrun(o, 0);
+	if (o->ana && o->ana->tic != ~0U) {
+		song_anatick(o);
+		song_anawin(o);
+	}
+	song_stop(o);
+	if (o->renderptr) {
+		seqptr_del(o->renderptr);
+		o->renderptr = NULL;
+	}
+	mux_offline = 0;
+}
+
+/*
+ * render the current measure of the song pointed by 'cur', then cut
+ * to the next song as songswap does during playback, and render the
+ * next song to its end. Events of the next song follow the ones of
+ * the current song in the given track. The pointer is changed only
+ * during the render, both songs are stopped afterwards
+ */
+void
+song_rendercut(struct song **cur, struct song *next, struct track *dst)
+{
+	struct song *o = *cur;
+	struct seqptr *sp;
+
+	mux_offline = 1;
+	sp = seqptr_new(dst);
+	o->renderptr = sp;
+	song_play(o);
+	o->cutreq = 1;
+	song_renderrun(o, 1);
+	if (o->cutready) {
+		next->renderptr = sp;
+		next->renderofs = o->abspos -
+		    track_findmeasure(&next->meta, next->curpos);
+		song_cut(cur, next);
+		o->renderptr = NULL;
+		song_renderrun(next, 0);
+		song_stop(next);
+		next->renderptr = NULL;
+		next->renderofs = 0;
+		*cur = o;
+		cons_putpos(o->curpos, 0, 0);
+	} else {
+		song_stop(o);
+		o->renderptr = NULL;
+	}
+	seqptr_del(sp);
+	mux_offline = 0;
+}
+
+/*
+ * play the song offline as song_render() does, and store in the
+ * given structure how much each device would be loaded: events and
+ * bytes per tick and per millisecond, time to transmit each tick,
+ * and measures where it exceeds the tick duration. Devices are
+ * not used, but their conversion and rate settings are
+ */
+void
+song_analyze(struct song *o, struct songana *a)
+{
+	struct songanadev *d;
+	struct mididev *dev;
+	struct songsx *x;
+	struct sysex *s;
+	unsigned i;
+
+	a->tic = ~0U;
+	a->meas = 0;
+	a->win = ~0UL;
+	a->nticks = 0;
+	a->maxstates = a->maxstatesmeas = 0;
+	a->nhot = 0;
+	a->dev = xmalloc(ev_ndevs * sizeof(struct songanadev), "songana");
+	for (i = 0; i < ev_ndevs; i++) {
+		d = a->dev + i;
+		dev = mididev_byunit[i];
+		d->status = 0;
+		d->rate = (dev != NULL && dev->orate != 0) ?
+		    dev->orate : DEFAULT_SXRATE;
+		d->nev = d->nbytes = d->sxbytes = 0;
+		d->tickev = d->tickbytes = d->winbytes = 0;
+		d->maxev = d->maxevmeas = 0;
+		d->maxbytes = d->maxbytesmeas = 0;
+		d->maxwin = d->maxwinmeas = 0;
+		d->maxusec = d->nover = 0;
+	}
+	SONG_FOREACH_SX(o, x) {
+		for (s = x->sx.first; s != NULL; s = s->next) {
+			if (s->unit < ev_ndevs)
+				a->dev[s->unit].sxbytes += s->used;
+		}
+	}
+	conv_init(&song_anaconv);
+	o->ana = a;
+	song_render(o, NULL);
+	o->ana = NULL;
+	conv_done(&song_anaconv);
+}
+
 
 /*
  * the song_try_xxx() routines return 1 if we can have exclusive write
@@ -1753,6 +2577,10 @@ song_try_filt(struct song *o, struct songfilt *f)
 unsigned
 song_try_sx(struct song *o, struct songsx *x)
 {
+	if (o->sxstate == SONG_SX_SEND && o->sxbank == x) {
+		logx(1, "sysex being sent, use ``s'' to stop");
+		return 0;
+	}
 	if (o->mode >= SONG_REC && (o->cursx == x)) {
 		logx(1, "sysex in use, use ``s'' or ``i'' to stop recording");
 		return 0;
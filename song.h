@@ -21,6 +21,13 @@
 #define SONG_DEFAULT_TPB	24
 #define SONG_DEFAULT_TEMPO	60
 
+/*
+ * max number of events captured during a tick, if recording is
+ * deferred
+ */
+#define SONG_RECQLEN		1024
+
+#include <stdio.h>
 #include "name.h"
 #include "track.h"
 #include "frame.h"
@@ -34,6 +41,17 @@ struct songfilt;
 struct songsx;
 struct undo;
 
+/*
+ * events to play when the loop wraps, to go from the state at loop
+ * end to the state at loop start, see song_loop_mkwrap()
+ */
+struct songwrap {
+	unsigned nstates;		/* number of states at loop end */
+	unsigned ncancel, nrestore;	/* number of events below */
+	struct ev *cancel;		/* frames to cancel */
+	struct ev *restore;		/* events to restore */
+};
+
 struct songtrk {
 	struct name name;		/* identifier + list entry */
 	struct track track;		/* actual data */
@@ -41,7 +59,12 @@ struct songtrk {
 	struct seqptr *loopstate;
 	struct songfilt *curfilt;	/* source and dest. channel */
 	struct seqptr *loop_trackptr;	/* backup of trackptr */
+	struct songwrap loop_wrap;	/* events to play on loop wrap */
 	unsigned mute;
+	unsigned nexttic;		/* abs. tic of the next event */
+	unsigned playidx;		/* order in which tracks play */
+	unsigned char *smf;		/* cached MTrk data, see smf.c */
+	unsigned smflen, smfunit;	/* its size and tics_per_unit */
 };
 
 struct songchan {
@@ -62,6 +85,47 @@ struct songsx {
 	struct sysexlist sx;		/* list of sysex messages */
 };
 
+/*
+ * output statistics of a device, see song_analyze()
+ */
+struct songanadev {
+	unsigned status;		/* running status */
+	unsigned rate;			/* bytes per second */
+	unsigned long nev, nbytes;	/* events and bytes sent */
+	unsigned long sxbytes;		/* bytes of sysex banks */
+	unsigned tickev, tickbytes;	/* sent during the current tick */
+	unsigned winbytes;		/* sent during the current msec */
+	unsigned maxev, maxevmeas;	/* peak events per tick, measure */
+	unsigned maxbytes, maxbytesmeas; /* peak bytes per tick, measure */
+	unsigned maxwin, maxwinmeas;	/* peak bytes per msec, measure */
+	unsigned maxusec;		/* peak transmit time of a tick */
+	unsigned nover;			/* ticks longer to transmit */
+};
+
+/*
+ * measure where a device needs more time to transmit a tick than
+ * the tick lasts
+ */
+#define SONG_NHOT	32
+struct songanahot {
+	unsigned dev, measure;
+	unsigned nticks;		/* overloaded ticks in the measure */
+};
+
+/*
+ * result of a dry run, see song_analyze()
+ */
+struct songana {
+	unsigned tic;			/* abspos of the current tick */
+	unsigned meas;			/* measure of the current tick */
+	unsigned long win;		/* current msec window */
+	unsigned nticks;		/* ticks played */
+	unsigned maxstates, maxstatesmeas; /* peak track states, measure */
+	unsigned nhot;			/* entries in 'hot' */
+	struct songanahot hot[SONG_NHOT];
+	struct songanadev *dev;		/* per-device stats */
+};
+
 struct song {
 	/*
 	 * music-related fields that should be saved
@@ -71,8 +135,23 @@ struct song {
 	struct name *chanlist;		/* list of channels */
 	struct name *filtlist;		/* list of fiters */
 	struct name *sxlist;		/* list of system exclive banks */
+
+	/*
+	 * indexes of the above lists, built by the first lookup and
+	 * discarded by any change other than an addition, see
+	 * song_idxreset()
+	 */
+	unsigned idx_valid;		/* true if the indexes are built */
+	struct nameidx trkidx, filtidx, sxidx;
+	struct nameidx chanidx[2];	/* output and input chans by name */
+	unsigned chanmapsz;		/* number of (dev, ch) pairs */
+	struct songchan **chanmap[2];	/* chans by (dev, ch) */
+
 	struct undo *undo;		/* list of operation to undo */
 	unsigned undo_size;		/* size of all undo buffers */
+	FILE *undo_file;		/* old undo data, see undo_spill() */
+	long undo_fileend;		/* end of data in 'undo_file' */
+	unsigned undo_nspill;		/* number of entries in 'undo_file' */
 	unsigned tics_per_unit;		/* number of tics in an unit note */
 	unsigned tempo_factor;		/* tempo := tempo * factor / 256 */
 	struct songtrk *curtrk;		/* default track */
@@ -110,7 +189,46 @@ struct song {
 	struct seqptr *playptr;		/* replay position in rec track */
 	struct statelist rec_input;	/* events to be recorded */
 	struct statelist rec_replay;	/* recorded events to be replayed */
+
+	/*
+	 * if 'recdefer' is set, events to record are stored in this
+	 * ring as they arrive, and merged into the 'rec' track at the
+	 * next tick, see song_recdrain()
+	 */
+	unsigned recdefer;
+	unsigned recq_start, recq_used;
+	struct ev recq[SONG_RECQLEN];
 	struct sysexlist recsx;
+	struct seqptr *renderptr;	/* output capture, see song_render() */
+	unsigned renderofs;		/* added to 'abspos' in the capture */
+	struct songana *ana;		/* output stats, see song_analyze() */
+
+	/*
+	 * sysex banks are sent in the background, one message at a
+	 * time, at the rate of their device, then the config of the
+	 * channels is sent, see song_sxcb(). If 'sxwait' is set, the
+	 * position is restored and playback started only after that
+	 */
+	unsigned sxwait;
+#define SONG_SX_DONE	0		/* nothing left to send */
+#define SONG_SX_SEND	1		/* sending sysex messages */
+#define SONG_SX_CONF	2		/* waiting after chan config */
+	unsigned sxstate;		/* one of above */
+	struct timo sxto;		/* to send the next message */
+	struct songsx *sxbank;		/* bank of the next message */
+	struct sysex *sxnext;		/* next message to send */
+#define SONG_SXGO_NONE	0		/* nothing deferred */
+#define SONG_SXGO_GOTO	1		/* position must be restored */
+#define SONG_SXGO_START	2		/* above + playback start */
+	unsigned sxgo;			/* one of above */
+	unsigned sxgopos;		/* measure to go to */
+
+	/*
+	 * if 'cutreq' is set, playback stops at the next measure
+	 * boundary without playing it, and 'cutready' is set; then
+	 * the next song can be started in its place, see song_cut()
+	 */
+	unsigned cutreq, cutready;
 	unsigned abspos;		/* cur postion in ticks */
 	unsigned measure, beat, tic;	/* cur position (for metronome) */
 #define SONG_IDLE	1		/* filter running */
@@ -127,6 +245,16 @@ struct song {
 	unsigned loop_tstart;		/* loop start tick */
 	unsigned loop_tend;		/* loop end tick */
 	struct seqptr *loop_metaptr;	/* backup of metaptr */
+	struct songwrap loop_metawrap;	/* events to play on loop wrap */
+
+	/*
+	 * tracks that didn't reach the end-of-track, as a binary
+	 * heap ordered by next event tic (then by 'playidx'). Track
+	 * pointers are moved forward only when they have an event to
+	 * play, see song_trksync()
+	 */
+	struct songtrk **playq;
+	unsigned playq_n;
 };
 
 extern char *song_tap_modestr[3];
@@ -157,8 +285,10 @@ void song_init(struct song *);
 void song_done(struct song *);
 
 struct songtrk *song_trknew(struct song *, char *);
+void song_idxreset(struct song *);
 struct songtrk *song_trklookup(struct song *, char *);
 void song_trkdel(struct song *, struct songtrk *);
+void song_trkdirty(struct song *, struct track *);
 void song_trkmute(struct song *, struct songtrk *);
 void song_trkunmute(struct song *, struct songtrk *);
 
@@ -188,11 +318,16 @@ void song_setcurchan(struct song *, struct songchan *, int);
 unsigned song_endpos(struct song *);
 
 void song_setmode(struct song *, unsigned);
+void song_sxcb(void *);
 void song_goto(struct song *, unsigned);
 void song_record(struct song *);
 void song_play(struct song *);
 void song_idle(struct song *);
+void song_render(struct song *, struct track *);
+void song_rendercut(struct song **, struct song *, struct track *);
+void song_analyze(struct song *, struct songana *);
 void song_stop(struct song *);
+void song_cut(struct song **, struct song *);
 
 unsigned song_try_mode(struct song *, unsigned);
 unsigned song_try_curev(struct song *);
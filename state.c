@@ -26,8 +26,8 @@
  * state pool. In a typical performace, the maximum state list length
  * is roughly equal to the maximum sounding notes; the mean list
  * length is between 2 and 3 states and the maximum is between 10 and
- * 20 states. Currently we use a singly linked list, but for
- * performance reasons we shoud use a hash table in the future.
+ * 20 states. Currently we use a doubly linked list, and long lists
+ * are indexed by a hash table keyed by the fields ev_match() compares.
  *
  */
 
@@ -307,6 +307,126 @@ state_restore(struct state *st, struct ev *rev)
 }
 
 
+/*
+ * return the hash index bucket of the given event. Events
+ * matching each other (see ev_match()) go to the same bucket
+ */
+static unsigned
+statelist_hash(struct ev *ev)
+{
+	unsigned h;
+
+	switch (ev->cmd) {
+	case EV_NON:
+	case EV_NOFF:
+	case EV_KAT:
+		h = (EV_NON << 12) + (ev->dev << 4) + ev->ch;
+		h = h * 131 + ev->note_num;
+		break;
+	case EV_XCTL:
+	case EV_NRPN:
+	case EV_RPN:
+		h = (ev->cmd << 12) + (ev->dev << 4) + ev->ch;
+		h = h * 131 + ev->v0;
+		break;
+	case EV_BEND:
+	case EV_CAT:
+	case EV_XPC:
+		h = (ev->cmd << 12) + (ev->dev << 4) + ev->ch;
+		break;
+	default:
+		h = ev->cmd;
+		break;
+	}
+	h ^= h >> 8;
+	return h & (STATELIST_NBUCKETS - 1);
+}
+
+/*
+ * add the state to the head of its hash index bucket
+ */
+static void
+statelist_hashadd(struct statelist *o, struct state *st)
+{
+	struct state **b;
+
+	b = o->hash + statelist_hash(&st->ev);
+	st->hnext = *b;
+	st->hprev = b;
+	if (*b)
+		(*b)->hprev = &st->hnext;
+	*b = st;
+}
+
+/*
+ * build the hash index of the given list, states are appended to the
+ * buckets so the buckets have the same order as the list
+ */
+static void
+statelist_hashinit(struct statelist *o)
+{
+	struct state *i, **tail[STATELIST_NBUCKETS];
+	unsigned n;
+
+	o->hash = xmalloc(STATELIST_NBUCKETS * sizeof(struct state *),
+	    "statelist_hash");
+	for (n = 0; n < STATELIST_NBUCKETS; n++) {
+		o->hash[n] = NULL;
+		tail[n] = &o->hash[n];
+	}
+	for (i = o->first; i != NULL; i = i->next) {
+		n = statelist_hash(&i->ev);
+		i->hnext = NULL;
+		i->hprev = tail[n];
+		*tail[n] = i;
+		tail[n] = &i->hnext;
+	}
+}
+
+/*
+ * free the hash index of the given list
+ */
+static void
+statelist_hashdone(struct statelist *o)
+{
+	if (o->hash) {
+		xfree(o->hash);
+		o->hash = NULL;
+	}
+}
+
+/*
+ * return the list of states that may match the given event, linked
+ * through the 'next' field if 'hashed' is zero or through 'hnext'
+ * otherwise
+ */
+static struct state *
+statelist_first(struct statelist *o, struct ev *ev, int *hashed)
+{
+	if (o->hash == NULL && o->nstates > STATELIST_HASHMIN)
+		statelist_hashinit(o);
+	if (o->hash) {
+		*hashed = 1;
+		return o->hash[statelist_hash(ev)];
+	}
+	*hashed = 0;
+	return o->first;
+}
+
+#ifdef STATE_PROF
+/*
+ * account a lookup that visited the given number of states
+ */
+static void
+statelist_prof(struct statelist *o, unsigned depth)
+{
+	o->nlookup++;
+	o->ndepth += depth;
+	if (o->maxdepth < depth)
+		o->maxdepth = depth;
+}
+#endif
+
 /*
  * initialize an empty state list
  */
@@ -314,8 +434,15 @@ void
 statelist_init(struct statelist *o)
 {
 	o->first = NULL;
+	o->hash = NULL;
+	o->nstates = 0;
 	o->changed = 0;
 	o->serial = state_serial++;
+#ifdef STATE_PROF
+	o->nlookup = 0;
+	o->ndepth = 0;
+	o->maxdepth = 0;
+#endif
 }
 
 /*
@@ -343,7 +470,16 @@ statelist_done(struct statelist *o)
 		statelist_rm(o, i);
 		state_del(i);
 	}
-
+	statelist_hashdone(o);
+#ifdef STATE_PROF
+	if (o->nlookup > 0) {
+		logx(1, "%s: %u: %u lookups, depth: avg = %u.%02u, max = %u",
+		    __func__, o->serial, o->nlookup,
+		    o->ndepth / o->nlookup,
+		    100 * (o->ndepth % o->nlookup) / o->nlookup,
+		    o->maxdepth);
+	}
+#endif
 }
 
 void
@@ -375,6 +511,37 @@ statelist_dup(struct statelist *o, struct statelist *src)
 	}
 }
 
+/*
+ * create a new statelist by copying another one, unlike
+ * statelist_dup(), the order of states and all their fields except
+ * the tag are preserved, so the copy can be used as if the track was
+ * read again
+ */
+void
+statelist_copy(struct statelist *o, struct statelist *src)
+{
+	struct state *i, *n, **tail;
+
+	statelist_init(o);
+	tail = &o->first;
+	for (i = src->first; i != NULL; i = i->next) {
+		n = state_new();
+		n->ev = i->ev;
+		n->phase = i->phase;
+		n->flags = i->flags;
+		n->nevents = i->nevents;
+		n->tag = 0;
+		n->tic = i->tic;
+		n->pos = i->pos;
+		n->next = NULL;
+		n->prev = tail;
+		*tail = n;
+		tail = &n->next;
+		o->nstates++;
+	}
+	o->changed = src->changed;
+}
+
 /*
  * remove and free all states from the state list
  */
@@ -388,10 +555,12 @@ statelist_empty(struct statelist *o)
 		statelist_rm(o, i);
 		state_del(i);
 	}
+	statelist_hashdone(o);
 }
 
 /*
- * add a state to the state list
+ * add a state to the state list. If the list is indexed, the
+ * state's event must be set, since it's used as hash key
  */
 void
 statelist_add(struct statelist *o, struct state *st)
@@ -401,6 +570,9 @@ statelist_add(struct statelist *o, struct state *st)
 	if (o->first)
 		o->first->prev = &st->next;
 	o->first = st;
+	o->nstates++;
+	if (o->hash)
+		statelist_hashadd(o, st);
 }
 
 /*
@@ -413,6 +585,12 @@ statelist_rm(struct statelist *o, struct state *st)
 	*st->prev = st->next;
 	if (st->next)
 		st->next->prev = st->prev;
+	o->nstates--;
+	if (o->hash) {
+		*st->hprev = st->hnext;
+		if (st->hnext)
+			st->hnext->hprev = st->hprev;
+	}
 }
 
 /*
@@ -423,11 +601,23 @@ struct state *
 statelist_lookup(struct statelist *o, struct ev *ev)
 {
 	struct state *i;
-	for (i = o->first; i != NULL; i = i->next) {
+	int hashed;
+#ifdef STATE_PROF
+	unsigned depth = 0;
+#endif
+
+	for (i = statelist_first(o, ev, &hashed); i != NULL;
+	     i = hashed ? i->hnext : i->next) {
+#ifdef STATE_PROF
+		depth++;
+#endif
 		if (state_match(i, ev)) {
 			break;
 		}
 	}
+#ifdef STATE_PROF
+	statelist_prof(o, depth);
+#endif
 	return i;
 }
 
@@ -444,19 +634,26 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 {
 	struct state *st, *stnext;
 	unsigned phase;
+	int hashed;
+#ifdef STATE_PROF
+	unsigned depth = 0;
+#endif
 
 	phase = ev_phase(ev);
 
-	st = statelist->first;
+	st = statelist_first(statelist, ev, &hashed);
 	for (;;) {
 		if (st == NULL) {
 			st = state_new();
+			st->ev = *ev;
 			st->flags = STATE_NEW;
 			statelist_add(statelist, st);
 			break;
 		}
-
-		stnext = st->next;
+#ifdef STATE_PROF
+		depth++;
+#endif
+		stnext = hashed ? st->hnext : st->next;
 
 		if (state_match(st, ev)) {
 			if (!(st->phase == EV_PHASE_LAST) &&
@@ -470,11 +667,15 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 		}
 		st = stnext;
 	}
+#ifdef STATE_PROF
+	statelist_prof(statelist, depth);
+#endif
 
 	switch (phase) {
 	case EV_PHASE_FIRST:
 		if (st->flags != STATE_NEW) {
 			st = state_new();
+			st->ev = *ev;
 			st->flags = STATE_NEW | STATE_NESTED;
 			statelist_add(statelist, st);
 #ifdef STATE_DEBUG
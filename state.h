@@ -25,6 +25,7 @@ struct statelist;
 
 struct state  {
 	struct state *next, **prev;	/* for statelist */
+	struct state *hnext, **hprev;	/* for statelist hash index */
 	struct ev ev;			/* last event */
 	unsigned phase;			/* current phase (of the 'ev' field) */
 	/*
@@ -51,19 +52,31 @@ struct state  {
 	struct seqev *pos;		/* pointer to the FIRST event */
 };
 
+/*
+ * number of hash index buckets, and the number of states above which
+ * the index is created
+ */
+#define STATELIST_NBUCKETS	256
+#define STATELIST_HASHMIN	32
+
 struct statelist {
 	/*
-	 * instead of a simple list, we should use a hash table here,
-	 * but statistics on real-life cases seem to show that lookups
+	 * statistics on real-life cases seem to show that lookups
 	 * are very fast thanks to the state ordering (average lookup
 	 * time is around 1-2 iterations for a common MIDI file), so
-	 * we keep using a simple list
+	 * we use a simple list. Once the list becomes long, a hash
+	 * index of the states is built and used for lookups. Buckets
+	 * keep the same order as the list.
 	 */
 	struct state *first;	/* head of the state list */
+	struct state **hash;	/* hash index or NULL if none */
+	unsigned nstates;	/* number of states in the list */
 	unsigned changed;	/* if changed within this tick */
 	unsigned serial;	/* unique ID */
 #ifdef STATE_PROF
-	struct prof prof;
+	unsigned nlookup;	/* number of lookups */
+	unsigned ndepth;	/* total number of states visited */
+	unsigned maxdepth;	/* max states visited by a lookup */
 #endif
 };
 
@@ -83,6 +96,7 @@ void	      statelist_init(struct statelist *);
 void	      statelist_done(struct statelist *);
 void	      statelist_dump(struct statelist *);
 void	      statelist_dup(struct statelist *, struct statelist *);
+void	      statelist_copy(struct statelist *, struct statelist *);
 void	      statelist_empty(struct statelist *);
 void	      statelist_add(struct statelist *, struct state *);
 void	      statelist_rm(struct statelist *, struct state *);
@@ -18,15 +18,17 @@
  * system exclusive (sysex) message management.
  *
  * A sysex message is a long byte string whose size is not know in
- * advance. So we preallocate a large pool of 256 byte chunks and we
- * represent a sysex message as a list of chunks. Since there may be
- * several sysex messages we use a pool for the sysex messages
- * themselves.
+ * advance. It's stored in a contiguous buffer that grows as
+ * needed. Most messages are small, so they are stored in 256 byte
+ * chunks taken from a pool; only larger messages (ex. bulk dumps)
+ * use xmalloc(). Since there may be several sysex messages we use
+ * a pool for the sysex messages themselves.
  *
  * the song contains a list of sysex message, so we group them in a
  * list.
  */
 
+#include <string.h>
 #include "utils.h"
 #include "sysex.h"
 #include "defs.h"
@@ -54,8 +56,6 @@ chunk_new(void)
 {
 	struct chunk *o;
 	o = (struct chunk *)pool_new(&chunk_pool);
-	o->next = NULL;
-	o->used = 0;
 	return o;
 }
 
@@ -87,43 +87,81 @@ sysex_new(unsigned unit)
 	o = (struct sysex *)pool_new(&sysex_pool);
 	o->next = NULL;
 	o->unit = unit;
-	o->first = o->last = NULL;
+	o->data = NULL;
+	o->used = o->size = 0;
 	return o;
 }
 
 /*
- * free all chunks of a sysex message, and the message
- * itself
+ * free the message storage
+ */
+static void
+sysex_free(struct sysex *o)
+{
+	if (o->size == CHUNK_SIZE)
+		chunk_del((struct chunk *)o->data);
+	else if (o->size > 0)
+		xfree(o->data);
+}
+
+/*
+ * free the message data and the message itself
  */
 void
 sysex_del(struct sysex *o)
 {
-	struct chunk *i, *inext;
-	for (i = o->first; i != NULL; i = inext) {
-		inext = i->next;
-		chunk_del(i);
-	}
+	sysex_free(o);
 	pool_del(&sysex_pool, o);
 }
 
+/*
+ * make room for 'n' more bytes; small messages are stored in a
+ * chunk, larger ones in a buffer that doubles as it fills
+ */
+static void
+sysex_grow(struct sysex *o, unsigned n)
+{
+	unsigned char *data;
+	unsigned size;
+
+	if (o->used + n <= o->size)
+		return;
+	size = (o->size == 0) ? CHUNK_SIZE : o->size;
+	while (size < o->used + n)
+		size *= 2;
+	if (size == CHUNK_SIZE)
+		data = chunk_new()->data;
+	else
+		data = xmalloc(size, "sysex");
+	if (o->used > 0)
+		memcpy(data, o->data, o->used);
+	sysex_free(o);
+	o->data = data;
+	o->size = size;
+}
+
 /*
  * add a byte to the message
  */
 void
 sysex_add(struct sysex *o, unsigned data)
 {
-	struct chunk *ck;
+	if (o->used == o->size)
+		sysex_grow(o, 1);
+	o->data[o->used++] = data;
+}
 
-	ck = o->last;
-	if (!ck) {
-		ck = o->first = o->last = chunk_new();
-	}
-	if (ck->used >= CHUNK_SIZE) {
-		ck->next = chunk_new();
-		ck = ck->next;
-		o->last = ck;
-	}
-	ck->data[ck->used++] = data;
+/*
+ * add a block of bytes to the message
+ */
+void
+sysex_addbuf(struct sysex *o, unsigned char *buf, unsigned len)
+{
+	if (len == 0)
+		return;
+	sysex_grow(o, len);
+	memcpy(o->data + o->used, buf, len);
+	o->used += len;
 }
 
 /*
@@ -132,16 +170,13 @@ sysex_add(struct sysex *o, unsigned data)
 void
 sysex_log(struct sysex *o)
 {
-	struct chunk *ck;
 	unsigned count;
 
-	for (ck = o->first; ck != NULL; ck = ck->next) {
-		count = ck->used;
-		if (count > 16)
-			count = 16;
-		logx(1, "unit = %x, data = {{hexdump:%p,%u}%s}",
-		    o->unit, ck->data, count, (count < ck->used) ? " ..." : "");
-	}
+	count = o->used;
+	if (count > 16)
+		count = 16;
+	logx(1, "unit = %x, data = {{hexdump:%p,%u}%s}",
+	    o->unit, o->data, count, (count < o->used) ? " ..." : "");
 }
 
 /*
@@ -152,30 +187,27 @@ unsigned
 sysex_check(struct sysex *o)
 {
 	unsigned status, data;
-	struct chunk *ck;
 	unsigned i;
 
 
 	status = 0;
-	for (ck = o->first; ck != NULL; ck = ck->next) {
-		for (i = 0; i < ck->used; i++) {
-			data = ck->data[i];
-			if (data == 0xf0) { 		/* sysex start */
-				if (status != 0) {
-					return 0;
-				}
-				status = data;
-			} else if (data == 0xf7) {
-				if (status != 0xf0) {
-					return 0;
-				}
-				status = data;
-			} else if (data > 0x7f) {
+	for (i = 0; i < o->used; i++) {
+		data = o->data[i];
+		if (data == 0xf0) { 		/* sysex start */
+			if (status != 0) {
+				return 0;
+			}
+			status = data;
+		} else if (data == 0xf7) {
+			if (status != 0xf0) {
+				return 0;
+			}
+			status = data;
+		} else if (data > 0x7f) {
+			return 0;
+		} else {
+			if (status != 0xf0) {
 				return 0;
-			} else {
-				if (status != 0xf0) {
-					return 0;
-				}
 			}
 		}
 	}
@@ -302,7 +334,7 @@ sysexlist_log(struct sysexlist *o)
 	struct sysex *e;
 
 	for (e = o->first; e != NULL; e = e->next) {
-		if (e->first)
+		if (e->used > 0)
 			sysex_log(e);
 	}
 }
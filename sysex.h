@@ -17,17 +17,23 @@
 #ifndef MIDISH_SYSEX_H
 #define MIDISH_SYSEX_H
 
+/*
+ * storage of small messages; larger ones are allocated with xmalloc()
+ */
 struct chunk {
-	struct chunk *next;
-	unsigned used;			/* bytes used in 'data' */
 #define CHUNK_SIZE	0x100
 	unsigned char data[CHUNK_SIZE];
 };
 
+/*
+ * a sysex message is stored contiguously, so it can be copied or
+ * sent as a single block
+ */
 struct sysex {
 	struct sysex *next;
 	unsigned unit;			/* device number */
-	struct chunk *first, *last;
+	unsigned char *data;		/* message bytes */
+	unsigned used, size;		/* bytes used and allocated */
 };
 
 struct sysexlist {
@@ -51,6 +57,7 @@ void	      sysex_pool_done(void);
 struct sysex *sysex_new(unsigned);
 void	      sysex_del(struct sysex *);
 void	      sysex_add(struct sysex *, unsigned);
+void	      sysex_addbuf(struct sysex *, unsigned char *, unsigned);
 void	      sysex_log(struct sysex *);
 unsigned      sysex_check(struct sysex *);
 
@@ -31,16 +31,33 @@
 #include "textio.h"
 #include "cons.h"
 
+/*
+ * input is read in large blocks, except on stdin, which is read one
+ * character at a time, so that interactive use isn't delayed
+ */
+#define TEXTIN_BUFSZ	0x4000
+
+/*
+ * output is accumulated and written in large blocks, except on stdout
+ * which is written at the end of each textout_putxxx() call, so it
+ * stays in sync with other messages
+ */
+#define TEXTOUT_BUFSZ	0x4000
+
 struct textin
 {
 	FILE *file;
 	unsigned line, col;
+	unsigned char *pos, *end;	/* unread part of the buffer */
+	unsigned char buf[TEXTIN_BUFSZ];
 };
 
 struct textout
 {
 	FILE *file;
 	unsigned indent, col;
+	unsigned used;			/* bytes in the buffer */
+	char buf[TEXTOUT_BUFSZ];
 };
 
 /* -------------------------------------------------------- input --- */
@@ -62,6 +79,7 @@ textin_new(char *filename)
 		}
 	}
 	o->line = o->col = 0;
+	o->pos = o->end = o->buf;
 	return o;
 }
 
@@ -72,17 +90,31 @@ textin_delete(struct textin *o)
 	xfree(o);
 }
 
+/*
+ * refill the buffer, return the number of characters read
+ */
+static size_t
+textin_fill(struct textin *o)
+{
+	size_t n;
+
+	n = fread(o->buf, 1, o->file == stdin ? 1 : TEXTIN_BUFSZ, o->file);
+	if (n == 0 && ferror(o->file)) {
+		logx(1, "fread: %s", strerror(errno));
+	}
+	o->pos = o->buf;
+	o->end = o->buf + n;
+	return n;
+}
+
 unsigned
 textin_getchar(struct textin *o, int *c)
 {
-	*c = fgetc(o->file);
-	if (*c == EOF) {
+	if (o->pos == o->end && textin_fill(o) == 0) {
 		*c = CHAR_EOF;
-		if (ferror(o->file)) {
-			logx(1, "fgetc: %s", strerror(errno));
-		}
 		return 1;
 	}
+	*c = *o->pos++;
 	if (*c == '\n') {
 		o->col = 0;
 		o->line++;
@@ -91,7 +123,6 @@ textin_getchar(struct textin *o, int *c)
 	} else {
 		o->col++;
 	}
-	*c = *c & 0xff;
 	return 1;
 }
 
@@ -122,12 +153,46 @@ textout_new(char *filename)
 
 	o->indent = 0;
 	o->col = 0;
+	o->used = 0;
 	return o;
 }
 
+/*
+ * write the buffer contents to the file
+ */
+static void
+textout_flush(struct textout *o)
+{
+	if (o->used > 0 && fwrite(o->buf, o->used, 1, o->file) != 1)
+		logx(1, "fwrite: %s", strerror(errno));
+	o->used = 0;
+}
+
+/*
+ * append the given bytes to the buffer
+ */
+static void
+textout_write(struct textout *o, char *data, unsigned len)
+{
+	unsigned n;
+
+	while (len > 0) {
+		if (o->used == TEXTOUT_BUFSZ)
+			textout_flush(o);
+		n = TEXTOUT_BUFSZ - o->used;
+		if (n > len)
+			n = len;
+		memcpy(o->buf + o->used, data, n);
+		o->used += n;
+		data += n;
+		len -= n;
+	}
+}
+
 void
 textout_delete(struct textout *o)
 {
+	textout_flush(o);
 	if (o->file != stdout)
 		fclose(o->file);
 
@@ -159,7 +224,7 @@ textout_putstr(struct textout *o, char *str)
 
 		if (o->col == 0) {
 			for (i = 0; i < o->indent; i++) {
-				fwrite(buf, sizeof(buf), 1, o->file);
+				textout_write(o, buf, sizeof(buf));
 				o->col += 8;
 			}
 		}
@@ -173,18 +238,33 @@ textout_putstr(struct textout *o, char *str)
 			o->col++;
 		}
 
-		fwrite(str, p - str, 1, o->file);
+		textout_write(o, str, p - str);
 		str = p;
 	}
+	if (o->file == stdout)
+		textout_flush(o);
 }
 
 void
 textout_putlong(struct textout *o, long val)
 {
-	char buf[sizeof(val) * 3 + 1];
-
-	snprintf(buf, sizeof(buf), "%ld", val);
-	textout_putstr(o, buf);
+	char buf[sizeof(val) * 3 + 2], *p;
+	unsigned long uval;
+
+	/*
+	 * this is called for every number of every event when saving
+	 * files, so avoid snprintf()
+	 */
+	p = buf + sizeof(buf);
+	*--p = 0;
+	uval = val < 0 ? -(unsigned long)val : (unsigned long)val;
+	do {
+		*--p = '0' + uval % 10;
+		uval /= 10;
+	} while (uval > 0);
+	if (val < 0)
+		*--p = '-';
+	textout_putstr(o, p);
 }
 
 void
@@ -15,10 +15,10 @@
  */
 
 /*
- * trivial timeouts implementation.
+ * timeouts implementation.
  *
  * A timeout is used to schedule the call of a routine (the callback)
- * there is a global list of timeouts that is processed inside the
+ * there is a global set of timeouts that is processed inside the
  * event loop ie mux_run(). Timeouts work as follows:
  *
  *	first the timo structure must be initialized with timo_set()
@@ -32,15 +32,103 @@
  *	the timeout can be aborted with timo_del(), it is OK to try to
  *	abort a timout that has expired
  *
+ * Pending timeouts are stored in a hierarchical timing wheel, so
+ * that timo_add() and timo_del() don't depend on the number of
+ * pending timeouts. Level 0 slots hold timeouts expiring at the
+ * exact slot time, level 'n' slots hold timeouts expiring within
+ * the TIMO_NSLOTS^n units long slot. A timeout is put on the level of
+ * the most significant bit by which its expiration time differs
+ * from the wheel time; this way all level 'n' timeouts expire before
+ * any level 'n + 1' timeout. Once the wheel time reaches a level 'n'
+ * slot, its timeouts are moved ("cascaded") to lower levels.
+ *
+ * Internally, times are 64-bit, so they never wrap.
  */
 
+#include <strings.h>
 #include "utils.h"
 #include "timo.h"
+#include "trace.h"
+
+struct timoslot {
+	struct timo *head, **tail;
+};
 
 unsigned timo_debug = 0;
-struct timo *timo_queue;
 unsigned timo_abstime;
 
+/*
+ * current time and time up to which the wheel was processed; they
+ * only differ inside timo_update()
+ */
+unsigned long long timo_now, timo_wtime;
+
+/*
+ * the wheel and per-level bitmaps of non-empty slots
+ */
+struct timoslot timo_wheel[TIMO_NLEVELS * TIMO_NSLOTS];
+unsigned timo_map[TIMO_NLEVELS];
+
+/*
+ * return the absolute time the given slot starts at
+ */
+static unsigned long long
+timo_slotstart(unsigned level, unsigned idx)
+{
+	unsigned long long mask;
+	unsigned shift;
+
+	shift = (level + 1) * TIMO_BITS;
+	mask = (shift >= 64) ? 0 : ~0ULL << shift;
+	return (timo_wtime & mask) |
+	    ((unsigned long long)idx << (level * TIMO_BITS));
+}
+
+/*
+ * put the timeout on the wheel slot corresponding to its expiration
+ * time
+ */
+static void
+timo_insert(struct timo *o)
+{
+	struct timoslot *s;
+	unsigned long long diff;
+	unsigned level, idx;
+
+	level = 0;
+	for (diff = (o->val ^ timo_wtime) >> TIMO_BITS;
+	     diff != 0; diff >>= TIMO_BITS)
+		level++;
+	idx = (o->val >> (level * TIMO_BITS)) & (TIMO_NSLOTS - 1);
+	o->slot = level * TIMO_NSLOTS + idx;
+	s = timo_wheel + o->slot;
+	o->next = NULL;
+	o->prev = s->tail;
+	*s->tail = o;
+	s->tail = &o->next;
+	timo_map[level] |= 1U << idx;
+}
+
+/*
+ * remove the timeout from its wheel slot
+ */
+static void
+timo_unlink(struct timo *o)
+{
+	struct timoslot *s = timo_wheel + o->slot;
+
+	*o->prev = o->next;
+	if (o->next)
+		o->next->prev = o->prev;
+	else
+		s->tail = o->prev;
+	if (s->head == NULL) {
+		timo_map[o->slot / TIMO_NSLOTS] &=
+		    ~(1U << (o->slot % TIMO_NSLOTS));
+	}
+	o->set = 0;
+}
+
 /*
  * initialise a timeout structure, arguments are callback and argument
  * that will be passed to the callback
@@ -60,10 +148,6 @@ timo_set(struct timo *o, void (*cb)(void *), void *arg)
 void
 timo_add(struct timo *o, unsigned delta)
 {
-	struct timo **i;
-	unsigned val;
-	int diff;
-
 #ifdef TIMO_DEBUG
 	if (o->set) {
 		logx(1, "%s: already set", __func__);
@@ -74,17 +158,9 @@ timo_add(struct timo *o, unsigned delta)
 		panic();
 	}
 #endif
-	val = timo_abstime + delta;
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		diff = (*i)->val - val;
-		if (diff > 0) {
-			break;
-		}
-	}
+	o->val = timo_now + delta;
 	o->set = 1;
-	o->val = val;
-	o->next = *i;
-	*i = o;
+	timo_insert(o);
 }
 
 /*
@@ -93,17 +169,12 @@ timo_add(struct timo *o, unsigned delta)
 void
 timo_del(struct timo *o)
 {
-	struct timo **i;
-
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		if (*i == o) {
-			*i = o->next;
-			o->set = 0;
-			return;
-		}
+	if (!o->set) {
+		if (timo_debug)
+			logx(1, "%s: not found", __func__);
+		return;
 	}
-	if (timo_debug)
-		logx(1, "%s: not found", __func__);
+	timo_unlink(o);
 }
 
 /*
@@ -114,31 +185,78 @@ timo_del(struct timo *o)
 void
 timo_update(unsigned delta)
 {
+	struct timoslot *s;
 	struct timo *to;
-	int diff;
+	unsigned long long start;
+	unsigned level, idx;
+
+	if (trace_on)
+		trace_put(TRACE_TIMO_UPDATE, TRACE_BEGIN, delta, 0, 0, 0);
 
 	/*
 	 * update time reference
 	 */
 	timo_abstime += delta;
+	timo_now += delta;
 
 	/*
-	 * remove from the queue and run expired timeouts
+	 * the earliest timeout is on the first slot of the first
+	 * non-empty level. Move the wheel time to it, then either
+	 * run its timeouts (level 0) or cascade them to lower levels
 	 */
-	while (timo_queue != NULL) {
-		/*
-		 * there is no overflow here because + and - are
-		 * modulo 2^32, they are the same for both signed and
-		 * unsigned integers
-		 */
-		diff = timo_queue->val - timo_abstime;
-		if (diff > 0)
+	for (;;) {
+		for (level = 0; level < TIMO_NLEVELS; level++) {
+			if (timo_map[level] != 0)
+				break;
+		}
+		if (level == TIMO_NLEVELS)
 			break;
-		to = timo_queue;
-		timo_queue = to->next;
-		to->set = 0;
-		to->cb(to->arg);
+		idx = ffs(timo_map[level]) - 1;
+		start = timo_slotstart(level, idx);
+		if (start > timo_now)
+			break;
+		timo_wtime = start;
+		s = timo_wheel + level * TIMO_NSLOTS + idx;
+		while ((to = s->head) != NULL) {
+			timo_unlink(to);
+			if (level == 0) {
+				to->cb(to->arg);
+			} else {
+				to->set = 1;
+				timo_insert(to);
+			}
+		}
 	}
+	timo_wtime = timo_now;
+	if (trace_on)
+		trace_put(TRACE_TIMO_UPDATE, TRACE_END, 0, 0, 0, 0);
+}
+
+/*
+ * store in 'delta' the time until the next call to timo_update() has
+ * something to do, ie either run or cascade timeouts. Return 0 if
+ * there are no pending timeouts
+ */
+int
+timo_next(unsigned *delta)
+{
+	unsigned long long start;
+	unsigned level;
+
+	for (level = 0; level < TIMO_NLEVELS; level++) {
+		if (timo_map[level] != 0)
+			break;
+	}
+	if (level == TIMO_NLEVELS)
+		return 0;
+	start = timo_slotstart(level, ffs(timo_map[level]) - 1);
+	if (start <= timo_now)
+		*delta = 0;
+	else if (start - timo_now > ~0U)
+		*delta = ~0U;
+	else
+		*delta = start - timo_now;
+	return 1;
 }
 
 /*
@@ -147,7 +265,15 @@ timo_update(unsigned delta)
 void
 timo_init(void)
 {
-	timo_queue = NULL;
+	unsigned i;
+
+	for (i = 0; i < TIMO_NLEVELS * TIMO_NSLOTS; i++) {
+		timo_wheel[i].head = NULL;
+		timo_wheel[i].tail = &timo_wheel[i].head;
+	}
+	for (i = 0; i < TIMO_NLEVELS; i++)
+		timo_map[i] = 0;
+	timo_now = timo_wtime = 0;
 	timo_abstime = 0;
 }
 
@@ -157,9 +283,12 @@ timo_init(void)
 void
 timo_done(void)
 {
-	if (timo_queue != NULL) {
-		logx(1, "%s: timo_queue not empty!", __func__);
-		panic();
+	unsigned i;
+
+	for (i = 0; i < TIMO_NLEVELS; i++) {
+		if (timo_map[i] != 0) {
+			logx(1, "%s: timo_queue not empty!", __func__);
+			panic();
+		}
 	}
-	timo_queue = (struct timo *)0xdeadbeef;
 }
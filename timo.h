@@ -17,9 +17,18 @@
 #ifndef MIDISH_TIMO_H
 #define MIDISH_TIMO_H
 
+/*
+ * the timeout wheel is made of TIMO_NLEVELS levels of TIMO_NSLOTS
+ * slots each, level 'n' slots are TIMO_NSLOTS^n time units long
+ */
+#define TIMO_BITS	5
+#define TIMO_NSLOTS	(1 << TIMO_BITS)
+#define TIMO_NLEVELS	((64 + TIMO_BITS - 1) / TIMO_BITS)
+
 struct timo {
-	struct timo *next;
-	unsigned val;			/* time to wait before the callback */
+	struct timo *next, **prev;	/* for the wheel slot list */
+	unsigned long long val;		/* absolute expiration time */
+	unsigned slot;			/* wheel slot the timeout is on */
 	unsigned set;			/* true if the timeout is set */
 	void (*cb)(void *arg);		/* routine to call on expiration */
 	void *arg;			/* argument to give to 'cb' */
@@ -29,6 +38,7 @@ void timo_set(struct timo *, void (*)(void *), void *);
 void timo_add(struct timo *, unsigned);
 void timo_del(struct timo *);
 void timo_update(unsigned);
+int timo_next(unsigned *);
 void timo_init(void);
 void timo_done(void);
 
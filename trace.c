@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * the tracer stores binary records in a fixed size ring, so it can
+ * be used during performances: probes in the real-time path just
+ * copy their arguments with a time stamp. Once recording stopped,
+ * the ring can be saved in the Chrome trace event format (JSON), to
+ * be displayed by chrome://tracing or Perfetto.
+ *
+ * When the tracer is off, probes cost a single test of 'trace_on'
+ */
+
+#include <stdio.h>
+#include "utils.h"
+#include "mux.h"
+#include "textio.h"
+#include "trace.h"
+
+struct traceinfo {
+	char *name;
+	char *args[TRACE_NARGS];	/* arg names, NULL if unused */
+} trace_info[TRACE_NPROBES] = {
+	{"mux_timercb",		{"delta", NULL, NULL, NULL}},
+	{"mux_ticcb",		{"phase", NULL, NULL, NULL}},
+	{"song_movecb",		{"measure", "beat", "tic", NULL}},
+	{"mixout_putev",	{"cmd", "dev", "ch", "v0"}},
+	{"mididev_flush",	{"unit", "bytes", NULL, NULL}},
+	{"timo_update",		{"delta", NULL, NULL, NULL}}
+};
+
+char *trace_phase[] = {"B", "E", "i"};
+
+unsigned trace_on = 0;
+struct tracerec *trace_buf = NULL;
+unsigned trace_pos, trace_cnt;
+
+/*
+ * clear the ring and start storing records
+ */
+void
+trace_start(void)
+{
+	if (trace_buf == NULL)
+		trace_buf = xmalloc(TRACE_NREC * sizeof(struct tracerec),
+		    "trace");
+	trace_pos = trace_cnt = 0;
+	trace_on = 1;
+}
+
+/*
+ * stop storing records, the ring is kept until the next start
+ */
+void
+trace_stop(void)
+{
+	trace_on = 0;
+}
+
+/*
+ * store a record, overwriting the oldest one if the ring is full.
+ * Called by probes only if 'trace_on' is set
+ */
+void
+trace_put(unsigned probe, unsigned phase,
+    unsigned a0, unsigned a1, unsigned a2, unsigned a3)
+{
+	struct tracerec *r;
+
+	r = trace_buf + trace_pos;
+	r->nsec = mux_mdep_nsec();
+	r->probe = probe;
+	r->phase = phase;
+	r->arg[0] = a0;
+	r->arg[1] = a1;
+	r->arg[2] = a2;
+	r->arg[3] = a3;
+	trace_pos = (trace_pos + 1) % TRACE_NREC;
+	if (trace_cnt < TRACE_NREC)
+		trace_cnt++;
+}
+
+/*
+ * save the records of the ring, oldest first, in the given file.
+ * Time stamps are in microseconds, relative to the oldest record
+ */
+int
+trace_save(char *filename)
+{
+	struct textout *f;
+	struct traceinfo *info;
+	struct tracerec *r;
+	unsigned long long start, nsec;
+	unsigned i, j, first;
+	char buf[8];
+
+	f = textout_new(filename);
+	if (f == NULL)
+		return 0;
+	textout_putstr(f, "{\"traceEvents\": [\n");
+	textout_shiftright(f);
+	first = (trace_pos + TRACE_NREC - trace_cnt) % TRACE_NREC;
+	start = trace_cnt > 0 ? trace_buf[first].nsec : 0;
+	for (i = 0; i < trace_cnt; i++) {
+		r = trace_buf + (first + i) % TRACE_NREC;
+		info = trace_info + r->probe;
+		nsec = r->nsec - start;
+		textout_putstr(f, "{\"name\": \"");
+		textout_putstr(f, info->name);
+		textout_putstr(f, "\", \"ph\": \"");
+		textout_putstr(f, trace_phase[r->phase]);
+		textout_putstr(f, "\", \"ts\": ");
+		textout_putlong(f, nsec / 1000);
+		snprintf(buf, sizeof(buf), ".%03u", (unsigned)(nsec % 1000));
+		textout_putstr(f, buf);
+		textout_putstr(f, ", \"pid\": 1, \"tid\": 1");
+		if (r->phase == TRACE_MARK)
+			textout_putstr(f, ", \"s\": \"t\"");
+		if (r->phase != TRACE_END && info->args[0] != NULL) {
+			textout_putstr(f, ", \"args\": {");
+			for (j = 0; j < TRACE_NARGS; j++) {
+				if (info->args[j] == NULL)
+					break;
+				if (j > 0)
+					textout_putstr(f, ", ");
+				textout_putstr(f, "\"");
+				textout_putstr(f, info->args[j]);
+				textout_putstr(f, "\": ");
+				textout_putlong(f, r->arg[j]);
+			}
+			textout_putstr(f, "}");
+		}
+		textout_putstr(f, i + 1 < trace_cnt ? "},\n" : "}\n");
+	}
+	textout_shiftleft(f);
+	textout_putstr(f, "]}\n");
+	textout_delete(f);
+	return 1;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_TRACE_H
+#define MIDISH_TRACE_H
+
+#define TRACE_NREC	65536		/* records in the ring */
+#define TRACE_NARGS	4		/* args per record */
+
+/*
+ * probes, see trace_info[] for names and arguments
+ */
+#define TRACE_MUX_TIMERCB	0
+#define TRACE_MUX_TICCB		1
+#define TRACE_SONG_MOVECB	2
+#define TRACE_MIXOUT_PUTEV	3
+#define TRACE_MIDIDEV_FLUSH	4
+#define TRACE_TIMO_UPDATE	5
+#define TRACE_NPROBES		6
+
+/*
+ * record phases: begin and end of a routine, or single event
+ */
+#define TRACE_BEGIN	0
+#define TRACE_END	1
+#define TRACE_MARK	2
+
+struct tracerec {
+	unsigned long long nsec;	/* time the record was stored */
+	unsigned short probe;		/* one of TRACE_xxx above */
+	unsigned short phase;		/* one of TRACE_{BEGIN,END,MARK} */
+	unsigned arg[TRACE_NARGS];	/* probe specific args */
+};
+
+void trace_start(void);
+void trace_stop(void);
+void trace_put(unsigned, unsigned,
+    unsigned, unsigned, unsigned, unsigned);
+int trace_save(char *);
+
+extern unsigned trace_on;
+
+#endif /* MIDISH_TRACE_H */
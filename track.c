@@ -27,8 +27,30 @@
  *	- each clock tick marks the begining of a delta
  *	- each event (struct ev) is played after delta ticks
  *
+ * Events are allocated from a pool, so after editing they may be
+ * scattered in memory; track_compact() reorders them so that the
+ * list order matches the memory order.
+ *
+ * Since reaching a given position requires reading the track from
+ * its beginning, a track may hold a seek index, ie a list of saved
+ * positions (see seqptr_locate()). Any routine modifying a track
+ * must discard the saved positions it may affect, with
+ * track_unindex() or track_unindexfrom().
+ *
+ * The track also caches its number of events, its length and the
+ * number of events of each type. They are computed when first
+ * needed and invalidated by track_unindex() and track_unindexfrom(),
+ * so code using seqev_ins() and seqev_rm() directly must call one of
+ * them before.
+ *
+ * While an undo record of a track is being built, events must be
+ * saved for undo before they are modified, with track_undotouch() or
+ * track_undoall(), see track_undosave().
+ *
  */
 
+#include <stddef.h>
+#include <stdlib.h>
 #include "utils.h"
 #include "pool.h"
 #include "track.h"
@@ -71,6 +93,10 @@ track_init(struct track *o)
 	o->eot.next = NULL;
 	o->eot.prev = &o->first;
 	o->first = &o->eot;
+	o->marks = NULL;
+	o->marksmeas = 0;
+	o->undo = NULL;
+	o->statsok = 0;
 }
 
 /*
@@ -85,6 +111,7 @@ track_done(struct track *o)
 		inext = i->next;
 		seqev_del(i);
 	}
+	track_unindex(o);
 #ifdef TRACK_DEBUG
 	o->first = (void *)0xdeadbeef;
 #endif
@@ -121,6 +148,9 @@ track_isempty(struct track *o)
 void
 track_chomp(struct track *o)
 {
+	if (o->undo != NULL && o->eot.delta > 0)
+		track_undotouch(o, &o->eot, track_numtic(o), 0);
+	track_unindex(o);
 	o->eot.delta = 0;
 }
 
@@ -130,6 +160,8 @@ track_chomp(struct track *o)
 void
 track_shift(struct track *o, unsigned ntics)
 {
+	track_undoall(o);
+	track_unindex(o);
 	o->first->delta += ntics;
 }
 
@@ -141,6 +173,11 @@ track_swap(struct track *t1, struct track *t2)
 {
 	struct seqev *se, eot;
 
+	track_undoall(t1);
+	track_undoall(t2);
+	track_unindex(t1);
+	track_unindex(t2);
+
 	/* swap list of events */
 	se = t1->first;
 	t1->first = t2->first;
@@ -158,6 +195,78 @@ track_swap(struct track *t1, struct track *t2)
 	*t2->eot.prev = &t2->eot;
 }
 
+/*
+ * compare addresses of two events, used by qsort()
+ */
+static int
+seqev_cmpaddr(const void *p1, const void *p2)
+{
+	struct seqev *e1 = *(struct seqev **)p1, *e2 = *(struct seqev **)p2;
+
+	if (e1 < e2)
+		return -1;
+	if (e1 > e2)
+		return 1;
+	return 0;
+}
+
+/*
+ * reorder events of the track so that they are stored in increasing
+ * memory addresses, this way traversing the track accesses memory
+ * sequentially. Events are moved from one seqev structure to
+ * another, so this must not be called while seqptr structures point
+ * to the track
+ */
+void
+track_compact(struct track *o)
+{
+	struct seqev *i, **evs;
+	struct seqev_data *data;
+	unsigned n, k, sorted;
+
+	/*
+	 * count events, and return if they are already ordered
+	 */
+	n = 0;
+	sorted = 1;
+	for (i = o->first; i != &o->eot; i = i->next) {
+		if (i->next != &o->eot && i->next < i)
+			sorted = 0;
+		n++;
+	}
+	if (sorted)
+		return;
+	track_undoall(o);
+	track_unindex(o);
+
+	/*
+	 * save events in list order, and sort seqev structures
+	 */
+	evs = xmalloc(n * sizeof(struct seqev *), "track_compact");
+	data = xmalloc(n * sizeof(struct seqev_data), "track_compact");
+	for (i = o->first, k = 0; i != &o->eot; i = i->next, k++) {
+		evs[k] = i;
+		data[k].delta = i->delta;
+		data[k].ev = i->ev;
+	}
+	qsort(evs, n, sizeof(struct seqev *), seqev_cmpaddr);
+
+	/*
+	 * relink sorted structures and store events in list order
+	 */
+	for (k = 0; k < n; k++) {
+		i = evs[k];
+		i->delta = data[k].delta;
+		i->ev = data[k].ev;
+		i->prev = (k == 0) ? &o->first : &evs[k - 1]->next;
+		i->next = (k == n - 1) ? &o->eot : evs[k + 1];
+	}
+	o->first = evs[0];
+	o->eot.prev = &evs[n - 1]->next;
+	xfree(data);
+	xfree(evs);
+}
+
 /*
  * return true if an event is available on the track
  */
@@ -184,6 +293,17 @@ seqev_ins(struct seqev *pos, struct seqev *se)
 	pos->prev = &se->next;
 }
 
+/*
+ * return the event preceding the given one, which must not be the
+ * first event of the track
+ */
+struct seqev *
+seqev_prev(struct seqev *pos)
+{
+	return (struct seqev *)((char *)pos->prev -
+	    offsetof(struct seqev, next));
+}
+
 /*
  * remove the event (but not blank space) on the given position
  */
@@ -203,19 +323,38 @@ seqev_rm(struct seqev *pos)
 	pos->next->prev = pos->prev;
 }
 
+/*
+ * count events and tics of the track, if not already done
+ */
+static void
+track_stats(struct track *o)
+{
+	struct seqev *i;
+	unsigned cmd;
+
+	if (o->statsok)
+		return;
+	o->nev = 0;
+	o->ntic = 0;
+	for (cmd = 0; cmd < EV_NUMCMD; cmd++)
+		o->evcnt[cmd] = 0;
+	for (i = o->first; i != NULL; i = i->next) {
+		o->nev++;
+		o->ntic += i->delta;
+		if (i->ev.cmd < EV_NUMCMD)
+			o->evcnt[i->ev.cmd]++;
+	}
+	o->statsok = 1;
+}
+
 /*
  * return the number of events in the track
  */
 unsigned
 track_numev(struct track *o)
 {
-	unsigned n;
-	struct seqev *i;
-
-	n = 0;
-	for (i = o->first; i != NULL; i = i->next)
-		n++;
-	return n;
+	track_stats(o);
+	return o->nev;
 }
 
 /*
@@ -225,13 +364,8 @@ track_numev(struct track *o)
 unsigned
 track_numtic(struct track *o)
 {
-	unsigned ntics;
-	struct seqev *i;
-
-	ntics = 0;
-	for(i = o->first; i != NULL; i = i->next)
-		ntics += i->delta;
-	return ntics;
+	track_stats(o);
+	return o->ntic;
 }
 
 
@@ -243,6 +377,8 @@ track_clear(struct track *o)
 {
 	struct seqev *i, *inext;
 
+	track_undoall(o);
+	track_unindex(o);
 	for (i = o->first;  i != &o->eot;  i = inext) {
 		inext = i->next;
 		seqev_del(i);
@@ -261,6 +397,8 @@ track_setchan(struct track *src, unsigned dev, unsigned ch)
 {
 	struct seqev *i;
 
+	track_undoall(src);
+	track_unindex(src);
 	for (i = src->first; i != NULL; i = i->next) {
 		if (EV_ISVOICE(&i->ev)) {
 			i->ev.dev = dev;
@@ -270,7 +408,41 @@ track_setchan(struct track *src, unsigned dev, unsigned ch)
 }
 
 /*
- * fill a map of used channels/devices
+ * discard saved positions of the seek index at or beyond the given
+ * tic and cached counts. Since marks are sorted last first, the ones
+ * to discard are at the beginning of the list
+ */
+void
+track_unindexfrom(struct track *o, unsigned tic)
+{
+	struct trackmark *m;
+
+	o->statsok = 0;
+	while ((m = o->marks) != NULL && m->tic >= tic) {
+		o->marks = m->next;
+		statelist_empty(&m->statelist);
+		xfree(m);
+	}
+}
+
+/*
+ * free the seek index of the track and discard cached counts
+ */
+void
+track_unindex(struct track *o)
+{
+	struct trackmark *m;
+
+	o->statsok = 0;
+	while ((m = o->marks) != NULL) {
+		o->marks = m->next;
+		statelist_empty(&m->statelist);
+		xfree(m);
+	}
+}
+
+/*
+ * fill a map of used channels/devices, indexed by dev * 16 + ch
  */
 void
 track_chanmap(struct track *o, char *map)
@@ -278,7 +450,7 @@ track_chanmap(struct track *o, char *map)
 	struct seqev *se;
 	unsigned dev, ch, i;
 
-	for (i = 0; i < DEFAULT_MAXNCHANS; i++) {
+	for (i = 0; i < ev_ndevs * 16; i++) {
 		map[i] = 0;
 	}
 
@@ -286,7 +458,7 @@ track_chanmap(struct track *o, char *map)
 		if (EV_ISVOICE(&se->ev)) {
 			dev = se->ev.dev;
 			ch  = se->ev.ch;
-			if (dev >= DEFAULT_MAXNDEVS || ch >= 16) {
+			if (dev > EV_MAXDEV || ch >= 16) {
 				logx(1, "%s: bogus dev/ch pair, stopping", __func__);
 				break;
 			}
@@ -301,12 +473,8 @@ track_chanmap(struct track *o, char *map)
 unsigned
 track_evcnt(struct track *o, unsigned cmd)
 {
-	struct seqev *se;
-	unsigned cnt = 0;
-
-	for (se = o->first; se != NULL; se = se->next) {
-		if (se->ev.cmd == cmd)
-			cnt++;
-	}
-	return cnt;
+	if (cmd >= EV_NUMCMD)
+		return 0;
+	track_stats(o);
+	return o->evcnt[cmd];
 }
@@ -18,6 +18,7 @@
 #define MIDISH_TRACK_H
 
 #include "ev.h"
+#include "state.h"
 
 struct seqev {
 	unsigned delta;
@@ -25,17 +26,48 @@ struct seqev {
 	struct seqev *next, **prev;
 };
 
+/*
+ * saved reader position used as starting point when seeking, see
+ * seqptr_locate() and seqptr_locmeasure()
+ */
+struct trackmark {
+	struct trackmark *next;		/* previous mark in the track */
+	unsigned key;			/* tic or measure number */
+	unsigned tic;			/* absolute tic of the position */
+	unsigned delta;			/* tics elapsed since 'pos->prev' */
+	struct seqev *pos;		/* next event to read */
+	struct statelist statelist;	/* state at the position */
+};
+
 struct track {
 	struct seqev eot;		/* end-of-track event */
 	struct seqev *first;		/* head of the event list */
+	struct trackmark *marks;	/* seek index, last mark first */
+	unsigned marksmeas;		/* if marks keys are measures */
+	struct track_data *undo;	/* undo data being saved, if any */
+	unsigned statsok;		/* if the counts below are valid */
+	unsigned nev, ntic;		/* number of events and tics */
+	unsigned evcnt[EV_NUMCMD];	/* number of events of each type */
 };
 
+/*
+ * undo data of a track: 'nrm' events were removed at position 'pos'
+ * and replaced by 'nins' events. While the track is being modified
+ * (see track_undosave()), 'evs' holds the original events between
+ * the unmodified 'lo' and 'hi' events. Once done (see track_undodiff())
+ * the removed events are stored packed in 'pack', to save memory
+ */
 struct track_data {
 	struct seqev_data {
 		unsigned delta;
 		struct ev ev;
 	} *evs;
+	unsigned char *pack;		/* packed removed events */
+	unsigned int packlen;		/* size of 'pack' in bytes */
 	unsigned int pos, nrm, nins;
+	unsigned int maxnrm;		/* allocated size of 'evs' */
+	struct seqev *lo, *hi;		/* unsaved events around saved ones */
+	unsigned int lotic, hitic;	/* absolute tics of 'lo' and 'hi' */
 };
 
 void	      seqev_pool_init(unsigned);
@@ -54,16 +86,22 @@ unsigned      track_isempty(struct track *);
 void	      track_chomp(struct track *);
 void	      track_shift(struct track *, unsigned);
 void	      track_swap(struct track *, struct track *);
+void	      track_compact(struct track *);
+void	      track_unindex(struct track *);
+void	      track_unindexfrom(struct track *, unsigned);
 
 unsigned      seqev_avail(struct seqev *);
 void	      seqev_ins(struct seqev *, struct seqev *);
 void	      seqev_rm(struct seqev *);
+struct seqev *seqev_prev(struct seqev *);
 
 void	      track_setchan(struct track *, unsigned, unsigned);
 void	      track_chanmap(struct track *, char *);
 unsigned      track_evcnt(struct track *, unsigned);
 
 unsigned track_undosave(struct track *, struct track_data *);
+void track_undotouch(struct track *, struct seqev *, unsigned, int);
+void track_undoall(struct track *);
 unsigned track_undodiff(struct track *, struct track_data *);
 void track_undorestore(struct track *, struct track_data *);
 
@@ -416,22 +416,69 @@ el_getprompt(void)
 #endif
 }
 
+/*
+ * add a completion item; items are sorted by compl_sort() once
+ * all of them are added
+ */
 void
 el_compladd(char *s)
 {
-	struct textline *l;
-	int cmp;
+	textbuf_ins(&el_compl, NULL, s, strlen(s));
+}
+
+/*
+ * sort completion items with a merge sort, so that completion
+ * doesn't depend on the square of the number of items
+ */
+void
+compl_sort(void)
+{
+	struct textline *l, *list, *tail, *a, *b, **p;
+	unsigned int i, width, na, nb;
+
+	list = el_compl.head;
+	for (width = 1; width < el_compl.count; width *= 2) {
+		p = &l;
+		a = list;
+		while (a != NULL) {
+			b = a;
+			for (i = 0; i < width && b != NULL; i++)
+				b = b->next;
+			na = i;
+			nb = width;
+			while (na > 0 || (nb > 0 && b != NULL)) {
+				if (na > 0 && (nb == 0 || b == NULL ||
+					strcmp(a->text, b->text) <= 0)) {
+					*p = a;
+					a = a->next;
+					na--;
+				} else {
+					*p = b;
+					b = b->next;
+					nb--;
+				}
+				p = &(*p)->next;
+			}
+			a = b;
+		}
+		*p = NULL;
+		list = l;
+	}
 
-	for (l = el_compl.head; l != NULL; l = l->next) {
-		cmp = strcmp(l->text, s);
-		if (cmp == 0) {
-			logx(1, "%s: duplicate completion item", s);
+	/*
+	 * fix backward links and check for duplicates
+	 */
+	tail = NULL;
+	for (l = list; l != NULL; l = l->next) {
+		if (tail != NULL && strcmp(tail->text, l->text) == 0) {
+			logx(1, "%s: duplicate completion item", l->text);
 			panic();
 		}
-		if (cmp > 0)
-			break;
+		l->prev = tail;
+		tail = l;
 	}
-	textbuf_ins(&el_compl, l, s, strlen(s));
+	el_compl.head = list;
+	el_compl.tail = tail;
 }
 
 void
@@ -468,6 +515,7 @@ compl_start(void)
 	struct textline *n;
 
 	el_ops->oncompl(el_arg, el_buf, el_curs, el_used, &el_selstart, &el_selend);
+	compl_sort();
 	el_curline = el_compl.head;
 
 	if (textbuf_findline(&el_compl,
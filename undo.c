@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <string.h>
 #include "utils.h"
 #include "mididev.h"
 #include "mux.h"
@@ -28,6 +29,142 @@
 #include "norm.h"
 #include "undo.h"
 
+/*
+ * Once the undo data exceeds UNDO_MAXSIZE, the events saved by the
+ * oldest track entries are moved to a temporary file instead of
+ * being freed; other entries, usually small, are freed as
+ * before. Entries are undone newest first, so the spill file is used
+ * as a stack: entries are written oldest first, and track entries
+ * older than a spilled one are spilled too, so the most recent
+ * spilled entry is always at the end of the file, and when it's read
+ * back, its space is reused. Freeing the oldest entries leaves a hole
+ * at the beginning of the file which is reclaimed by undo_compact().
+ */
+
+/*
+ * return 1 if the saved events of the given entry may be moved to the
+ * spill file, i.e. if it's a track entry not being built
+ */
+static int
+undo_canspill(struct undo *u)
+{
+	return u->type == UNDO_TRACK &&
+	    u->u.track.track->undo != &u->u.track.data;
+}
+
+/*
+ * move the saved events of the given entry to the spill file. Return
+ * 1 if the entry doesn't use memory anymore, or 0 if it can't be moved
+ */
+static int
+undo_spill(struct song *s, struct undo *u)
+{
+	struct track_data *d;
+	size_t n;
+
+	d = &u->u.track.data;
+	if (u->u.track.spill >= 0 || d->pack == NULL)
+		return 1;
+	if (s->undo_file == NULL) {
+		s->undo_file = tmpfile();
+		if (s->undo_file == NULL) {
+			logx(1, "%s: failed to create undo file", __func__);
+			return 0;
+		}
+		s->undo_fileend = 0;
+	}
+	n = d->packlen;
+	if (fseek(s->undo_file, s->undo_fileend, SEEK_SET) < 0 ||
+	    fwrite(d->pack, n, 1, s->undo_file) != 1) {
+		logx(1, "%s: failed to write undo file", __func__);
+		return 0;
+	}
+	xfree(d->pack);
+	d->pack = NULL;
+	u->u.track.spill = s->undo_fileend;
+	s->undo_fileend += n;
+	s->undo_nspill++;
+	s->undo_size -= u->size;
+	u->size = 0;
+	return 1;
+}
+
+/*
+ * read back the saved events of the given entry, which is the most
+ * recent spilled one
+ */
+static int
+undo_unspill(struct song *s, struct undo *u)
+{
+	struct track_data *d = &u->u.track.data;
+	size_t n;
+
+	n = d->packlen;
+	d->pack = xmalloc(n, "track_diff");
+	if (fflush(s->undo_file) == EOF ||
+	    fseek(s->undo_file, u->u.track.spill, SEEK_SET) < 0 ||
+	    fread(d->pack, n, 1, s->undo_file) != 1) {
+		logx(1, "%s: failed to read undo file", __func__);
+		xfree(d->pack);
+		d->pack = NULL;
+		return 0;
+	}
+	s->undo_fileend = u->u.track.spill;
+	s->undo_nspill--;
+	u->u.track.spill = -1;
+	return 1;
+}
+
+/*
+ * move the spilled data starting at 'base' to the beginning of the
+ * spill file. On error, spilled entries are dropped
+ */
+static void
+undo_compact(struct song *s, long base)
+{
+	struct undo *u, **pu;
+	unsigned char *buf;
+	long src, dst;
+	size_t n;
+
+	buf = xmalloc(UNDO_MAXSIZE, "undo_compact");
+	src = base;
+	dst = 0;
+	while (src < s->undo_fileend) {
+		n = s->undo_fileend - src;
+		if (n > UNDO_MAXSIZE)
+			n = UNDO_MAXSIZE;
+		if (fseek(s->undo_file, src, SEEK_SET) < 0 ||
+		    fread(buf, n, 1, s->undo_file) != 1 ||
+		    fseek(s->undo_file, dst, SEEK_SET) < 0 ||
+		    fwrite(buf, n, 1, s->undo_file) != 1) {
+			logx(1, "%s: failed to compact undo file", __func__);
+			xfree(buf);
+
+			/*
+			 * spilled entries are the oldest ones, so drop
+			 * the first one and all older ones
+			 */
+			pu = &s->undo;
+			while ((u = *pu) != NULL) {
+				if (u->type == UNDO_TRACK && u->u.track.spill >= 0)
+					break;
+				pu = &u->next;
+			}
+			undo_clear(s, pu);
+			logx(1, "undo data lost");
+			return;
+		}
+		src += n;
+		dst += n;
+	}
+	xfree(buf);
+	for (u = s->undo; u != NULL; u = u->next) {
+		if (u->type == UNDO_TRACK && u->u.track.spill >= 0)
+			u->u.track.spill -= base;
+	}
+	s->undo_fileend -= base;
+}
 
 struct undo *
 undo_new(struct song *s, int type, char *func, char *name)
@@ -76,21 +213,38 @@ undo_pop(struct song *s)
 		case UNDO_EMPTY:
 			break;
 		case UNDO_STR:
+			song_idxreset(s);
 			str_delete(*u->u.ren.ptr);
 			*u->u.ren.ptr = u->u.ren.val;
 			break;
 		case UNDO_UINT:
+			if (u->u.uint.idx)
+				song_idxreset(s);
 			*u->u.uint.ptr = u->u.uint.val;
 			break;
 		case UNDO_TRACK:
+			if (u->u.track.spill >= 0 && !undo_unspill(s, u)) {
+				/*
+				 * the track can't be restored, so older
+				 * entries can't be undone either
+				 */
+				logx(1, "undo data lost");
+				s->undo_nspill--;
+				xfree(u);
+				undo_clear(s, &s->undo);
+				return;
+			}
 			track_undorestore(u->u.track.track, &u->u.track.data);
+			song_trkdirty(s, u->u.track.track);
 			break;
 		case UNDO_TDEL:
+			song_idxreset(s);
 			name_add(&s->trklist, &u->u.tdel.trk->name);
 			if (s->curtrk == NULL)
 				s->curtrk = u->u.tdel.trk;
 			break;
 		case UNDO_TNEW:
+			song_idxreset(s);
 			song_trkdel(s, u->u.tdel.trk);
 			break;
 		case UNDO_FILT:
@@ -98,6 +252,7 @@ undo_pop(struct song *s)
 			*u->u.filt.filt = u->u.filt.data;
 			break;
 		case UNDO_FDEL:
+			song_idxreset(s);
 			name_add(&s->filtlist, &u->u.fdel.filt->name);
 			if (s->curfilt == NULL)
 				s->curfilt = u->u.fdel.filt;
@@ -108,9 +263,11 @@ undo_pop(struct song *s)
 			}
 			break;
 		case UNDO_FNEW:
+			song_idxreset(s);
 			song_filtdel(s, u->u.fdel.filt);
 			break;
 		case UNDO_CDEL:
+			song_idxreset(s);
 			name_add(&s->chanlist, &u->u.cdel.chan->name);
 			if (u->u.cdel.chan->isinput) {
 				if (s->curin == NULL)
@@ -121,6 +278,7 @@ undo_pop(struct song *s)
 			}
 			break;
 		case UNDO_CNEW:
+			song_idxreset(s);
 			song_chandel(s, u->u.cdel.chan);
 			break;
 		case UNDO_XADD:
@@ -134,11 +292,13 @@ undo_pop(struct song *s)
 			    u->u.sysex.data.pos, x);
 			break;
 		case UNDO_XDEL:
+			song_idxreset(s);
 			name_add(&s->sxlist, &u->u.xdel.sx->name);
 			if (s->cursx == NULL)
 				s->cursx = u->u.xdel.sx;
 			break;
 		case UNDO_XNEW:
+			song_idxreset(s);
 			song_sxdel(s, u->u.xdel.sx);
 			break;
 		case UNDO_SCALE:
@@ -182,7 +342,10 @@ undo_clear(struct song *s, struct undo **pos)
 		case UNDO_UINT:
 			break;
 		case UNDO_TRACK:
-			xfree(u->u.track.data.evs);
+			if (u->u.track.spill >= 0)
+				s->undo_nspill--;
+			else if (u->u.track.data.pack)
+				xfree(u->u.track.data.pack);
 			break;
 		case UNDO_TDEL:
 			track_done(&u->u.tdel.trk->track);
@@ -232,13 +395,17 @@ undo_clear(struct song *s, struct undo **pos)
 		s->undo_size -= u->size;
 		xfree(u);
 	}
+	if (s->undo_nspill == 0)
+		s->undo_fileend = 0;
 }
 
 void
 undo_push(struct song *s, struct undo *u)
 {
-	struct undo **pu;
-	size_t size;
+	struct undo **pu, **pfull, **tab;
+	size_t size, spill;
+	unsigned i, n;
+	long base;
 
 	u->next = s->undo;
 	s->undo = u;
@@ -249,21 +416,65 @@ undo_push(struct song *s, struct undo *u)
 #endif
 
 	/*
-	 * free old entries exceeding memory usage limit
+	 * keep recent entries in memory up to the memory usage limit,
+	 * older track entries go to the spill file. Free the entries
+	 * that can't be kept or that exceed the spill file limit
 	 */
-	size = 0;
+	size = spill = 0;
+	n = 0;
+	pfull = NULL;
 	pu = &s->undo;
-	while (1) {
-		u = *pu;
-		if (u == NULL)
-			return;
-		size += u->size;
-		if (size > UNDO_MAXSIZE)
-			break;
+	while ((u = *pu) != NULL) {
+		if (pfull == NULL && undo_canspill(u) &&
+		    (u->u.track.spill >= 0 || size + u->size > UNDO_MAXSIZE))
+			pfull = pu;
+		if (pfull != NULL && undo_canspill(u)) {
+			spill += u->u.track.data.packlen;
+			if (spill > UNDO_MAXSPILL)
+				break;
+			if (u->u.track.spill < 0)
+				n++;
+		} else {
+			if (size + u->size > UNDO_MAXSIZE)
+				break;
+			size += u->size;
+		}
 		pu = &u->next;
 	}
-
 	undo_clear(s, pu);
+	if (pfull == NULL)
+		return;
+
+	/*
+	 * spill the oldest entries first, so the most recent spilled
+	 * entry is always at the end of the file
+	 */
+	if (n > 0) {
+		tab = xmalloc(n * sizeof(struct undo *), "undo_tab");
+		i = 0;
+		for (u = *pfull; u != NULL; u = u->next) {
+			if (undo_canspill(u) && u->u.track.spill < 0)
+				tab[i++] = u;
+		}
+		while (i-- > 0) {
+			if (!undo_spill(s, tab[i])) {
+				undo_clear(s, pfull);
+				break;
+			}
+		}
+		xfree(tab);
+	}
+
+	/*
+	 * if the hole left by freed entries is large, reclaim it
+	 */
+	base = s->undo_fileend;
+	for (u = *pfull; u != NULL; u = u->next) {
+		if (u->type == UNDO_TRACK && u->u.track.spill >= 0)
+			base = u->u.track.spill;
+	}
+	if (s->undo_nspill > 0 && base > UNDO_MAXSPILL)
+		undo_compact(s, base);
 }
 
 void
@@ -284,22 +495,44 @@ undo_setstr(struct song *s, char *func, char **ptr, char *val)
 	u->u.ren.ptr = ptr;
 	u->u.ren.val = *ptr;
 	*ptr = str_new(val);
+	song_idxreset(s);
 	undo_push(s, u);
 }
 
-void
-undo_setuint(struct song *s, char *func, char *tag,
-	unsigned int *ptr, unsigned int val)
+static void
+undo_setuint_do(struct song *s, char *func, char *tag,
+	unsigned int *ptr, unsigned int val, int idx)
 {
 	struct undo *u;
 
 	u = undo_new(s, UNDO_UINT, func, tag);
 	u->u.uint.ptr = ptr;
 	u->u.uint.val = *ptr;
+	u->u.uint.idx = idx;
 	*ptr = val;
+	if (idx)
+		song_idxreset(s);
 	undo_push(s, u);
 }
 
+void
+undo_setuint(struct song *s, char *func, char *tag,
+	unsigned int *ptr, unsigned int val)
+{
+	undo_setuint_do(s, func, tag, ptr, val, 0);
+}
+
+/*
+ * same as undo_setuint(), for chan numbers the (dev, ch) index
+ * is built from
+ */
+void
+undo_setchan(struct song *s, char *func, char *tag,
+	unsigned int *ptr, unsigned int val)
+{
+	undo_setuint_do(s, func, tag, ptr, val, 1);
+}
+
 void
 undo_scale(struct song *s, char *func, char *tag,
 	unsigned int oldunit, unsigned int newunit)
@@ -319,81 +552,330 @@ undo_scale(struct song *s, char *func, char *tag,
 	undo_push(s, u);
 }
 
+/*
+ * start saving undo data of the given track: nothing is copied
+ * yet, events are saved only when they are about to be modified
+ * (see track_undotouch()), so the undo data is proportional to
+ * the modified part of the track
+ */
 unsigned
 track_undosave(struct track *t, struct track_data *u)
+{
+	u->evs = NULL;
+	u->pack = NULL;
+	u->packlen = 0;
+	u->pos = 0;
+	u->nrm = 0;
+	u->nins = 0;
+	u->maxnrm = 0;
+	t->undo = u;
+	return 0;
+}
+
+/*
+ * make room for 'n' more saved events
+ */
+static void
+track_undogrow(struct track_data *u, unsigned n)
+{
+	struct seqev_data *evs;
+
+	if (u->nrm + n <= u->maxnrm)
+		return;
+	u->maxnrm = 2 * u->maxnrm;
+	if (u->maxnrm < u->nrm + n)
+		u->maxnrm = u->nrm + n;
+	evs = xmalloc(u->maxnrm * sizeof(struct seqev_data), "track_data");
+	if (u->evs) {
+		memcpy(evs, u->evs, u->nrm * sizeof(struct seqev_data));
+		xfree(u->evs);
+	}
+	u->evs = evs;
+}
+
+/*
+ * save events from 'first' to 'last' (included) after or before
+ * (if 'front' is set) the already saved ones
+ */
+static void
+track_undocopy(struct track_data *u, struct seqev *first,
+    struct seqev *last, int front)
 {
 	struct seqev *i;
 	struct seqev_data *e;
-	unsigned size;
+	unsigned n;
 
-	u->nins = track_numev(t);
-	size = sizeof(struct seqev_data) * u->nins;
-	u->evs = xmalloc(size, "track_data");
-	e = u->evs;
-	for (i = t->first; i != NULL; i = i->next) {
+	n = 1;
+	for (i = first; i != last; i = i->next)
+		n++;
+	track_undogrow(u, n);
+	if (front) {
+		memmove(u->evs + n, u->evs, u->nrm * sizeof(struct seqev_data));
+		e = u->evs;
+	} else
+		e = u->evs + u->nrm;
+	for (i = first; ; i = i->next) {
 		e->delta = i->delta;
 		e->ev = i->ev;
 		e++;
+		if (i == last)
+			break;
+	}
+	u->nrm += n;
+}
+
+/*
+ * return true if the given event at the given tic is before the
+ * saved ones. Events before 'lo' are at lower tics, except the ones
+ * at the same tic, which are checked one by one
+ */
+static int
+track_undoisbefore(struct track *t, struct seqev *se, unsigned tic)
+{
+	struct track_data *u = t->undo;
+	struct seqev *i;
+
+	if (u->lo == NULL)
+		return 0;
+	if (tic != u->lotic)
+		return tic < u->lotic;
+	for (i = u->lo; ; i = seqev_prev(i)) {
+		if (i == se)
+			return 1;
+		if (i->delta != 0 || i->prev == &t->first)
+			return 0;
 	}
-	u->pos = 0;
-	u->nrm = 0;
-	return size;
 }
 
+/*
+ * return true if the given event at the given tic is after the
+ * saved ones, see track_undoisbefore()
+ */
+static int
+track_undoisafter(struct track *t, struct seqev *se, unsigned tic)
+{
+	struct track_data *u = t->undo;
+	struct seqev *i;
+
+	if (u->hi == NULL)
+		return 0;
+	if (tic != u->hitic)
+		return tic > u->hitic;
+	for (i = u->hi; ; ) {
+		if (i == se)
+			return 1;
+		i = i->next;
+		if (i == NULL || i->delta != 0)
+			return 0;
+	}
+}
+
+/*
+ * the given event, at the given absolute tic, is about to be
+ * modified or removed: if it's not saved yet, save it together with
+ * the unmodified events between it and the saved ones. Saved events
+ * are contiguous: all events between 'lo' and 'hi' are either saved
+ * or new. 'shift' is the number of tics about to be inserted (or
+ * removed if negative) before the event
+ */
 void
-track_diff(struct track_data *u1, struct track_data *u2,
-	unsigned *pos, unsigned *nrm, unsigned *nins)
+track_undotouch(struct track *t, struct seqev *se, unsigned tic, int shift)
 {
-	unsigned start, end1, end2;
+	struct track_data *u = t->undo;
 
-	start = 0;
-	while (1) {
-		if (start == u1->nins || start == u2->nins)
-			break;
-		if (u1->evs[start].delta != u2->evs[start].delta)
-			break;
-		if (!ev_eq(&u1->evs[start].ev, &u2->evs[start].ev))
-			break;
-		start++;
+	if (u == NULL)
+		return;
+	if (u->nrm == 0) {
+		u->lo = (se->prev == &t->first) ? NULL : seqev_prev(se);
+		u->lotic = tic - se->delta;
+		u->hi = se->next;
+		if (u->hi)
+			u->hitic = tic + u->hi->delta;
+		track_undocopy(u, se, se, 0);
+	} else if (track_undoisbefore(t, se, tic)) {
+		track_undocopy(u, se, u->lo, 1);
+		u->lo = (se->prev == &t->first) ? NULL : seqev_prev(se);
+		u->lotic = tic - se->delta;
+	} else if (track_undoisafter(t, se, tic)) {
+		track_undocopy(u, u->hi, se, 0);
+		u->hi = se->next;
+		if (u->hi)
+			u->hitic = tic + u->hi->delta;
 	}
+	if (u->hi)
+		u->hitic += shift;
+}
 
-	end1 = u1->nins;
-	end2 = u2->nins;
-	while (1) {
-		if (end1 == start || end2 == start)
-			break;
-		if (u1->evs[end1 - 1].delta != u2->evs[end2 - 1].delta)
-			break;
-		if (!ev_eq(&u1->evs[end1 - 1].ev, &u2->evs[end2 - 1].ev))
-			break;
-		end1--;
-		end2--;
+/*
+ * the whole track is about to be modified, save all events
+ */
+void
+track_undoall(struct track *t)
+{
+	struct track_data *u = t->undo;
+
+	if (u == NULL)
+		return;
+	if (u->nrm == 0) {
+		track_undocopy(u, t->first, &t->eot, 0);
+	} else {
+		if (u->lo)
+			track_undocopy(u, t->first, u->lo, 1);
+		if (u->hi)
+			track_undocopy(u, u->hi, &t->eot, 0);
 	}
-	*pos = start;
-	*nrm = end1 - start;
-	*nins = end2 - start;
+	u->lo = u->hi = NULL;
 }
 
+/*
+ * store the given number in the given buffer, 7 bits per byte, most
+ * significant bits first, with the high bit set on all bytes but the
+ * last. Return the number of bytes used, or that would be used if
+ * the buffer is NULL
+ */
+static unsigned
+track_undoputnum(unsigned char *p, unsigned val)
+{
+	unsigned n, i;
+
+	n = 1;
+	while (n < 5 && (val >> (7 * n)) != 0)
+		n++;
+	if (p != NULL) {
+		for (i = n - 1; i > 0; i--)
+			*p++ = 0x80 | ((val >> (7 * i)) & 0x7f);
+		*p = val & 0x7f;
+	}
+	return n;
+}
+
+/*
+ * read a number stored with track_undoputnum(), and return
+ * the pointer to the next byte
+ */
+static unsigned char *
+track_undogetnum(unsigned char *p, unsigned *val)
+{
+	unsigned v = 0;
+
+	while (*p & 0x80)
+		v = (v << 7) | (*p++ & 0x7f);
+	*val = (v << 7) | *p++;
+	return p;
+}
+
+/*
+ * store an event in the given buffer, the small 'cmd', 'dev' and
+ * 'ch' fields on a byte each, and 'delta', 'v0' and 'v1' as variable
+ * length numbers. Most events fit in 6 bytes instead of the size of
+ * struct seqev_data. Return the number of bytes used
+ */
+static unsigned
+track_undoputev(unsigned char *p, struct seqev_data *e)
+{
+	unsigned n;
+
+	n = track_undoputnum(p, e->delta);
+	if (p != NULL) {
+		p[n] = e->ev.cmd;
+		p[n + 1] = e->ev.dev;
+		p[n + 2] = e->ev.ch;
+	}
+	n += 3;
+	n += track_undoputnum(p ? p + n : NULL, e->ev.v0);
+	n += track_undoputnum(p ? p + n : NULL, e->ev.v1);
+	return n;
+}
+
+/*
+ * read an event stored with track_undoputev(), and return the
+ * pointer to the next byte
+ */
+static unsigned char *
+track_undogetev(unsigned char *p, struct seqev_data *e)
+{
+	p = track_undogetnum(p, &e->delta);
+	e->ev.cmd = p[0];
+	e->ev.dev = p[1];
+	e->ev.ch = p[2];
+	p = track_undogetnum(p + 3, &e->ev.v0);
+	p = track_undogetnum(p, &e->ev.v1);
+	return p;
+}
+
+/*
+ * finish saving undo data of the given track: compare saved events
+ * with the ones that replaced them, and keep only the differing ones
+ */
 unsigned
-track_undodiff(struct track *t, struct track_data *orig)
+track_undodiff(struct track *t, struct track_data *u)
 {
-	struct track_data mod;
-	unsigned int i, pos, nrm, nins;
-	struct seqev_data *evs;
+	struct seqev *i, *end;
+	unsigned char *p;
+	unsigned n, pre, suf, nins;
 
-	track_undosave(t, &mod);
-	track_diff(orig, &mod, &pos, &nrm, &nins);
+	t->undo = NULL;
+	if (u->nrm == 0)
+		return 0;
+
+	/*
+	 * find the index of the first saved event
+	 */
+	n = 0;
+	if (u->lo) {
+		for (i = t->first; ; i = i->next) {
+			n++;
+			if (i == u->lo)
+				break;
+		}
+	}
 
-	evs = xmalloc(sizeof(struct seqev_data) * nrm, "track_diff");
-	for (i = 0; i < nrm; i++)
-		evs[i] = orig->evs[pos + i];
-	xfree(mod.evs);
-	xfree(orig->evs);
-	orig->evs = evs;
-	orig->nins = nins;
-	orig->nrm = nrm;
-	orig->pos = pos;
-	return sizeof(struct seqev_data) * nrm;
+	/*
+	 * skip the common beginning
+	 */
+	i = u->lo ? u->lo->next : t->first;
+	end = u->hi;
+	pre = 0;
+	while (pre < u->nrm && i != end &&
+	    u->evs[pre].delta == i->delta &&
+	    ev_eq(&u->evs[pre].ev, &i->ev)) {
+		pre++;
+		i = i->next;
+	}
+
+	/*
+	 * count the new events, and skip the common ending
+	 */
+	nins = 0;
+	for (; i != end; i = i->next)
+		nins++;
+	suf = 0;
+	if (nins > 0) {
+		i = (end == NULL) ? &t->eot : seqev_prev(end);
+		while (suf < nins && suf < u->nrm - pre &&
+		    u->evs[u->nrm - 1 - suf].delta == i->delta &&
+		    ev_eq(&u->evs[u->nrm - 1 - suf].ev, &i->ev)) {
+			if (++suf < nins)
+				i = seqev_prev(i);
+		}
+	}
+
+	u->pos = n + pre;
+	u->nins = nins - suf;
+	u->nrm -= pre + suf;
+	u->packlen = 0;
+	for (n = 0; n < u->nrm; n++)
+		u->packlen += track_undoputev(NULL, u->evs + pre + n);
+	if (u->nrm > 0) {
+		u->pack = xmalloc(u->packlen, "track_diff");
+		p = u->pack;
+		for (n = 0; n < u->nrm; n++)
+			p += track_undoputev(p, u->evs + pre + n);
+	} else
+		u->pack = NULL;
+	xfree(u->evs);
+	u->evs = NULL;
+	return u->packlen;
 }
 
 void
@@ -401,7 +883,10 @@ track_undorestore(struct track *t, struct track_data *u)
 {
 	unsigned n;
 	struct seqev *pos, *se;
-	struct seqev_data *e;
+	struct seqev_data e;
+	unsigned char *p;
+
+	track_unindex(t);
 
 	/* go to pos */
 	pos = t->first;
@@ -428,20 +913,20 @@ track_undorestore(struct track *t, struct track_data *u)
 	}
 
 	/* insert events that were removed */
-	e = u->evs;
+	p = u->pack;
 	for (n = u->nrm; n > 0; n--) {
-		if (e->ev.cmd == EV_NULL) {
+		p = track_undogetev(p, &e);
+		if (e.ev.cmd == EV_NULL) {
 			if (n != 1) {
 				logx(1, "%s: can't insert eot event", __func__);
 				panic();
 			}
-			t->eot.delta = e->delta;
+			t->eot.delta = e.delta;
 			break;
 		}
 		se = seqev_new();
-		se->ev = e->ev;
-		se->delta = e->delta;
-		e++;
+		se->ev = e.ev;
+		se->delta = e.delta;
 
 		/* insert seqev */
 		se->next = pos;
@@ -449,7 +934,8 @@ track_undorestore(struct track *t, struct track_data *u)
 		*(se->prev) = se;
 		pos->prev = &se->next;
 	}
-	xfree(u->evs);
+	if (u->pack)
+		xfree(u->pack);
 }
 
 void
@@ -457,8 +943,10 @@ undo_track_save(struct song *s, struct track *t, char *func, char *name)
 {
 	struct undo *u;
 
+	song_trkdirty(s, t);
 	u = undo_new(s, UNDO_TRACK, func, name);
 	u->u.track.track = t;
+	u->u.track.spill = -1;
 	u->size = track_undosave(t, &u->u.track.data);
 	undo_push(s, u);
 }
@@ -491,6 +979,7 @@ undo_tdel_do(struct song *s, struct songtrk *t, char *func)
 	u = undo_new(s, UNDO_TDEL, NULL, NULL);
 	u->u.tdel.trk = t;
 	name_remove(&s->trklist, &t->name);
+	song_idxreset(s);
 	undo_push(s, u);
 }
 
@@ -527,6 +1016,7 @@ filtnode_dup(struct filtnode **dloc, struct filtnode **sloc)
 	s = *sloc;
 	while (s != NULL) {
 		d = filtnode_new(&s->es, dloc);
+		d->u = s->u;
 		filtnode_dup(&d->dstlist, &s->dstlist);
 		dloc = &d->next;
 		s = s->next;
@@ -538,7 +1028,8 @@ filt_size(struct filt *f)
 {
 	return filtnode_size(&f->map) +
 	    filtnode_size(&f->vcurve) +
-	    filtnode_size(&f->transp);
+	    filtnode_size(&f->transp) +
+	    filtnode_size(&f->thin);
 
 }
 
@@ -549,6 +1040,7 @@ filt_undosave(struct filt *f, struct filt *data)
 	filtnode_dup(&data->map, &f->map);
 	filtnode_dup(&data->vcurve, &f->vcurve);
 	filtnode_dup(&data->transp, &f->transp);
+	filtnode_dup(&data->thin, &f->thin);
 }
 
 void
@@ -589,6 +1081,7 @@ undo_fdel_do(struct song *s, struct songfilt *f, char *func)
 		song_setcurfilt(s, NULL);
 
 	name_remove(&s->filtlist, &f->name);
+	song_idxreset(s);
 
 	undo_push(s, u);
 }
@@ -641,6 +1134,7 @@ undo_cdel_do(struct song *s, struct songchan *c, char *func)
 	u = undo_new(s, UNDO_CDEL, NULL, NULL);
 	u->u.cdel.chan = c;
 	name_remove(&s->chanlist, &c->name);
+	song_idxreset(s);
 	undo_push(s, u);
 	if (c->filt)
 		undo_fdel_do(s, c->filt, NULL);
@@ -649,24 +1143,10 @@ undo_cdel_do(struct song *s, struct songchan *c, char *func)
 unsigned int
 sysex_undosave(struct sysex *x, struct sysex_data *data)
 {
-	struct chunk *ck;
-	unsigned char *p;
-	unsigned int i;
-
 	data->unit = x->unit;
-
-	data->size = 0;
-	for (ck = x->first; ck != NULL; ck = ck->next)
-		data->size += ck->used;
-
+	data->size = x->used;
 	data->data = xmalloc(data->size, "undo_sysex");
-
-	p = data->data;
-	for (ck = x->first; ck != NULL; ck = ck->next) {
-		for (i = 0; i < ck->used; i++)
-			*p++ = ck->data[i];
-	}
-
+	memcpy(data->data, x->data, data->size);
 	return data->size;
 }
 
@@ -674,11 +1154,9 @@ struct sysex *
 sysex_undorestore(struct sysex_data *data)
 {
 	struct sysex *x;
-	unsigned int i;
 
 	x = sysex_new(data->unit);
-	for (i = 0; i < data->size; i++)
-		sysex_add(x, data->data[i]);
+	sysex_addbuf(x, data->data, data->size);
 	xfree(data->data);
 	return x;
 }
@@ -735,6 +1213,7 @@ undo_xdel_do(struct song *s, char *func, struct songsx *sx)
 	while (sx->sx.first)
 		undo_xrm_do(s, NULL, sx, 0);
 	name_remove(&s->sxlist, &sx->name);
+	song_idxreset(s);
 }
 
 struct songsx *
@@ -56,10 +56,12 @@ struct undo {
 		} ren;
 		struct undo_setuint {
 			unsigned int *ptr, val;
+			int idx;	/* song index depends on it */
 		} uint;
 		struct undo_track {
 			struct track *track;
 			struct track_data data;
+			long spill;	/* offset in the spill file or -1 */
 		} track;
 		struct undo_tdel {
 			struct songtrk *trk;
@@ -99,6 +101,7 @@ void undo_clear(struct song *, struct undo **);
 void undo_start(struct song *, char *, char *);
 void undo_setstr(struct song *, char *, char **, char *);
 void undo_setuint(struct song *, char *, char *, unsigned int *, unsigned int);
+void undo_setchan(struct song *, char *, char *, unsigned int *, unsigned int);
 void undo_scale(struct song *, char *, char *, unsigned int, unsigned int);
 
 void undo_track_save(struct song *, struct track *, char *, char *);
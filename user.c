@@ -42,8 +42,10 @@
 #include "saveload.h"
 
 struct song *usong;
+struct song *usong_stage = NULL;	/* next song, see songstage */
 unsigned user_flag_batch = 0;
 unsigned user_flag_verb = 0;
+unsigned user_flag_rt = 0;
 
 void
 exec_cb(struct exec *e, struct node *root)
@@ -80,6 +82,7 @@ exec_runfile(struct exec *exec, char *filename)
 	struct parse parse;
 	struct textin *in;
 	struct name **locals;
+	unsigned long frame;
 	int c;
 
 	in = textin_new(filename);
@@ -87,6 +90,8 @@ exec_runfile(struct exec *exec, char *filename)
 		return 0;
 	locals = exec->locals;
 	exec->locals = &exec->globals;
+	frame = exec->frame;
+	exec->frame = 0;
 	parse_init(&parse, exec, exec_cb);
 	lex_init(&parse, filename, parse_cb, &parse);
 	for (;;) {
@@ -97,6 +102,7 @@ exec_runfile(struct exec *exec, char *filename)
 			break;
 	}
 	exec->locals = locals;
+	exec->frame = frame;
 	textin_delete(in);
 	lex_done(&parse);
 	parse_done(&parse);
@@ -278,7 +284,7 @@ exec_lookupev(struct exec *o, char *name, struct ev *ev, int input)
 			logx(1, "device number expected in event spec");
 			return 0;
 		}
-		if (d->val.num < 0 || d->val.num >= DEFAULT_MAXNDEVS) {
+		if (d->val.num < 0 || d->val.num >= ev_ndevs) {
 			logx(1, "device number out of range in event spec");
 			return 0;
 		}
@@ -345,16 +351,24 @@ unsigned
 exec_lookupevspec(struct exec *o, char *name, struct evspec *e, int input)
 {
 	struct var *arg;
-	struct data *d;
-	struct songchan *i;
-	unsigned lo, hi, min, max;
 
 	arg = exec_varlookup(o, name);
 	if (!arg) {
 		logx(1, "%s: %s: no such var", __func__, name);
 		panic();
 	}
-	d = arg->data;
+	return data_getevspec(arg->data, e, input);
+}
+
+/*
+ * convert a list to an evspec, see exec_lookupevspec()
+ */
+unsigned
+data_getevspec(struct data *d, struct evspec *e, int input)
+{
+	struct songchan *i;
+	unsigned lo, hi, min, max;
+
 	if (d->type != DATA_LIST) {
 		logx(1, "list expected in event range spec");
 		return 0;
@@ -761,27 +775,18 @@ unsigned
 data_matchsysex(struct data *d, struct sysex *sx, unsigned *res)
 {
 	unsigned i;
-	struct chunk *ck;
 
 	i = 0;
-	ck = sx->first;
 	while (d) {
 		if (d->type != DATA_LONG) {
 			logx(1, "not-a-number in sysex pattern");
 			return 0;
 		}
-		for (;;) {
-			if (!ck) {
-				*res = 0;
-				return 1;
-			}
-			if (i < ck->used) {
-				break;
-			}
-			ck = ck->next;
-			i = 0;
+		if (i == sx->used) {
+			*res = 0;
+			return 1;
 		}
-		if (d->val.num != ck->data[i++]) {
+		if (d->val.num != sx->data[i++]) {
 			*res = 0;
 			return 1;
 		}
@@ -926,11 +931,12 @@ user_mainloop(void)
 	cons_init(&user_el_ops, NULL);
 	textio_init();
 	evctl_init();
-	seqev_pool_init(DEFAULT_MAXNSEQEVS);
-	state_pool_init(DEFAULT_MAXNSTATES);
-	chunk_pool_init(DEFAULT_MAXNCHUNKS);
-	sysex_pool_init(DEFAULT_MAXNSYSEXS);
-	seqptr_pool_init(DEFAULT_MAXNSEQPTRS);
+	data_pool_init(DEFAULT_NDATAS);
+	seqev_pool_init(DEFAULT_NSEQEVS);
+	state_pool_init(DEFAULT_NSTATES);
+	chunk_pool_init(DEFAULT_NCHUNKS);
+	sysex_pool_init(DEFAULT_NSYSEXS);
+	seqptr_pool_init(DEFAULT_NSEQPTRS);
 
 	/*
 	 * create the project (ie the song) and
@@ -956,6 +962,18 @@ user_mainloop(void)
 			name_newarg("value", NULL)));
 	exec_newbuiltin(exec, "version", blt_version, NULL);
 	exec_newbuiltin(exec, "panic", blt_panic, NULL);
+	exec_newbuiltin(exec, "tickstat", blt_tickstat, NULL);
+	exec_newbuiltin(exec, "tickstatreset", blt_tickstatreset, NULL);
+	exec_newbuiltin(exec, "procstat", blt_procstat, NULL);
+	exec_newbuiltin(exec, "procstatreset", blt_procstatreset, NULL);
+	exec_newbuiltin(exec, "poolstat", blt_poolstat, NULL);
+	exec_newbuiltin(exec, "poolstatreset", blt_poolstatreset, NULL);
+	exec_newbuiltin(exec, "poolwarn", blt_poolwarn,
+			name_newarg("percent", NULL));
+	exec_newbuiltin(exec, "trace", blt_trace,
+			name_newarg("bool", NULL));
+	exec_newbuiltin(exec, "tracesave", blt_tracesave,
+			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "info", blt_info, NULL);
 
 	exec_newbuiltin(exec, "getunit", blt_getunit, NULL);
@@ -972,6 +990,13 @@ user_mainloop(void)
 			name_newarg("length", NULL));
 	exec_newbuiltin(exec, "loop", blt_loop, NULL);
 	exec_newbuiltin(exec, "noloop", blt_noloop, NULL);
+	exec_newbuiltin(exec, "recdefer", blt_recdefer,
+			name_newarg("bool", NULL));
+	exec_newbuiltin(exec, "sxwait", blt_sxwait,
+			name_newarg("bool", NULL));
+	exec_newbuiltin(exec, "songstage", blt_songstage,
+			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "songswap", blt_songswap, NULL);
 	exec_newbuiltin(exec, "getq", blt_getq, NULL);
 	exec_newbuiltin(exec, "setq", blt_setq,
 			name_newarg("step", NULL));
@@ -1012,6 +1037,9 @@ user_mainloop(void)
 	exec_newbuiltin(exec, "p", blt_play, NULL);
 	exec_newbuiltin(exec, "r", blt_rec, NULL);
 	exec_newbuiltin(exec, "s", blt_stop, NULL);
+	exec_newbuiltin(exec, "render", blt_render,
+			name_newarg("trackname", NULL));
+	exec_newbuiltin(exec, "dryrun", blt_dryrun, NULL);
 	exec_newbuiltin(exec, "t", blt_tempo,
 			name_newarg("beats_per_minute", NULL));
 	exec_newbuiltin(exec, "mins", blt_mins,
@@ -1084,9 +1112,14 @@ user_mainloop(void)
 			name_newarg("halftones", NULL));
 	exec_newbuiltin(exec, "tvcurve", blt_tvcurve,
 			name_newarg("weight", NULL));
+	exec_newbuiltin(exec, "tthin", blt_tthin,
+			name_newarg("tics",
+			name_newarg("delta", NULL)));
 	exec_newbuiltin(exec, "tevmap", blt_tevmap,
 			name_newarg("from",
 			name_newarg("to", NULL)));
+	exec_newbuiltin(exec, "tapply", blt_tapply,
+			name_newarg("oplist", NULL));
 	exec_newbuiltin(exec, "tclist", blt_tclist, NULL);
 	exec_newbuiltin(exec, "tinfo", blt_tinfo, NULL);
 	exec_newbuiltin(exec, "tdump", blt_tdump, NULL);
@@ -1151,6 +1184,10 @@ user_mainloop(void)
 	exec_newbuiltin(exec, "fvcurve", blt_fvcurve,
 			name_newarg("evspec",
 			name_newarg("weight", NULL)));
+	exec_newbuiltin(exec, "fthin", blt_fthin,
+			name_newarg("evspec",
+			name_newarg("millisecs",
+			name_newarg("delta", NULL))));
 	exec_newbuiltin(exec, "fchgin", blt_fchgin,
 			name_newarg("from",
 			name_newarg("to", NULL)));
@@ -1204,11 +1241,27 @@ user_mainloop(void)
 			name_newarg("devlist", NULL));
 	exec_newbuiltin(exec, "dclktx", blt_dclktx,
 			name_newarg("devlist", NULL));
+	exec_newbuiltin(exec, "dnodup", blt_dnodup,
+			name_newarg("devlist", NULL));
+	exec_newbuiltin(exec, "dcoalesce", blt_dcoalesce,
+			name_newarg("devlist", NULL));
 	exec_newbuiltin(exec, "dclkrx", blt_dclkrx,
 			name_newarg("devnum", NULL));
 	exec_newbuiltin(exec, "dclkrate", blt_dclkrate,
 			name_newarg("devnum",
 			name_newarg("tics_per_unit", NULL)));
+	exec_newbuiltin(exec, "dclkpll", blt_dclkpll,
+			name_newarg("devnum",
+			name_newarg("bool", NULL)));
+	exec_newbuiltin(exec, "dlatency", blt_dlatency,
+			name_newarg("devnum",
+			name_newarg("millisecs", NULL)));
+	exec_newbuiltin(exec, "dcomp", blt_dcomp,
+			name_newarg("devnum",
+			name_newarg("millisecs", NULL)));
+	exec_newbuiltin(exec, "drate", blt_drate,
+			name_newarg("devnum",
+			name_newarg("bytes_per_sec", NULL)));
 	exec_newbuiltin(exec, "dinfo", blt_dinfo,
 			name_newarg("devnum", NULL));
 	exec_newbuiltin(exec, "dixctl", blt_dixctl,
@@ -1248,6 +1301,10 @@ user_mainloop(void)
 
 	song_delete(usong);
 	usong = NULL;
+	if (usong_stage) {
+		song_delete(usong_stage);
+		usong_stage = NULL;
+	}
 	lex_done(&parse);
 	parse_done(&parse);
 	exec_delete(exec);
@@ -1257,6 +1314,7 @@ user_mainloop(void)
 	chunk_pool_done();
 	state_pool_done();
 	seqev_pool_done();
+	data_pool_done();
 	evctl_done();
 	textio_done();
 	cons_done();
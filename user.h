@@ -30,8 +30,10 @@ struct evspec;
 struct sysex;
 
 extern struct song *usong;
+extern struct song *usong_stage;
 extern unsigned user_flag_batch;
 extern unsigned user_flag_verb;
+extern unsigned user_flag_rt;
 
 unsigned user_mainloop(void);
 
@@ -63,5 +65,6 @@ unsigned data_list2ctl(struct data *, unsigned *);
 unsigned data_getctlset(struct data *, unsigned *);
 unsigned data_getxev(struct data *, unsigned *);
 unsigned data_getctl(struct data *, unsigned *);
+unsigned data_getevspec(struct data *, struct evspec *, int);
 
 #endif /* MIDISH_USER_H */